@@ -0,0 +1,328 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "itkImage.h"
+#include "itkImageBase.h"
+#include "itkContinuousIndex.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * \brief deformation field represented by cubic B-spline control points
+ *
+ * The displacements of a (coarse) grid are used directly as B-spline coefficients, which gives the same field as
+ * resampling the grid with itk::BSplineResampleImageFunction (spline order 3, mirror boundary conditions), as done by
+ * TransfUtils::bSplineInterpolateDeformationField. Sampling on the geometry of the control grid itself returns the
+ * control values unchanged, as that function does.
+ *
+ * The dense field is only evaluated where it is needed: evaluate() at single points, materialize() on a reference
+ * geometry and warpImage() directly warps an image without allocating the dense field. If the reference has the same
+ * orientation as the control grid, the basis functions are separable and are tabulated once per axis.
+ */
+template<class DeformationFieldType>
+class ControlPointDeformation{
+public:
+    typedef typename DeformationFieldType::Pointer DeformationFieldPointerType;
+    typedef typename DeformationFieldType::PixelType DisplacementType;
+    static const unsigned int D=DeformationFieldType::ImageDimension;
+    typedef itk::ImageBase<D> GeometryType;
+    typedef typename GeometryType::PointType PointType;
+    typedef typename GeometryType::IndexType IndexType;
+    typedef typename GeometryType::SizeType SizeType;
+    typedef typename GeometryType::RegionType RegionType;
+    typedef itk::ContinuousIndex<double,D> ContinuousIndexType;
+
+private:
+    ///4 (mirrored) control point offsets and basis weights per sample position along one axis
+    struct AxisTable{
+        std::vector<long int> offsets;
+        std::vector<double> weights;
+        std::vector<bool> inside;
+    };
+    DeformationFieldPointerType m_coefficients;
+    const DisplacementType * m_buffer;
+    SizeType m_size;
+    long int m_strides[D];
+
+public:
+    ControlPointDeformation(DeformationFieldPointerType coefficients){
+        m_coefficients=coefficients;
+        m_buffer=coefficients->GetBufferPointer();
+        m_size=coefficients->GetBufferedRegion().GetSize();
+        long int stride=1;
+        for (unsigned int d=0;d<D;++d){
+            m_strides[d]=stride;
+            stride*=m_size[d];
+        }
+    }
+    DeformationFieldPointerType getCoefficients(){return m_coefficients;}
+
+    ///displacement at a physical point, zero outside of the control grid
+    DisplacementType evaluate(const PointType & pt) const{
+        ContinuousIndexType idx;
+        m_coefficients->TransformPhysicalPointToContinuousIndex(pt,idx);
+        long int offsets[D][4];
+        double weights[D][4];
+        DisplacementType result;
+        result.Fill(0.0);
+        for (unsigned int d=0;d<D;++d){
+            if (!axisWeights(idx[d],d,offsets[d],weights[d])) return result;
+        }
+        return sum(offsets,weights);
+    }
+
+    ///dense deformation field on the geometry of reference
+    DeformationFieldPointerType materialize(const GeometryType * reference) const{
+        DeformationFieldPointerType result=DeformationFieldType::New();
+        result->SetRegions(reference->GetLargestPossibleRegion());
+        result->SetOrigin(reference->GetOrigin());
+        result->SetSpacing(reference->GetSpacing());
+        result->SetDirection(reference->GetDirection());
+        result->Allocate();
+        DisplacementType * out=result->GetBufferPointer();
+        std::vector<AxisTable> tables;
+        bool separable=buildTables(reference,tables);
+        RegionType region=reference->GetLargestPossibleRegion();
+        long int nPixels=region.GetNumberOfPixels();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            out[i]=evaluateAt(reference,region,i,separable,tables);
+        }
+        return result;
+    }
+
+    /**
+     * warp image with the deformation sampled on the geometry of reference, without storing the dense field.
+     * Same conventions as TransfUtils::warpImage: pixels mapped outside of image are set to its minimum.
+     */
+    template<class TImage>
+    typename TImage::Pointer warpImage(const TImage * image, const GeometryType * reference, bool nnInterpol=false) const{
+        return warp(image,reference,nnInterpol,(const TImage *)NULL,(const std::vector<char> *)NULL,NULL);
+    }
+
+    /**
+     * warp image like warpImage(), given previousWarped, the result of warping it with previous on the same geometry.
+     * Only pixels in the support of a control point that moved by more than tolerance since previous are interpolated
+     * again, all others are copied from previousWarped. With tolerance 0 the result equals warpImage(). Falls back to
+     * warping all pixels if the control grids differ or the geometry is not aligned with them.
+     * nUpdated receives the number of interpolated pixels.
+     */
+    template<class TImage>
+    typename TImage::Pointer updateWarpedImage(const TImage * image, const TImage * previousWarped, const ControlPointDeformation & previous, double tolerance, bool nnInterpol=false, long int * nUpdated=NULL) const{
+        bool sameGrid=previous.m_size==m_size && previous.m_coefficients->GetSpacing()==m_coefficients->GetSpacing()
+            && previous.m_coefficients->GetOrigin()==m_coefficients->GetOrigin() && previous.m_coefficients->GetDirection()==m_coefficients->GetDirection();
+        if (!sameGrid){
+            if (nUpdated) *nUpdated=previousWarped->GetLargestPossibleRegion().GetNumberOfPixels();
+            return warpImage(image,previousWarped,nnInterpol);
+        }
+        long int nCoefficients=m_coefficients->GetBufferedRegion().GetNumberOfPixels();
+        std::vector<char> moved(nCoefficients);
+        double squaredTolerance=tolerance*tolerance;
+#pragma omp parallel for
+        for (long int i=0;i<nCoefficients;++i){
+            double dist=0.0;
+            for (unsigned int c=0;c<D;++c){
+                double diff=m_buffer[i][c]-previous.m_buffer[i][c];
+                dist+=diff*diff;
+            }
+            moved[i]=dist>squaredTolerance;
+        }
+        return warp(image,previousWarped,nnInterpol,previousWarped,&moved,nUpdated);
+    }
+
+private:
+    ///warp all pixels, or only those affected by moved control points if previousWarped is given
+    template<class TImage>
+    typename TImage::Pointer warp(const TImage * image, const GeometryType * reference, bool nnInterpol, const TImage * previousWarped, const std::vector<char> * moved, long int * nUpdated) const{
+        typedef typename itk::LinearInterpolateImageFunction<TImage,double> LinearInterpolatorType;
+        typedef typename itk::NearestNeighborInterpolateImageFunction<TImage,double> NNInterpolatorType;
+        typename LinearInterpolatorType::Pointer interpolator=LinearInterpolatorType::New();
+        typename NNInterpolatorType::Pointer nnInt=NNInterpolatorType::New();
+        if (nnInterpol){
+            nnInt->SetInputImage(image);
+        }else{
+            interpolator->SetInputImage(image);
+        }
+        typename TImage::Pointer deformed=TImage::New();
+        deformed->SetRegions(reference->GetLargestPossibleRegion());
+        deformed->SetOrigin(reference->GetOrigin());
+        deformed->SetSpacing(reference->GetSpacing());
+        deformed->SetDirection(reference->GetDirection());
+        deformed->Allocate();
+        typename TImage::PixelType * out=deformed->GetBufferPointer();
+        const typename TImage::PixelType * in=image->GetBufferPointer();
+        typename TImage::PixelType fillVal=in[0];
+        long int nIn=image->GetBufferedRegion().GetNumberOfPixels();
+        for (long int i=1;i<nIn;++i) fillVal=std::min(fillVal,in[i]);
+
+        std::vector<AxisTable> tables;
+        bool separable=buildTables(reference,tables);
+        RegionType region=reference->GetLargestPossibleRegion();
+        long int nPixels=region.GetNumberOfPixels();
+        const typename TImage::PixelType * previousOut=NULL;
+        if (separable && previousWarped) previousOut=previousWarped->GetBufferPointer();
+        long int count=0;
+#pragma omp parallel for reduction(+:count)
+        for (long int i=0;i<nPixels;++i){
+            if (previousOut && !isAffected(region,i,tables,*moved)){
+                out[i]=previousOut[i];
+                continue;
+            }
+            ++count;
+            DisplacementType displacement=evaluateAt(reference,region,i,separable,tables);
+            PointType p;
+            reference->TransformIndexToPhysicalPoint(getIndex(region,i),p);
+            for (unsigned int d=0;d<D;++d) p[d]+=displacement[d];
+            ContinuousIndexType idx;
+            image->TransformPhysicalPointToContinuousIndex(p,idx);
+            if (nnInterpol){
+                out[i]=nnInt->IsInsideBuffer(idx)?nnInt->EvaluateAtContinuousIndex(idx):fillVal;
+            }else{
+                out[i]=interpolator->IsInsideBuffer(idx)?interpolator->EvaluateAtContinuousIndex(idx):fillVal;
+            }
+        }
+        if (nUpdated) *nUpdated=count;
+        return deformed;
+    }
+
+    static IndexType getIndex(const RegionType & region, long int i){
+        IndexType idx;
+        for (unsigned int d=0;d<D;++d){
+            idx[d]=region.GetIndex()[d]+i%region.GetSize()[d];
+            i/=region.GetSize()[d];
+        }
+        return idx;
+    }
+
+    ///control point offsets and cubic B-spline weights at continuous grid position x along axis d. false if outside of the grid
+    bool axisWeights(double x, unsigned int d, long int * offsets, double * weights) const{
+        if (x < -0.5 || x >= m_size[d]-0.5) return false;
+        double start=floor(x);
+        double w=x-start;
+        weights[3]=(1.0/6.0)*w*w*w;
+        weights[0]=(1.0/6.0)+0.5*w*(w-1.0)-weights[3];
+        weights[2]=w+weights[0]-2.0*weights[3];
+        weights[1]=1.0-weights[0]-weights[2]-weights[3];
+        long int length=m_size[d], length2=2*length-2;
+        for (int k=0;k<4;++k){
+            long int idx=long(start)-1+k;
+            if (length==1){
+                idx=0;
+            }else{
+                if (idx<0) idx=-idx-length2*((-idx)/length2);
+                else idx=idx-length2*(idx/length2);
+                if (length<=idx) idx=length2-idx;
+            }
+            offsets[k]=idx*m_strides[d];
+        }
+        return true;
+    }
+
+    ///tabulate the basis functions per axis if reference is aligned with the control grid
+    bool buildTables(const GeometryType * reference, std::vector<AxisTable> & tables) const{
+        if (reference->GetDirection()!=m_coefficients->GetDirection()) return false;
+        RegionType region=reference->GetLargestPossibleRegion();
+        bool sameGrid=region.GetSize()==m_size && reference->GetSpacing()==m_coefficients->GetSpacing() && reference->GetOrigin()==m_coefficients->GetOrigin();
+        PointType origin;
+        reference->TransformIndexToPhysicalPoint(region.GetIndex(),origin);
+        ContinuousIndexType start;
+        m_coefficients->TransformPhysicalPointToContinuousIndex(origin,start);
+        tables=std::vector<AxisTable>(D);
+        for (unsigned int d=0;d<D;++d){
+            int n=region.GetSize()[d];
+            double step=reference->GetSpacing()[d]/m_coefficients->GetSpacing()[d];
+            tables[d].offsets.resize(4*n);
+            tables[d].weights.resize(4*n);
+            tables[d].inside.resize(n);
+            for (int i=0;i<n;++i){
+                tables[d].inside[i]=axisWeights(start[d]+i*step,d,&tables[d].offsets[4*i],&tables[d].weights[4*i]);
+                if (sameGrid){
+                    //control values are returned unchanged on the control grid itself
+                    tables[d].weights[4*i]=0.0;
+                    tables[d].weights[4*i+1]=1.0;
+                    tables[d].weights[4*i+2]=0.0;
+                    tables[d].weights[4*i+3]=0.0;
+                }
+            }
+        }
+        return true;
+    }
+
+    inline DisplacementType evaluateAt(const GeometryType * reference, const RegionType & region, long int i, bool separable, const std::vector<AxisTable> & tables) const{
+        if (!separable){
+            PointType p;
+            reference->TransformIndexToPhysicalPoint(getIndex(region,i),p);
+            return evaluate(p);
+        }
+        long int offsets[D][4];
+        double weights[D][4];
+        DisplacementType result;
+        result.Fill(0.0);
+        for (unsigned int d=0;d<D;++d){
+            long int pos=i%region.GetSize()[d];
+            i/=region.GetSize()[d];
+            if (!tables[d].inside[pos]) return result;
+            for (int k=0;k<4;++k){
+                offsets[d][k]=tables[d].offsets[4*pos+k];
+                weights[d][k]=tables[d].weights[4*pos+k];
+            }
+        }
+        return sum(offsets,weights);
+    }
+
+    ///true if a control point with nonzero weight at pixel i of the separable tables has moved
+    inline bool isAffected(const RegionType & region, long int i, const std::vector<AxisTable> & tables, const std::vector<char> & moved) const{
+        long int offsets[D][4];
+        double weights[D][4];
+        for (unsigned int d=0;d<D;++d){
+            long int pos=i%region.GetSize()[d];
+            i/=region.GetSize()[d];
+            //zero displacement outside of the grid
+            if (!tables[d].inside[pos]) return false;
+            for (int k=0;k<4;++k){
+                offsets[d][k]=tables[d].offsets[4*pos+k];
+                weights[d][k]=tables[d].weights[4*pos+k];
+            }
+        }
+        int nTerms=1<<(2*D);
+        for (int t=0;t<nTerms;++t){
+            long int offset=0;
+            double w=1.0;
+            for (unsigned int d=0;d<D;++d){
+                int k=(t>>(2*d))&3;
+                offset+=offsets[d][k];
+                w*=weights[d][k];
+            }
+            if (w!=0.0 && moved[offset]) return true;
+        }
+        return false;
+    }
+
+    ///tensor product of the per-axis weights with the 4^D control points
+    inline DisplacementType sum(const long int offsets[D][4], const double weights[D][4]) const{
+        double acc[D];
+        for (unsigned int c=0;c<D;++c) acc[c]=0.0;
+        int nTerms=1<<(2*D);
+        for (int t=0;t<nTerms;++t){
+            long int offset=0;
+            double w=1.0;
+            for (unsigned int d=0;d<D;++d){
+                int k=(t>>(2*d))&3;
+                offset+=offsets[d][k];
+                w*=weights[d][k];
+            }
+            if (w==0.0) continue;
+            const DisplacementType & coeff=m_buffer[offset];
+            for (unsigned int c=0;c<D;++c) acc[c]+=w*coeff[c];
+        }
+        DisplacementType result;
+        for (unsigned int c=0;c<D;++c) result[c]=acc[c];
+        return result;
+    }
+};
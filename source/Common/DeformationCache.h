@@ -31,6 +31,8 @@
 #include "itkTransformFactoryBase.h"
 #include "itkTransformFactory.h"
 #include "itkMatrixOffsetTransformBase.h"
+#include "ImageListLoader.h"
+#include <boost/shared_ptr.hpp>
  
 using namespace std;
 
@@ -59,10 +61,16 @@ public:
     typedef typename OutputDeformationFieldType::ConstPointer OutputDeformationFieldConstPointerType;
     typedef map< string, map <string, DeformationFieldPointerType> > DeformationCacheType;
     typedef map< string, map <string, string> > DeformationFilenameCacheType;
+    typedef ImageListLoader<DeformationFieldType> LoaderType;
+    typedef boost::shared_ptr<LoaderType> LoaderPointerType;
+    typedef map< string, map <string, pair<LoaderPointerType,int> > > PendingDeformationsType;
 private:
     bool m_cacheDeformations;
     DeformationCacheType m_deformationCache;
-    DeformationFilenameCacheType m_deformationFilenameCacheType;
+    DeformationFilenameCacheType m_deformationFilenameCache;
+    //deformations queued for asynchronous loading in caching mode
+    LoaderPointerType m_loader;
+    PendingDeformationsType m_pendingDeformations;
     
 public:
 
@@ -76,7 +84,12 @@ public:
     
     void add(string id1, string id2, string filename){
         if (m_cacheDeformations){
-            m_deformationCache[id1][id2]=ImageUtils<DeformationFieldType>::readImage(filename);
+            //read in the background, loading starts with the first get()
+            if (!m_loader || m_loader->isStarted()){
+                m_loader=LoaderPointerType(new LoaderType());
+            }
+            m_deformationCache[id1][id2]=NULL;
+            m_pendingDeformations[id1][id2]=make_pair(m_loader,m_loader->add(filename));
         }else{
             m_deformationFilenameCache[id1][id2]=filename;
         }
@@ -87,6 +100,9 @@ public:
             LOG<<"adding deformation field to cache, when cache is set to no-caching mode!"<<endl;
         }
         m_deformationCache[id1][id2]=def;
+        if (findPending(id1,id2)){
+            m_pendingDeformations[id1].erase(id2);
+        }
     }
     
     bool get(string id1,string id2, DeformationFieldPointerType & def){
@@ -95,6 +111,11 @@ public:
             return false;
         }
         if (m_cacheDeformations){
+            if (findPending(id1,id2)){
+                pair<LoaderPointerType,int> job=m_pendingDeformations[id1][id2];
+                m_deformationCache[id1][id2]=job.first->get(job.second);
+                m_pendingDeformations[id1].erase(id2);
+            }
             def=m_deformationCache[id1][id2];
         }else{
             def=ImageUtils<DeformationFieldType>::readImage(m_deformationFilenameCache[id1][id2]);
@@ -104,6 +125,9 @@ public:
 
     bool find(string id1,string id2){
         if (m_cacheDeformations){
+            if (findPending(id1,id2)){
+                return true;
+            }
             if ( m_deformationCache.find(id1)!= m_deformationCache.end() 
                  && m_deformationCache[id1].find(id2)!=m_deformationCache[id1].end() 
                  &&  m_deformationCache[id1][id2].IsNotNull()){
@@ -121,4 +145,9 @@ public:
             }
         }
     }
+private:
+    bool findPending(string id1,string id2){
+        return m_pendingDeformations.find(id1)!=m_pendingDeformations.end() 
+            && m_pendingDeformations[id1].find(id2)!=m_pendingDeformations[id1].end();
+    }
 };
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <ctime>
+#include "itkImage.h"
+#include "boost/filesystem.hpp"
+#include "ImageUtils.h"
+#include "Log.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * \brief content addressed on-disk cache for images derived from other images
+ *
+ * Entries are keyed by the content hash of all input images plus the name and parameters of the operation that
+ * derived them, so a cached product is reused by every job that gets the same inputs, regardless of file names:
+ *
+ *     DerivedImageCache::Key key("sheetness");
+ *     key.input(atlasImage).param("sigma",sigma);
+ *     FloatImagePointerType result=cache.get<FloatImageType>(key);
+ *     if (result.IsNull()){ result=compute(...); cache.put<FloatImageType>(key,result); }
+ *
+ * Files are written under a temporary name and renamed, so concurrent jobs sharing a cache directory never read
+ * partial files. If a size limit is set, the least recently used entries (by modification time, which is refreshed
+ * on every hit) are evicted after each insertion. A cache without directory is disabled: get() always misses and
+ * put() does nothing.
+ */
+class DerivedImageCache{
+public:
+    ///64 bit FNV-1a
+    class Hash{
+        unsigned long long int m_hash;
+    public:
+        Hash(){m_hash=14695981039346656037ULL;}
+        void add(const void * data, unsigned long int nBytes){
+            const unsigned char * bytes=reinterpret_cast<const unsigned char *>(data);
+            for (unsigned long int i=0;i<nBytes;++i){
+                m_hash=(m_hash^bytes[i])*1099511628211ULL;
+            }
+        }
+        template<class T> void add(const T & value){add(&value,sizeof(T));}
+        unsigned long long int get() const{return m_hash;}
+        std::string str() const{
+            std::ostringstream s;
+            s<<std::hex<<m_hash;
+            return s.str();
+        }
+    };
+
+    ///hash of the geometry and the pixel buffer of an image. Blocks of the buffer are hashed in parallel.
+    template<class ImageType>
+    static std::string hashImage(const ImageType * image){
+        static const unsigned int D=ImageType::ImageDimension;
+        Hash hash;
+        hash.add((unsigned int)(sizeof(typename ImageType::PixelType)));
+        for (unsigned int d=0;d<D;++d){
+            hash.add((unsigned long int)(image->GetLargestPossibleRegion().GetSize()[d]));
+            hash.add(double(image->GetSpacing()[d]));
+            hash.add(double(image->GetOrigin()[d]));
+            for (unsigned int d2=0;d2<D;++d2) hash.add(double(image->GetDirection()[d][d2]));
+        }
+        const unsigned char * buffer=reinterpret_cast<const unsigned char *>(image->GetBufferPointer());
+        unsigned long int nBytes=image->GetBufferedRegion().GetNumberOfPixels()*sizeof(typename ImageType::PixelType);
+        const unsigned long int blockSize=1<<20;
+        long int nBlocks=(nBytes+blockSize-1)/blockSize;
+        std::vector<unsigned long long int> blockHashes(nBlocks);
+#pragma omp parallel for
+        for (long int b=0;b<nBlocks;++b){
+            Hash blockHash;
+            blockHash.add(buffer+b*blockSize,std::min(blockSize,nBytes-b*blockSize));
+            blockHashes[b]=blockHash.get();
+        }
+        for (long int b=0;b<nBlocks;++b) hash.add(blockHashes[b]);
+        return hash.str();
+    }
+
+    ///operation name, hashes of its inputs and its parameters
+    class Key{
+        std::string m_operation;
+        std::ostringstream m_description;
+    public:
+        Key(std::string operation){
+            m_operation=operation;
+            //round-trip precision, so parameters differing only in late digits don't share an entry
+            m_description<<std::setprecision(17)<<operation;
+        }
+        Key & input(std::string hash){
+            m_description<<" input="<<hash;
+            return *this;
+        }
+        template<class ImagePointerType>
+        Key & input(const ImagePointerType & image){
+            return input(hashImage(image.GetPointer()));
+        }
+        template<class T>
+        Key & param(std::string name, const T & value){
+            m_description<<" "<<name<<"="<<value;
+            return *this;
+        }
+        std::string str() const{
+            Hash hash;
+            std::string description=m_description.str();
+            hash.add(description.c_str(),description.size());
+            return m_operation+"-"+hash.str();
+        }
+    };
+
+private:
+    std::string m_directory;
+    double m_maxSizeMB;
+
+public:
+    DerivedImageCache(std::string directory="", double maxSizeMB=0.0){
+        setDirectory(directory,maxSizeMB);
+    }
+    ///maxSizeMB<=0 disables eviction
+    void setDirectory(std::string directory, double maxSizeMB=0.0){
+        m_directory=directory;
+        m_maxSizeMB=maxSizeMB;
+        if (m_directory!=""){
+            boost::system::error_code error;
+            boost::filesystem::create_directories(m_directory,error);
+        }
+    }
+    bool enabled() const{return m_directory!="";}
+    std::string getDirectory() const{return m_directory;}
+
+    ///cached image, or NULL
+    template<class ImageType>
+    typename ImageType::Pointer get(const Key & key){
+        typename ImageType::Pointer result=NULL;
+        if (!enabled()) return result;
+        std::string filename=getFilename(key);
+        boost::system::error_code error;
+        if (!boost::filesystem::exists(filename,error)) return result;
+        try{
+            typedef itk::ImageFileReader<ImageType> ReaderType;
+            typename ReaderType::Pointer reader=ReaderType::New();
+            reader->SetFileName(filename);
+            reader->Update();
+            result=reader->GetOutput();
+        }catch( itk::ExceptionObject & err ){
+            //evicted or being replaced by another job
+            LOGV(3)<<"Could not read cached image "<<filename<<std::endl;
+            return NULL;
+        }
+        boost::filesystem::last_write_time(filename,std::time(0),error);
+        LOGV(3)<<"Read cached "<<key.str()<<std::endl;
+        return result;
+    }
+
+    template<class ImageType>
+    void put(const Key & key, typename ImageType::Pointer image){
+        if (!enabled()) return;
+        std::string filename=getFilename(key);
+        std::string tmpFilename=m_directory+"/tmp-"+boost::filesystem::unique_path().string()+".mha";
+        boost::system::error_code error;
+        try{
+            typedef itk::ImageFileWriter<ImageType> WriterType;
+            typename WriterType::Pointer writer=WriterType::New();
+            writer->SetFileName(tmpFilename);
+            writer->SetInput(image);
+            writer->Update();
+        }catch( itk::ExceptionObject & err ){
+            LOG<<"WARNING: could not write cache file "<<tmpFilename<<std::endl;
+            boost::filesystem::remove(tmpFilename,error);
+            return;
+        }
+        boost::filesystem::rename(tmpFilename,filename,error);
+        if (error){
+            boost::filesystem::remove(tmpFilename,error);
+            return;
+        }
+        LOGV(3)<<"Cached "<<key.str()<<std::endl;
+        evict(filename);
+    }
+
+private:
+    std::string getFilename(const Key & key) const{
+        return m_directory+"/"+key.str()+".mha";
+    }
+
+    struct Entry{
+        std::time_t time;
+        unsigned long int size;
+        std::string filename;
+        bool operator<(const Entry & other) const{return time<other.time;}
+    };
+
+    ///remove least recently used entries until the cache fits its size limit. keep is never removed
+    void evict(std::string keep){
+        if (m_maxSizeMB<=0.0) return;
+        boost::system::error_code error;
+        std::vector<Entry> entries;
+        double totalSize=0.0;
+        boost::filesystem::directory_iterator end;
+        for (boost::filesystem::directory_iterator it(m_directory,error);!error && it!=end;it.increment(error)){
+            //files still being written by other jobs start with tmp-
+            if (it->path().extension()!=".mha" || it->path().filename().string().compare(0,4,"tmp-")==0 || !boost::filesystem::is_regular_file(it->status())) continue;
+            Entry entry;
+            entry.filename=it->path().string();
+            entry.size=boost::filesystem::file_size(it->path(),error);
+            if (error) continue;
+            entry.time=boost::filesystem::last_write_time(it->path(),error);
+            if (error) continue;
+            totalSize+=entry.size;
+            entries.push_back(entry);
+        }
+        std::sort(entries.begin(),entries.end());
+        double maxSize=m_maxSizeMB*1024*1024;
+        for (unsigned int i=0;i<entries.size() && totalSize>maxSize;++i){
+            if (entries[i].filename==keep) continue;
+            //another job might have removed it already
+            boost::filesystem::remove(entries[i].filename,error);
+            totalSize-=entries[i].size;
+            LOGV(3)<<"Evicted "<<entries[i].filename<<" from cache"<<std::endl;
+        }
+    }
+};
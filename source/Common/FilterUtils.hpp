@@ -27,6 +27,7 @@
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkBSplineInterpolateImageFunction.h"
 #include "ImageUtils.h"
+#include "MultiLabelDistanceTransform.h"
 #include <algorithm> //max,min
 #include "Log.h"
 #include "itkStatisticsImageFilter.h"
@@ -40,6 +41,10 @@
 #include "itkSignedMaurerDistanceMapImageFilter.h"
 #include <itkMinimumMaximumImageCalculator.h>
 #include <algorithm>
+#include <limits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 ///\brief This class provides static functions which are mostly wrappers around ITK routines.
 ///Its main purpose is to alleviate the inclusion of common methods such as resampling, thresholding,...
@@ -270,6 +275,17 @@ public:
 
 #ifdef ISOTROPIC_RESAMPLING
   
+    ///grid of LinearResample(input,scale,...)
+    static void resampledGeometry( ConstInputImagePointer input, double scale, SizeType & size, SpacingType & spacing, OriginType & origin){
+        typename InputImage::SpacingType inputSpacing=input->GetSpacing();
+        typename InputImage::SizeType inputSize=input->GetLargestPossibleRegion().GetSize();
+        for (uint d=0;d<InputImage::ImageDimension;++d){
+            size[d]=int(inputSize[d]*scale);
+            spacing[d]=inputSpacing[d]*(1.0*(inputSize[d]-1)/(size[d]-1));
+            origin[d]=input->GetOrigin()[d];//+0.5*spacing[d]/inputSpacing[d];
+        }
+    }
+
     static OutputImagePointer LinearResample( ConstInputImagePointer input,  double scale, bool smooth,bool nnResample=false) {
         LinearInterpolatorPointerType interpol=LinearInterpolatorType::New();
         NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
@@ -280,16 +296,10 @@ public:
         else
             resampler->SetInterpolator(interpol);
         typename InputImage::SpacingType spacing,inputSpacing;
-        typename InputImage::SizeType size,inputSize;
-        typename InputImage::PointType origin,inputOrigin;
-        inputOrigin=input->GetOrigin();
-        inputSize=input->GetLargestPossibleRegion().GetSize();
+        typename InputImage::SizeType size;
+        typename InputImage::PointType origin;
         inputSpacing=input->GetSpacing();
-        for (uint d=0;d<InputImage::ImageDimension;++d){
-            size[d]=int(inputSize[d]*scale);
-            spacing[d]=inputSpacing[d]*(1.0*(inputSize[d]-1)/(size[d]-1));
-            origin[d]=inputOrigin[d];//+0.5*spacing[d]/inputSpacing[d];
-        }
+        resampledGeometry(input,scale,size,spacing,origin);
         resampler->SetOutputOrigin(origin);
 		resampler->SetOutputSpacing ( spacing );
 		resampler->SetOutputDirection ( input->GetDirection() );
@@ -308,22 +318,11 @@ public:
 
 
 #else
-    //downscale to isotropic spacing defined by minspacing/scale
-    //never upsample! unless scale>1.0
-    static OutputImagePointer LinearResample( ConstInputImagePointer input,  double scale, bool smooth, bool nnResample=false) {
-
-        if (scale == 1.0) return cast(ImageUtils<InputImage>::duplicateConst(input));
-        LinearInterpolatorPointerType interpol=LinearInterpolatorType::New();
-        NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
-        ResampleFilterPointerType resampler=ResampleFilterType::New();
-        LOGV(5)<<VAR(smooth)<<" "<<VAR(nnResample)<<std::endl;
-        if (nnResample)
-            resampler->SetInterpolator(interpolNN);
-        else
-            resampler->SetInterpolator(interpol);
-        typename InputImage::SpacingType spacing,inputSpacing;
-        typename InputImage::SizeType size,inputSize;
-        typename InputImage::PointType origin,inputOrigin;
+    ///grid of LinearResample(input,scale,...)
+    static void resampledGeometry( ConstInputImagePointer input, double scale, SizeType & size, SpacingType & spacing, OriginType & origin){
+        typename InputImage::SpacingType inputSpacing;
+        typename InputImage::SizeType inputSize;
+        typename InputImage::PointType inputOrigin;
         inputOrigin=input->GetOrigin();
         inputSize=input->GetLargestPossibleRegion().GetSize();
         inputSpacing=input->GetSpacing();
@@ -349,6 +348,26 @@ public:
 
             origin[d]=inputOrigin[d];//+0.5*spacing[d]/inputSpacing[d];
         }
+    }
+
+    //downscale to isotropic spacing defined by minspacing/scale
+    //never upsample! unless scale>1.0
+    static OutputImagePointer LinearResample( ConstInputImagePointer input,  double scale, bool smooth, bool nnResample=false) {
+
+        if (scale == 1.0) return cast(ImageUtils<InputImage>::duplicateConst(input));
+        LinearInterpolatorPointerType interpol=LinearInterpolatorType::New();
+        NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
+        ResampleFilterPointerType resampler=ResampleFilterType::New();
+        LOGV(5)<<VAR(smooth)<<" "<<VAR(nnResample)<<std::endl;
+        if (nnResample)
+            resampler->SetInterpolator(interpolNN);
+        else
+            resampler->SetInterpolator(interpol);
+        typename InputImage::SpacingType spacing,inputSpacing;
+        typename InputImage::SizeType size;
+        typename InputImage::PointType origin;
+        inputSpacing=input->GetSpacing();
+        resampledGeometry(input,scale,size,spacing,origin);
         LOGV(7)<<"full parameters : "<<spacing<<" "<<size<<" "<<origin<<std::endl;
         LOGV(3)<<"Resampling to isotropic  spacing "<<spacing<<" with resolution "<<size<<std::endl;
         resampler->SetOutputOrigin(origin);
@@ -510,8 +529,9 @@ public:
         resampler->Update();
         return resampler->GetOutput();
     }
-    static OutputImagePointer LinearResample( InputImagePointer input,  SizeType size, OriginType origin, SpacingType spacing, DirectionType dir, bool smooth) {
+    static OutputImagePointer LinearResample( ConstInputImagePointer input,  SizeType size, OriginType origin, SpacingType spacing, DirectionType dir, bool smooth, bool nnResample=false) {
         LinearInterpolatorPointerType interpol=LinearInterpolatorType::New();
+        NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
         ResampleFilterPointerType resampler=ResampleFilterType::New();
         if (smooth){
             InputImagePointer smoothedInput = gaussian(input,(spacing-input->GetSpacing())/2);
@@ -519,7 +539,10 @@ public:
         }else{
             resampler->SetInput(input);
         }
-        resampler->SetInterpolator(interpol);
+        if (nnResample)
+            resampler->SetInterpolator(interpolNN);
+        else
+            resampler->SetInterpolator(interpol);
         resampler->SetOutputOrigin(origin);
 		resampler->SetOutputSpacing (spacing );
 		resampler->SetOutputDirection ( dir );
@@ -1123,6 +1146,104 @@ public:
         //        return dilateFilter->GetOutput();
     }
 
+    /**
+       Dilate every label l>0 by its own radius radii[l] (in pixels, using the same balls as dilation()) in a single pass.
+       Labels without a radius are not dilated. Where balls of several labels overlap, the label whose ball reaches
+       furthest beyond the pixel wins.
+
+       A pixel x is covered iff min over labeled pixels s of |x-s|^2-(r_s+0.5)^2 <= 0, which is one separable squared
+       distance transform with the seeds initialized to -(r_s+0.5)^2, instead of one morphological pass per label.
+    */
+    static OutputImagePointer variableRadiusDilation(InputImagePointer labelImage, const std::vector<double> & radii){
+        static const unsigned int D=InputImage::ImageDimension;
+        typename InputImage::SizeType size=labelImage->GetLargestPossibleRegion().GetSize();
+        long int nPixels=labelImage->GetLargestPossibleRegion().GetNumberOfPixels();
+        const InputImagePixelType * labels=labelImage->GetBufferPointer();
+        const double inf=std::numeric_limits<double>::max();
+        std::vector<double> power(nPixels);
+        std::vector<InputImagePixelType> nearest(labels,labels+nPixels);
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            long int label=labels[i];
+            if (label>0){
+                double r=(label<(long int)radii.size()?std::max(0.0,radii[label]):0.0)+0.5;
+                power[i]=-r*r;
+            }else{
+                power[i]=inf;
+            }
+        }
+        long int stride=1;
+        for (unsigned int d=0;d<D;++d){
+            long int n=size[d];
+            long int nLines=nPixels/n;
+#pragma omp parallel
+            {
+                std::vector<double> f(n),z(n),roots(n);
+                std::vector<long int> v(n);
+                std::vector<InputImagePixelType> lineLabels(n),rootLabels(n);
+#pragma omp for
+                for (long int line=0;line<nLines;++line){
+                    //first pixel of the line
+                    long int base=(line/stride)*stride*n+line%stride;
+                    for (long int q=0;q<n;++q){
+                        f[q]=power[base+q*stride];
+                        lineLabels[q]=nearest[base+q*stride];
+                    }
+                    if (labeledLowerEnvelope(f,lineLabels,v,z,roots,rootLabels,n,inf)){
+                        for (long int q=0;q<n;++q){
+                            power[base+q*stride]=f[q];
+                            nearest[base+q*stride]=lineLabels[q];
+                        }
+                    }
+                }
+            }
+            stride*=n;
+        }
+        OutputImagePointer result=createEmpty(labelImage);
+        typename OutputImage::PixelType * out=result->GetBufferPointer();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            out[i]=power[i]<=0.0?nearest[i]:0;
+        }
+        return result;
+    }
+
+    ///1D distance transform min_s((q-s)^2+f(s)) of f (in place) and the label of the minimizing s, false if all of f is infinite
+    static bool labeledLowerEnvelope(std::vector<double> & f, std::vector<InputImagePixelType> & labels, std::vector<long int> & v,
+                                     std::vector<double> & z, std::vector<double> & roots, std::vector<InputImagePixelType> & rootLabels, long int n, double inf){
+        long int k=-1;
+        for (long int q=0;q<n;++q){
+            if (f[q]>=inf) continue;
+            double s=-std::numeric_limits<double>::max();
+            while (k>=0){
+                s=((f[q]+1.0*q*q)-(f[v[k]]+1.0*v[k]*v[k]))/(2.0*(q-v[k]));
+                if (s<=z[k]){
+                    --k;
+                    s=-std::numeric_limits<double>::max();
+                }else{
+                    break;
+                }
+            }
+            ++k;
+            v[k]=q;
+            z[k]=s;
+        }
+        if (k<0) return false;
+        //f and labels are overwritten, keep the values at the parabola roots
+        for (long int j=0;j<=k;++j){
+            roots[j]=f[v[j]];
+            rootLabels[j]=labels[v[j]];
+        }
+        long int j=0;
+        for (long int q=0;q<n;++q){
+            while (j<k && z[j+1]<q) ++j;
+            double dx=q-v[j];
+            f[q]=dx*dx+roots[j];
+            labels[q]=rootLabels[j];
+        }
+        return true;
+    }
+
 
 #if 0
     // compute connected components of a (binary image)
@@ -1217,6 +1338,22 @@ public:
 
     }
 
+    /**
+       Euclidean distance maps of all labels 0..nLabels-1 in one pass over the label image, see MultiLabelDistanceTransform.
+       Signed maps equal distanceMapBySignedMaurer of each label, unsigned maps are zero inside the label.
+       If band>0 the distances are clamped to [-band,band]. If selected is not empty, only the selected labels are computed.
+    */
+    static std::vector<OutputImagePointer> multiLabelDistanceMaps(
+                                                                  ConstInputImagePointer image,
+                                                                  int nLabels,
+                                                                  bool signedDistance=true,
+                                                                  double band=-1.0,
+                                                                  const std::vector<bool> & selected=std::vector<bool>()
+                                                                  ) {
+        MultiLabelDistanceTransform<InputImage,OutputImage> transform(signedDistance,band);
+        return transform.compute(image,nLabels,selected);
+    }
+
 
 
     static OutputImagePointer computeObjectness(InputImagePointer img){
@@ -1309,11 +1446,19 @@ public:
         int maxLabel=getMax(seg);
         typedef typename ImageUtils<InputImage>::FloatImageType FloatImageType;
         typedef typename ImageUtils<InputImage>::FloatImagePointerType FloatImagePointerType;
+        //absent labels would get empty distance maps
+        std::vector<bool> present(maxLabel+1,false);
+        itk::ImageRegionConstIterator<InputImage> segIt(seg,seg->GetLargestPossibleRegion());
+        for (segIt.GoToBegin();!segIt.IsAtEnd();++segIt){
+            int val=segIt.Get();
+            if (val>0) present[val]=true;
+        }
+        LOGV(2)<<"Computing distance maps"<<std::endl;
+        std::vector<FloatImagePointerType> distanceMaps=FilterUtils<InputImage,FloatImageType>::multiLabelDistanceMaps(seg,maxLabel+1,false,-1.0,present);
         for (int l=1;l<=maxLabel;++l){
-
+            if (!present[l]) continue;
             LOGV(2)<<"Upsampling segmentation for label "<<l<<std::endl;
-            LOGV(2)<<"Computing distance map"<<std::endl;
-            FloatImagePointerType distanceMap=FilterUtils<InputImage,FloatImageType>::distanceMapByFastMarcher(FilterUtils<InputImage>::select(seg,l),1);
+            FloatImagePointerType distanceMap=distanceMaps[l];
             LOGI(6,ImageUtils<FloatImageType>::writeImage("distnaceMapLow.nii",distanceMap));
             LOGV(2)<<"Resampling and smoothing distance map..."<<std::endl;
             distanceMap=FilterUtils<FloatImageType>::LinearResample(distanceMap,FilterUtils<InputImage,FloatImageType>::cast(ref),false);
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageIOFactory.h"
+#include "itkRegionOfInterestImageFilter.h"
+#include "itkResampleImageFilter.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkContinuousIndex.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleMutexLock.h"
+#include "itkConditionVariable.h"
+
+/**
+ * \brief asynchronous loader for lists of images or deformation fields
+ *
+ * All files are added first, then start() spawns a bounded number of I/O threads which
+ * decompress the files in the order they were added. get(job) blocks until that file is
+ * loaded, so callers can start processing the first images while the rest are still read.
+ * Each result can be fetched once, after which the loader drops its reference.
+ *
+ * At most readAhead files are loaded but not yet fetched (nThreads+2 by default), the I/O threads
+ * wait until results are consumed, so a list is streamed instead of becoming resident at once.
+ * Files should be fetched roughly in the order they were added; a file requested before an I/O
+ * thread picked it up is read by the calling thread.
+ *
+ * If a region of interest is set, only the bounding region of the ROI (plus one pixel for
+ * interpolation) is requested from the reader. Formats supporting streamed reading (eg.
+ * uncompressed mha/nrrd) then only read that part of the file. Optionally the cropped image
+ * is resampled to the ROI geometry, which gives the same result as resampling the full image.
+ */
+template<class ImageType>
+class ImageListLoader{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::RegionType RegionType;
+    typedef typename ImageType::IndexType IndexType;
+    typedef typename ImageType::SizeType SizeType;
+    typedef typename ImageType::PointType PointType;
+    static const unsigned int D=ImageType::ImageDimension;
+    typedef itk::ContinuousIndex<double,D> ContinuousIndexType;
+    typedef itk::ImageFileReader<ImageType> ReaderType;
+    typedef itk::RegionOfInterestImageFilter<ImageType,ImageType> ROIFilterType;
+    typedef itk::ResampleImageFilter<ImageType,ImageType> ResampleFilterType;
+    typedef itk::NearestNeighborInterpolateImageFunction<ImageType,double> NNInterpolatorType;
+
+private:
+    struct Job{
+        std::string fileName;
+        ImagePointerType image;
+        bool claimed,done,fetched,failed;
+        std::string error;
+    };
+    std::vector<Job> m_jobs;
+    unsigned int m_nextJob;
+    int m_nThreads;
+    ///loaded or loading files which are not fetched yet, and their limit
+    int m_nInFlight,m_readAhead;
+    bool m_stop;
+    std::vector<itk::ThreadIdType> m_threads;
+    itk::MultiThreader::Pointer m_threader;
+    itk::SimpleMutexLock m_mutex;
+    itk::ConditionVariable::Pointer m_jobDone;
+    ImagePointerType m_ROI;
+    bool m_resampleToROI,m_nnInterpol;
+    bool m_started;
+
+public:
+    ImageListLoader(int nThreads=-1){
+        m_nThreads=nThreads>0?nThreads:itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+        m_nThreads=std::min(m_nThreads,ITK_MAX_THREADS-1);
+        m_nextJob=0;
+        m_nInFlight=0;
+        m_readAhead=m_nThreads+2;
+        m_stop=false;
+        m_threader=itk::MultiThreader::New();
+        m_jobDone=itk::ConditionVariable::New();
+        m_resampleToROI=false;
+        m_nnInterpol=false;
+        m_started=false;
+    }
+    ~ImageListLoader(){
+        wait();
+    }
+
+    ///maximal number of files loaded ahead of the consumer, must be set before start()
+    void setReadAhead(int n){m_readAhead=std::max(1,n);}
+
+    ///only read the part of each file covered by ROI, and optionally resample it to the geometry of ROI
+    void setROI(ImagePointerType ROI, bool resample=true, bool nnInterpol=false){
+        m_ROI=ROI;
+        m_resampleToROI=resample;
+        m_nnInterpol=nnInterpol;
+    }
+
+    ///queue a file, returns the job number used to fetch the image. all files must be added before start()
+    int add(std::string fileName){
+        if (m_started){
+            std::cerr<<"ImageListLoader: cannot add "<<fileName<<" after loading has started"<<std::endl;
+            exit(0);
+        }
+        Job job;
+        job.fileName=fileName;
+        job.claimed=false;
+        job.done=false;
+        job.fetched=false;
+        job.failed=false;
+        m_jobs.push_back(job);
+        return m_jobs.size()-1;
+    }
+    int size(){return m_jobs.size();}
+    bool isStarted(){return m_started;}
+    std::string getFileName(int job){return m_jobs[job].fileName;}
+
+    void start(){
+        if (m_started || !m_jobs.size()) return;
+        m_started=true;
+        //the IO factories are not initialized thread-safely, do it once here
+        itk::ImageIOFactory::CreateImageIO(m_jobs[0].fileName.c_str(),itk::ImageIOFactory::ReadMode);
+        int nThreads=std::min(m_nThreads,int(m_jobs.size()));
+        for (int t=0;t<nThreads;++t){
+            m_threads.push_back(m_threader->SpawnThread(&ImageListLoader::workerCallback,this));
+        }
+    }
+
+    bool isReady(int job){
+        m_mutex.Lock();
+        bool done=m_jobs[job].done;
+        m_mutex.Unlock();
+        return done;
+    }
+
+    ///block until the file is loaded and return it. the loader does not keep a reference afterwards.
+    ImagePointerType get(int job){
+        start();
+        m_mutex.Lock();
+        if (!m_jobs[job].claimed){
+            //not picked up by an I/O thread yet, read it here instead of waiting for the window to reach it
+            m_jobs[job].claimed=true;
+            m_mutex.Unlock();
+            loadJob(job);
+            m_mutex.Lock();
+        }else{
+            while (!m_jobs[job].done){
+                m_jobDone->Wait(&m_mutex);
+            }
+            if (!m_jobs[job].fetched){
+                --m_nInFlight;
+                m_jobDone->Broadcast();
+            }
+        }
+        ImagePointerType result=m_jobs[job].image;
+        bool fetched=m_jobs[job].fetched;
+        m_jobs[job].image=NULL;
+        m_jobs[job].fetched=true;
+        m_mutex.Unlock();
+        if (m_jobs[job].failed){
+            std::cerr << "ExceptionObject caught !" << std::endl;
+            std::cerr << "Could not read image from "<<m_jobs[job].fileName<<" "<<std::endl;
+            std::cerr << m_jobs[job].error << std::endl;
+        }else if (fetched){
+            std::cerr<<"ImageListLoader: "<<m_jobs[job].fileName<<" was already fetched"<<std::endl;
+        }
+        return result;
+    }
+
+    ///stop the I/O threads after their current file and join them. files not read yet are read by get()
+    void wait(){
+        m_mutex.Lock();
+        m_stop=true;
+        m_jobDone->Broadcast();
+        m_mutex.Unlock();
+        for (unsigned int t=0;t<m_threads.size();++t){
+            m_threader->TerminateThread(m_threads[t]);
+        }
+        m_threads.clear();
+    }
+
+private:
+    static ITK_THREAD_RETURN_TYPE workerCallback(void * arg){
+        itk::MultiThreader::ThreadInfoStruct * info=static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+        static_cast<ImageListLoader *>(info->UserData)->work();
+        return ITK_THREAD_RETURN_VALUE;
+    }
+
+    void work(){
+        while (true){
+            m_mutex.Lock();
+            while (!m_stop && m_nInFlight>=m_readAhead){
+                m_jobDone->Wait(&m_mutex);
+            }
+            while (m_nextJob<m_jobs.size() && m_jobs[m_nextJob].claimed) ++m_nextJob;
+            if (m_stop || m_nextJob>=m_jobs.size()){
+                m_mutex.Unlock();
+                return;
+            }
+            int job=m_nextJob++;
+            m_jobs[job].claimed=true;
+            ++m_nInFlight;
+            m_mutex.Unlock();
+            loadJob(job);
+        }
+    }
+
+    ///read one file and store the result in its job
+    void loadJob(int job){
+        ImagePointerType image;
+        bool failed=false;
+        std::ostringstream error;
+        try{
+            image=load(m_jobs[job].fileName);
+        }
+        catch( itk::ExceptionObject & err ){
+            failed=true;
+            error<<err;
+        }
+
+        m_mutex.Lock();
+        m_jobs[job].image=image;
+        m_jobs[job].failed=failed;
+        m_jobs[job].error=error.str();
+        m_jobs[job].done=true;
+        m_jobDone->Broadcast();
+        m_mutex.Unlock();
+    }
+
+    ImagePointerType load(std::string fileName){
+        typename ReaderType::Pointer reader=ReaderType::New();
+        reader->SetFileName(fileName);
+        if (m_ROI.IsNull()){
+            reader->Update();
+            return reader->GetOutput();
+        }
+        reader->UpdateOutputInformation();
+        RegionType region;
+        ImagePointerType image;
+        if (getROIRegion(reader->GetOutput(),region)){
+            typename ROIFilterType::Pointer roiFilter=ROIFilterType::New();
+            roiFilter->SetNumberOfThreads(1);
+            roiFilter->SetInput(reader->GetOutput());
+            roiFilter->SetRegionOfInterest(region);
+            roiFilter->Update();
+            image=roiFilter->GetOutput();
+        }else{
+            reader->Update();
+            image=reader->GetOutput();
+        }
+        if (m_resampleToROI){
+            typename ResampleFilterType::Pointer resampler=ResampleFilterType::New();
+            resampler->SetNumberOfThreads(1);
+            if (m_nnInterpol){
+                resampler->SetInterpolator(NNInterpolatorType::New());
+            }
+            resampler->SetInput(image);
+            resampler->SetOutputOrigin(m_ROI->GetOrigin());
+            resampler->SetOutputSpacing(m_ROI->GetSpacing());
+            resampler->SetOutputDirection(m_ROI->GetDirection());
+            resampler->SetSize(m_ROI->GetLargestPossibleRegion().GetSize());
+            resampler->Update();
+            image=resampler->GetOutput();
+        }
+        return image;
+    }
+
+    ///region of image covering the ROI, padded by one pixel. returns false if they don't overlap
+    bool getROIRegion(ImagePointerType image, RegionType & region){
+        RegionType roiRegion=m_ROI->GetLargestPossibleRegion();
+        IndexType roiStart=roiRegion.GetIndex();
+        SizeType roiSize=roiRegion.GetSize();
+        std::vector<double> lower(D,std::numeric_limits<double>::max()),upper(D,-std::numeric_limits<double>::max());
+        //map all corners of the ROI to the image, its axes might not be aligned with the ROI
+        for (unsigned int c=0;c<(1u<<D);++c){
+            IndexType corner;
+            for (unsigned int d=0;d<D;++d){
+                corner[d]=roiStart[d]+(((c>>d)&1)?roiSize[d]-1:0);
+            }
+            PointType pt;
+            m_ROI->TransformIndexToPhysicalPoint(corner,pt);
+            ContinuousIndexType idx;
+            image->TransformPhysicalPointToContinuousIndex(pt,idx);
+            for (unsigned int d=0;d<D;++d){
+                lower[d]=std::min(lower[d],idx[d]);
+                upper[d]=std::max(upper[d],idx[d]);
+            }
+        }
+        IndexType start;
+        SizeType size;
+        for (unsigned int d=0;d<D;++d){
+            start[d]=floor(lower[d])-1;
+            size[d]=ceil(upper[d])+1-start[d]+1;
+        }
+        region.SetIndex(start);
+        region.SetSize(size);
+        return region.Crop(image->GetLargestPossibleRegion());
+    }
+};
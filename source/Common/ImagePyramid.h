@@ -0,0 +1,220 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "itkImage.h"
+#include "FilterUtils.hpp"
+#include "Log.h"
+
+/**
+ * \brief resolution levels of images, built once per run and shared by everyone that resamples the same inputs
+ *
+ * Levels are requested with the arguments of FilterUtils::LinearResample and have exactly its grids. A level that
+ * was already computed for the same input (same image object, unmodified since) is returned from the cache instead
+ * of being resampled again, so all potentials of a multiresolution pipeline get the same coarse images without
+ * recomputing them from the full resolution input at every level:
+ *
+ *     ImagePyramid<ImageType> pyramid;
+ *     pyramid.build(targetImage,scales,true);
+ *     ImageConstPointerType coarseTarget=ImagePyramid<ImageType>::LinearResample(&pyramid,targetImage,0.25,true);
+ *
+ * Smoothed linear levels are computed from the coarsest cached smoothed level that is still finer than the requested
+ * one. Only the missing variance is added there, since gaussian variances add up, so a pyramid built from fine to
+ * coarse smooths and resamples every level from the previous one. Smoothing and resampling are the separable,
+ * multithreaded ITK filters used by FilterUtils. Since every level adds interpolation and boundary effects of its
+ * own, cascaded smoothed levels only approximate the direct FilterUtils result; callers that need it exactly pass a
+ * NULL pyramid to the static helpers (the SRS filter does so with -noSharedPyramid). Unsmoothed and nearest neighbour
+ * levels are always resampled from the input itself, since interpolating interpolated values would change them. If a
+ * size limit is set, the least recently used levels are dropped from the cache after each insertion; images still
+ * held by callers stay valid.
+ */
+template<class ImageType>
+class ImagePyramid{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::ConstPointer ImageConstPointerType;
+    typedef typename ImageType::SizeType SizeType;
+    typedef typename ImageType::SpacingType SpacingType;
+    typedef typename ImageType::PointType OriginType;
+    typedef typename ImageType::DirectionType DirectionType;
+    typedef FilterUtils<ImageType> FilterUtilsType;
+    static const unsigned int D=ImageType::ImageDimension;
+
+private:
+    struct Level{
+        ImageConstPointerType input;
+        unsigned long int inputTime;
+        SizeType size;
+        SpacingType spacing;
+        OriginType origin;
+        DirectionType direction;
+        bool nn;
+        ///gaussian variance applied to the input before resampling, zero if unsmoothed
+        SpacingType variance;
+        ///covers the physical extent of the input, so coarser levels can be computed from it
+        bool fullExtent;
+        ImageConstPointerType image;
+        unsigned long int lastUse;
+    };
+    std::vector<Level> m_levels;
+    unsigned long int m_clock;
+    double m_maxSizeMB;
+    int m_nHits,m_nMisses;
+
+public:
+    ImagePyramid(double maxSizeMB=0.0){
+        m_clock=0;
+        m_maxSizeMB=maxSizeMB;
+        m_nHits=0;
+        m_nMisses=0;
+    }
+    ///maxSizeMB<=0 keeps all levels
+    void setMaxSizeMB(double maxSizeMB){
+        m_maxSizeMB=maxSizeMB;
+        evict(-1);
+    }
+    void clear(){
+        m_levels.clear();
+        LOGV(3)<<"Cleared image pyramid, "<<VAR(m_nHits)<<" "<<VAR(m_nMisses)<<std::endl;
+        m_nHits=0;
+        m_nMisses=0;
+    }
+    double getSizeMB() const{
+        double size=0.0;
+        for (unsigned int i=0;i<m_levels.size();++i) size+=sizeMB(m_levels[i].image);
+        return size;
+    }
+
+    ///approximates FilterUtils::LinearResample(input,scale,smooth,nn), smoothed levels are cascaded from finer cached levels
+    ImageConstPointerType resample(ImageConstPointerType input, double scale, bool smooth, bool nn=false){
+        if (scale==1.0) return input;
+        SizeType size;
+        SpacingType spacing;
+        OriginType origin;
+        FilterUtilsType::resampledGeometry(input,scale,size,spacing,origin);
+        SpacingType variance;
+        for (unsigned int d=0;d<D;++d){
+            variance[d]=(smooth && scale<1.0)?spacing[d]-input->GetSpacing()[d]:0.0;
+        }
+        return get(input,size,spacing,origin,input->GetDirection(),variance,nn,true);
+    }
+
+    ///approximates FilterUtils::LinearResample(input,reference,smooth), smoothed levels are cascaded from finer cached levels
+    ImageConstPointerType resample(ImageConstPointerType input, ImageConstPointerType reference, bool smooth){
+        SpacingType variance;
+        for (unsigned int d=0;d<D;++d){
+            variance[d]=smooth?(reference->GetSpacing()[d]-input->GetSpacing()[d])/2:0.0;
+        }
+        return get(input,reference->GetLargestPossibleRegion().GetSize(),reference->GetSpacing(),reference->GetOrigin(),reference->GetDirection(),variance,false,false);
+    }
+
+    ///compute the levels of all scales from fine to coarse, each from the previous one
+    void build(ImageConstPointerType input, std::vector<double> scales, bool smooth, bool nn=false){
+        std::sort(scales.begin(),scales.end());
+        for (int i=scales.size()-1;i>=0;--i){
+            resample(input,scales[i],smooth,nn);
+        }
+    }
+
+    ///resample with the pyramid if there is one, with FilterUtils otherwise
+    static ImageConstPointerType LinearResample(ImagePyramid * pyramid, ImageConstPointerType input, double scale, bool smooth, bool nn=false){
+        if (pyramid) return pyramid->resample(input,scale,smooth,nn);
+        return (ImageConstPointerType)FilterUtilsType::LinearResample(input,scale,smooth,nn);
+    }
+    static ImageConstPointerType NNResample(ImagePyramid * pyramid, ImageConstPointerType input, double scale, bool smooth){
+        return LinearResample(pyramid,input,scale,smooth,true);
+    }
+    static ImageConstPointerType LinearResample(ImagePyramid * pyramid, ImageConstPointerType input, ImageConstPointerType reference, bool smooth){
+        if (pyramid) return pyramid->resample(input,reference,smooth);
+        return (ImageConstPointerType)FilterUtilsType::LinearResample(input,reference,smooth);
+    }
+
+private:
+    ImageConstPointerType get(ImageConstPointerType input, SizeType size, SpacingType spacing, OriginType origin, DirectionType direction, SpacingType variance, bool nn, bool fullExtent){
+        int source=-1;
+        bool smooth=false;
+        for (unsigned int d=0;d<D;++d) smooth|=variance[d]!=0.0;
+        for (unsigned int i=0;i<m_levels.size();++i){
+            const Level & level=m_levels[i];
+            if (level.input!=input || level.inputTime!=input->GetMTime() || level.direction!=direction) continue;
+            if (level.nn==nn && sameGeometry(level,size,spacing,origin) && level.variance==variance){
+                m_levels[i].lastUse=++m_clock;
+                ++m_nHits;
+                return level.image;
+            }
+            if (nn || !smooth || level.nn || !level.fullExtent || !finerThan(level,spacing,variance)) continue;
+            //start from the coarsest candidate
+            if (source<0 || nPixels(level.size)<nPixels(m_levels[source].size)) source=i;
+        }
+        ++m_nMisses;
+
+        ImageConstPointerType sourceImage=input;
+        SpacingType extraVariance=variance;
+        if (source>=0){
+            sourceImage=m_levels[source].image;
+            extraVariance=variance-m_levels[source].variance;
+            m_levels[source].lastUse=++m_clock;
+            LOGV(4)<<"Resampling pyramid level "<<size<<" from level "<<m_levels[source].size<<std::endl;
+        }else{
+            LOGV(4)<<"Resampling pyramid level "<<size<<" from input"<<std::endl;
+        }
+        if (smooth){
+            sourceImage=(ImageConstPointerType)FilterUtilsType::gaussian(sourceImage,extraVariance);
+        }
+        Level level;
+        level.input=input;
+        level.inputTime=input->GetMTime();
+        level.size=size;
+        level.spacing=spacing;
+        level.origin=origin;
+        level.direction=direction;
+        level.nn=nn;
+        level.variance=variance;
+        level.fullExtent=fullExtent;
+        level.image=(ImageConstPointerType)FilterUtilsType::LinearResample(sourceImage,size,origin,spacing,direction,false,nn);
+        level.lastUse=++m_clock;
+        m_levels.push_back(level);
+        evict(m_levels.size()-1);
+        return level.image;
+    }
+
+    static bool sameGeometry(const Level & level, const SizeType & size, const SpacingType & spacing, const OriginType & origin){
+        return level.size==size && level.spacing==spacing && level.origin==origin;
+    }
+    ///level is smoothed, finer and less smoothed than the requested grid
+    static bool finerThan(const Level & level, const SpacingType & spacing, const SpacingType & variance){
+        bool finer=false,smoothed=false;
+        for (unsigned int d=0;d<D;++d){
+            if (level.spacing[d]>spacing[d] || level.variance[d]>variance[d]) return false;
+            finer|=level.spacing[d]<spacing[d];
+            smoothed|=level.variance[d]>0.0;
+        }
+        return finer && smoothed;
+    }
+    static double nPixels(const SizeType & size){
+        double n=1.0;
+        for (unsigned int d=0;d<D;++d) n*=size[d];
+        return n;
+    }
+    static double sizeMB(ImageConstPointerType image){
+        return nPixels(image->GetLargestPossibleRegion().GetSize())*sizeof(typename ImageType::PixelType)/(1024.0*1024.0);
+    }
+
+    ///drop least recently used levels until the cache fits its size limit. keep is never dropped
+    void evict(int keep){
+        if (m_maxSizeMB<=0.0) return;
+        double size=getSizeMB();
+        while (size>m_maxSizeMB){
+            int oldest=-1;
+            for (unsigned int i=0;i<m_levels.size();++i){
+                if (int(i)==keep) continue;
+                if (oldest<0 || m_levels[i].lastUse<m_levels[oldest].lastUse) oldest=i;
+            }
+            if (oldest<0) return;
+            size-=sizeMB(m_levels[oldest].image);
+            LOGV(4)<<"Dropping pyramid level "<<m_levels[oldest].size<<std::endl;
+            m_levels.erase(m_levels.begin()+oldest);
+            if (keep>oldest) --keep;
+        }
+    }
+};
@@ -25,6 +25,7 @@
 #include <ctime>
 #include <sys/time.h>
 #include <itkResampleImageFilter.h>
+#include "ImageListLoader.h"
 //#include "FilterUtils.hpp"
 template<class ImageType, class FloatPrecision=float>
 class ImageUtils {
@@ -568,43 +569,33 @@ public:
             std::cerr<<"could not read "<<filename<<std::endl;
             exit(0);
         }
+        //images are decompressed in parallel, only the part covered by the ROI is read if the format allows it
+        ImageListLoader<ImageType> loader;
+        if (ROI.IsNotNull()){
+            loader.setROI(ROI,true,nnInterpol);
+        }
+        std::vector<std::string> listIDs;
         while( ! ifs.eof() ) 
             {
                 std::string imageID;
                 ifs >> imageID;                
                 if (imageID!=""){
-                    imageIDs.push_back(imageID);
-                    ImagePointerType img;
                     std::string imageFileName ;
                     ifs >> imageFileName;
-                    //LOGV(3)<<"Reading image with id "<<imageID<<" from file "<<imageFileName<<endl;
-                    img=ImageUtils<ImageType>::readImage(imageFileName);
-                    if (ROI.IsNotNull()){
-                        typedef typename itk::ResampleImageFilter< ImageType,ImageType>	ResampleFilterType;
-                        typename ResampleFilterType::Pointer resampler=ResampleFilterType::New();
-                        typedef typename itk::NearestNeighborInterpolateImageFunction<ImageType, double> NNInterpolatorType;
-                        typedef typename NNInterpolatorType::Pointer NNInterpolatorPointerType;
-                        NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
-                        if (nnInterpol){
-                            resampler->SetInterpolator(interpolNN);
-                        }
-                        resampler->SetInput(img);
-                        resampler->SetOutputOrigin(ROI->GetOrigin());
-                        resampler->SetOutputSpacing ( ROI->GetSpacing() );
-                        resampler->SetOutputDirection ( ROI->GetDirection() );
-                        resampler->SetSize ( ROI->GetLargestPossibleRegion().GetSize() );
-                        resampler->Update();
-                        img=resampler->GetOutput();
-                        //img=FilterUtils<ImageType>::linearResample(img,ROI,false);
-                    }
-                    if (result.find(imageID)==result.end())
-                        result[imageID]=img;
-                    else{
+                    if (std::find(listIDs.begin(),listIDs.end(),imageID)!=listIDs.end()){
                         std::cerr<<"duplicate image ID "<<imageID<<", aborting"<<std::endl;
                         exit(0);
                     }
+                    listIDs.push_back(imageID);
+                    //LOGV(3)<<"Reading image with id "<<imageID<<" from file "<<imageFileName<<endl;
+                    loader.add(imageFileName);
                 }
             }
+        loader.start();
+        for (unsigned int i=0;i<listIDs.size();++i){
+            imageIDs.push_back(listIDs[i]);
+            result[listIDs[i]]=loader.get(i);
+        }
         return result;
     }        
 
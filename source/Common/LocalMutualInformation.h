@@ -0,0 +1,285 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "itkImage.h"
+#include "FilterUtils.hpp"
+#include "Log.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * \brief local mutual information of two images on the same grid, computed with sliding window joint histograms
+ *
+ * Intensities are converted to bin indices once per image. For every image line along the first axis, a box window
+ * is swept along the line. Voxel columns entering and leaving the window update the joint and marginal histograms,
+ * together with the sums of c*log(c) over their bins. The entropies of each window are therefore available in
+ * constant time, instead of being recomputed from a new histogram per voxel. Lines are distributed over threads.
+ *
+ * Windows are clipped at the image borders, and voxels where the mask is zero are not counted. The result can be
+ * evaluated on a coarser grid (e.g. a registration control grid), in which case only the lines through the coarse
+ * sample positions are swept. Available measures are the mutual information Hf+Hm-Hj, the normalized mutual
+ * information (Hf+Hm)/Hj and the entropy correlation coefficient 2-2*Hj/(Hf+Hm), which lies in [0,1].
+ */
+template<class ImageType>
+class LocalMutualInformation{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::ConstPointer ConstImagePointerType;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename ImageType::IndexType IndexType;
+    typedef typename ImageType::PointType PointType;
+    typedef typename ImageType::SizeType SizeType;
+    typedef typename ImageType::RegionType RegionType;
+    static const unsigned int D=ImageType::ImageDimension;
+    typedef itk::Image<float,D> FloatImageType;
+    typedef typename FloatImageType::Pointer FloatImagePointerType;
+    typedef unsigned short BinType;
+    enum MeasureType{MI,NMI,ECC};
+
+protected:
+    ///window center on the fine grid and index of the result pixel
+    struct Target{
+        long int line,x,output;
+        bool operator<(const Target & other) const{return line<other.line || (line==other.line && x<other.x);}
+    };
+
+    int m_numberOfBins;
+    MeasureType m_measure;
+    SizeType m_radius;
+    ConstImagePointerType m_fixedImage;
+    std::vector<BinType> m_fixedBins;
+    bool m_haveMovingRange;
+    double m_movingMin,m_movingMax;
+    ///c*log(c) for all counts a window can reach
+    std::vector<double> m_cLogC;
+
+public:
+    LocalMutualInformation(){
+        m_numberOfBins=32;
+        m_measure=ECC;
+        m_radius.Fill(1);
+        m_haveMovingRange=false;
+        m_movingMin=0.0;
+        m_movingMax=0.0;
+    }
+    ///has to be set before the fixed image
+    void setNumberOfBins(int n){m_numberOfBins=std::max(2,std::min(n,65535));}
+    void setMeasure(MeasureType m){m_measure=m;}
+    void setRadius(SizeType r){m_radius=r;}
+    void setRadius(unsigned int r){m_radius.Fill(r);}
+    ///bin all moving images over the same intensity range instead of the range of each moving image
+    void setMovingRange(double minValue, double maxValue){
+        m_movingMin=minValue;
+        m_movingMax=maxValue;
+        m_haveMovingRange=true;
+    }
+
+    void setFixedImage(ConstImagePointerType fixed){
+        m_fixedImage=fixed;
+        computeBins(fixed,FilterUtils<ImageType>::getMin(fixed),FilterUtils<ImageType>::getMax(fixed),m_fixedBins);
+    }
+
+    /**
+     * local measure between the fixed and the moving image, which has to be sampled on the grid of the fixed image.
+     * The result is sampled on outputGrid, or on the fixed image grid if outputGrid is NULL.
+     */
+    FloatImagePointerType compute(ConstImagePointerType moving, ConstImagePointerType mask=NULL, ConstImagePointerType outputGrid=NULL){
+        if (m_fixedImage.IsNull()){
+            LOG<<"LocalMutualInformation: fixed image has to be set before computing"<<std::endl;
+            exit(0);
+        }
+        RegionType region=m_fixedImage->GetLargestPossibleRegion();
+        if (moving->GetLargestPossibleRegion().GetSize()!=region.GetSize() || (mask.IsNotNull() && mask->GetLargestPossibleRegion().GetSize()!=region.GetSize())){
+            LOG<<"LocalMutualInformation: moving image and mask have to be sampled on the grid of the fixed image"<<std::endl;
+            exit(0);
+        }
+        std::vector<BinType> movingBins;
+        if (m_haveMovingRange){
+            computeBins(moving,m_movingMin,m_movingMax,movingBins);
+        }else{
+            computeBins(moving,FilterUtils<ImageType>::getMin(moving),FilterUtils<ImageType>::getMax(moving),movingBins);
+        }
+        const PixelType * maskBuffer=mask.IsNotNull()?mask->GetBufferPointer():NULL;
+
+        FloatImagePointerType result=FloatImageType::New();
+        ConstImagePointerType grid=outputGrid.IsNotNull()?outputGrid:m_fixedImage;
+        result->SetRegions(grid->GetLargestPossibleRegion());
+        result->SetOrigin(grid->GetOrigin());
+        result->SetSpacing(grid->GetSpacing());
+        result->SetDirection(grid->GetDirection());
+        result->Allocate();
+        float * resultBuffer=result->GetBufferPointer();
+
+        SizeType size=region.GetSize();
+        long int sizeX=size[0];
+        long int nLines=region.GetNumberOfPixels()/sizeX;
+        long int windowSize=1;
+        for (unsigned int d=0;d<D;++d) windowSize*=std::min<long int>(2*m_radius[d]+1,size[d]);
+        m_cLogC.resize(windowSize+1);
+        m_cLogC[0]=0.0;
+        for (long int c=1;c<=windowSize;++c) m_cLogC[c]=c*log(double(c));
+
+        //result pixels grouped by the line of the fixed image their window is centered on
+        std::vector<Target> targets;
+        std::vector<long int> lineStarts;
+        if (outputGrid.IsNotNull()){
+            long int nOutput=result->GetBufferedRegion().GetNumberOfPixels();
+            targets.resize(nOutput);
+#pragma omp parallel for
+            for (long int i=0;i<nOutput;++i){
+                PointType pt;
+                result->TransformIndexToPhysicalPoint(getIndex(result->GetLargestPossibleRegion(),i),pt);
+                IndexType idx;
+                m_fixedImage->TransformPhysicalPointToIndex(pt,idx);
+                long int linear=0,stride=1;
+                for (unsigned int d=0;d<D;++d){
+                    long int c=std::max<long int>(0,std::min<long int>(size[d]-1,idx[d]-region.GetIndex()[d]));
+                    linear+=c*stride;
+                    stride*=size[d];
+                }
+                targets[i].line=linear/sizeX;
+                targets[i].x=linear%sizeX;
+                targets[i].output=i;
+            }
+            std::sort(targets.begin(),targets.end());
+            for (long int i=0;i<nOutput;++i){
+                if (i==0 || targets[i].line!=targets[i-1].line) lineStarts.push_back(i);
+            }
+            lineStarts.push_back(nOutput);
+        }
+        long int nSweeps=outputGrid.IsNotNull()?long(lineStarts.size())-1:nLines;
+        LOGV(3)<<"Local mutual information: sweeping "<<nSweeps<<" of "<<nLines<<" lines with "<<m_numberOfBins<<" bins and window radius "<<m_radius<<std::endl;
+
+#pragma omp parallel
+        {
+            std::vector<unsigned int> joint(m_numberOfBins*m_numberOfBins),fixedHist(m_numberOfBins),movingHist(m_numberOfBins);
+            std::vector<Target> lineTargets(outputGrid.IsNotNull()?0:sizeX);
+            std::vector<long int> columnOffsets;
+#pragma omp for schedule(dynamic)
+            for (long int s=0;s<nSweeps;++s){
+                const Target * first;
+                long int nTargets;
+                if (outputGrid.IsNotNull()){
+                    first=&targets[lineStarts[s]];
+                    nTargets=lineStarts[s+1]-lineStarts[s];
+                }else{
+                    for (long int x=0;x<sizeX;++x){
+                        lineTargets[x].line=s;
+                        lineTargets[x].x=x;
+                        lineTargets[x].output=s*sizeX+x;
+                    }
+                    first=&lineTargets[0];
+                    nTargets=sizeX;
+                }
+                getColumnOffsets(size,first->line,columnOffsets);
+                sweepLine(first,nTargets,sizeX,columnOffsets,movingBins,maskBuffer,joint,fixedHist,movingHist,resultBuffer);
+            }
+        }
+        return result;
+    }
+
+protected:
+    void computeBins(ConstImagePointerType img, double minValue, double maxValue, std::vector<BinType> & bins){
+        long int nPixels=img->GetBufferedRegion().GetNumberOfPixels();
+        const PixelType * buffer=img->GetBufferPointer();
+        bins.resize(nPixels);
+        double scale=(maxValue>minValue)?m_numberOfBins/(maxValue-minValue):0.0;
+        int maxBin=m_numberOfBins-1;
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            int bin=int((buffer[i]-minValue)*scale);
+            bins[i]=std::max(0,std::min(maxBin,bin));
+        }
+    }
+
+    static IndexType getIndex(const RegionType & region, long int i){
+        IndexType idx;
+        for (unsigned int d=0;d<D;++d){
+            idx[d]=region.GetIndex()[d]+i%region.GetSize()[d];
+            i/=region.GetSize()[d];
+        }
+        return idx;
+    }
+
+    ///linear offsets of the voxels at x=0 of all lines within the window around line
+    void getColumnOffsets(const SizeType & size, long int line, std::vector<long int> & offsets){
+        offsets.assign(1,0);
+        long int stride=size[0];
+        for (unsigned int d=1;d<D;++d){
+            long int center=line%size[d];
+            line/=size[d];
+            long int lo=std::max<long int>(0,center-m_radius[d]),hi=std::min<long int>(size[d]-1,center+m_radius[d]);
+            std::vector<long int> extended;
+            extended.reserve(offsets.size()*(hi-lo+1));
+            for (long int c=lo;c<=hi;++c){
+                for (unsigned int o=0;o<offsets.size();++o) extended.push_back(offsets[o]+c*stride);
+            }
+            offsets.swap(extended);
+            stride*=size[d];
+        }
+    }
+
+    ///add (sign=1) or remove (sign=-1) the voxel column at x to the histograms and their c*log(c) sums
+    inline void updateColumn(long int x, int sign, const std::vector<long int> & columnOffsets, const std::vector<BinType> & movingBins,
+                             const PixelType * mask, std::vector<unsigned int> & joint, std::vector<unsigned int> & fixedHist,
+                             std::vector<unsigned int> & movingHist, long int & count, double & jointSum, double & fixedSum, double & movingSum){
+        for (unsigned int o=0;o<columnOffsets.size();++o){
+            long int i=columnOffsets[o]+x;
+            if (mask && !mask[i]) continue;
+            BinType f=m_fixedBins[i],m=movingBins[i];
+            unsigned int & j=joint[f*m_numberOfBins+m];
+            unsigned int & fh=fixedHist[f];
+            unsigned int & mh=movingHist[m];
+            jointSum-=m_cLogC[j]; fixedSum-=m_cLogC[fh]; movingSum-=m_cLogC[mh];
+            j+=sign; fh+=sign; mh+=sign;
+            jointSum+=m_cLogC[j]; fixedSum+=m_cLogC[fh]; movingSum+=m_cLogC[mh];
+            count+=sign;
+        }
+    }
+
+    ///evaluate all targets of one line, which have to be sorted by x
+    void sweepLine(const Target * targets, long int nTargets, long int sizeX, const std::vector<long int> & columnOffsets,
+                   const std::vector<BinType> & movingBins, const PixelType * mask, std::vector<unsigned int> & joint,
+                   std::vector<unsigned int> & fixedHist, std::vector<unsigned int> & movingHist, float * result){
+        long int count=0;
+        double jointSum=0.0,fixedSum=0.0,movingSum=0.0;
+        long int lo=0,hi=-1;
+        for (long int t=0;t<nTargets;++t){
+            long int newLo=std::max<long int>(0,targets[t].x-m_radius[0]);
+            long int newHi=std::min<long int>(sizeX-1,targets[t].x+m_radius[0]);
+            if (newLo>hi){
+                //no overlap with the previous window, restart from an empty window
+                for (long int x=lo;x<=hi;++x) updateColumn(x,-1,columnOffsets,movingBins,mask,joint,fixedHist,movingHist,count,jointSum,fixedSum,movingSum);
+                lo=newLo;
+                hi=newLo-1;
+            }
+            for (;hi<newHi;) updateColumn(++hi,1,columnOffsets,movingBins,mask,joint,fixedHist,movingHist,count,jointSum,fixedSum,movingSum);
+            for (;lo<newLo;++lo) updateColumn(lo,-1,columnOffsets,movingBins,mask,joint,fixedHist,movingHist,count,jointSum,fixedSum,movingSum);
+            result[targets[t].output]=evaluate(count,jointSum,fixedSum,movingSum);
+        }
+        //leave the histograms empty for the next line
+        for (long int x=lo;x<=hi;++x) updateColumn(x,-1,columnOffsets,movingBins,mask,joint,fixedHist,movingHist,count,jointSum,fixedSum,movingSum);
+    }
+
+    ///H=log(N)-sum(c*log(c))/N
+    inline float evaluate(long int count, double jointSum, double fixedSum, double movingSum){
+        if (count==0){
+            return m_measure==NMI?1.0:0.0;
+        }
+        double logN=log(double(count));
+        double hJoint=std::max(0.0,logN-jointSum/count);
+        double hFixed=std::max(0.0,logN-fixedSum/count);
+        double hMoving=std::max(0.0,logN-movingSum/count);
+        switch (m_measure){
+        case MI:
+            return std::max(0.0,hFixed+hMoving-hJoint);
+        case NMI:
+            return hJoint>0.0?(hFixed+hMoving)/hJoint:1.0;
+        default:
+            return (hFixed+hMoving)>0.0?std::max(0.0,std::min(1.0,2.0-2.0*hJoint/(hFixed+hMoving))):0.0;
+        }
+    }
+};
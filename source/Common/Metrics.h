@@ -21,6 +21,7 @@
 #include <itkBoxMeanImageFilter.h>
 #include "itkSubtractAbsImageFilter.h"
 #include <itkAbsoluteValueDifferenceImageFilter.h>
+#include "LocalMutualInformation.h"
 #ifdef WITH_MIND
 #include "dataCostSSC.h"
 #include "dataCostLCC.h"
@@ -1001,6 +1002,39 @@ public:
 
     }
 
+    ///sliding window local mutual information, same window and output conventions as ITKLMI: ((1+MI)/2)^exp
+    static inline OutputImagePointer LMI(InputImagePointer i1,InputImagePointer i2,double sigma=1.0, double exp = 1.0, InputImagePointer coarseImg=NULL){
+        return LMI( (ConstInputImagePointer)i1, (ConstInputImagePointer)i2, sigma,exp,coarseImg);
+    }
+    static inline OutputImagePointer LMI(ConstInputImagePointer i1,ConstInputImagePointer i2,double sigma=1.0, double exp = 1.0, InputImagePointer coarseImg=NULL){
+        return localMutualInformation(i1,i2,sigma,exp,coarseImg,LocalMutualInformation<InputImage>::MI);
+    }
+    ///sliding window local entropy correlation coefficient (normalized mutual information in [0,1]), ECC^exp
+    static inline OutputImagePointer LECC(InputImagePointer i1,InputImagePointer i2,double sigma=1.0, double exp = 1.0, InputImagePointer coarseImg=NULL){
+        return LECC( (ConstInputImagePointer)i1, (ConstInputImagePointer)i2, sigma,exp,coarseImg);
+    }
+    static inline OutputImagePointer LECC(ConstInputImagePointer i1,ConstInputImagePointer i2,double sigma=1.0, double exp = 1.0, InputImagePointer coarseImg=NULL){
+        return localMutualInformation(i1,i2,sigma,exp,coarseImg,LocalMutualInformation<InputImage>::ECC);
+    }
+    static inline OutputImagePointer localMutualInformation(ConstInputImagePointer i1,ConstInputImagePointer i2,double sigma, double exp, InputImagePointer coarseImg,
+                                                            typename LocalMutualInformation<InputImage>::MeasureType measure){
+        LocalMutualInformation<InputImage> lmi;
+        lmi.setMeasure(measure);
+        lmi.setRadius(std::max(1,int(sigma)));
+        lmi.setFixedImage(i1);
+        typedef typename LocalMutualInformation<InputImage>::FloatImageType FloatImageType;
+        typename FloatImageType::Pointer localMI=lmi.compute(i2,NULL,(ConstInputImagePointer)coarseImg);
+        float * buffer=localMI->GetBufferPointer();
+        long int nPixels=localMI->GetBufferedRegion().GetNumberOfPixels();
+        bool mi=(measure==LocalMutualInformation<InputImage>::MI);
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            double val=mi?(1.0+buffer[i])/2:buffer[i];
+            buffer[i]=pow(val,exp);
+        }
+        return FilterUtils<FloatImageType,OutputImage>::cast(localMI);
+    }
+
     static inline OutputImagePointer ITKLNCC(InputImagePointer i1,InputImagePointer i2,double sigma=1.0, double exp = 1.0, InputImagePointer coarseImg=NULL){
         return ITKLNCC( (ConstInputImagePointer)i1, (ConstInputImagePointer)i2, sigma,exp,coarseImg);
     }
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "itkImage.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * \brief exact euclidean distance maps of all labels of a label image at once
+ *
+ * The boundary voxels of all labels are found in a single pass over the label image. As in
+ * itk::SignedMaurerDistanceMapImageFilter, a boundary voxel of a label has at least one face neighbour inside the image
+ * with a different label. The squared distance to the boundary of every label is then computed with the separable
+ * transform of Felzenszwalb & Huttenlocher, using the voxel spacing. Each axis pass sweeps every scanline once for all
+ * labels, and the scanlines are processed in parallel. No binary image is built per label.
+ *
+ * Outside of a label, the distance to its boundary equals the distance to the label itself. Inside, it is returned
+ * negated by default (the values of FilterUtils::distanceMapBySignedMaurer) or as zero when unsigned (the positive
+ * part). With a band, distances are clamped to [-band,band]. Values beyond the band are dropped after each axis pass,
+ * so lines far from any boundary are skipped. Labels without boundary voxels (absent, or covering the whole image) get
+ * maps of zeros.
+ */
+template<class LabelImageType, class DistanceImageType>
+class MultiLabelDistanceTransform{
+public:
+    typedef typename LabelImageType::ConstPointer LabelImageConstPointerType;
+    typedef typename LabelImageType::PixelType LabelType;
+    typedef typename LabelImageType::SizeType SizeType;
+    typedef typename DistanceImageType::Pointer DistanceImagePointerType;
+    typedef typename DistanceImageType::PixelType DistanceType;
+    static const unsigned int D=LabelImageType::ImageDimension;
+
+private:
+    bool m_signed;
+    double m_band;
+
+public:
+    MultiLabelDistanceTransform(bool signedDistance=true, double band=-1.0){
+        m_signed=signedDistance;
+        m_band=band;
+    }
+    void setSigned(bool signedDistance){m_signed=signedDistance;}
+    ///band<=0 computes all distances
+    void setBand(double band){m_band=band;}
+
+    ///distance maps of labels 0..nLabels-1. If selected is not empty, only labels with selected[l] are computed, the others are NULL
+    std::vector<DistanceImagePointerType> compute(LabelImageConstPointerType labelImage, int nLabels, const std::vector<bool> & selected=std::vector<bool>()) const{
+        std::vector<DistanceImagePointerType> result(nLabels);
+        std::vector<int> slots(nLabels,-1);
+        std::vector<int> active;
+        for (int l=0;l<nLabels;++l){
+            if (selected.empty() || selected[l]){
+                slots[l]=active.size();
+                active.push_back(l);
+            }
+        }
+        int nActive=active.size();
+        if (!nActive) return result;
+
+        SizeType size=labelImage->GetLargestPossibleRegion().GetSize();
+        long int strides[D];
+        long int nPixels=1;
+        for (unsigned int d=0;d<D;++d){
+            strides[d]=nPixels;
+            nPixels*=size[d];
+        }
+        std::vector<DistanceType *> buffers(nActive);
+        for (int a=0;a<nActive;++a){
+            DistanceImagePointerType map=DistanceImageType::New();
+            map->SetRegions(labelImage->GetLargestPossibleRegion());
+            map->SetOrigin(labelImage->GetOrigin());
+            map->SetSpacing(labelImage->GetSpacing());
+            map->SetDirection(labelImage->GetDirection());
+            map->Allocate();
+            result[active[a]]=map;
+            buffers[a]=map->GetBufferPointer();
+        }
+
+        //squared distances, zero at the boundary voxels
+        const LabelType * labels=labelImage->GetBufferPointer();
+        const DistanceType inf=std::numeric_limits<DistanceType>::max();
+        std::vector<char> hasBoundary(nActive,0);
+#pragma omp parallel
+        {
+            std::vector<char> localHasBoundary(nActive,0);
+#pragma omp for
+            for (long int i=0;i<nPixels;++i){
+                for (int a=0;a<nActive;++a) buffers[a][i]=inf;
+                int slot=getSlot(labels[i],slots);
+                if (slot>=0 && isBoundary(labels,i,strides,size)){
+                    buffers[slot][i]=0.0;
+                    localHasBoundary[slot]=1;
+                }
+            }
+#pragma omp critical
+            for (int a=0;a<nActive;++a) hasBoundary[a]|=localHasBoundary[a];
+        }
+
+        double band2=m_band>0.0?m_band*m_band:inf;
+        for (unsigned int d=0;d<D;++d){
+            long int n=size[d];
+            long int stride=strides[d];
+            long int nLines=nPixels/n;
+            double spacing=labelImage->GetSpacing()[d];
+#pragma omp parallel
+            {
+                std::vector<double> f(n),z(n),roots(n);
+                std::vector<long int> v(n);
+#pragma omp for
+                for (long int line=0;line<nLines;++line){
+                    //first voxel of the line
+                    long int base=(line/stride)*stride*n+line%stride;
+                    for (int a=0;a<nActive;++a){
+                        DistanceType * buffer=buffers[a];
+                        bool finite=false;
+                        for (long int q=0;q<n;++q){
+                            f[q]=buffer[base+q*stride];
+                            finite|=f[q]<inf;
+                        }
+                        if (!finite) continue;
+                        lowerEnvelope(f,v,z,roots,n,spacing,inf);
+                        //distances only grow in later passes
+                        for (long int q=0;q<n;++q) buffer[base+q*stride]=f[q]>band2?inf:f[q];
+                    }
+                }
+            }
+        }
+
+        double band=m_band>0.0?m_band:0.0;
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            for (int a=0;a<nActive;++a){
+                DistanceType & value=buffers[a][i];
+                if (!hasBoundary[a]){
+                    value=0.0;
+                    continue;
+                }
+                double dist=value>=inf?band:sqrt(value);
+                if (labels[i]==active[a]){
+                    value=m_signed?-dist:0.0;
+                }else{
+                    value=dist;
+                }
+            }
+        }
+        return result;
+    }
+
+    ///1D squared distance transform of f (in place) by the lower envelope of parabolas rooted at the finite samples
+    static void lowerEnvelope(std::vector<double> & f, std::vector<long int> & v, std::vector<double> & z, std::vector<double> & roots, long int n, double spacing, double inf){
+        long int k=-1;
+        for (long int q=0;q<n;++q){
+            if (f[q]>=inf) continue;
+            double s=-std::numeric_limits<double>::max();
+            double xq=q*spacing;
+            while (k>=0){
+                double xv=v[k]*spacing;
+                s=((f[q]+xq*xq)-(f[v[k]]+xv*xv))/(2*(xq-xv));
+                if (s<=z[k]){
+                    --k;
+                    s=-std::numeric_limits<double>::max();
+                }else{
+                    break;
+                }
+            }
+            ++k;
+            v[k]=q;
+            z[k]=s;
+        }
+        if (k<0) return;
+        //f is overwritten, keep the values at the parabola roots
+        for (long int j=0;j<=k;++j) roots[j]=f[v[j]];
+        long int j=0;
+        for (long int q=0;q<n;++q){
+            double xq=q*spacing;
+            while (j<k && z[j+1]<xq) ++j;
+            double dx=xq-v[j]*spacing;
+            f[q]=dx*dx+roots[j];
+        }
+    }
+
+private:
+    static inline int getSlot(LabelType value, const std::vector<int> & slots){
+        if (value<0 || value>=(long int)slots.size()) return -1;
+        return slots[int(value)];
+    }
+
+    static inline bool isBoundary(const LabelType * labels, long int i, const long int * strides, const SizeType & size){
+        long int rest=i;
+        for (unsigned int d=0;d<D;++d){
+            long int coord=rest%size[d];
+            rest/=size[d];
+            if (coord>0 && labels[i-strides[d]]!=labels[i]) return true;
+            if (coord<long(size[d])-1 && labels[i+strides[d]]!=labels[i]) return true;
+        }
+        return false;
+    }
+};
@@ -25,6 +25,8 @@
 #include "Log.h"
 #include <vector>
 #include "itkConnectedComponentImageFilter.h"
+#include "itkHistogramMatchingImageFilter.h"
+#include "DerivedImageCache.h"
 using namespace boost;
 
 
@@ -56,53 +58,24 @@ public:
 
         assert(scales.size() >= 1);
 
-        FloatImagePointer multiscaleSheetness;
-
-        for (unsigned i = 0; i < scales.size(); ++i) {
-
-            LOG<<"Computing single-scale sheetness, sigma="<< scales[i]<<std::endl;
-
-            MemoryEfficientObjectnessFilter *sheetnessFilter =
-                new MemoryEfficientObjectnessFilter();
-            sheetnessFilter->SetImage((img));
-            sheetnessFilter->SetAlpha(0.5);
-            sheetnessFilter->SetBeta(0.5);
-            sheetnessFilter->SetSigma(scales[i]);
-            sheetnessFilter->SetObjectDimension(2);
-            sheetnessFilter->SetBrightObject(true);
-            //sheetnessFilter->SetBrightObject(false);
-            sheetnessFilter->ScaleObjectnessMeasureOff();
-            sheetnessFilter->Update();
-            sheetnessFilter->SetROIImage(NULL);
-
-            FloatImagePointer singleScaleSheetness = sheetnessFilter->GetOutput();
-
-            if (i==0) {
-                multiscaleSheetness = singleScaleSheetness;
-                continue;
-            }
-
-            // update the multiscale sheetness
-            // take the value which is larger in absolute value
-            itk::ImageRegionIterator<FloatImage>
-                itMulti(singleScaleSheetness,singleScaleSheetness->GetLargestPossibleRegion());
-            itk::ImageRegionIterator<FloatImage>
-                itSingle(multiscaleSheetness,multiscaleSheetness->GetLargestPossibleRegion());
-            for (
-                 itMulti.GoToBegin(),itSingle.GoToBegin();
-                 !itMulti.IsAtEnd();
-                 ++itMulti, ++itSingle
-                 ) {
-                float multiVal = itMulti.Get();
-                float singleVal = itSingle.Get();
-
-                // higher absolute value is better
-                if (fabs(singleVal) > fabs(multiVal)) {
-                    itMulti.Set(singleVal);
-                }
-            }
-            delete sheetnessFilter;
-        } // iteration trough scales
+        LOG<<"Computing sheetness at "<<scales.size()<<" scales"<<std::endl;
+
+        // all scales are evaluated in one pass over the image,
+        // at each pixel the value which is larger in absolute value is taken
+        MemoryEfficientObjectnessFilter *sheetnessFilter =
+            new MemoryEfficientObjectnessFilter();
+        sheetnessFilter->SetImage((img));
+        sheetnessFilter->SetAlpha(0.5);
+        sheetnessFilter->SetBeta(0.5);
+        sheetnessFilter->SetSigmas(std::vector<double>(scales.begin(),scales.end()));
+        sheetnessFilter->SetObjectDimension(2);
+        sheetnessFilter->SetBrightObject(true);
+        //sheetnessFilter->SetBrightObject(false);
+        sheetnessFilter->ScaleObjectnessMeasureOff();
+        sheetnessFilter->Update();
+
+        FloatImagePointer multiscaleSheetness = sheetnessFilter->GetOutput();
+        delete sheetnessFilter;
 
         return multiscaleSheetness;
     }
@@ -131,6 +104,38 @@ public:
         return sheetness;
 
     }
+    ///computeSheetness(img), reused from cache if it was computed for the same image before
+    static InputImagePointer computeSheetness(InputImagePointer img, DerivedImageCache & cache){
+        DerivedImageCache::Key key("sheetness");
+        key.input(img);
+        InputImagePointer sheetness=cache.get<InputImage>(key);
+        if (sheetness.IsNull()){
+            sheetness=computeSheetness(img);
+            cache.put<InputImage>(key,sheetness);
+        }
+        return sheetness;
+    }
+
+    ///match the histogram of img to reference, with the settings used by the SRS applications
+    static InputImagePointer histogramMatching(InputImagePointer img, InputImagePointer reference, DerivedImageCache & cache){
+        const int nHistogramLevels=100, nMatchPoints=15;
+        DerivedImageCache::Key key("histogramMatching");
+        key.input(img).input(reference).param("levels",nHistogramLevels).param("matchPoints",nMatchPoints);
+        InputImagePointer result=cache.get<InputImage>(key);
+        if (result.IsNotNull()) return result;
+        typedef itk::HistogramMatchingImageFilter<InputImage,InputImage> HEFilterType;
+        typename HEFilterType::Pointer IntensityEqualizeFilter = HEFilterType::New();
+        IntensityEqualizeFilter->SetReferenceImage(reference);
+        IntensityEqualizeFilter->SetInput(img);
+        IntensityEqualizeFilter->SetNumberOfHistogramLevels(nHistogramLevels);
+        IntensityEqualizeFilter->SetNumberOfMatchPoints(nMatchPoints);
+        IntensityEqualizeFilter->ThresholdAtMeanIntensityOn();
+        IntensityEqualizeFilter->Update();
+        result=IntensityEqualizeFilter->GetOutput();
+        cache.put<InputImage>(key,result);
+        return result;
+    }
+
     /*
       Input: Normalized CT image, scales for the sheetness measure
       Output: (ROI, MultiScaleSheetness, SoftTissueEstimation)
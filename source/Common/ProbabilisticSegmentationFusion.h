@@ -0,0 +1,210 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include "itkImage.h"
+#include "itkContinuousIndex.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkSmoothingRecursiveGaussianImageFilter.h"
+#include <itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h>
+#include "FilterUtils.hpp"
+#include "Log.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * \brief fused warping, weighting and accumulation of probabilistic atlas segmentations
+ *
+ * Each atlas contribution used to be warped into a temporary probability image, weighted by a separately computed
+ * weight image and then added to the target accumulator in a third loop. Here the probability vector is interpolated
+ * directly at the deformed position and added to the accumulator in the same (multithreaded) pass.
+ * Several atlases can be accumulated in one pass, so that the accumulator is read and written only once.
+ *
+ * For local NCC weighting the local mean and variance of the target are computed once per target (TargetStatistics).
+ * Per atlas, only the warped atlas intensities, their squares and their product with the target are smoothed; the
+ * NCC weight is then computed on the fly while accumulating. This gives the same weights as Metrics::efficientLNCC.
+ *
+ * The deformations have to be sampled on the grid of the accumulator. A NULL deformation is the identity.
+ */
+template<class ImageType, class ProbabilisticVectorImageType, class DeformationFieldType>
+class ProbabilisticSegmentationFusion{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename ProbabilisticVectorImageType::Pointer ProbabilisticVectorImagePointerType;
+    typedef typename ProbabilisticVectorImageType::PixelType ProbabilisticPixelType;
+    typedef typename DeformationFieldType::Pointer DeformationFieldPointerType;
+    typedef typename DeformationFieldType::PixelType DisplacementType;
+    static const unsigned int D=ImageType::ImageDimension;
+    static const unsigned int nLabels=ProbabilisticPixelType::Dimension;
+    typedef itk::Image<double,D> InternalImageType;
+    typedef typename InternalImageType::Pointer InternalImagePointerType;
+    typedef typename ImageType::IndexType IndexType;
+    typedef typename ImageType::PointType PointType;
+    typedef typename ImageType::RegionType RegionType;
+    typedef itk::ContinuousIndex<double,D> ContinuousIndexType;
+    typedef itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<ProbabilisticVectorImageType,double> ProbInterpolatorType;
+    typedef itk::LinearInterpolateImageFunction<ImageType,double> ImageInterpolatorType;
+
+    ///local means of the target image and of its square
+    struct TargetStatistics{
+        ImagePointerType target;
+        InternalImagePointerType mean,squareMean;
+        double sigma;
+    };
+
+    static TargetStatistics computeTargetStatistics(ImagePointerType target, double sigma){
+        TargetStatistics stats;
+        if (sigma==0.0) sigma=0.001;
+        stats.target=target;
+        stats.sigma=sigma;
+        InternalImagePointerType f=createInternal(target);
+        InternalImagePointerType f2=createInternal(target);
+        const PixelType * in=target->GetBufferPointer();
+        double * fBuf=f->GetBufferPointer(), *f2Buf=f2->GetBufferPointer();
+        long int nPixels=target->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            fBuf[i]=in[i];
+            f2Buf[i]=1.0*in[i]*in[i];
+        }
+        stats.mean=smooth(f,sigma);
+        stats.squareMean=smooth(f2,sigma);
+        return stats;
+    }
+
+    ///accumulator += globalWeight * increment(x+deformation(x))
+    static void accumulateUniform(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment, DeformationFieldPointerType deformation, double globalWeight){
+        accumulateUniform(accumulator,std::vector<ProbabilisticVectorImagePointerType>(1,increment),std::vector<DeformationFieldPointerType>(1,deformation),std::vector<double>(1,globalWeight));
+    }
+
+    ///accumulate several atlases in one pass over the accumulator
+    static void accumulateUniform(ProbabilisticVectorImagePointerType accumulator, const std::vector<ProbabilisticVectorImagePointerType> & increments,
+                                  const std::vector<DeformationFieldPointerType> & deformations, const std::vector<double> & globalWeights){
+        int nAtlases=increments.size();
+        if (!nAtlases) return;
+        std::vector<typename ProbInterpolatorType::Pointer> interpolators(nAtlases);
+        std::vector<const DisplacementType *> displacements(nAtlases);
+        for (int a=0;a<nAtlases;++a){
+            interpolators[a]=ProbInterpolatorType::New();
+            interpolators[a]->SetInputImage(increments[a]);
+            displacements[a]=deformations[a].IsNotNull()?deformations[a]->GetBufferPointer():NULL;
+        }
+        ProbabilisticPixelType * acc=accumulator->GetBufferPointer();
+        RegionType region=accumulator->GetLargestPossibleRegion();
+        long int nPixels=region.GetNumberOfPixels();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            PointType p;
+            accumulator->TransformIndexToPhysicalPoint(getIndex(region,i),p);
+            double sum[nLabels];
+            for (unsigned int l=0;l<nLabels;++l) sum[l]=0.0;
+            for (int a=0;a<nAtlases;++a){
+                typename ProbInterpolatorType::OutputType prob=warpedProbability(interpolators[a],increments[a],displacements[a],p,i);
+                for (unsigned int l=0;l<nLabels;++l) sum[l]+=globalWeights[a]*prob[l];
+            }
+            for (unsigned int l=0;l<nLabels;++l) acc[i][l]+=sum[l];
+        }
+    }
+
+    ///accumulator += globalWeight * lncc(warped atlas image, target)^exponent * increment(x+deformation(x))
+    static void accumulateLocalNCC(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment, ImagePointerType atlasImage,
+                                   DeformationFieldPointerType deformation, double globalWeight, const TargetStatistics & stats, double exponent){
+        RegionType region=accumulator->GetLargestPossibleRegion();
+        long int nPixels=region.GetNumberOfPixels();
+        const DisplacementType * displacement=deformation.IsNotNull()?deformation->GetBufferPointer():NULL;
+        const PixelType * target=stats.target->GetBufferPointer();
+
+        //warped atlas intensities, their squares and their products with the target
+        typename ImageInterpolatorType::Pointer imageInterpolator=ImageInterpolatorType::New();
+        imageInterpolator->SetInputImage(atlasImage);
+        PixelType fillVal=FilterUtils<ImageType>::getMin(atlasImage);
+        InternalImagePointerType m=createInternal(stats.target);
+        InternalImagePointerType m2=createInternal(stats.target);
+        InternalImagePointerType mf=createInternal(stats.target);
+        double * mBuf=m->GetBufferPointer(), *m2Buf=m2->GetBufferPointer(), *mfBuf=mf->GetBufferPointer();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            PointType p;
+            accumulator->TransformIndexToPhysicalPoint(getIndex(region,i),p);
+            if (displacement) p+=displacement[i];
+            ContinuousIndexType idx;
+            atlasImage->TransformPhysicalPointToContinuousIndex(p,idx);
+            //same conversion as storing the warped image in TransfUtils::warpImageWithMask
+            PixelType value=imageInterpolator->IsInsideBuffer(idx)?PixelType(imageInterpolator->EvaluateAtContinuousIndex(idx)):fillVal;
+            mBuf[i]=value;
+            m2Buf[i]=1.0*value*value;
+            mfBuf[i]=1.0*value*target[i];
+        }
+        m=smooth(m,stats.sigma);
+        m2=smooth(m2,stats.sigma);
+        mf=smooth(mf,stats.sigma);
+        mBuf=m->GetBufferPointer(); m2Buf=m2->GetBufferPointer(); mfBuf=mf->GetBufferPointer();
+        const double * fBuf=stats.mean->GetBufferPointer(), *f2Buf=stats.squareMean->GetBufferPointer();
+
+        typename ProbInterpolatorType::Pointer interpolator=ProbInterpolatorType::New();
+        interpolator->SetInputImage(increment);
+        ProbabilisticPixelType * acc=accumulator->GetBufferPointer();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            double weight=globalWeight*localNCCWeight(mBuf[i],fBuf[i],m2Buf[i],f2Buf[i],mfBuf[i],exponent);
+            PointType p;
+            accumulator->TransformIndexToPhysicalPoint(getIndex(region,i),p);
+            typename ProbInterpolatorType::OutputType prob=warpedProbability(interpolator,increment,displacement,p,i);
+            for (unsigned int l=0;l<nLabels;++l) acc[i][l]+=weight*prob[l];
+        }
+    }
+
+private:
+    static IndexType getIndex(const RegionType & region, long int i){
+        IndexType idx;
+        for (unsigned int d=0;d<D;++d){
+            idx[d]=region.GetIndex()[d]+i%region.GetSize()[d];
+            i/=region.GetSize()[d];
+        }
+        return idx;
+    }
+
+    static inline typename ProbInterpolatorType::OutputType warpedProbability(const ProbInterpolatorType * interpolator, ProbabilisticVectorImagePointerType input,
+                                                                            const DisplacementType * displacement, PointType p, long int i){
+        if (displacement) p+=displacement[i];
+        ContinuousIndexType idx;
+        input->TransformPhysicalPointToContinuousIndex(p,idx);
+        return interpolator->EvaluateAtContinuousIndex(idx);
+    }
+
+    ///same as the final loop of Metrics::efficientLNCC
+    static inline double localNCCWeight(double mBar, double fBar, double m2Bar, double f2Bar, double mfBar, double exponent){
+        double numerator=mfBar-mBar*fBar;
+        //the recursive gaussian is not exact, which can result in slightly negative variances
+        double varM=std::max(0.0,m2Bar-mBar*mBar);
+        double varF=std::max(0.0,f2Bar-fBar*fBar);
+        double denominator=sqrt(varM)*sqrt(varF);
+        double r=(fabs(denominator)>1000.0*std::numeric_limits<double>::epsilon())?numerator/denominator:0.0;
+        r=std::max(-1.0,std::min(1.0,r));
+        return pow((r+1.0)/2,exponent);
+    }
+
+    static InternalImagePointerType createInternal(ImagePointerType reference){
+        InternalImagePointerType result=InternalImageType::New();
+        result->SetRegions(reference->GetLargestPossibleRegion());
+        result->SetOrigin(reference->GetOrigin());
+        result->SetSpacing(reference->GetSpacing());
+        result->SetDirection(reference->GetDirection());
+        result->Allocate();
+        return result;
+    }
+
+    static InternalImagePointerType smooth(InternalImagePointerType img, double sigma){
+        typedef itk::SmoothingRecursiveGaussianImageFilter<InternalImageType,InternalImageType> FilterType;
+        typename FilterType::Pointer filter=FilterType::New();
+        filter->SetSigma(sigma);
+        filter->SetInput(img);
+        filter->Update();
+        InternalImagePointerType result=filter->GetOutput();
+        result->DisconnectPipeline();
+        return result;
+    }
+};
@@ -0,0 +1,589 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <unistd.h>
+#include "itkImage.h"
+#include "itkContinuousIndex.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkAffineTransform.h"
+#include <itksys/SystemTools.hxx>
+#include <vnl/vnl_matrix.h>
+#include <vnl/vnl_vector.h>
+#include <vnl/algo/vnl_determinant.h>
+#include <vnl/algo/vnl_svd.h>
+#include "ImageUtils.h"
+#include "FilterUtils.hpp"
+#include "Log.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * \brief multithreaded affine/rigid registration on stratified voxel samples
+ *
+ * Replacement for the ITK registration framework used by RegistrationAffineMultiRes3D. The metric (SSD or NCC)
+ * is only evaluated on one randomly placed voxel per cell of a regular grid on the fixed image (stratified
+ * sampling) and minimised by inverse compositional Gauss-Newton with Levenberg-Marquardt damping. With the inverse
+ * compositional update, the gradients of the fixed image, the steepest descent directions and the Gauss-Newton
+ * matrix only depend on the fixed image. They are computed once per pyramid level in setFixed() and reused for all
+ * starting poses and all moving images registered against the same fixed image.
+ *
+ * Pyramids are built by repeated smoothing and downsampling by two. If a cache directory is given, each level is
+ * stored there as mha and reused as long as it is newer than the image it was computed from.
+ *
+ * Transforms map fixed to moving physical points, as itk::AffineTransform does in the resampling filters.
+ */
+template<class ImageType>
+class SampledAffineRegistration{
+public:
+    static const unsigned int D=ImageType::ImageDimension;
+    static const unsigned int nParameters=D*(D+1);
+    typedef itk::Image<float,D> InternalImageType;
+    typedef typename InternalImageType::Pointer InternalImagePointerType;
+    typedef typename InternalImageType::PointType PointType;
+    typedef typename InternalImageType::IndexType IndexType;
+    typedef typename InternalImageType::SizeType SizeType;
+    typedef typename InternalImageType::RegionType RegionType;
+    typedef itk::ContinuousIndex<double,D> ContinuousIndexType;
+    typedef itk::LinearInterpolateImageFunction<InternalImageType,double> InterpolatorType;
+    typedef itk::AffineTransform<double,D> AffineTransformType;
+    typedef typename AffineTransformType::Pointer AffineTransformPointerType;
+    ///pyramid[k] is downsampled k times, pyramid[0] is the full resolution image
+    typedef std::vector<InternalImagePointerType> PyramidType;
+    typedef vnl_matrix<double> MatrixType;
+    typedef vnl_vector<double> VectorType;
+
+    enum MetricType{SSD,NCC};
+
+    ///y = matrix * x + offset
+    struct Pose{
+        MatrixType matrix;
+        VectorType offset;
+        double cost;
+    };
+
+private:
+    ///samples of one fixed pyramid level, shared by all moving images and starting poses
+    struct FixedLevel{
+        InternalImagePointerType image;
+        std::vector<PointType> points;
+        std::vector<double> values;
+        ///nParameters entries per sample
+        std::vector<double> steepestDescent;
+        MatrixType hessian;
+    };
+    std::vector<FixedLevel> m_fixedLevels;
+    PointType m_center;
+    MetricType m_metric;
+    int m_nSamples;
+    int m_iterations;
+    double m_startAngle;
+    bool m_rigid;
+
+public:
+    SampledAffineRegistration(){
+        m_metric=NCC;
+        m_nSamples=20000;
+        m_iterations=50;
+        m_startAngle=0.0;
+        m_rigid=false;
+    }
+    void setMetric(MetricType metric){m_metric=metric;}
+    void setNumberOfSamples(int n){m_nSamples=n;}
+    void setIterations(int n){m_iterations=n;}
+    ///additional starting poses rotated by +-angle (degrees) in each coordinate plane around the fixed image center. 0 disables them
+    void setStartAngle(double angle){m_startAngle=angle;}
+    void setRigid(bool rigid){m_rigid=rigid;}
+
+    /**
+     * load or compute the pyramid of filename with up to nLevels levels.
+     * Levels are not downsampled further once halving would make an image dimension smaller than minLevelSize voxels.
+     * The cache stores the number of levels that were computed and whether that number was limited by the image size,
+     * so images with fewer levels than requested are read from the cache as well.
+     */
+    static PyramidType getPyramid(std::string filename, int nLevels, std::string cacheDir=""){
+        PyramidType pyramid;
+        int nCached=cacheDir!=""?cachedLevels(filename,nLevels,cacheDir):0;
+        if (nCached>0){
+            LOGV(1)<<"Reading cached pyramid of "<<filename<<" from "<<cacheDir<<std::endl;
+            for (int k=0;k<nCached;++k){
+                pyramid.push_back(ImageUtils<InternalImageType>::readImage(cacheName(filename,k,cacheDir)));
+            }
+            return pyramid;
+        }
+        pyramid.push_back(ImageUtils<InternalImageType>::readImage(filename));
+        bool limited=false;
+        for (int k=1;k<nLevels;++k){
+            SizeType size=pyramid[k-1]->GetLargestPossibleRegion().GetSize();
+            for (unsigned int d=0;d<D;++d) limited=limited || size[d]/2<minLevelSize;
+            if (limited){
+                LOG<<"Image "<<filename<<" is too small for "<<nLevels<<" pyramid levels, using "<<k<<std::endl;
+                break;
+            }
+            pyramid.push_back(FilterUtils<InternalImageType>::LinearResample(pyramid[k-1],0.5,true));
+        }
+        if (cacheDir!=""){
+            itksys::SystemTools::MakeDirectory(cacheDir.c_str());
+            //write to temporary files and rename them, so concurrent readers never see partially written levels.
+            //the level count is written last and marks the cache as complete
+            for (unsigned int k=0;k<pyramid.size();++k){
+                std::string tmpName=tempName(cacheName(filename,k,cacheDir));
+                ImageUtils<InternalImageType>::writeImage(tmpName,pyramid[k]);
+                std::rename(tmpName.c_str(),cacheName(filename,k,cacheDir).c_str());
+            }
+            std::string countName=levelCountName(filename,cacheDir);
+            std::string tmpName=tempName(countName);
+            std::ofstream countFile(tmpName.c_str());
+            countFile<<pyramid.size()<<" "<<limited<<std::endl;
+            countFile.close();
+            std::rename(tmpName.c_str(),countName.c_str());
+        }
+        return pyramid;
+    }
+
+    ///sample all levels of the fixed pyramid, optionally restricted to mask>0
+    template<class MaskImagePointerType>
+    void setFixed(const PyramidType & pyramid, MaskImagePointerType mask){
+        m_fixedLevels=std::vector<FixedLevel>(pyramid.size());
+        m_center=getCenter(pyramid[0]);
+        for (unsigned int k=0;k<pyramid.size();++k){
+            sampleLevel(pyramid[k],mask,m_fixedLevels[k]);
+            LOGV(1)<<"Fixed level "<<k<<": "<<m_fixedLevels[k].points.size()<<" samples"<<std::endl;
+        }
+    }
+    void setFixed(const PyramidType & pyramid){
+        setFixed(pyramid,typename ImageType::Pointer(NULL));
+    }
+
+    ///initial pose aligning the image centers, or the intensity centroids of the coarsest levels if moments is set
+    Pose getCenteredPose(const PyramidType & moving, bool moments=false) const{
+        Pose pose;
+        pose.matrix.set_size(D,D);
+        pose.matrix.set_identity();
+        pose.offset.set_size(D);
+        PointType fixedCenter=moments?getCentroid(m_fixedLevels.back().image):m_center;
+        PointType movingCenter=moments?getCentroid(moving.back()):getCenter(moving[0]);
+        for (unsigned int d=0;d<D;++d) pose.offset[d]=movingCenter[d]-fixedCenter[d];
+        pose.cost=std::numeric_limits<double>::max();
+        return pose;
+    }
+
+    static Pose getPose(AffineTransformPointerType affine){
+        Pose pose;
+        pose.matrix.set_size(D,D);
+        pose.offset.set_size(D);
+        for (unsigned int r=0;r<D;++r){
+            for (unsigned int c=0;c<D;++c) pose.matrix(r,c)=affine->GetMatrix()(r,c);
+            pose.offset[r]=affine->GetOffset()[r];
+        }
+        pose.cost=std::numeric_limits<double>::max();
+        return pose;
+    }
+
+    static AffineTransformPointerType getAffine(const Pose & pose){
+        AffineTransformPointerType affine=AffineTransformType::New();
+        typename AffineTransformType::MatrixType matrix;
+        typename AffineTransformType::OutputVectorType offset;
+        for (unsigned int r=0;r<D;++r){
+            for (unsigned int c=0;c<D;++c) matrix(r,c)=pose.matrix(r,c);
+            offset[r]=pose.offset[r];
+        }
+        affine->SetMatrix(matrix);
+        affine->SetOffset(offset);
+        return affine;
+    }
+
+    /**
+     * register a moving pyramid to the fixed image, starting from initial.
+     * All starting poses are optimised concurrently on the coarsest level, the best one is refined on the finer levels.
+     */
+    Pose registerMoving(const PyramidType & moving, const Pose & initial) const{
+        std::vector<Pose> poses=getStartingPoses(initial);
+        int nLevels=m_fixedLevels.size();
+        int coarsest=nLevels-1;
+        int nPoses=poses.size();
+        if (nPoses>1){
+            //one pose per thread, the metric is evaluated single-threaded within each
+#pragma omp parallel for schedule(dynamic)
+            for (int p=0;p<nPoses;++p){
+                optimise(m_fixedLevels[coarsest],moving[std::min(coarsest,int(moving.size())-1)],poses[p]);
+            }
+            int best=0;
+            for (int p=0;p<nPoses;++p){
+                LOGV(1)<<"Starting pose "<<p<<" final cost on coarsest level: "<<poses[p].cost<<std::endl;
+                if (poses[p].cost<poses[best].cost) best=p;
+            }
+            LOGV(1)<<"Using starting pose "<<best<<std::endl;
+            poses[0]=poses[best];
+            --coarsest;
+        }
+        Pose pose=poses[0];
+        for (int k=coarsest;k>=0;--k){
+            optimise(m_fixedLevels[k],moving[std::min(k,int(moving.size())-1)],pose);
+            LOGV(1)<<"Level "<<k<<" final cost: "<<pose.cost<<std::endl;
+        }
+        return pose;
+    }
+
+private:
+    ///smallest image dimension of a downsampled pyramid level
+    static const unsigned int minLevelSize=8;
+
+    static std::string cachePrefix(std::string filename, std::string cacheDir){
+        //djb2 hash of the path, so that images with the same name in different directories don't collide
+        unsigned long hash=5381;
+        for (unsigned int i=0;i<filename.size();++i) hash=hash*33+(unsigned char)filename[i];
+        std::ostringstream name;
+        name<<cacheDir<<"/"<<itksys::SystemTools::GetFilenameWithoutExtension(filename)<<"-"<<std::hex<<hash<<std::dec;
+        return name.str();
+    }
+    static std::string cacheName(std::string filename, int level, std::string cacheDir){
+        std::ostringstream name;
+        name<<cachePrefix(filename,cacheDir)<<"-level"<<level<<".mha";
+        return name.str();
+    }
+    static std::string levelCountName(std::string filename, std::string cacheDir){
+        return cachePrefix(filename,cacheDir)+"-levels.txt";
+    }
+    ///unique name in the directory of name with the same extension
+    static std::string tempName(std::string name){
+        std::ostringstream tmp;
+        tmp<<itksys::SystemTools::GetFilenamePath(name)<<"/"<<itksys::SystemTools::GetFilenameWithoutLastExtension(name)
+           <<"-tmp"<<getpid()<<itksys::SystemTools::GetFilenameLastExtension(name);
+        return tmp.str();
+    }
+    static bool isNewer(std::string cached, std::string filename){
+        int result;
+        return itksys::SystemTools::FileExists(cached.c_str()) && itksys::SystemTools::FileTimeCompare(cached.c_str(),filename.c_str(),&result) && result>=0;
+    }
+    ///number of cached levels to read for a request of nLevels, 0 if the cache is missing, incomplete or outdated
+    static int cachedLevels(std::string filename, int nLevels, std::string cacheDir){
+        std::string countName=levelCountName(filename,cacheDir);
+        if (!isNewer(countName,filename)) return 0;
+        std::ifstream countFile(countName.c_str());
+        int nStored=0;
+        bool limited=false;
+        if (!(countFile>>nStored>>limited)) return 0;
+        if (nStored<nLevels && !limited) return 0;
+        int n=std::min(nLevels,nStored);
+        for (int k=0;k<n;++k){
+            if (!isNewer(cacheName(filename,k,cacheDir),filename)) return 0;
+        }
+        return n;
+    }
+
+    static PointType getCenter(InternalImagePointerType image){
+        RegionType region=image->GetLargestPossibleRegion();
+        ContinuousIndexType idx;
+        for (unsigned int d=0;d<D;++d) idx[d]=region.GetIndex()[d]+0.5*(region.GetSize()[d]-1);
+        PointType center;
+        image->TransformContinuousIndexToPhysicalPoint(idx,center);
+        return center;
+    }
+
+    static PointType getCentroid(InternalImagePointerType image){
+        RegionType region=image->GetLargestPossibleRegion();
+        const float * buf=image->GetBufferPointer();
+        long int nPixels=region.GetNumberOfPixels();
+        double minVal=std::numeric_limits<double>::max();
+        for (long int i=0;i<nPixels;++i) minVal=std::min(minVal,double(buf[i]));
+        double sum=0.0;
+        std::vector<double> weighted(D,0.0);
+        for (long int i=0;i<nPixels;++i){
+            double w=buf[i]-minVal;
+            if (w<=0.0) continue;
+            PointType p;
+            image->TransformIndexToPhysicalPoint(getIndex(region,i),p);
+            for (unsigned int d=0;d<D;++d) weighted[d]+=w*p[d];
+            sum+=w;
+        }
+        if (sum==0.0) return getCenter(image);
+        PointType centroid;
+        for (unsigned int d=0;d<D;++d) centroid[d]=weighted[d]/sum;
+        return centroid;
+    }
+
+    static IndexType getIndex(const RegionType & region, long int i){
+        IndexType idx;
+        for (unsigned int d=0;d<D;++d){
+            idx[d]=region.GetIndex()[d]+i%region.GetSize()[d];
+            i/=region.GetSize()[d];
+        }
+        return idx;
+    }
+
+    template<class MaskImagePointerType>
+    void sampleLevel(InternalImagePointerType image, MaskImagePointerType mask, FixedLevel & level) const{
+        level.image=image;
+        RegionType region=image->GetLargestPossibleRegion();
+        SizeType size=region.GetSize();
+        int stride=std::max(1,int(floor(pow(1.0*region.GetNumberOfPixels()/std::max(1,m_nSamples),1.0/D))));
+        SizeType cells;
+        long int nCells=1;
+        for (unsigned int d=0;d<D;++d){
+            cells[d]=(size[d]+stride-1)/stride;
+            nCells*=cells[d];
+        }
+        //one voxel at a random position within each cell. fixed seed, so that repeated runs use the same samples
+        unsigned long seed=12345;
+        level.points.clear();
+        level.values.clear();
+        std::vector<IndexType> indices;
+        for (long int c=0;c<nCells;++c){
+            IndexType idx;
+            long int rest=c;
+            bool inside=true;
+            for (unsigned int d=0;d<D;++d){
+                seed=seed*1103515245+12345;
+                idx[d]=region.GetIndex()[d]+(rest%cells[d])*stride+(seed>>16)%stride;
+                rest/=cells[d];
+                inside=inside && idx[d]<region.GetIndex()[d]+long(size[d]);
+            }
+            if (!inside) continue;
+            PointType p;
+            image->TransformIndexToPhysicalPoint(idx,p);
+            if (mask.IsNotNull()){
+                typename MaskImagePointerType::ObjectType::IndexType maskIdx;
+                if (!mask->TransformPhysicalPointToIndex(p,maskIdx) || !mask->GetPixel(maskIdx)) continue;
+            }
+            indices.push_back(idx);
+            level.points.push_back(p);
+            level.values.push_back(image->GetPixel(idx));
+        }
+
+        long int nSamples=indices.size();
+        double scale=1.0;
+        if (m_metric==NCC){
+            //work on zero mean, unit variance samples
+            double mean=0.0,sumSq=0.0;
+            for (long int s=0;s<nSamples;++s) mean+=level.values[s];
+            mean/=std::max(1l,nSamples);
+            for (long int s=0;s<nSamples;++s) sumSq+=(level.values[s]-mean)*(level.values[s]-mean);
+            double sd=sqrt(sumSq/std::max(1l,nSamples));
+            if (sd<=0.0) sd=1.0;
+            for (long int s=0;s<nSamples;++s) level.values[s]=(level.values[s]-mean)/sd;
+            scale=1.0/sd;
+        }
+
+        level.steepestDescent.resize(nSamples*nParameters);
+        int nThreads=1;
+#ifdef _OPENMP
+        nThreads=omp_get_max_threads();
+#endif
+        std::vector<MatrixType> hessians(nThreads,MatrixType(nParameters,nParameters,0.0));
+#pragma omp parallel for
+        for (long int s=0;s<nSamples;++s){
+            int thread=0;
+#ifdef _OPENMP
+            thread=omp_get_thread_num();
+#endif
+            double gradient[D];
+            imageGradient(image,indices[s],gradient);
+            double * sd=&level.steepestDescent[s*nParameters];
+            for (unsigned int r=0;r<D;++r){
+                for (unsigned int c=0;c<D;++c) sd[r*D+c]=scale*gradient[r]*(level.points[s][c]-m_center[c]);
+                sd[D*D+r]=scale*gradient[r];
+            }
+            addOuterProduct(hessians[thread],sd);
+        }
+        level.hessian=hessians[0];
+        for (int t=1;t<nThreads;++t) level.hessian+=hessians[t];
+    }
+
+    ///physical gradient by central differences, one-sided at the border
+    static void imageGradient(InternalImagePointerType image, const IndexType & idx, double * gradient){
+        RegionType region=image->GetLargestPossibleRegion();
+        double indexGradient[D];
+        for (unsigned int d=0;d<D;++d){
+            IndexType lower=idx,upper=idx;
+            if (idx[d]>region.GetIndex()[d]) --lower[d];
+            if (idx[d]<region.GetIndex()[d]+long(region.GetSize()[d])-1) ++upper[d];
+            int dist=upper[d]-lower[d];
+            indexGradient[d]=dist?(image->GetPixel(upper)-image->GetPixel(lower))/(dist*image->GetSpacing()[d]):0.0;
+        }
+        for (unsigned int r=0;r<D;++r){
+            gradient[r]=0.0;
+            for (unsigned int c=0;c<D;++c) gradient[r]+=image->GetDirection()(r,c)*indexGradient[c];
+        }
+    }
+
+    static inline void addOuterProduct(MatrixType & m, const double * v){
+        for (unsigned int i=0;i<nParameters;++i){
+            for (unsigned int j=0;j<nParameters;++j) m(i,j)+=v[i]*v[j];
+        }
+    }
+
+    std::vector<Pose> getStartingPoses(const Pose & initial) const{
+        std::vector<Pose> poses(1,initial);
+        if (m_startAngle==0.0) return poses;
+        double angle=m_startAngle*M_PI/180.0;
+        for (unsigned int i=0;i<D;++i){
+            for (unsigned int j=i+1;j<D;++j){
+                for (int sign=-1;sign<=1;sign+=2){
+                    //rotation in the (i,j) plane around the fixed center, applied before the initial pose
+                    MatrixType rotation(D,D);
+                    rotation.set_identity();
+                    rotation(i,i)=cos(angle); rotation(i,j)=-sign*sin(angle);
+                    rotation(j,i)=sign*sin(angle); rotation(j,j)=cos(angle);
+                    VectorType center(D);
+                    for (unsigned int d=0;d<D;++d) center[d]=m_center[d];
+                    Pose pose;
+                    pose.matrix=initial.matrix*rotation;
+                    pose.offset=initial.matrix*(center-rotation*center)+initial.offset;
+                    pose.cost=std::numeric_limits<double>::max();
+                    poses.push_back(pose);
+                }
+            }
+        }
+        return poses;
+    }
+
+    /**
+     * cost at pose and the right hand side of the Gauss-Newton system.
+     * The Gauss-Newton matrix is the precomputed one minus the contributions of samples mapped outside of the moving image.
+     */
+    double evaluate(const FixedLevel & level, InternalImagePointerType moving, typename InterpolatorType::Pointer interpolator,
+                    const Pose & pose, VectorType & rhs, MatrixType & hessian) const{
+        long int nSamples=level.points.size();
+        int nThreads=1;
+#ifdef _OPENMP
+        nThreads=omp_get_max_threads();
+#endif
+        std::vector<double> warped(nSamples);
+        std::vector<char> valid(nSamples);
+        std::vector<double> sums(nThreads,0.0),sumsSq(nThreads,0.0);
+        std::vector<long int> counts(nThreads,0);
+#pragma omp parallel for
+        for (long int s=0;s<nSamples;++s){
+            int thread=0;
+#ifdef _OPENMP
+            thread=omp_get_thread_num();
+#endif
+            PointType p;
+            for (unsigned int r=0;r<D;++r){
+                p[r]=pose.offset[r];
+                for (unsigned int c=0;c<D;++c) p[r]+=pose.matrix(r,c)*level.points[s][c];
+            }
+            ContinuousIndexType idx;
+            moving->TransformPhysicalPointToContinuousIndex(p,idx);
+            valid[s]=interpolator->IsInsideBuffer(idx);
+            if (!valid[s]) continue;
+            warped[s]=interpolator->EvaluateAtContinuousIndex(idx);
+            sums[thread]+=warped[s];
+            sumsSq[thread]+=warped[s]*warped[s];
+            ++counts[thread];
+        }
+        double sum=0.0,sumSq=0.0;
+        long int count=0;
+        for (int t=0;t<nThreads;++t){
+            sum+=sums[t];
+            sumSq+=sumsSq[t];
+            count+=counts[t];
+        }
+        //require a reasonable overlap
+        if (count<std::max(1l,nSamples/10)) return std::numeric_limits<double>::max();
+        double mean=0.0,sd=1.0;
+        if (m_metric==NCC){
+            mean=sum/count;
+            sd=sqrt(std::max(0.0,sumSq/count-mean*mean));
+            if (sd<=0.0) sd=1.0;
+        }
+
+        std::vector<VectorType> rhss(nThreads,VectorType(nParameters,0.0));
+        std::vector<MatrixType> outside(nThreads,MatrixType(nParameters,nParameters,0.0));
+        std::vector<double> costs(nThreads,0.0);
+#pragma omp parallel for
+        for (long int s=0;s<nSamples;++s){
+            int thread=0;
+#ifdef _OPENMP
+            thread=omp_get_thread_num();
+#endif
+            const double * sd_s=&level.steepestDescent[s*nParameters];
+            if (!valid[s]){
+                addOuterProduct(outside[thread],sd_s);
+                continue;
+            }
+            double residual=(warped[s]-mean)/sd-level.values[s];
+            for (unsigned int i=0;i<nParameters;++i) rhss[thread][i]+=sd_s[i]*residual;
+            costs[thread]+=residual*residual;
+        }
+        rhs=rhss[0];
+        hessian=level.hessian-outside[0];
+        double cost=costs[0];
+        for (int t=1;t<nThreads;++t){
+            rhs+=rhss[t];
+            hessian-=outside[t];
+            cost+=costs[t];
+        }
+        return cost/count;
+    }
+
+    ///inverse compositional update: pose <- pose o W(delta)^-1, with W(delta)(x) = x + A(x-center) + t
+    Pose update(const Pose & pose, const VectorType & delta) const{
+        MatrixType linear(D,D);
+        linear.set_identity();
+        VectorType translation(D);
+        for (unsigned int r=0;r<D;++r){
+            for (unsigned int c=0;c<D;++c) linear(r,c)+=delta[r*D+c];
+            translation[r]=delta[D*D+r];
+            for (unsigned int c=0;c<D;++c) translation[r]-=delta[r*D+c]*m_center[c];
+        }
+        MatrixType inverse=vnl_svd<double>(linear).inverse();
+        Pose result;
+        result.matrix=pose.matrix*inverse;
+        result.offset=pose.offset-result.matrix*translation;
+        result.cost=std::numeric_limits<double>::max();
+        if (m_rigid){
+            //closest rotation, keeping the image of the fixed center
+            vnl_svd<double> svd(result.matrix);
+            MatrixType u=svd.U();
+            if (vnl_determinant(u*svd.V().transpose())<0){
+                for (unsigned int r=0;r<D;++r) u(r,D-1)*=-1;
+            }
+            MatrixType rotation=u*svd.V().transpose();
+            VectorType center(D);
+            for (unsigned int d=0;d<D;++d) center[d]=m_center[d];
+            result.offset+=(result.matrix-rotation)*center;
+            result.matrix=rotation;
+        }
+        return result;
+    }
+
+    ///Levenberg-Marquardt damped inverse compositional Gauss-Newton on one level
+    void optimise(const FixedLevel & level, InternalImagePointerType moving, Pose & pose) const{
+        typename InterpolatorType::Pointer interpolator=InterpolatorType::New();
+        interpolator->SetInputImage(moving);
+        VectorType rhs;
+        MatrixType hessian;
+        pose.cost=evaluate(level,moving,interpolator,pose,rhs,hessian);
+        if (pose.cost==std::numeric_limits<double>::max()) return;
+        double lambda=1e-3;
+        for (int it=0;it<m_iterations;++it){
+            MatrixType damped=hessian;
+            for (unsigned int i=0;i<nParameters;++i) damped(i,i)*=1.0+lambda;
+            VectorType delta=vnl_svd<double>(damped).solve(rhs);
+            Pose candidate=update(pose,delta);
+            VectorType candidateRhs;
+            MatrixType candidateHessian;
+            candidate.cost=evaluate(level,moving,interpolator,candidate,candidateRhs,candidateHessian);
+            if (candidate.cost<pose.cost){
+                double improvement=(pose.cost-candidate.cost)/std::max(pose.cost,std::numeric_limits<double>::epsilon());
+                pose=candidate;
+                rhs=candidateRhs;
+                hessian=candidateHessian;
+                lambda=std::max(1e-6,lambda/10);
+                if (improvement<1e-6) break;
+            }else{
+                lambda*=10;
+                if (lambda>1e6) break;
+            }
+        }
+    }
+};
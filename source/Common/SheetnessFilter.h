@@ -24,6 +24,10 @@
 #include "Log.h"
 #include <limits>
 #include "float.h"
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //#include "image_utils.h"
 
@@ -55,6 +59,8 @@ public:
 	void SetBeta(double b);
 	void SetGamma(double c);
 	void SetSigma(double s);
+	///evaluate several scales in one pass, the output is the response with the largest absolute value over all scales
+	void SetSigmas(std::vector<double> s);
 	void SetBrightObject(bool cond);
 
 	void ScaleObjectnessMeasureOff();
@@ -66,6 +72,8 @@ public:
 
 private:
 	ImagePointerType input_image, output_image;
+	std::vector<ImagePointerType> smoothed_images;
+	std::vector<double> sigmas;
 	VectorImagePointerType vector_image;
 	ROIImagePointerType roi_image;
 	unsigned int objectDimension;
@@ -83,6 +91,9 @@ private:
         VectorType & firstPrincipalEigenvector);
 
 	void GenerateObjectnessImage();
+
+	///edge length of the cubic tiles processed by one thread, tiles without ROI voxels are skipped
+	static const int TileSize=16;
 };
 
 
@@ -111,7 +122,8 @@ void MemoryEfficientObjectnessFilter::SetObjectDimension(unsigned int dim)	{ obj
 void MemoryEfficientObjectnessFilter::SetAlpha(double a)					{ alpha = a; }
 void MemoryEfficientObjectnessFilter::SetBeta(double b)						{ beta = b; }
 void MemoryEfficientObjectnessFilter::SetGamma(double c)					{ gamma = c; }
-void MemoryEfficientObjectnessFilter::SetSigma(double s)					{ sigma = s; }
+void MemoryEfficientObjectnessFilter::SetSigma(double s)					{ sigma = s; sigmas.clear(); }
+void MemoryEfficientObjectnessFilter::SetSigmas(std::vector<double> s)		{ sigmas = s; }
 void MemoryEfficientObjectnessFilter::SetBrightObject(bool cond)
 {
 	if (cond)	bright = 1;
@@ -126,172 +138,242 @@ void MemoryEfficientObjectnessFilter::ScaleObjectnessMeasureOn()  { scaleObjectn
 void MemoryEfficientObjectnessFilter::Update()
 {
 	typedef itk::SmoothingRecursiveGaussianImageFilter <ImageType> FilterType;
-	FilterType::Pointer filter = FilterType::New();
-
-	filter->SetInput( input_image );
-	filter->SetSigma( sigma );
-	filter->Update();
-	output_image = filter->GetOutput();
+	if (!sigmas.size()) sigmas.push_back(sigma);
 
-	output_image->DisconnectPipeline();
+	smoothed_images.clear();
+	for (unsigned int s=0 ; s<sigmas.size() ; s++)
+	{
+		FilterType::Pointer filter = FilterType::New();
+		filter->SetInput( input_image );
+		filter->SetSigma( sigmas[s] );
+		filter->Update();
+		ImagePointerType smoothed = filter->GetOutput();
+		smoothed->DisconnectPipeline();
+		smoothed_images.push_back(smoothed);
+	}
 
 	GenerateObjectnessImage();
+	smoothed_images.clear();
 }
 
 MemoryEfficientObjectnessFilter::ImagePointerType MemoryEfficientObjectnessFilter::GetOutput()	{ return output_image; }
 
+//the volume is split into cubic tiles which are processed in parallel. within a tile, the hessians of one row
+//are computed first and then the eigenvalues and the objectness of the whole row, for all scales.
+//the noise term depends on the mean hessian norm over the whole ROI, so a first pass over the tiles only
+//accumulates the norms per scale. the second pass recomputes the eigenvalues, applies the noise term and keeps
+//the response with the largest absolute value of each row while the scales are evaluated, so no per-scale
+//volume is stored and the output image is the only full size buffer.
 void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
 {
 	// define variables for image size
-	int w,h,d,wh,whd;
-	w = output_image->GetLargestPossibleRegion().GetSize()[0];
-	h = output_image->GetLargestPossibleRegion().GetSize()[1];
-	d = output_image->GetLargestPossibleRegion().GetSize()[2];
-	wh = w*h;
-	whd = wh*d;
-
-	//variables for browsing through image
-	ImageType::IndexType image_index;	image_index[0]=0;image_index[1]=0;image_index[2]=0;
-	int add;
-	int pi, mi, pj, mj, pk, mk, p2i, m2i, p2j, m2j, p2k, m2k;
-
-	//
-	PixelType *img; //img = (PixelType *) calloc( wh*d, sizeof(PixelType) );
-	img = output_image->GetBufferPointer();
-	float hxx, hyy, hzz, hxy, hxz, hyz;
-	float tmp;
-	//float *l; l = (float *)calloc(3,sizeof(float));
-	PixelType *tmp_obj;		tmp_obj = (PixelType *) calloc( whd, sizeof(PixelType) );
-	PixelType *tmp_sum;		tmp_sum = (PixelType *) calloc( whd, sizeof(PixelType) );
-
-	float al1, al2, al3, sum; double mean_norm=0;
-	float Rsheet, Rblob, Rtube, Rnoise;
+	int w,h,d;
+	long int wh;
+	w = input_image->GetLargestPossibleRegion().GetSize()[0];
+	h = input_image->GetLargestPossibleRegion().GetSize()[1];
+	d = input_image->GetLargestPossibleRegion().GetSize()[2];
+	wh = (long int)w*h;
+	int nScales = smoothed_images.size();
+
+	output_image = ImageType::New();
+	output_image->SetRegions(input_image->GetLargestPossibleRegion());
+	output_image->SetOrigin(input_image->GetOrigin());
+	output_image->SetSpacing(input_image->GetSpacing());
+	output_image->SetDirection(input_image->GetDirection());
+	output_image->Allocate();
+	output_image->FillBuffer(0);
+
+	std::vector<const PixelType *> img(nScales);
+	for (int s=0 ; s<nScales ; s++) img[s] = smoothed_images[s]->GetBufferPointer();
+	const unsigned char * roi = roi_image.IsNotNull() ? roi_image->GetBufferPointer() : NULL;
+	PixelType * out = output_image->GetBufferPointer();
+	VectorType * vec = vector_image.IsNotNull() ? vector_image->GetBufferPointer() : NULL;
+
 	float alpha_sq = 2*alpha*alpha, beta_sq = 2*beta*beta, gamma_sq = 2*gamma*gamma;
+	float eps = std::numeric_limits<float>::epsilon()*100;
+
+	int nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	std::vector<double> mean_norms(nThreads*nScales,0.0);
+	std::vector<long int> pixelsInRoi(nThreads,0);
+	std::vector<float> mean_norm(nScales,1.0);
+
+	if (objectDimension!=1 && objectDimension!=2)
+	{
+		std::cerr<<"not implemented! objectDimension:"<<objectDimension<<std::endl;
+		exit(0);
+	}
 
-    unsigned pixelsInRoi = 0;
+	int tw = (w+TileSize-1)/TileSize, th = (h+TileSize-1)/TileSize, td = (d+TileSize-1)/TileSize;
+	long int nTiles = (long int)tw*th*td;
 
-	for (int k=0 ; k<d ; k++)
+	// pass 0: mean hessian norm per scale, pass 1: objectness with noise term, reduced over the scales
+	for (int pass=0 ; pass<2 ; pass++)
+	{
+#pragma omp parallel for schedule(dynamic)
+	for (long int tile=0 ; tile<nTiles ; tile++)
 	{
-	    image_index[2] = k;
-		pk=wh; p2k=2*wh; mk=-wh; m2k=-2*wh;
-		if ( (k<2) || (k>d-3) )
+		int thread = 0;
+#ifdef _OPENMP
+		thread = omp_get_thread_num();
+#endif
+		int i0 = (tile%tw)*TileSize, j0 = ((tile/tw)%th)*TileSize, k0 = (tile/(tw*th))*TileSize;
+		int i1 = min(i0+TileSize,w), j1 = min(j0+TileSize,h), k1 = min(k0+TileSize,d);
+
+		// dont process tiles without any roi pixel, the output is already zero there
+		if (roi)
 		{
-			if (k==0)	{mk=0; m2k=0;}
-			if (k==d-1) {pk=0; p2k=0;}
-			if (k==1)	m2k=-wh;
-			if (k==d-2) p2k= wh;
+			bool any = false;
+			for (int k=k0 ; k<k1 && !any ; k++)
+				for (int j=j0 ; j<j1 && !any ; j++)
+					for (int i=i0 ; i<i1 ; i++)
+						if (roi[i + j*w + k*wh]) { any = true; break; }
+			if (!any) continue;
 		}
 
-		for (int j=0 ; j<h; j++)
+		float hxx[TileSize], hyy[TileSize], hzz[TileSize], hxy[TileSize], hxz[TileSize], hyz[TileSize];
+		VectorType eigenVals[TileSize], eigenVecs[TileSize];
+		bool inside[TileSize];
+		// running maximum of the absolute response over the scales and the eigenvector of that scale
+		PixelType best[TileSize];
+		VectorType bestVec[TileSize];
+
+		for (int k=k0 ; k<k1 ; k++)
 		{
-            image_index[1] = j;
-			pj=w; p2j=2*w; mj=-w; m2j=-2*w;
-			if ( (j<2) || (j>h-3) )
+			long int pk=wh, p2k=2*wh, mk=-wh, m2k=-2*wh;
+			if ( (k<2) || (k>d-3) )
 			{
-				if (j==0)	{mj=0; m2j=0;}
-				if (j==h-1) {pj=0; p2j=0;}
-				if (j==1)	m2j=-w;
-				if (j==h-2) p2j= w;
+				if (k==0)	{mk=0; m2k=0;}
+				if (k==d-1) {pk=0; p2k=0;}
+				if (k==1)	m2k=-wh;
+				if (k==d-2) p2k= wh;
 			}
-			for (int i=0 ; i<w ; i++)
+			for (int j=j0 ; j<j1 ; j++)
 			{
-                image_index[0] = i;
-				add = i + j*w + k*wh; //current pixel
-
-                // dont process pixels outside roi
-                if (roi_image.IsNotNull() && roi_image->GetPixel(image_index) == 0) {
-                    tmp_obj[add] = 0;
-                    continue;
-                }
-
-                pixelsInRoi++;
-
-				pi=1; p2i=2; mi=-1;	m2i=-2;
-				if ( (i<2) || (i>w-3) )
+				long int pj=w, p2j=2*w, mj=-w, m2j=-2*w;
+				if ( (j<2) || (j>h-3) )
 				{
-					if (i==0)	{mi=0; m2i=0;}
-					if (i==w-1) {pi=0; p2i=0;}
-					if (i==1)	m2i=-1;
-					if (i==w-2) p2i= 1;
+					if (j==0)	{mj=0; m2j=0;}
+					if (j==h-1) {pj=0; p2j=0;}
+					if (j==1)	m2j=-w;
+					if (j==h-2) p2j= w;
 				}
-
-				tmp = 2.0*img[add];
-
-				hxx = (img[add+m2i] - tmp + img[add+p2i])/4.0;
-				hyy = (img[add+m2j] - tmp + img[add+p2j])/4.0;
-				hzz = (img[add+m2k] - tmp + img[add+p2k])/4.0;
-				hxy = (img[add+mi+mj] - img[add+pi+mj] - img[add+mi+pj] + img[add+pi+pj])/4.0;
-				hxz = (img[add+mi+mk] - img[add+pi+mk] - img[add+mi+pk] + img[add+pi+pk])/4.0;
-				hyz = (img[add+mj+mk] - img[add+pj+mk] - img[add+mj+pk] + img[add+pj+pk])/4.0;
-
-
-                VectorType eigenVals;
-
-                if (vector_image.IsNotNull()) {
-                    VectorType principalEigenVector;
-                    solve_3x3_symmetric_eigensystem(
-                        hxx, hxy, hxz, hyy, hyz, hzz,
-                        eigenVals, principalEigenVector);
-                    vector_image->SetPixel(image_index, principalEigenVector);
-                } else {
-                    Eigenvalues_3_3_symetric(hxx, hxy, hxz, hyy, hyz, hzz, eigenVals);
-                }
-
-
-                al1 = fabs(eigenVals[0]); al2 = max(fabs(eigenVals[1]),std::numeric_limits<float>::epsilon()*100); al3 = max(fabs(eigenVals[2]),std::numeric_limits<float>::epsilon()*100);
-				sum = al1+al2+al3;
-				mean_norm+=sum;
-				tmp_sum[add]=sum;
-
-				if (al3<=std::numeric_limits<float>::epsilon()*100)
+				long int rowStart = j*w + k*wh;
+				int nInside = 0;
+				for (int i=i0 ; i<i1 ; i++)
 				{
-					tmp_obj[add] = 0;
+					// dont process pixels outside roi
+					inside[i-i0] = !roi || roi[rowStart+i];
+					nInside += inside[i-i0];
 				}
-				else
+				if (!nInside) continue;
+				if (pass==0) pixelsInRoi[thread] += nInside;
+
+				for (int s=0 ; s<nScales ; s++)
 				{
-					Rtube  = al1 / (al2*al3);
-					Rsheet = al2 / al3;
-					Rblob  = 3.0*al1 / sum;
+					const PixelType * im = img[s];
+					for (int i=i0 ; i<i1 ; i++)
+					{
+						int r = i-i0;
+						if (!inside[r]) continue;
+						long int add = rowStart + i; //current pixel
+						long int pi=1, p2i=2, mi=-1, m2i=-2;
+						if ( (i<2) || (i>w-3) )
+						{
+							if (i==0)	{mi=0; m2i=0;}
+							if (i==w-1) {pi=0; p2i=0;}
+							if (i==1)	m2i=-1;
+							if (i==w-2) p2i= 1;
+						}
+						float tmp = 2.0*im[add];
+						hxx[r] = (im[add+m2i] - tmp + im[add+p2i])/4.0;
+						hyy[r] = (im[add+m2j] - tmp + im[add+p2j])/4.0;
+						hzz[r] = (im[add+m2k] - tmp + im[add+p2k])/4.0;
+						hxy[r] = (im[add+mi+mj] - im[add+pi+mj] - im[add+mi+pj] + im[add+pi+pj])/4.0;
+						hxz[r] = (im[add+mi+mk] - im[add+pi+mk] - im[add+mi+pk] + im[add+pi+pk])/4.0;
+						hyz[r] = (im[add+mj+mk] - im[add+pj+mk] - im[add+mj+pk] + im[add+pj+pk])/4.0;
+					}
 
+					for (int r=0 ; r<i1-i0 ; r++)
+					{
+						if (!inside[r]) continue;
+						// both passes use the same solver, so the norms of pass 0 match the ones of pass 1
+						if (vec) {
+							solve_3x3_symmetric_eigensystem(
+								hxx[r], hxy[r], hxz[r], hyy[r], hyz[r], hzz[r],
+								eigenVals[r], eigenVecs[r]);
+						} else {
+							Eigenvalues_3_3_symetric(hxx[r], hxy[r], hxz[r], hyy[r], hyz[r], hzz[r], eigenVals[r]);
+						}
+					}
 
-					if (objectDimension==1)
-					{//Vesselness
-						tmp_obj[add] = bright * (-eigenVals[2]/al3) * (1-exp(-Rsheet*Rsheet/alpha_sq)) * exp(-Rtube*Rtube/beta_sq) * exp(-Rblob*Rblob/gamma_sq);
+					double row_norm = 0;
+					for (int r=0 ; r<i1-i0 ; r++)
+					{
+						if (!inside[r]) continue;
+						float al1 = fabs(eigenVals[r][0]), al2 = max((float)fabs(eigenVals[r][1]),eps), al3 = max((float)fabs(eigenVals[r][2]),eps);
+						float sum = al1+al2+al3;
+						if (pass==0)
+						{
+							row_norm += sum;
+							continue;
+						}
+						float val = 0;
+						if (al3>eps)
+						{
+							float Rtube  = al1 / (al2*al3);
+							float Rsheet = al2 / al3;
+							float Rblob  = 3.0*al1 / sum;
+							val = bright * (-eigenVals[r][2]/al3) * exp(-Rtube*Rtube/beta_sq) * exp(-Rblob*Rblob/gamma_sq);
+							if (objectDimension==1)
+							{//Vesselness
+								val *= (1-exp(-Rsheet*Rsheet/alpha_sq));
+							}
+							else
+							{//Sheetness
+								val *= exp(-Rsheet*Rsheet/alpha_sq);
+							}
+							if (scaleObjectnessMeasure)	 val *= al3;
+							float Rnoise = sum/mean_norm[s];
+							val *= (1 - exp(-Rnoise*Rnoise/0.25));
+						}
+						if (s==0 || fabs(val) > fabs(best[r]))
+						{
+							best[r] = val;
+							if (vec) bestVec[r] = eigenVecs[r];
+						}
 					}
-					else if (objectDimension==2)
-					{//Sheetness
-						tmp_obj[add] = bright * (-eigenVals[2]/al3) * exp(-Rsheet*Rsheet/alpha_sq) * exp(-Rtube*Rtube/beta_sq) * exp(-Rblob*Rblob/gamma_sq);
+					if (pass==0) mean_norms[thread*nScales+s] += row_norm;
+				}
+
+				if (pass==1)
+				{
+					for (int r=0 ; r<i1-i0 ; r++)
+					{
+						if (!inside[r]) continue;
+						out[rowStart+i0+r] = best[r];
+						if (vec) vec[rowStart+i0+r] = bestVec[r];
 					}
-                    else{
-                        std::cerr<<"not implemented! objectDimension:"<<objectDimension<<std::endl;
-                        exit(0);
-                    }
-					if (scaleObjectnessMeasure)	 tmp_obj[add] *= al3;
 				}
 			}
 		}
 	}
-	mean_norm /= (float)pixelsInRoi;
 
-    LOG<<"Mean norm = "<< mean_norm<<std::endl;
-
-	for (int k=0 ; k<d ; k++)
+	if (pass==0)
 	{
-		image_index[2] = k;
-		for (int j=0 ; j<h; j++)
+		long int nPixelsInRoi = 0;
+		for (int t=0 ; t<nThreads ; t++) nPixelsInRoi += pixelsInRoi[t];
+		for (int s=0 ; s<nScales ; s++)
 		{
-			image_index[1] = j;
-			for (int i=0 ; i<w ; i++)
-			{
-				image_index[0] = i;
-				add = i + j*w + k*wh;
-				Rnoise = tmp_sum[add]/mean_norm;
-				tmp_obj[add] *= (1 - exp(-Rnoise*Rnoise/0.25));
-				output_image->SetPixel(image_index, tmp_obj[add]);
-			}
+			double norm = 0;
+			for (int t=0 ; t<nThreads ; t++) norm += mean_norms[t*nScales+s];
+			mean_norm[s] = nPixelsInRoi ? norm/nPixelsInRoi : 1.0;
+			LOG<<"Mean norm = "<< mean_norm[s]<<" at sigma="<<sigmas[s]<<std::endl;
 		}
 	}
-	free(tmp_sum); 	free(tmp_obj);
+	}
 }
 
 
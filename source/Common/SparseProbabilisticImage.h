@@ -0,0 +1,305 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include "itkImage.h"
+#include "itkVector.h"
+#include "ImageUtils.h"
+#include "Log.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+///K most probable labels of a voxel, their quantized shares of the total mass, and the total mass
+template<unsigned int K, class QuantizedType>
+struct SparseProbabilisticPixel{
+    float mass;
+    unsigned char labels[K];
+    QuantizedType shares[K];
+};
+
+/**
+ * \brief compact storage of probabilistic segmentations (itk::Vector<float,nLabels> images)
+ *
+ * Per voxel, only the K labels with the highest probability are kept, with their share of the (unnormalized) total
+ * mass quantized to QuantizedType. The residual mass is spread uniformly over the other labels when a voxel is
+ * decoded. With K=4 and unsigned short shares a voxel takes 16 bytes instead of 4*nLabels. Label images (one-hot
+ * vectors) and voxels with at most K nonzero labels are stored exactly up to the quantization of the shares
+ * (1/65535 of the mass for unsigned short). K must not exceed nLabels and nLabels must not exceed 256.
+ *
+ * The accumulation operators work on the compact images: adding to a sparse accumulator decodes, adds and re-encodes
+ * each voxel, so the K labels kept can change. Warping still needs the float vector image, use expand() right before
+ * and compress() right after.
+ *
+ * On disk, a sparse image is an itk::Vector<unsigned short,2K+2> image (.mha) with the K labels, the K shares and
+ * the float mass split into two 16 bit words.
+ */
+template<class ProbabilisticVectorImageType, unsigned int K=4, class QuantizedType=unsigned short>
+class SparseProbabilisticImage{
+public:
+    typedef typename ProbabilisticVectorImageType::Pointer ProbabilisticVectorImagePointerType;
+    typedef typename ProbabilisticVectorImageType::PixelType ProbabilisticPixelType;
+    static const unsigned int D=ProbabilisticVectorImageType::ImageDimension;
+    static const unsigned int nLabels=ProbabilisticPixelType::Dimension;
+    typedef SparseProbabilisticPixel<K,QuantizedType> SparsePixelType;
+    typedef itk::Image<SparsePixelType,D> SparseImageType;
+    typedef typename SparseImageType::Pointer SparseImagePointerType;
+    typedef itk::Vector<unsigned short,2*K+2> DiskPixelType;
+    typedef itk::Image<DiskPixelType,D> DiskImageType;
+    typedef typename DiskImageType::Pointer DiskImagePointerType;
+
+    ///largest quantized share, which stands for the full mass
+    static double maxShare(){return std::numeric_limits<QuantizedType>::max();}
+
+    ///empty (zero mass) sparse image on the grid of reference
+    template<class ReferencePointerType>
+    static SparseImagePointerType createEmpty(const ReferencePointerType & reference){
+        SparseImagePointerType result=SparseImageType::New();
+        result->SetOrigin(reference->GetOrigin());
+        result->SetSpacing(reference->GetSpacing());
+        result->SetDirection(reference->GetDirection());
+        result->SetRegions(reference->GetLargestPossibleRegion());
+        result->Allocate();
+        std::vector<double> zeros(nLabels,0.0);
+        SparsePixelType empty;
+        encode(&zeros[0],empty);
+        result->FillBuffer(empty);
+        return result;
+    }
+
+    ///one-hot encoding of a label image
+    template<class LabelImagePointerType>
+    static SparseImagePointerType fromSegmentation(const LabelImagePointerType & segmentation){
+        SparseImagePointerType result=createEmpty(segmentation);
+        SparsePixelType * out=result->GetBufferPointer();
+        long int nPixels=result->GetBufferedRegion().GetNumberOfPixels();
+        long int nInvalid=0;
+        int invalidLabel=0;
+#pragma omp parallel
+        {
+            std::vector<double> probs(nLabels,0.0);
+#pragma omp for reduction(+:nInvalid)
+            for (long int i=0;i<nPixels;++i){
+                int label=int(segmentation->GetBufferPointer()[i]);
+                if (label<0 || label>=int(nLabels)){
+                    ++nInvalid;
+                    invalidLabel=label;
+                    continue;
+                }
+                probs[label]=1.0;
+                encode(&probs[0],out[i]);
+                probs[label]=0.0;
+            }
+        }
+        if (nInvalid){
+            LOG<<"ERROR: segmentation contains "<<nInvalid<<" voxels with labels outside [0,"<<nLabels<<"), e.g. "<<invalidLabel<<", aborting."<<std::endl;
+            exit(0);
+        }
+        return result;
+    }
+
+    static SparseImagePointerType compress(ProbabilisticVectorImagePointerType dense){
+        SparseImagePointerType result=createEmpty(dense);
+        const ProbabilisticPixelType * in=dense->GetBufferPointer();
+        SparsePixelType * out=result->GetBufferPointer();
+        long int nPixels=result->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel
+        {
+            std::vector<double> probs(nLabels);
+#pragma omp for
+            for (long int i=0;i<nPixels;++i){
+                for (unsigned int l=0;l<nLabels;++l) probs[l]=in[i][l];
+                encode(&probs[0],out[i]);
+            }
+        }
+        return result;
+    }
+
+    static ProbabilisticVectorImagePointerType expand(SparseImagePointerType sparse){
+        ProbabilisticVectorImagePointerType result=ProbabilisticVectorImageType::New();
+        result->SetOrigin(sparse->GetOrigin());
+        result->SetSpacing(sparse->GetSpacing());
+        result->SetDirection(sparse->GetDirection());
+        result->SetRegions(sparse->GetLargestPossibleRegion());
+        result->Allocate();
+        const SparsePixelType * in=sparse->GetBufferPointer();
+        ProbabilisticPixelType * out=result->GetBufferPointer();
+        long int nPixels=sparse->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel
+        {
+            std::vector<double> probs(nLabels);
+#pragma omp for
+            for (long int i=0;i<nPixels;++i){
+                decode(in[i],&probs[0]);
+                for (unsigned int l=0;l<nLabels;++l) out[i][l]=probs[l];
+            }
+        }
+        return result;
+    }
+
+    ///accumulator += weight*increment, the voxels of the accumulator are re-encoded
+    static void accumulate(SparseImagePointerType accumulator, ProbabilisticVectorImagePointerType increment, double weight){
+        SparsePixelType * acc=accumulator->GetBufferPointer();
+        const ProbabilisticPixelType * inc=increment->GetBufferPointer();
+        long int nPixels=accumulator->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel
+        {
+            std::vector<double> probs(nLabels);
+#pragma omp for
+            for (long int i=0;i<nPixels;++i){
+                decode(acc[i],&probs[0]);
+                for (unsigned int l=0;l<nLabels;++l) probs[l]+=weight*inc[i][l];
+                encode(&probs[0],acc[i]);
+            }
+        }
+    }
+
+    ///accumulator += weight*increment
+    static void accumulate(SparseImagePointerType accumulator, SparseImagePointerType increment, double weight){
+        SparsePixelType * acc=accumulator->GetBufferPointer();
+        const SparsePixelType * inc=increment->GetBufferPointer();
+        long int nPixels=accumulator->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel
+        {
+            std::vector<double> probs(nLabels),incProbs(nLabels);
+#pragma omp for
+            for (long int i=0;i<nPixels;++i){
+                decode(acc[i],&probs[0]);
+                decode(inc[i],&incProbs[0]);
+                for (unsigned int l=0;l<nLabels;++l) probs[l]+=weight*incProbs[l];
+                encode(&probs[0],acc[i]);
+            }
+        }
+    }
+
+    ///accumulator += weight*increment, for float accumulators
+    static void accumulate(ProbabilisticVectorImagePointerType accumulator, SparseImagePointerType increment, double weight){
+        ProbabilisticPixelType * acc=accumulator->GetBufferPointer();
+        const SparsePixelType * inc=increment->GetBufferPointer();
+        long int nPixels=accumulator->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel
+        {
+            std::vector<double> probs(nLabels);
+#pragma omp for
+            for (long int i=0;i<nPixels;++i){
+                decode(inc[i],&probs[0]);
+                for (unsigned int l=0;l<nLabels;++l) acc[i][l]+=weight*probs[l];
+            }
+        }
+    }
+
+    ///scale the mass of every voxel to one
+    static void normalize(SparseImagePointerType image){
+        SparsePixelType * buffer=image->GetBufferPointer();
+        long int nPixels=image->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            if (buffer[i].mass>0.0) buffer[i].mass=1.0;
+        }
+    }
+
+    ///most probable label of each voxel
+    template<class LabelImageType>
+    static typename LabelImageType::Pointer argmax(SparseImagePointerType image){
+        typename LabelImageType::Pointer result=LabelImageType::New();
+        result->SetOrigin(image->GetOrigin());
+        result->SetSpacing(image->GetSpacing());
+        result->SetDirection(image->GetDirection());
+        result->SetRegions(image->GetLargestPossibleRegion());
+        result->Allocate();
+        const SparsePixelType * in=image->GetBufferPointer();
+        typename LabelImageType::PixelType * out=result->GetBufferPointer();
+        long int nPixels=image->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            //shares are sorted
+            out[i]=in[i].labels[0];
+        }
+        return result;
+    }
+
+    static void encode(const double * probs, SparsePixelType & pixel){
+        int best[K];
+        double bestValue[K];
+        unsigned int n=0;
+        double mass=0.0;
+        for (unsigned int l=0;l<nLabels;++l){
+            double value=probs[l];
+            mass+=value;
+            if (n==K && value<=bestValue[K-1]) continue;
+            unsigned int pos=n<K?n:K-1;
+            while (pos>0 && bestValue[pos-1]<value){
+                best[pos]=best[pos-1];
+                bestValue[pos]=bestValue[pos-1];
+                --pos;
+            }
+            best[pos]=l;
+            bestValue[pos]=value;
+            if (n<K) ++n;
+        }
+        pixel.mass=mass;
+        for (unsigned int k=0;k<K;++k){
+            pixel.labels[k]=best[k];
+            double share=mass>0.0?bestValue[k]/mass:0.0;
+            pixel.shares[k]=QuantizedType(std::max(0.0,std::min(maxShare(),share*maxShare()+0.5)));
+        }
+    }
+
+    static void decode(const SparsePixelType & pixel, double * probs){
+        double scale=pixel.mass/maxShare();
+        double kept=0.0;
+        for (unsigned int k=0;k<K;++k) kept+=pixel.shares[k];
+        double residual=0.0;
+        if (nLabels>K){
+            residual=std::max(0.0,pixel.mass-kept*scale)/(nLabels-K);
+        }
+        for (unsigned int l=0;l<nLabels;++l) probs[l]=residual;
+        for (unsigned int k=0;k<K;++k) probs[pixel.labels[k]]=scale*pixel.shares[k];
+    }
+
+    static void writeImage(std::string filename, SparseImagePointerType image){
+        DiskImagePointerType disk=DiskImageType::New();
+        disk->SetOrigin(image->GetOrigin());
+        disk->SetSpacing(image->GetSpacing());
+        disk->SetDirection(image->GetDirection());
+        disk->SetRegions(image->GetLargestPossibleRegion());
+        disk->Allocate();
+        const SparsePixelType * in=image->GetBufferPointer();
+        DiskPixelType * out=disk->GetBufferPointer();
+        long int nPixels=image->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            for (unsigned int k=0;k<K;++k){
+                out[i][k]=in[i].labels[k];
+                out[i][K+k]=in[i].shares[k];
+            }
+            unsigned int bits;
+            std::memcpy(&bits,&in[i].mass,sizeof(float));
+            out[i][2*K]=bits>>16;
+            out[i][2*K+1]=bits&0xffff;
+        }
+        ImageUtils<DiskImageType>::writeImage(filename,disk);
+    }
+
+    static SparseImagePointerType readImage(std::string filename){
+        DiskImagePointerType disk=ImageUtils<DiskImageType>::readImage(filename);
+        SparseImagePointerType result=createEmpty(disk);
+        const DiskPixelType * in=disk->GetBufferPointer();
+        SparsePixelType * out=result->GetBufferPointer();
+        long int nPixels=result->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            for (unsigned int k=0;k<K;++k){
+                out[i].labels[k]=in[i][k];
+                out[i].shares[k]=in[i][K+k];
+            }
+            unsigned int bits=(static_cast<unsigned int>(in[i][2*K])<<16) | in[i][2*K+1];
+            std::memcpy(&out[i].mass,&bits,sizeof(float));
+        }
+        return result;
+    }
+};
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "itkImage.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * \brief exact surface distance measures (Hausdorff, percentile Hausdorff, ASSD) for many labels at once
+ *
+ * The surface voxels of all labels of both segmentations are extracted in a single pass. A surface voxel is a voxel
+ * of the label with at least one face neighbour of a different label (or outside of the image). Per label, the exact
+ * euclidean distance transform (Felzenszwalb & Huttenlocher, with voxel spacing) of each surface is computed only on
+ * the bounding box of both surfaces of that label, which contains all query points and all seeds, and sampled at the
+ * surface voxels of the other segmentation. Labels (and image pairs in batch mode) are processed in parallel.
+ *
+ * Definitions follow the usual evaluation conventions: HD is the maximum, HDPercentile the given percentile of the
+ * pooled directed surface distances of both directions, and ASSD the mean of the two directed average distances.
+ * meanDistance and maxAbsDistance are the average and maximum distance of itk::HausdorffDistanceImageFilter instead:
+ * every voxel of one label volume has the distance to the nearest voxel of the other (zero inside it), averaged over
+ * the volume and over both directions. The voxels outside the other volume are collected in the same pass and sampled
+ * from the same distance transforms. Both images must be sampled on the same grid. If one of the surfaces of a label is
+ * empty, its distances are -1. With distances disabled, only volumes and dice are computed.
+ */
+template<class ImageType>
+class SurfaceDistance{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename ImageType::SizeType SizeType;
+    typedef typename ImageType::SpacingType SpacingType;
+    static const unsigned int D=ImageType::ImageDimension;
+
+    struct Scores{
+        int label;
+        long int volumeA, volumeB;
+        double dice, HD, HDPercentile, ASSD, meanDistance, maxAbsDistance;
+    };
+
+private:
+    ///surface voxel indices and volumes of all labels of one image pair
+    struct Surfaces{
+        std::vector<std::vector<long int> > a,b;
+        ///voxels of the label in one image only
+        std::vector<std::vector<long int> > onlyA,onlyB;
+        std::vector<long int> volumeA,volumeB,intersection;
+        SizeType size;
+        SpacingType spacing;
+    };
+    double m_percentile;
+    bool m_distances;
+
+public:
+    SurfaceDistance(double percentile=95.0, bool distances=true){
+        m_percentile=percentile;
+        m_distances=distances;
+    }
+
+    std::vector<Scores> compute(ImagePointerType a, ImagePointerType b, const std::vector<int> & labels) const{
+        return compute(std::vector<ImagePointerType>(1,a),std::vector<ImagePointerType>(1,b),labels)[0];
+    }
+
+    ///all labels of all image pairs (as[i],bs[i])
+    std::vector<std::vector<Scores> > compute(const std::vector<ImagePointerType> & as, const std::vector<ImagePointerType> & bs, const std::vector<int> & labels) const{
+        int nPairs=as.size();
+        int nLabels=labels.size();
+        std::vector<Surfaces> surfaces(nPairs);
+        for (int p=0;p<nPairs;++p){
+            extractSurfaces(as[p],bs[p],labels,surfaces[p]);
+        }
+        std::vector<std::vector<Scores> > result(nPairs,std::vector<Scores>(nLabels));
+        long int nTasks=nPairs*nLabels;
+        int nThreads=1;
+#ifdef _OPENMP
+        nThreads=omp_get_max_threads();
+#endif
+        //with fewer tasks than threads, the distance transforms are parallelised instead
+#pragma omp parallel for schedule(dynamic) if(nTasks>=nThreads)
+        for (long int t=0;t<nTasks;++t){
+            int p=t/nLabels, l=t%nLabels;
+            result[p][l]=computeLabel(surfaces[p],l);
+            result[p][l].label=labels[l];
+        }
+        return result;
+    }
+
+private:
+    void extractSurfaces(ImagePointerType a, ImagePointerType b, const std::vector<int> & labels, Surfaces & surfaces) const{
+        int nLabels=labels.size();
+        surfaces.size=a->GetLargestPossibleRegion().GetSize();
+        surfaces.spacing=a->GetSpacing();
+        surfaces.a=std::vector<std::vector<long int> >(nLabels);
+        surfaces.b=std::vector<std::vector<long int> >(nLabels);
+        surfaces.onlyA=std::vector<std::vector<long int> >(nLabels);
+        surfaces.onlyB=std::vector<std::vector<long int> >(nLabels);
+        surfaces.volumeA=std::vector<long int>(nLabels,0);
+        surfaces.volumeB=std::vector<long int>(nLabels,0);
+        surfaces.intersection=std::vector<long int>(nLabels,0);
+        if (!nLabels) return;
+        //label -> slot lookup table
+        int minLabel=*std::min_element(labels.begin(),labels.end());
+        int maxLabel=*std::max_element(labels.begin(),labels.end());
+        std::vector<int> slots(maxLabel-minLabel+1,-1);
+        for (int l=0;l<nLabels;++l) slots[labels[l]-minLabel]=l;
+
+        const PixelType * bufA=a->GetBufferPointer(), *bufB=b->GetBufferPointer();
+        long int strides[D];
+        long int nPixels=1;
+        for (unsigned int d=0;d<D;++d){
+            strides[d]=nPixels;
+            nPixels*=surfaces.size[d];
+        }
+        int nThreads=1;
+#ifdef _OPENMP
+        nThreads=omp_get_max_threads();
+#endif
+        std::vector<std::vector<std::vector<long int> > > threadA(nThreads,std::vector<std::vector<long int> >(nLabels));
+        std::vector<std::vector<std::vector<long int> > > threadB(nThreads,std::vector<std::vector<long int> >(nLabels));
+        std::vector<std::vector<std::vector<long int> > > threadOnlyA(threadA),threadOnlyB(threadB);
+        bool distances=m_distances;
+        std::vector<std::vector<long int> > volumeA(nThreads,std::vector<long int>(nLabels,0)),volumeB=volumeA,intersection=volumeA;
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            int thread=0;
+#ifdef _OPENMP
+            thread=omp_get_thread_num();
+#endif
+            int slotA=slot(bufA[i],slots,minLabel,maxLabel);
+            int slotB=slot(bufB[i],slots,minLabel,maxLabel);
+            if (slotA<0 && slotB<0) continue;
+            long int coords[D];
+            long int rest=i;
+            for (unsigned int d=0;d<D;++d){
+                coords[d]=rest%surfaces.size[d];
+                rest/=surfaces.size[d];
+            }
+            if (slotA>=0){
+                ++volumeA[thread][slotA];
+                if (distances && isSurface(bufA,i,coords,strides,surfaces.size)) threadA[thread][slotA].push_back(i);
+            }
+            if (slotB>=0){
+                ++volumeB[thread][slotB];
+                if (distances && isSurface(bufB,i,coords,strides,surfaces.size)) threadB[thread][slotB].push_back(i);
+            }
+            if (slotA>=0 && slotA==slotB){
+                ++intersection[thread][slotA];
+            }else if (distances){
+                if (slotA>=0) threadOnlyA[thread][slotA].push_back(i);
+                if (slotB>=0) threadOnlyB[thread][slotB].push_back(i);
+            }
+        }
+        for (int t=0;t<nThreads;++t){
+            for (int l=0;l<nLabels;++l){
+                surfaces.a[l].insert(surfaces.a[l].end(),threadA[t][l].begin(),threadA[t][l].end());
+                surfaces.b[l].insert(surfaces.b[l].end(),threadB[t][l].begin(),threadB[t][l].end());
+                surfaces.onlyA[l].insert(surfaces.onlyA[l].end(),threadOnlyA[t][l].begin(),threadOnlyA[t][l].end());
+                surfaces.onlyB[l].insert(surfaces.onlyB[l].end(),threadOnlyB[t][l].begin(),threadOnlyB[t][l].end());
+                surfaces.volumeA[l]+=volumeA[t][l];
+                surfaces.volumeB[l]+=volumeB[t][l];
+                surfaces.intersection[l]+=intersection[t][l];
+            }
+        }
+    }
+
+    static inline int slot(PixelType value, const std::vector<int> & slots, int minLabel, int maxLabel){
+        if (value<minLabel || value>maxLabel) return -1;
+        return slots[int(value)-minLabel];
+    }
+
+    static inline bool isSurface(const PixelType * buf, long int i, const long int * coords, const long int * strides, const SizeType & size){
+        for (unsigned int d=0;d<D;++d){
+            if (coords[d]==0 || coords[d]==long(size[d])-1) return true;
+            if (buf[i-strides[d]]!=buf[i] || buf[i+strides[d]]!=buf[i]) return true;
+        }
+        return false;
+    }
+
+    Scores computeLabel(const Surfaces & surfaces, int l) const{
+        Scores scores;
+        long int volumes=surfaces.volumeA[l]+surfaces.volumeB[l];
+        scores.dice=volumes?2.0*surfaces.intersection[l]/volumes:1.0;
+        scores.volumeA=surfaces.volumeA[l];
+        scores.volumeB=surfaces.volumeB[l];
+        scores.HD=scores.HDPercentile=scores.ASSD=scores.meanDistance=scores.maxAbsDistance=-1;
+        const std::vector<long int> & a=surfaces.a[l], & b=surfaces.b[l];
+        if (!a.size() || !b.size()) return scores;
+
+        //bounding box of both surfaces, which also contains both volumes
+        long int lower[D],upper[D];
+        for (unsigned int d=0;d<D;++d){
+            lower[d]=surfaces.size[d];
+            upper[d]=-1;
+        }
+        updateBox(a,surfaces.size,lower,upper);
+        updateBox(b,surfaces.size,lower,upper);
+        long int boxSize[D];
+        long int nBox=1;
+        for (unsigned int d=0;d<D;++d){
+            boxSize[d]=upper[d]-lower[d]+1;
+            nBox*=boxSize[d];
+        }
+        std::vector<float> distances(nBox);
+        std::vector<double> ab,ba,volumeAB,volumeBA;
+        //the nearest voxel of a volume seen from outside is always one of its surface voxels
+        squaredDistanceTransform(b,surfaces,lower,boxSize,distances);
+        sample(a,surfaces.size,lower,boxSize,distances,ab);
+        sample(surfaces.onlyA[l],surfaces.size,lower,boxSize,distances,volumeAB);
+        squaredDistanceTransform(a,surfaces,lower,boxSize,distances);
+        sample(b,surfaces.size,lower,boxSize,distances,ba);
+        sample(surfaces.onlyB[l],surfaces.size,lower,boxSize,distances,volumeBA);
+
+        double sumAB=0.0,sumBA=0.0;
+        for (unsigned int i=0;i<ab.size();++i) sumAB+=ab[i];
+        for (unsigned int i=0;i<ba.size();++i) sumBA+=ba[i];
+        scores.ASSD=0.5*(sumAB/ab.size()+sumBA/ba.size());
+        std::vector<double> pooled(ab);
+        pooled.insert(pooled.end(),ba.begin(),ba.end());
+        scores.HD=*std::max_element(pooled.begin(),pooled.end());
+        scores.HDPercentile=percentile(pooled,m_percentile);
+
+        double sumVolumeAB=0.0,sumVolumeBA=0.0;
+        scores.maxAbsDistance=0.0;
+        for (unsigned int i=0;i<volumeAB.size();++i){
+            sumVolumeAB+=volumeAB[i];
+            scores.maxAbsDistance=std::max(scores.maxAbsDistance,volumeAB[i]);
+        }
+        for (unsigned int i=0;i<volumeBA.size();++i){
+            sumVolumeBA+=volumeBA[i];
+            scores.maxAbsDistance=std::max(scores.maxAbsDistance,volumeBA[i]);
+        }
+        scores.meanDistance=0.5*(sumVolumeAB/surfaces.volumeA[l]+sumVolumeBA/surfaces.volumeB[l]);
+        return scores;
+    }
+
+    ///linearly interpolated percentile, as numpy.percentile
+    static double percentile(std::vector<double> & values, double p){
+        double pos=p/100.0*(values.size()-1);
+        unsigned int lowerPos=floor(pos);
+        std::nth_element(values.begin(),values.begin()+lowerPos,values.end());
+        double lowerValue=values[lowerPos];
+        if (lowerPos+1>=values.size()) return lowerValue;
+        double upperValue=*std::min_element(values.begin()+lowerPos+1,values.end());
+        return lowerValue+(pos-lowerPos)*(upperValue-lowerValue);
+    }
+
+    static void updateBox(const std::vector<long int> & voxels, const SizeType & size, long int * lower, long int * upper){
+        for (unsigned int i=0;i<voxels.size();++i){
+            long int rest=voxels[i];
+            for (unsigned int d=0;d<D;++d){
+                long int c=rest%size[d];
+                rest/=size[d];
+                lower[d]=std::min(lower[d],c);
+                upper[d]=std::max(upper[d],c);
+            }
+        }
+    }
+
+    static long int boxIndex(long int i, const SizeType & size, const long int * lower, const long int * boxSize){
+        long int result=0,stride=1;
+        for (unsigned int d=0;d<D;++d){
+            result+=(i%size[d]-lower[d])*stride;
+            i/=size[d];
+            stride*=boxSize[d];
+        }
+        return result;
+    }
+
+    static void sample(const std::vector<long int> & voxels, const SizeType & size, const long int * lower, const long int * boxSize,
+                       const std::vector<float> & squaredDistances, std::vector<double> & result){
+        result.resize(voxels.size());
+        for (unsigned int i=0;i<voxels.size();++i){
+            result[i]=sqrt(squaredDistances[boxIndex(voxels[i],size,lower,boxSize)]);
+        }
+    }
+
+    ///exact squared euclidean distance to the seeds within the box, separably along each axis
+    static void squaredDistanceTransform(const std::vector<long int> & seeds, const Surfaces & surfaces, const long int * lower, const long int * boxSize, std::vector<float> & result){
+        const float inf=std::numeric_limits<float>::max();
+        std::fill(result.begin(),result.end(),inf);
+        for (unsigned int i=0;i<seeds.size();++i){
+            result[boxIndex(seeds[i],surfaces.size,lower,boxSize)]=0.0;
+        }
+        long int nBox=result.size();
+        long int strides[D];
+        long int stride=1;
+        for (unsigned int d=0;d<D;++d){
+            strides[d]=stride;
+            stride*=boxSize[d];
+        }
+        for (unsigned int d=0;d<D;++d){
+            long int n=boxSize[d];
+            long int nLines=nBox/n;
+            double spacing=surfaces.spacing[d];
+#pragma omp parallel
+            {
+                std::vector<double> f(n),z(n),roots(n);
+                std::vector<long int> v(n);
+#pragma omp for
+                for (long int line=0;line<nLines;++line){
+                    //first voxel of the line
+                    long int base=0,rest=line;
+                    for (unsigned int e=0;e<D;++e){
+                        if (e==d) continue;
+                        base+=(rest%boxSize[e])*strides[e];
+                        rest/=boxSize[e];
+                    }
+                    for (long int q=0;q<n;++q) f[q]=result[base+q*strides[d]];
+                    lowerEnvelope(f,v,z,roots,n,spacing,inf);
+                    for (long int q=0;q<n;++q) result[base+q*strides[d]]=f[q];
+                }
+            }
+        }
+    }
+
+    ///1D squared distance transform of f (in place) by the lower envelope of parabolas rooted at the finite samples
+    static void lowerEnvelope(std::vector<double> & f, std::vector<long int> & v, std::vector<double> & z, std::vector<double> & roots, long int n, double spacing, double inf){
+        long int k=-1;
+        for (long int q=0;q<n;++q){
+            if (f[q]>=inf) continue;
+            double s=-std::numeric_limits<double>::max();
+            double xq=q*spacing;
+            while (k>=0){
+                double xv=v[k]*spacing;
+                s=((f[q]+xq*xq)-(f[v[k]]+xv*xv))/(2*(xq-xv));
+                if (s<=z[k]){
+                    --k;
+                    s=-std::numeric_limits<double>::max();
+                }else{
+                    break;
+                }
+            }
+            ++k;
+            v[k]=q;
+            z[k]=s;
+        }
+        if (k<0) return;
+        //f is overwritten, keep the values at the parabola roots
+        for (long int j=0;j<=k;++j) roots[j]=f[v[j]];
+        long int j=0;
+        for (long int q=0;q<n;++q){
+            double xq=q*spacing;
+            while (j<k && z[j+1]<xq) ++j;
+            double dx=xq-v[j]*spacing;
+            f[q]=dx*dx+roots[j];
+        }
+    }
+};
@@ -11,6 +11,8 @@
 #include "itkTransformFileWriter.h"
 #include "itkTransformFactoryBase.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageIOFactory.h"
 #include "itkContinuousIndex.h"
 #include "itkBSplineInterpolateImageFunction.h"
 #include "itkBSplineResampleImageFunction.h"
@@ -40,6 +42,12 @@
 #include <itkDisplacementFieldToBSplineImageFilter.h>
 #include "itkConstantPadImageFilter.h"
 #include "itkTranslationTransform.h"
+#include "ControlPointDeformation.h"
+#include <map>
+#include <limits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
@@ -354,80 +362,9 @@ public:
         }
         LOGV(5)<<"Upsampling deformation image"<<std::endl;
         LOGV(6)<<"From: "<<labelImg->GetLargestPossibleRegion().GetSize()<<" to: "<<reference->GetLargestPossibleRegion().GetSize()<<std::endl;
-        typedef typename  itk::ImageRegionIterator<DeformationFieldType> LabelIterator;
-        DeformationFieldPointerType fullDeformationField;
-        const unsigned int SplineOrder = 3;
-        typedef typename itk::Image<float,ImageType::ImageDimension> ParamImageType;
-        typedef typename itk::ResampleImageFilter<ParamImageType,ParamImageType> ResamplerType;
-        typedef typename itk::BSplineResampleImageFunction<ParamImageType,double> FunctionType;
-        typedef typename itk::BSplineDecompositionImageFilter<ParamImageType,ParamImageType>			DecompositionType;
-        typedef typename itk::ImageRegionIterator<ParamImageType> Iterator;
-        std::vector<typename ParamImageType::Pointer> newImages(ImageType::ImageDimension);
-        //interpolate deformation
-        for ( unsigned int k = 0; k < ImageType::ImageDimension; k++ )
-            {
-                //			LOG<<k<<" setup"<<std::endl;
-                typename ParamImageType::Pointer paramsK=ParamImageType::New();
-                paramsK->SetRegions(labelImg->GetLargestPossibleRegion());
-                paramsK->SetOrigin(labelImg->GetOrigin());
-                paramsK->SetSpacing(labelImg->GetSpacing());
-                paramsK->SetDirection(labelImg->GetDirection());
-                paramsK->Allocate();
-                Iterator itCoarse( paramsK, paramsK->GetLargestPossibleRegion() );
-                LabelIterator itOld(labelImg,labelImg->GetLargestPossibleRegion());
-                for (itCoarse.GoToBegin(),itOld.GoToBegin();!itCoarse.IsAtEnd();++itOld,++itCoarse){
-                    itCoarse.Set((itOld.Get()[k]));//*(k<ImageType::ImageDimension?getDisplacementFactor()[k]:1));
-                    //				LOG<<itCoarse.Get()<<std::endl;
-                }
-                //bspline interpolation for the displacements
-                typename ResamplerType::Pointer upsampler = ResamplerType::New();
-                typename FunctionType::Pointer function = FunctionType::New();
-                function->SetSplineOrder(SplineOrder);
-                upsampler->SetInput( paramsK );
-                upsampler->SetInterpolator( function );
-                upsampler->SetSize(reference->GetLargestPossibleRegion().GetSize() );
-                upsampler->SetOutputSpacing( reference->GetSpacing() );
-                upsampler->SetOutputOrigin( reference->GetOrigin());
-                upsampler->SetOutputDirection( reference->GetDirection());
-                upsampler->Update();
-#if 1
-                newImages[k]=upsampler->GetOutput();
-#else
-                typename DecompositionType::Pointer decomposition = DecompositionType::New();
-                decomposition->SetSplineOrder( SplineOrder );
-                decomposition->SetInput( upsampler->GetOutput() );
-                decomposition->Update();
-                newImages[k] = decomposition->GetOutput();
-#endif         
-                
-            }
-    
-        std::vector< Iterator> iterators(ImageType::ImageDimension+1);
-        for ( unsigned int k = 0; k < ImageType::ImageDimension; k++ )
-            {
-                iterators[k]=Iterator(newImages[k],newImages[k]->GetLargestPossibleRegion());
-                iterators[k].GoToBegin();
-            }
-        fullDeformationField=DeformationFieldType::New();
-        fullDeformationField->SetRegions(reference->GetLargestPossibleRegion());
-        fullDeformationField->SetOrigin(reference->GetOrigin());
-        fullDeformationField->SetSpacing(reference->GetSpacing());
-        fullDeformationField->SetDirection(reference->GetDirection());
-        fullDeformationField->Allocate();
-        LabelIterator lIt(fullDeformationField,fullDeformationField->GetLargestPossibleRegion());
-        lIt.GoToBegin();
-        for (;!lIt.IsAtEnd();++lIt){
-            DisplacementType l;
-            for ( unsigned int k = 0; k < ImageType::ImageDimension; k++ ){
-                //				LOG<<k<<" label: "<<iterators[k]->Get()<<std::endl;
-                l[k]=iterators[k].Get();
-                ++((iterators[k]));
-            }
-
-            //			lIt.Set(LabelMapperType::scaleDisplacement(l,getDisplacementFactor()));
-            lIt.Set(l);
-        }
-
+        //the coarse displacements are the B-spline coefficients, evaluated with tabulated basis functions instead of one resampler per component
+        ControlPointDeformation<DeformationFieldType> controlPoints(labelImg);
+        DeformationFieldPointerType fullDeformationField=controlPoints.materialize(reference.GetPointer());
         LOGV(6)<<"Finshed extrapolation"<<std::endl;
         return fullDeformationField;
     }
@@ -1569,9 +1506,129 @@ public:
     }
 
     static double getMinJacDet(DeformationFieldPointerType def){
+        return getJacDetStatistics(def).minJac;
+    }
+
+    ///summary of the jacobian determinants of a deformation field
+    struct JacobianStatistics{
+        double minJac,maxJac,meanJac;
+        unsigned long int nPixels,nFolded;
+        ///histogram of the determinants in [histMin,histMax], values outside are counted in the first/last bin
+        std::vector<unsigned long int> histogram;
+        double histMin,histMax;
+        ///number of pixels and folded pixels per label of the region image
+        std::map<int,unsigned long int> regionPixels,regionFolded;
+        double foldedFraction(){return nPixels?1.0*nFolded/nPixels:0.0;}
+    };
+
+    /**
+     * single pass over the displacement buffer computing min/max/mean of the jacobian determinants, the number of
+     * folded pixels (determinant <= foldThreshold), an optional histogram and per-region counts for a label image of the same geometry.
+     * Gives the same determinants as DisplacementFieldJacobianDeterminantFilter (central differences, replicated border),
+     * but never materializes the determinant image. If foldMask is not NULL, it is filled with 1 at folded pixels.
+     */
+    static JacobianStatistics getJacDetStatistics(DeformationFieldPointerType def, int nBins=0, double histMin=0.0, double histMax=2.0,
+                                                  ImagePointerType regions=NULL, ImagePointerType foldMask=NULL, double foldThreshold=0.0, bool useImageSpacing=true){
+        typename DeformationFieldType::SizeType size=def->GetBufferedRegion().GetSize();
+        SpacingType spacing=def->GetSpacing();
+        long int strides[D];
+        double scale[D];
+        long int nPixels=1;
+        for (int d=0;d<D;++d){
+            strides[d]=nPixels;
+            nPixels*=size[d];
+            scale[d]=0.5/(useImageSpacing?spacing[d]:1.0);
+        }
+        const DisplacementType * buffer=def->GetBufferPointer();
+        const PixelType * regionBuffer=regions.IsNotNull()?regions->GetBufferPointer():NULL;
+        PixelType * maskBuffer=foldMask.IsNotNull()?foldMask->GetBufferPointer():NULL;
+        if (maskBuffer) foldMask->FillBuffer(0);
+        double binWidth=nBins>0?(histMax-histMin)/nBins:1.0;
+
+        int nThreads=1;
+#ifdef _OPENMP
+        nThreads=omp_get_max_threads();
+#endif
+        std::vector<JacobianStatistics> threadStats(nThreads);
+        for (int t=0;t<nThreads;++t){
+            threadStats[t].minJac=std::numeric_limits<double>::max();
+            threadStats[t].maxJac=-std::numeric_limits<double>::max();
+            threadStats[t].meanJac=0.0;
+            threadStats[t].nPixels=0;
+            threadStats[t].nFolded=0;
+            threadStats[t].histogram=std::vector<unsigned long int>(std::max(nBins,0),0);
+        }
+#pragma omp parallel for
+        for (long int i=0;i<nPixels;++i){
+            int t=0;
+#ifdef _OPENMP
+            t=omp_get_thread_num();
+#endif
+            JacobianStatistics & stats=threadStats[t];
+            //J = I + grad u, derivative along axis d is stored in column d
+            double J[3][3];
+            long int rest=i;
+            for (int d=D-1;d>=0;--d){
+                long int idx=rest/strides[d];
+                rest-=idx*strides[d];
+                long int prev=(idx>0)?i-strides[d]:i;
+                long int next=(idx<long(size[d])-1)?i+strides[d]:i;
+                for (int c=0;c<D;++c){
+                    J[c][d]=scale[d]*(buffer[next][c]-buffer[prev][c])+(c==d);
+                }
+            }
+            double det;
+            if (D==2){
+                det=J[0][0]*J[1][1]-J[0][1]*J[1][0];
+            }else{
+                det=J[0][0]*(J[1][1]*J[2][2]-J[1][2]*J[2][1])
+                    -J[0][1]*(J[1][0]*J[2][2]-J[1][2]*J[2][0])
+                    +J[0][2]*(J[1][0]*J[2][1]-J[1][1]*J[2][0]);
+            }
+            bool folded=det<=foldThreshold;
+            stats.minJac=std::min(stats.minJac,det);
+            stats.maxJac=std::max(stats.maxJac,det);
+            stats.meanJac+=det;
+            stats.nPixels++;
+            stats.nFolded+=folded;
+            if (nBins>0){
+                int bin=std::max(0,std::min(nBins-1,int(floor((det-histMin)/binWidth))));
+                stats.histogram[bin]++;
+            }
+            if (regionBuffer){
+                int label=regionBuffer[i];
+                stats.regionPixels[label]++;
+                if (folded) stats.regionFolded[label]++;
+            }
+            if (maskBuffer && folded){
+                maskBuffer[i]=1;
+            }
+        }
 
-        return FilterUtils<FloatImageType>::getMin(getJacobian(def));
-        
+        JacobianStatistics result=threadStats[0];
+        for (int t=1;t<nThreads;++t){
+            result.minJac=std::min(result.minJac,threadStats[t].minJac);
+            result.maxJac=std::max(result.maxJac,threadStats[t].maxJac);
+            result.meanJac+=threadStats[t].meanJac;
+            result.nPixels+=threadStats[t].nPixels;
+            result.nFolded+=threadStats[t].nFolded;
+            for (int b=0;b<nBins;++b) result.histogram[b]+=threadStats[t].histogram[b];
+            typename std::map<int,unsigned long int>::iterator it;
+            for (it=threadStats[t].regionPixels.begin();it!=threadStats[t].regionPixels.end();++it) result.regionPixels[it->first]+=it->second;
+            for (it=threadStats[t].regionFolded.begin();it!=threadStats[t].regionFolded.end();++it) result.regionFolded[it->first]+=it->second;
+        }
+        if (result.nPixels) result.meanJac/=result.nPixels;
+        result.histMin=histMin;
+        result.histMax=histMax;
+        return result;
+    }
+
+    ///binary image marking pixels with jacobian determinant <= threshold, the statistics of the same pass are returned in stats if it is not NULL
+    static ImagePointerType getFoldMask(DeformationFieldPointerType def, double threshold=0.0, bool useImageSpacing=true, JacobianStatistics * stats=NULL){
+        ImagePointerType mask=createEmptyImage(def);
+        JacobianStatistics result=getJacDetStatistics(def,0,0.0,2.0,NULL,mask,threshold,useImageSpacing);
+        if (stats) *stats=result;
+        return mask;
     }
     static FloatImagePointerType getComponent(DeformationFieldPointerType def, int d){
         FloatImagePointerType result=createEmptyFloat(def);
@@ -1606,72 +1663,180 @@ public:
     }
 
 
+    typedef itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<DeformationFieldType,double> DeformationExtrapolatorType;
+    typedef itk::VectorLinearInterpolateImageFunction<DeformationFieldType,double> DeformationInterpolatorType;
+    typedef map< string, map <string, string> > DeformationFilenameCacheType;
+
+    ///pair/triplet of deformations whose residual is evaluated, d0 is only used for triplets
+    struct ResidualTask{
+        string sourceID,targetID,intermediateID;
+        DeformationFieldPointerType direct,d0,d1;
+        ImagePointerType mask;
+        double residual;
+    };
+
+    static bool sameGeometry(DeformationFieldPointerType d1, DeformationFieldPointerType d2){
+        return d1->GetLargestPossibleRegion()==d2->GetLargestPossibleRegion() && d1->GetSpacing()==d2->GetSpacing()
+            && d1->GetOrigin()==d2->GetOrigin() && d1->GetDirection()==d2->GetDirection();
+    }
+
+    ///central box of an image covering the given fraction along each axis
+    static typename ImageType::RegionType centralRegion(typename ImageType::RegionType region, double fraction=0.9){
+        typename ImageType::SizeType size=region.GetSize();
+        IndexType offset;
+        for (int d=0;d<D;++d){
+            offset[d]=(1.0-fraction)/2*size[d];
+            size[d]=fraction*size[d];
+        }
+        region.SetSize(size);
+        region.SetIndex(offset);
+        return region;
+    }
+
+    /**
+     * mean euclidean norm of direct - (d1 composed with d0) on the voxels of direct, without storing the composition.
+     * only voxels inside mask are used, or inside the central 90% box of direct if no mask is given.
+     * the composition is evaluated at each voxel of direct, which is the same as composeDeformations(d1,d0) if d1 and direct share their geometry.
+     */
+    static double computeCompositionResidual(DeformationFieldPointerType direct, DeformationFieldPointerType d0, DeformationFieldPointerType d1, ImagePointerType mask,
+                                             DeformationExtrapolatorType * d0Interpolator, DeformationInterpolatorType * d1Interpolator){
+        d0Interpolator->SetInputImage(d0);
+        d1Interpolator->SetInputImage(d1);
+        bool sameGrid=sameGeometry(direct,d1);
+        typename ImageType::RegionType region=direct->GetLargestPossibleRegion();
+        if (mask.IsNull()) region=centralRegion(region);
+        itk::ImageRegionConstIteratorWithIndex<DeformationFieldType> it(direct,region);
+        double norm=0.0;
+        long int count=0;
+        for (it.GoToBegin();!it.IsAtEnd();++it){
+            IndexType idx=it.GetIndex();
+            if (mask.IsNotNull() && (!mask->GetLargestPossibleRegion().IsInside(idx) || !mask->GetPixel(idx))) continue;
+            PointType p;
+            direct->TransformIndexToPhysicalPoint(idx,p);
+            DisplacementType u1;
+            if (sameGrid){
+                u1=d1->GetPixel(idx);
+            }else if (d1Interpolator->IsInsideBuffer(p)){
+                u1=d1Interpolator->Evaluate(p);
+            }else{
+                u1.Fill(0.0);
+            }
+            PointType q=p;
+            for (int d=0;d<D;++d) q[d]+=u1[d];
+            typename DeformationExtrapolatorType::OutputType u0=d0Interpolator->Evaluate(q);
+            DisplacementType u=it.Get();
+            double n=0.0;
+            for (int d=0;d<D;++d){
+                double diff=u[d]-(u1[d]+u0[d]);
+                n+=diff*diff;
+            }
+            norm+=sqrt(n);
+            ++count;
+        }
+        return count?norm/count:0.0;
+    }
+    static double computeCompositionResidual(DeformationFieldPointerType direct, DeformationFieldPointerType d0, DeformationFieldPointerType d1, ImagePointerType mask=NULL){
+        typename DeformationExtrapolatorType::Pointer d0Interpolator=DeformationExtrapolatorType::New();
+        typename DeformationInterpolatorType::Pointer d1Interpolator=DeformationInterpolatorType::New();
+        return computeCompositionResidual(direct,d0,d1,mask,d0Interpolator,d1Interpolator);
+    }
+
+    ///mean euclidean norm of estimated - trueDeform on the voxels of trueDeform, estimated is linearly interpolated if the grids differ
+    static double computeDifferenceResidual(DeformationFieldPointerType estimated, DeformationFieldPointerType trueDeform, DeformationInterpolatorType * interpolator){
+        interpolator->SetInputImage(estimated);
+        bool sameGrid=sameGeometry(estimated,trueDeform);
+        itk::ImageRegionConstIteratorWithIndex<DeformationFieldType> it(trueDeform,trueDeform->GetLargestPossibleRegion());
+        double norm=0.0;
+        long int count=0;
+        for (it.GoToBegin();!it.IsAtEnd();++it){
+            DisplacementType u;
+            if (sameGrid){
+                u=estimated->GetPixel(it.GetIndex());
+            }else{
+                PointType p;
+                trueDeform->TransformIndexToPhysicalPoint(it.GetIndex(),p);
+                if (interpolator->IsInsideBuffer(p)){
+                    u=interpolator->Evaluate(p);
+                }else{
+                    u.Fill(0.0);
+                }
+            }
+            DisplacementType t=it.Get();
+            double n=0.0;
+            for (int d=0;d<D;++d){
+                double diff=u[d]-t[d];
+                n+=diff*diff;
+            }
+            norm+=sqrt(n);
+            ++count;
+        }
+        return count?norm/count:0.0;
+    }
+
+    ///evaluate all residual tasks in parallel, each thread uses its own interpolators
+    static void evaluateResidualTasks(std::vector<ResidualTask> & tasks){
+        int nThreads=1;
+#ifdef _OPENMP
+        nThreads=omp_get_max_threads();
+#endif
+        std::vector<typename DeformationExtrapolatorType::Pointer> extrapolators(nThreads);
+        std::vector<typename DeformationInterpolatorType::Pointer> interpolators(nThreads);
+        for (int t=0;t<nThreads;++t){
+            extrapolators[t]=DeformationExtrapolatorType::New();
+            interpolators[t]=DeformationInterpolatorType::New();
+        }
+        int nTasks=tasks.size();
+#pragma omp parallel for schedule(dynamic)
+        for (int n=0;n<nTasks;++n){
+            int t=0;
+#ifdef _OPENMP
+            t=omp_get_thread_num();
+#endif
+            ResidualTask & task=tasks[n];
+            if (task.d0.IsNotNull()){
+                task.residual=computeCompositionResidual(task.direct,task.d0,task.d1,task.mask,extrapolators[t],interpolators[t]);
+            }else{
+                task.residual=computeDifferenceResidual(task.direct,task.d1,interpolators[t]);
+            }
+        }
+    }
+
     static double computeError(DeformationCacheType * cache, DeformationCacheType * m_trueDeformations,  std::vector<string> * m_imageIDList, ImagePointerType mask=NULL){
-        //compute inconsistency over triplets
-        double averageError=0;
-        int count=0;
+        //compute error over pairs
+        std::vector<ResidualTask> tasks;
         int m_numImages=m_imageIDList->size();
-        double maxErr=-1.0;
         for (int s = 0;s<m_numImages;++s){
             for (int t=0;t<m_numImages;++t){
-                DeformationFieldPointerType directDeform;
                 if (s!=t){
-                    string sourceID=(*m_imageIDList)[s];
-                    string targetID=(*m_imageIDList)[t];
-                    directDeform= (*cache)[(*m_imageIDList)[s]][(*m_imageIDList)[t]];
-                    if (directDeform.IsNotNull()){
-                      
-
-                        if ((*m_trueDeformations)[(*m_imageIDList)[s]][(*m_imageIDList)[t]].IsNotNull()){
-                            DeformationFieldPointerType trueDeform = (*m_trueDeformations)[(*m_imageIDList)[s]][(*m_imageIDList)[t]];
-
-
-                            mask=TransfUtils<ImageType>::createEmptyImage(trueDeform);
-                            mask->FillBuffer(0);
-                            typename ImageType::SizeType size=mask->GetLargestPossibleRegion().GetSize();
-                            IndexType offset;
-                            double fraction=0.9;
-                            for (int d=0;d<D;++d){
-                                offset[d]=(1.0-fraction)/2*size[d];
-                                size[d]=fraction*size[d];
-                            }
-                    
-                            typename ImageType::RegionType region;
-                            region.SetSize(size);
-                            region.SetIndex(offset);
-                            LOGV(6)<<VAR(region)<<endl;
-                            ImageUtils<ImageType>::setRegion(mask,region,1);
-
-
-                            directDeform=linearInterpolateDeformationField(directDeform,trueDeform,false);
-                            //trueDeform=linearInterpolateDeformationField(trueDeform,directDeform,false);
-                            DeformationFieldPointerType diff  = TransfUtils<ImageType>::subtract(directDeform,trueDeform);
-                        
-                            double residual;
-                            if (false && mask.IsNotNull())
-                                residual= computeDeformationNormMask(diff,mask,2);
-                            else
-                                residual= computeDeformationNorm(diff,2);
-                            LOGV(3)<<VAR(sourceID)<<" "<<VAR(targetID)<<" "<<VAR(residual)<<endl;
-                            averageError += residual;
-                            maxErr=residual>maxErr?residual:maxErr;
-                            count++;
-                        }
+                    ResidualTask task;
+                    task.sourceID=(*m_imageIDList)[s];
+                    task.targetID=(*m_imageIDList)[t];
+                    task.direct=(*cache)[task.sourceID][task.targetID];
+                    task.d1=(*m_trueDeformations)[task.sourceID][task.targetID];
+                    if (task.direct.IsNotNull() && task.d1.IsNotNull()){
+                        tasks.push_back(task);
                     }
                 }
             }
         }
-        if (!count)
+        evaluateResidualTasks(tasks);
+        double averageError=0;
+        for (unsigned int n=0;n<tasks.size();++n){
+            LOGV(3)<<VAR(tasks[n].sourceID)<<" "<<VAR(tasks[n].targetID)<<" "<<VAR(tasks[n].residual)<<endl;
+            averageError+=tasks[n].residual;
+        }
+        if (!tasks.size())
             return -1;
         else
-            return averageError/count;
+            return averageError/tasks.size();
     }
 
     static double computeInconsistency(DeformationCacheType * cache,  std::vector<string> * m_imageIDList, DeformationCacheType * trueCache, ImageCacheType * masks=NULL){
         //compute inconsistency over triplets
-        double averageInconsistency=0;
         int m_numImages=m_imageIDList->size();
-        int count=0;
+        std::vector<ResidualTask> tasks;
+        //target masks are resampled once per target and geometry
+        map<string,ImagePointerType> resampledMasks;
         for (int s = 0;s<m_numImages;++s){
             for (int t=0;t<m_numImages;++t){
                 if (s!=t){
@@ -1716,35 +1881,22 @@ public:
                                 }
 
                                 if (! skip && estimatedDeform){
-                                    ImagePointerType mask;
-                                    if (masks == NULL){
-                                        mask=TransfUtils<ImageType>::createEmptyImage(directDeform);
-                                        mask->FillBuffer(0);
-                                        typename ImageType::SizeType size=mask->GetLargestPossibleRegion().GetSize();
-                                        IndexType offset;
-                                        double fraction=0.9;
-                                        for (int d=0;d<D;++d){
-                                            offset[d]=(1.0-fraction)/2*size[d];
-                                            size[d]=fraction*size[d];
+                                    ResidualTask task;
+                                    task.sourceID=(*m_imageIDList)[s];
+                                    task.targetID=(*m_imageIDList)[t];
+                                    task.intermediateID=(*m_imageIDList)[i];
+                                    task.direct=directDeform;
+                                    task.d0=d0;
+                                    task.d1=d1;
+                                    if (masks != NULL){
+                                        ostringstream key;
+                                        key<<task.targetID<<" "<<d1->GetLargestPossibleRegion()<<d1->GetSpacing()<<d1->GetOrigin();
+                                        if (resampledMasks.find(key.str())==resampledMasks.end()){
+                                            resampledMasks[key.str()]=FilterUtils<ImageType>::NNResample((*masks)[task.targetID],createEmptyImage(d1),false);
                                         }
-                                        
-                                        typename ImageType::RegionType region;
-                                        region.SetSize(size);
-                                        region.SetIndex(offset);
-                                        LOGV(6)<<VAR(region)<<endl;
-                                        ImageUtils<ImageType>::setRegion(mask,region,1);
-                                    }else{
-                                        mask=(*masks)[(*m_imageIDList)[t]];
-                                        mask=FilterUtils<ImageType>::NNResample(mask,createEmptyImage(d1),false);
+                                        task.mask=resampledMasks[key.str()];
                                     }
-                            
-                                    DeformationFieldPointerType indirectDef = TransfUtils<ImageType>::composeDeformations(d1,d0);
-                                    indirectDef=TransfUtils<ImageType>::linearInterpolateDeformationField(indirectDef,TransfUtils<ImageType>::createEmptyImage(directDeform));
-                                    DeformationFieldPointerType diff  = TransfUtils<ImageType>::subtract(directDeform,indirectDef);
-                                    double residual = TransfUtils<ImageType>::computeDeformationNormMask(diff,mask,2,true);
-                                    //double residual = TransfUtils<ImageType>::computeDeformationNorm(diff,2);
-                                    averageInconsistency += residual;
-                                    count++;
+                                    tasks.push_back(task);
                                 }
                             }
                         }
@@ -1752,11 +1904,157 @@ public:
                 }
             }
         }
-        if (count)
-            return averageInconsistency/count;
+        evaluateResidualTasks(tasks);
+        double averageInconsistency=0;
+        for (unsigned int n=0;n<tasks.size();++n){
+            LOGV(6)<<VAR(tasks[n].sourceID)<<" "<<VAR(tasks[n].intermediateID)<<" "<<VAR(tasks[n].targetID)<<" "<<VAR(tasks[n].residual)<<endl;
+            averageInconsistency+=tasks[n].residual;
+        }
+        if (tasks.size())
+            return averageInconsistency/tasks.size();
         else return -1;
         
     }//computeInconsistency
+
+    ///approximate memory of a deformation file in mb, read from its header
+    static double getDeformationMemoryMB(string filename){
+        itk::ImageIOBase::Pointer imageIO=itk::ImageIOFactory::CreateImageIO(filename.c_str(),itk::ImageIOFactory::ReadMode);
+        if (imageIO.IsNull()){
+            LOG<<"Could not read header of "<<filename<<endl;
+            return 0.0;
+        }
+        imageIO->SetFileName(filename);
+        imageIO->ReadImageInformation();
+        double nPixels=1.0;
+        for (unsigned int d=0;d<imageIO->GetNumberOfDimensions();++d) nPixels*=imageIO->GetDimensions(d);
+        return nPixels*sizeof(DisplacementType)/(1024.0*1024.0);
+    }
+
+    ///same as computeError, but reading the deformations from disk in batches of pairs that fit into memoryBudgetMB
+    static double computeError(DeformationFilenameCacheType * files, DeformationFilenameCacheType * trueFiles, std::vector<string> * m_imageIDList, double memoryBudgetMB){
+        std::vector<std::pair<string,string> > pairs;
+        int m_numImages=m_imageIDList->size();
+        for (int s = 0;s<m_numImages;++s){
+            for (int t=0;t<m_numImages;++t){
+                string id1=(*m_imageIDList)[s],id2=(*m_imageIDList)[t];
+                if (s!=t && files->find(id1)!=files->end() && (*files)[id1].find(id2)!=(*files)[id1].end()
+                    && trueFiles->find(id1)!=trueFiles->end() && (*trueFiles)[id1].find(id2)!=(*trueFiles)[id1].end()){
+                    pairs.push_back(std::make_pair((*files)[id1][id2],(*trueFiles)[id1][id2]));
+                }
+            }
+        }
+        if (!pairs.size()) return -1;
+        double fieldMB=std::max(getDeformationMemoryMB(pairs[0].first),1e-3);
+        unsigned int batchSize=std::max(1,int(memoryBudgetMB/(2.0*fieldMB)));
+        double averageError=0;
+        long int count=0;
+        for (unsigned int start=0;start<pairs.size();start+=batchSize){
+            ImageListLoader<DeformationFieldType> loader;
+            std::vector<ResidualTask> tasks;
+            std::vector<std::pair<int,int> > jobs;
+            for (unsigned int n=start;n<std::min((unsigned int)pairs.size(),start+batchSize);++n){
+                jobs.push_back(std::make_pair(loader.add(pairs[n].first),loader.add(pairs[n].second)));
+            }
+            loader.start();
+            for (unsigned int j=0;j<jobs.size();++j){
+                ResidualTask task;
+                task.direct=loader.get(jobs[j].first);
+                task.d1=loader.get(jobs[j].second);
+                if (task.direct.IsNotNull() && task.d1.IsNotNull()) tasks.push_back(task);
+            }
+            evaluateResidualTasks(tasks);
+            for (unsigned int n=0;n<tasks.size();++n){
+                averageError+=tasks[n].residual;
+                ++count;
+            }
+        }
+        if (!count)
+            return -1;
+        else
+            return averageError/count;
+    }
+
+    /**
+     * same as computeInconsistency (without masks and ground truth), but the deformations are read from disk while evaluating.
+     * the triplets (s,i,t) are processed in blocks of b images per index, like a blocked matrix product, so that only the
+     * 3*b^2 deformations of the current block are in memory. b is chosen such that they fit into memoryBudgetMB.
+     * each block is read with parallel I/O threads, and its triplets are evaluated in parallel.
+     */
+    static double computeInconsistency(DeformationFilenameCacheType * files, std::vector<string> * m_imageIDList, double memoryBudgetMB){
+        int m_numImages=m_imageIDList->size();
+        std::vector<std::vector<string> > filenames(m_numImages,std::vector<string>(m_numImages,""));
+        string someFile="";
+        for (int s=0;s<m_numImages;++s){
+            for (int t=0;t<m_numImages;++t){
+                string id1=(*m_imageIDList)[s],id2=(*m_imageIDList)[t];
+                if (s!=t && files->find(id1)!=files->end() && (*files)[id1].find(id2)!=(*files)[id1].end()){
+                    filenames[s][t]=(*files)[id1][id2];
+                    someFile=filenames[s][t];
+                }
+            }
+        }
+        if (someFile=="") return -1;
+        double fieldMB=std::max(getDeformationMemoryMB(someFile),1e-3);
+        int blockSize=std::max(1,std::min(m_numImages,int(sqrt(memoryBudgetMB/(3.0*fieldMB)))));
+        int nBlocks=(m_numImages+blockSize-1)/blockSize;
+        LOGV(1)<<"Evaluating inconsistency in "<<nBlocks<<"^3 blocks of "<<blockSize<<" images, "<<VAR(fieldMB)<<endl;
+        double sumInconsistency=0.0;
+        long int count=0;
+        std::vector<std::vector<DeformationFieldPointerType> > loaded(m_numImages,std::vector<DeformationFieldPointerType>(m_numImages));
+        for (int bs=0;bs<nBlocks;++bs){
+            for (int bt=0;bt<nBlocks;++bt){
+                for (int bi=0;bi<nBlocks;++bi){
+                    //keep the deformations of the current block (s,t), (s,i) and (i,t), read the missing ones
+                    std::vector<std::vector<bool> > needed(m_numImages,std::vector<bool>(m_numImages,false));
+                    int blocks[3][2]={{bs,bt},{bs,bi},{bi,bt}};
+                    for (int b=0;b<3;++b){
+                        for (int s=blocks[b][0]*blockSize;s<std::min(m_numImages,(blocks[b][0]+1)*blockSize);++s){
+                            for (int t=blocks[b][1]*blockSize;t<std::min(m_numImages,(blocks[b][1]+1)*blockSize);++t){
+                                needed[s][t]=filenames[s][t]!="";
+                            }
+                        }
+                    }
+                    ImageListLoader<DeformationFieldType> loader;
+                    std::vector<std::pair<std::pair<int,int>,int> > jobs;
+                    for (int s=0;s<m_numImages;++s){
+                        for (int t=0;t<m_numImages;++t){
+                            if (!needed[s][t]){
+                                loaded[s][t]=NULL;
+                            }else if (loaded[s][t].IsNull()){
+                                jobs.push_back(std::make_pair(std::make_pair(s,t),loader.add(filenames[s][t])));
+                            }
+                        }
+                    }
+                    loader.start();
+                    for (unsigned int j=0;j<jobs.size();++j){
+                        loaded[jobs[j].first.first][jobs[j].first.second]=loader.get(jobs[j].second);
+                    }
+                    std::vector<ResidualTask> tasks;
+                    for (int s=bs*blockSize;s<std::min(m_numImages,(bs+1)*blockSize);++s){
+                        for (int t=bt*blockSize;t<std::min(m_numImages,(bt+1)*blockSize);++t){
+                            for (int i=bi*blockSize;i<std::min(m_numImages,(bi+1)*blockSize);++i){
+                                if (s!=t && i!=s && i!=t && loaded[s][t].IsNotNull() && loaded[s][i].IsNotNull() && loaded[i][t].IsNotNull()){
+                                    ResidualTask task;
+                                    task.direct=loaded[s][t];
+                                    task.d0=loaded[s][i];
+                                    task.d1=loaded[i][t];
+                                    tasks.push_back(task);
+                                }
+                            }
+                        }
+                    }
+                    evaluateResidualTasks(tasks);
+                    for (unsigned int n=0;n<tasks.size();++n){
+                        sumInconsistency+=tasks[n].residual;
+                        ++count;
+                    }
+                }
+            }
+        }
+        if (count)
+            return sumInconsistency/count;
+        else return -1;
+    }
     
 
     static double computeTRE(string targetLandmarks, string refLandmarks, 
@@ -127,7 +127,7 @@ int main(int argc, char ** argv){
     as->parameter ("true", trueDefListFilename, " list of TRUE deformations", false);
     as->parameter ("ROI", ROIFilename, "file containing a ROI on which to perform erstimation", false);
     as->parameter ("resamplingFactor", resamplingFactor,"lower resolution by a factor",false);
-    as->parameter ("optimizer", optimizer,"optimizer for lsq problem. optional number of iterations, eg lbfgsx100.opt in {lsqlin,cg,csd,,lbfgs,cgd}",false);
+    as->parameter ("optimizer", optimizer,"optimizer for lsq problem. optional number of iterations, eg lbfgsx100.opt in {lsqlin,cg,csd,,lbfgs,cgd}. matrixfree:iter:tol solves the same bounded problem as lsqlin in C++ (projected CG) without building the circle consistency matrix",false);
     as->parameter ("imageResamplingFactor", imageResamplingFactor,"lower image resolution by a different factor. This will lead to having more equations for the regularization than there are variables, with the chosen interpolation affecting the interpolation.",false);
     as->parameter ("winp", winput,"weight for adherence to input registration",false);
     as->parameter ("wcons", wcons,"weight consistency penalty",false);
@@ -158,7 +158,7 @@ int main(int argc, char ** argv){
     as->option ("useConstraints", useConstraints,"Use hard constraints to prevent folding. Tearing might currently still occur.");
 
 
-    as->parameter ("metric",localSimMetric ,"metric to be used for local sim computation (none,lncc, lsad, lssd,localautocorrelation).",false);
+    as->parameter ("metric",localSimMetric ,"metric to be used for local sim computation (none,lncc, lsad, lssd,localautocorrelation, lmi, lecc).",false);
     as->option ("filterMetricWithGradient", filterMetricWithGradient,"Multiply local metric with target and warped source image gradients to filter out smooth regions.");
 
     as->option ("updateDeformations", updateDeformations," use estimate of previous iteration in next one.");
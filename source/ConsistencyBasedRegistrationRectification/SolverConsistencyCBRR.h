@@ -26,6 +26,10 @@
 
 #include "SolverAQUIRCGlobal.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace CBRR{
 
 template<class ImageType >
@@ -87,6 +91,18 @@ protected:
     std::vector< map<string , map<string,FloatImagePointerType> > > m_pairwiseMetricDerivatives;
     map< string, map <string,int> > m_tripletCounts;
     std::vector<std::vector<int> > m_edgeNums;
+
+    ///circle source->intermediate->target used by the matrix-free consistency operator
+    struct ConsistencyCircle{
+        int source,intermediate,target;
+        bool estSourceTarget,estSourceIntermediate,estIntermediateTarget;
+        const DeformationType *dSourceTarget,*dSourceIntermediate,*dIntermediateTarget;
+    };
+    std::vector<ConsistencyCircle> m_circles;
+    ///interpolation neighbours (grid offsets and weights) of the intermediate point, per (intermediate,target) pair and grid point
+    std::vector<std::vector<long int> > m_circleNeighborOffsets;
+    std::vector<std::vector<float> > m_circleNeighborWeights;
+    std::vector<std::vector<unsigned char> > m_circleNeighborCounts;
 private:
     bool m_smoothDeformationDownsampling;
     int m_nPixels;// number of pixels/voxels
@@ -508,6 +524,19 @@ public:
         double * ub=mxGetPr(mxUpperBound);
         std::fill(ub,ub+m_nVars,200);
         long int cForConsistency, eqForConsistency;
+
+        if (split(m_optimizer,':')[0]=="matrixfree"){
+            if (m_useTaylor || m_ORACLE>=1 || m_maskList!=NULL){
+                LOG<<"WARNING: matrix-free consistency operator does not support taylor approximation, oracle or masks, using lsqlin"<<endl;
+                m_optimizer="lsqlin";
+            }else{
+                solveMatrixFree(init,lb,ub,m_nNonZerosPairs,m_nEQsPairs);
+                mxDestroyArray(mxInit);
+                mxDestroyArray(mxLowerBound);
+                mxDestroyArray(mxUpperBound);
+                return;
+            }
+        }
         for (unsigned int d = 0; d< D; ++d){
 
           
@@ -1544,6 +1573,313 @@ protected:
         LOGV(2)<<VAR(tripletCount)<<endl;
     }//compute triplets
 
+    ///collect all circles and the interpolation neighbours of their intermediate points.
+    ///memory is O(#pairs*#gridpoints), the circle equations themselves are never stored
+    void computeCircleTopology(){
+        m_circles.clear();
+        int nPairs=m_numImages*(m_numImages-1);
+        m_circleNeighborOffsets=std::vector<std::vector<long int> >(nPairs);
+        m_circleNeighborWeights=std::vector<std::vector<float> >(nPairs);
+        m_circleNeighborCounts=std::vector<std::vector<unsigned char> >(nPairs);
+        int maxNeighbors=pow(2,D);
+        for (int s = 0;s<m_numImages;++s){                            
+            string sourceID=(m_imageIDList)[s];
+            for (int t=0;t<m_numImages;++t){
+                if (t==s) continue;
+                string targetID=(m_imageIDList)[t];
+                DeformationFieldPointerType dSourceTarget;
+                bool estSourceTarget;
+                //as in computeTripletEnergies, a missing pair stays skipped for the following intermediates
+                bool skip=!getCircleDeformation(sourceID,targetID,dSourceTarget,estSourceTarget);
+                for (int i=0;i<m_numImages;++i){ 
+                    if (t==i || i==s) continue;
+                    string intermediateID=(m_imageIDList)[i];
+                    ConsistencyCircle circle;
+                    circle.source=s;circle.intermediate=i;circle.target=t;
+                    circle.estSourceTarget=estSourceTarget;
+                    DeformationFieldPointerType dSourceIntermediate,dIntermediateTarget;
+                    skip=!getCircleDeformation(sourceID,intermediateID,dSourceIntermediate,circle.estSourceIntermediate) || skip;
+                    skip=!getCircleDeformation(intermediateID,targetID,dIntermediateTarget,circle.estIntermediateTarget) || skip;
+                    //skip also if none of the registrations in the circle are to be re-estimated
+                    skip= skip || (!(circle.estIntermediateTarget || circle.estSourceTarget || circle.estSourceIntermediate));
+                    //don't skip if they're all to be estimated oO
+                    skip=skip && !(circle.estIntermediateTarget && circle.estSourceTarget && circle.estSourceIntermediate);
+                    if (skip) continue;
+                    if (!circle.estSourceIntermediate){
+                        LOG<<"NYI"<<endl;
+                        exit(0);
+                    }
+                    --m_tripletCounts[intermediateID][targetID];
+                    --m_tripletCounts[sourceID][targetID];
+                    --m_tripletCounts[sourceID][intermediateID];
+                    circle.dSourceTarget=dSourceTarget->GetBufferPointer();
+                    circle.dSourceIntermediate=dSourceIntermediate->GetBufferPointer();
+                    circle.dIntermediateTarget=dIntermediateTarget->GetBufferPointer();
+                    m_circles.push_back(circle);
+
+                    //neighbours only depend on the previous intermediate->target deformation
+                    long int pairIT=edgeNum(i,t);
+                    if (m_circleNeighborCounts[pairIT].size()) continue;
+                    DeformationFieldPointerType dIntermediateTargetPrevious=(m_previousDeformationCache)[intermediateID][targetID];
+                    m_circleNeighborOffsets[pairIT].resize(m_nGridPoints*maxNeighbors);
+                    m_circleNeighborWeights[pairIT].resize(m_nGridPoints*maxNeighbors);
+                    m_circleNeighborCounts[pairIT].resize(m_nGridPoints,0);
+                    ImageIterator it(m_grid,m_grid->GetLargestPossibleRegion());
+                    for (it.GoToBegin();!it.IsAtEnd();++it){
+                        IndexType gridIndex=it.GetIndex();
+                        long int g=m_grid->ComputeOffset(gridIndex);
+                        PointType ptTarget;
+                        m_grid->TransformIndexToPhysicalPoint(gridIndex,ptTarget);
+                        PointType ptIntermediate= ptTarget + dIntermediateTargetPrevious->GetPixel(gridIndex);
+                        std::vector<std::pair<IndexType,double> > neighbors;
+                        bool inside;
+                        if (m_linearInterpol){
+                            inside=getLinearNeighbors(m_grid,ptIntermediate,neighbors);
+                        }else{
+                            inside=getNearestNeighbors(dIntermediateTarget,ptIntermediate,neighbors);
+                        }
+                        if (!inside) continue;
+                        m_circleNeighborCounts[pairIT][g]=neighbors.size();
+                        for (unsigned int n=0;n<neighbors.size();++n){
+                            m_circleNeighborOffsets[pairIT][g*maxNeighbors+n]=m_grid->ComputeOffset(neighbors[n].first);
+                            m_circleNeighborWeights[pairIT][g*maxNeighbors+n]=neighbors[n].second;
+                        }
+                    }
+                }
+            }
+        }
+        LOGV(2)<<"Found "<<m_circles.size()<<" circles"<<endl;
+    }
+
+    ///deformation used for one edge of a circle, returns false if there is none
+    bool getCircleDeformation(string sourceID, string targetID, DeformationFieldPointerType & def, bool & estimate){
+        estimate=false;
+        if ((m_adherenceDeformationCache)[sourceID][targetID].IsNotNull()){
+            def=(m_adherenceDeformationCache)[sourceID][targetID];
+            estimate=true;
+        }else if ((m_trueDeformations)[sourceID][targetID].IsNotNull()){
+            def=(m_trueDeformations)[sourceID][targetID];
+        }else{
+            return false;
+        }
+        return true;
+    }
+
+    ///row of the circle consistency matrix for circle at grid point g and component d, same equations as computeTripletEnergies.
+    ///returns the number of non-zeros written to cols (0-based variable indices) and vals.
+    inline int getCircleEquation(const ConsistencyCircle & circle, long int g, unsigned int d, long int * cols, double * vals, double & rhs){
+        long int pairIT=edgeNum(circle.intermediate,circle.target);
+        int nNeighbors=m_circleNeighborCounts[pairIT][g];
+        if (!nNeighbors) return 0;
+        int maxNeighbors=pow(2,D);
+        const long int * offsets=&m_circleNeighborOffsets[pairIT][g*maxNeighbors];
+        const float * weights=&m_circleNeighborWeights[pairIT][g*maxNeighbors];
+        long int varShift=0;
+        double val=1.0;
+        if (m_estDef){
+            if (m_normalizeForces && m_Inconsistency>0.0)
+                val=1.0/m_Inconsistency;
+        }else{
+            varShift=m_estDef*m_nGridPoints*internalD*(m_numImages-1)*(m_numImages);
+        }
+        double w=val*m_wCircleNorm;
+        int n=0;
+        rhs=0.0;
+        if (circle.estIntermediateTarget){
+            //indirect
+            cols[n]=varShift+internalD*edgeNum(circle.intermediate,circle.target)*m_nGridPoints+g;
+            vals[n++]=w;
+            if (!m_estDef) rhs-=circle.dIntermediateTarget[g][d];
+        }else if (m_estDef){
+            rhs-=circle.dIntermediateTarget[g][d];
+        }
+        long int sourceIntermediateStart=varShift+internalD*edgeNum(circle.source,circle.intermediate)*m_nGridPoints;
+        for (int i=0;i<nNeighbors;++i){
+            cols[n]=sourceIntermediateStart+offsets[i];
+            vals[n++]=weights[i]*w;
+            if (!m_estDef) rhs-=weights[i]*circle.dSourceIntermediate[offsets[i]][d];
+        }
+        if (circle.estSourceTarget){
+            //minus direct
+            cols[n]=varShift+internalD*edgeNum(circle.source,circle.target)*m_nGridPoints+g;
+            vals[n++]=-w;
+            if (!m_estDef) rhs+=circle.dSourceTarget[g][d];
+        }else if (m_estDef){
+            rhs+=circle.dSourceTarget[g][d];
+        }
+        rhs*=w;
+        return n;
+    }
+
+    ///accumulate A^T A x (and A^T b if Atb is given) of the circle equations for component d, without storing A.
+    ///circles are processed in parallel, each thread scatters into its own buffer. returns |Ax-b|^2
+    double applyCircleOperator(const std::vector<double> & x, std::vector<double> & AtAx, std::vector<double> * Atb, unsigned int d){
+        int nCircles=m_circles.size();
+        int nThreads=1;
+#ifdef _OPENMP
+        nThreads=omp_get_max_threads();
+#endif
+        std::vector<std::vector<double> > threadAtAx(nThreads),threadAtb(nThreads);
+        double residual=0.0;
+#pragma omp parallel reduction(+:residual)
+        {
+            int thread=0;
+#ifdef _OPENMP
+            thread=omp_get_thread_num();
+#endif
+            std::vector<double> & localAtAx=threadAtAx[thread];
+            std::vector<double> & localAtb=threadAtb[thread];
+            localAtAx.assign(m_nVars,0.0);
+            if (Atb) localAtb.assign(m_nVars,0.0);
+            long int cols[(1<<D)+2];
+            double vals[(1<<D)+2];
+#pragma omp for schedule(dynamic)
+            for (int c=0;c<nCircles;++c){
+                for (long int g=0;g<m_nGridPoints;++g){
+                    double rhs;
+                    int n=getCircleEquation(m_circles[c],g,d,cols,vals,rhs);
+                    if (!n) continue;
+                    double row=0.0;
+                    for (int i=0;i<n;++i) row+=vals[i]*x[cols[i]];
+                    for (int i=0;i<n;++i) localAtAx[cols[i]]+=vals[i]*row;
+                    if (Atb){
+                        for (int i=0;i<n;++i) localAtb[cols[i]]+=vals[i]*rhs;
+                    }
+                    residual+=(row-rhs)*(row-rhs);
+                }
+            }
+        }
+        for (int t=0;t<nThreads;++t){
+            for (long int v=0;v<m_nVars;++v){
+                AtAx[v]+=threadAtAx[t][v];
+                if (Atb) (*Atb)[v]+=threadAtb[t][v];
+            }
+        }
+        return residual;
+    }
+
+    ///same for the pairwise equations, which are kept as (1-based) COO triplets
+    double applyPairwiseOperator(const std::vector<double> & px, const std::vector<double> & py, const std::vector<double> & pv, const std::vector<double> & pb, long int nNz, long int nEq,
+                                 const std::vector<double> & x, std::vector<double> & AtAx, std::vector<double> * Atb){
+        std::vector<double> Ax(nEq,0.0);
+        for (long int c=0;c<nNz;++c){
+            Ax[long(px[c])-1]+=pv[c]*x[long(py[c])-1];
+        }
+        for (long int c=0;c<nNz;++c){
+            AtAx[long(py[c])-1]+=pv[c]*Ax[long(px[c])-1];
+            if (Atb) (*Atb)[long(py[c])-1]+=pv[c]*pb[long(px[c])-1];
+        }
+        double residual=0.0;
+        for (long int e=0;e<nEq;++e){
+            residual+=(Ax[e]-pb[e])*(Ax[e]-pb[e]);
+        }
+        return residual;
+    }
+
+    ///mark the variables at a bound whose negative gradient r points outwards as fixed, returns the squared norm of r on the free variables
+    static double updateFixedVariables(const std::vector<double> & x, const std::vector<double> & r, const double * lb, const double * ub, std::vector<char> & fixed){
+        double rr=0.0;
+        for (unsigned long int v=0;v<x.size();++v){
+            fixed[v]=(x[v]<=lb[v] && r[v]<0.0) || (x[v]>=ub[v] && r[v]>0.0);
+            if (!fixed[v]) rr+=r[v]*r[v];
+        }
+        return rr;
+    }
+
+    ///solve the normal equations with projected conjugate gradients within the bounds lb,ub used by lsqlin,
+    ///applying the consistency part of A on the fly.
+    ///optimizer string: matrixfree:<iterations>:<relative tolerance>
+    void solveMatrixFree(double * init, double * lb, double * ub, long int nNonZerosPairs, long int nEQsPairs){
+        std::vector<string> p=split(m_optimizer,':');
+        int maxIter=p.size()>1?atoi(p[1].c_str()):500;
+        double tol=p.size()>2?atof(p[2].c_str()):1e-6;
+        LOGV(1)<<"Computing circle topology for matrix-free consistency operator"<<endl;
+        m_circles.clear();
+        if (m_wCircleNorm>0.0)
+            computeCircleTopology();
+        double neighborMB=0.0;
+        for (unsigned int pair=0;pair<m_circleNeighborCounts.size();++pair){
+            neighborMB+=(sizeof(long int)+sizeof(float))*m_circleNeighborOffsets[pair].size()+m_circleNeighborCounts[pair].size();
+        }
+        neighborMB/=1024*1024;
+        LOGV(1)<<"Matrix-free consistency operator uses "<<neighborMB<<" mb instead of "<<(3.0*sizeof(double)*m_nEqCircleNorm * m_nVarCircleNorm)/(1024*1024)<<" mb for explicit triplets"<<endl;
+        for (unsigned int d = 0; d< D; ++d){
+            logSetStage("MatrixFree"+boost::lexical_cast<string>(d));
+            std::vector<double> px(nNonZerosPairs,-1),py(nNonZerosPairs,m_nVars),pv(nNonZerosPairs,0.0),pb(nEQsPairs,-999999);
+            long int cPair=0,eqPair=1;
+            computePairwiseEnergiesAndBounds( &px[0],  &py[0], &pv[0],  &pb[0], init, lb, ub, cPair,  eqPair,d);
+            long int nEqPair=eqPair-1;
+
+            //start inside the box [lb,ub] that lsqlin enforces; estimated deformations start at the input deformation
+            //(the center of their box) instead of the random initialisation used for lsqlin
+            std::vector<double> x(m_nVars),Atb(m_nVars,0.0),r(m_nVars,0.0);
+            long int nDefVars=m_estDef*m_nGridPoints*internalD*(m_numImages-1)*(m_numImages);
+            for (long int v=0;v<m_nVars;++v){
+                x[v]=v<nDefVars?0.5*(lb[v]+ub[v]):std::min(std::max(init[v],lb[v]),ub[v]);
+            }
+            //r = A^T b - A^T A x, the negative gradient
+            double residual=applyCircleOperator(x,r,&Atb,d);
+            residual+=applyPairwiseOperator(px,py,pv,pb,cPair,nEqPair,x,r,&Atb);
+            LOGV(1)<<"initialisation residual "<<sqrt(residual)<<endl;
+            for (long int v=0;v<m_nVars;++v) r[v]=Atb[v]-r[v];
+
+            //projected CG: variables at a bound whose negative gradient points outwards are fixed, the others are optimised with CG.
+            //CG is restarted from the projected gradient whenever a step hits a bound or the set of fixed variables changes
+            std::vector<char> fixed(m_nVars);
+            double rr=updateFixedVariables(x,r,lb,ub,fixed);
+            double rr0=rr;
+            std::vector<double> dir(m_nVars),q(m_nVars);
+            for (long int v=0;v<m_nVars;++v) dir[v]=fixed[v]?0.0:r[v];
+            int it=0,nRestarts=0;
+            for (;it<maxIter && rr>tol*tol*rr0 && rr>0.0;++it){
+                std::fill(q.begin(),q.end(),0.0);
+                applyCircleOperator(dir,q,NULL,d);
+                applyPairwiseOperator(px,py,pv,pb,cPair,nEqPair,dir,q,NULL);
+                double dq=0.0;
+                for (long int v=0;v<m_nVars;++v) dq+=dir[v]*q[v];
+                double alpha=rr/dq;
+                bool clamped=false;
+                for (long int v=0;v<m_nVars;++v){
+                    x[v]+=alpha*dir[v];
+                    if (x[v]<lb[v]){ x[v]=lb[v]; clamped=true; }
+                    else if (x[v]>ub[v]){ x[v]=ub[v]; clamped=true; }
+                }
+                if (clamped){
+                    //the step was cut at the bounds, recompute the gradient at the projected point
+                    std::fill(r.begin(),r.end(),0.0);
+                    applyCircleOperator(x,r,NULL,d);
+                    applyPairwiseOperator(px,py,pv,pb,cPair,nEqPair,x,r,NULL);
+                    for (long int v=0;v<m_nVars;++v) r[v]=Atb[v]-r[v];
+                }else{
+                    for (long int v=0;v<m_nVars;++v) r[v]-=alpha*q[v];
+                }
+                std::vector<char> previousFixed(fixed);
+                double rrNew=updateFixedVariables(x,r,lb,ub,fixed);
+                if (clamped || fixed!=previousFixed){
+                    ++nRestarts;
+                    for (long int v=0;v<m_nVars;++v) dir[v]=fixed[v]?0.0:r[v];
+                }else{
+                    double beta=rrNew/rr;
+                    for (long int v=0;v<m_nVars;++v) dir[v]=fixed[v]?0.0:r[v]+beta*dir[v];
+                }
+                rr=rrNew;
+                LOGV(3)<<VAR(it)<<" "<<VAR(sqrt(rr/rr0))<<endl;
+            }
+            LOGV(2)<<"Projected CG restarted "<<nRestarts<<" times at active bounds"<<endl;
+            std::fill(q.begin(),q.end(),0.0);
+            residual=applyCircleOperator(x,q,NULL,d);
+            residual+=applyPairwiseOperator(px,py,pv,pb,cPair,nEqPair,x,q,NULL);
+            LOGV(1)<<"Finished optimizer "<<m_optimizer<<" for dimension "<<d<<" after "<<it<<" iterations, result: "<<sqrt(residual)<<std::endl;
+            m_results[d]=mxCreateDoubleMatrix((mwSize)m_nVars,1,mxREAL);
+            std::copy(x.begin(),x.end(),mxGetPr(m_results[d]));
+            logResetStage;
+        }
+        m_circles.clear();
+        m_circleNeighborOffsets.clear();
+        m_circleNeighborWeights.clear();
+        m_circleNeighborCounts.clear();
+    }
+
     void computePairwiseEnergiesAndBounds(double * x, 
                                           double * y,
                                           double * v, 
@@ -1975,6 +2311,19 @@ public:
         bool computeDownsampledMetrics=m_lowResSimilarity;
         m_maxSim=-1;
         m_minSim=100000;
+        //full resolution deformations are read in the background, in the order in which they are evaluated
+        ImageListLoader<DeformationFieldType> deformationLoader;
+        map<string,map<string,int> > deformationJobs;
+        for (int target=0;target<m_numImages;++target){
+            for (int source=0;source<m_numImages;++source){
+                string targetID=(m_imageIDList)[target];
+                string sourceID=(m_imageIDList)[source];
+                if (source!=target && findDeformation(m_deformationFileList,sourceID,targetID) && (m_estimatedDeformations[sourceID][targetID].IsNull() || !m_lowResolutionEval)){
+                    deformationJobs[sourceID][targetID]=deformationLoader.add(m_deformationFileList[sourceID][targetID]);
+                }
+            }
+        }
+        deformationLoader.start();
         for (int target=0;target<m_numImages;++target){
             for (int source=0;source<m_numImages;++source){
                 if (source!=target){
@@ -2008,7 +2357,7 @@ public:
                                 
                             }else{
                                 //read full resolution deformations
-                                deformation=ImageUtils<DeformationFieldType>::readImage(m_deformationFileList[sourceID][targetID]);
+                                deformation=deformationLoader.get(deformationJobs[sourceID][targetID]);
                                 //resample deformation to target image space
                                 deformation=TransfUtils<ImageType>::linearInterpolateDeformationField(deformation,targetImage,m_smoothDeformationDownsampling);
                                 //update deformation
@@ -2062,7 +2411,7 @@ public:
                             m_estimatedDeformations[sourceID][targetID]=NULL;
                         }else{
                             //read full resolution deformations
-                            deformation=ImageUtils<DeformationFieldType>::readImage(m_deformationFileList[sourceID][targetID]);
+                            deformation=deformationLoader.get(deformationJobs[sourceID][targetID]);
                             //resample deformation to target image space
                             deformation=TransfUtils<ImageType>::linearInterpolateDeformationField(deformation,targetImage,false);
                             updatedDeform=deformation;
@@ -2690,6 +3039,10 @@ public:
                                 localWeightImage= Metrics<ImageType,FloatImageType,float>::ITKLNCC(warpedImage,targetImage,m_sigma,m_exponent, this->m_ROI);
                             }else if (m_metric == "itklmi"){
                                 localWeightImage= Metrics<ImageType,FloatImageType,float>::ITKLMI(warpedImage,targetImage,m_sigma,m_exponent, this->m_ROI);
+                            }else if (m_metric == "lmi"){
+                                localWeightImage= Metrics<ImageType,FloatImageType,float>::LMI(warpedImage,targetImage,m_sigma,m_exponent, this->m_ROI);
+                            }else if (m_metric == "lecc"){
+                                localWeightImage= Metrics<ImageType,FloatImageType,float>::LECC(warpedImage,targetImage,m_sigma,m_exponent, this->m_ROI);
                             }else if (m_metric == "lnccAbs"){
                                 localWeightImage= Metrics<ImageType,FloatImageType>::efficientLNCCNewNorm(warpedImage,targetImage,m_sigma,m_exponent);
                             }else if (m_metric == "lnccAbsMultiscale"){
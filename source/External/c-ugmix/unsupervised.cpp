@@ -1,9 +1,108 @@
 #include "unsupervised.h"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #ifdef use_namespaces
 using namespace NEWMAT;
 #endif
+/*number of observations evaluated together in the block routines*/
+static const int BLOCK = 256;
+
+void gaussian_component::set(const ColumnVector& mix_mu, const Matrix& mix_sigma){
+	Dim = mix_mu.Nrows();
+	mean.resize(Dim);
+	for(int d=0;d<Dim;d++) mean[d] = mix_mu.element(d);
+	factor.assign(Dim*Dim, 0.0);
+	/*cholesky decomposition mix_sigma = L*L'*/
+	std::vector<double> L(Dim*Dim, 0.0);
+	double log_det = 0.0;
+	triangular = true;
+	for(int j=0;j<Dim && triangular;j++){
+		double diag = mix_sigma.element(j,j);
+		for(int k=0;k<j;k++) diag -= L[j*Dim+k]*L[j*Dim+k];
+		if(!(diag>0.0)){
+			triangular = false;
+			break;
+		}
+		L[j*Dim+j] = sqrt(diag);
+		log_det += 2.0*log(L[j*Dim+j]);
+		for(int i=j+1;i<Dim;i++){
+			double v = mix_sigma.element(i,j);
+			for(int k=0;k<j;k++) v -= L[i*Dim+k]*L[j*Dim+k];
+			L[i*Dim+j] = v/L[j*Dim+j];
+		}
+	}
+	if(triangular){
+		/*factor = inverse of L, by forward substitution*/
+		for(int c=0;c<Dim;c++){
+			for(int r=c;r<Dim;r++){
+				double v = (r==c) ? 1.0 : 0.0;
+				for(int k=c;k<r;k++) v -= L[r*Dim+k]*factor[k*Dim+c];
+				factor[r*Dim+c] = v/L[r*Dim+r];
+			}
+		}
+	}
+	else{
+		/*not positive definite, fall back to the full inverse as before*/
+		Matrix precision = mix_sigma.i();
+		for(int r=0;r<Dim;r++)
+			for(int c=0;c<Dim;c++) factor[r*Dim+c] = precision.element(r,c);
+		log_det = log(mix_sigma.Determinant());
+	}
+	logNorm = -0.5*(Dim*log(2.0*M_PI) + log_det);
+}
+
+double gaussian_component::mahalanobis(const double* ob) const{
+	double x = 0.0;
+	if(triangular){
+		for(int r=0;r<Dim;r++){
+			double y = 0.0;
+			for(int c=0;c<=r;c++) y += factor[r*Dim+c]*(ob[c]-mean[c]);
+			x += y*y;
+		}
+	}
+	else{
+		for(int r=0;r<Dim;r++)
+			for(int c=0;c<Dim;c++) x += (ob[r]-mean[r])*factor[r*Dim+c]*(ob[c]-mean[c]);
+		if( x<0.0 || std::isnan(x) ) x = 0.0; //for avoiding the failure from calculation error of newmat library.
+	}
+	return x;
+}
+
+void gaussian_component::log_gaussian(const double* obs, int n, double* result) const{
+	/*the loops over the block are innermost so that they can be vectorised*/
+	double y[BLOCK];
+	for(int i=0;i<n;i++) result[i] = 0.0;
+	if(triangular){
+		for(int r=0;r<Dim;r++){
+			for(int i=0;i<n;i++) y[i] = 0.0;
+			for(int c=0;c<=r;c++){
+				const double f = factor[r*Dim+c], m = mean[c];
+				const double* o = obs+c*n;
+				for(int i=0;i<n;i++) y[i] += f*(o[i]-m);
+			}
+			for(int i=0;i<n;i++) result[i] += y[i]*y[i];
+		}
+	}
+	else{
+		for(int r=0;r<Dim;r++){
+			for(int c=0;c<Dim;c++){
+				const double f = factor[r*Dim+c], mr = mean[r], mc = mean[c];
+				const double* o_r = obs+r*n;
+				const double* o_c = obs+c*n;
+				for(int i=0;i<n;i++) result[i] += f*(o_r[i]-mr)*(o_c[i]-mc);
+			}
+		}
+		for(int i=0;i<n;i++) if( result[i]<0.0 || std::isnan(result[i]) ) result[i] = 0.0;
+	}
+	for(int i=0;i<n;i++) result[i] = logNorm-0.5*result[i];
+}
+
 void unsupervised::init(){
 	FLAG=false;
 	best_k_nz=0;
@@ -31,6 +130,7 @@ void unsupervised::CleanUp(){
 	}
 	delete [] mu;
 	delete [] sigma;
+	best_components.clear();
 	best_k_nz=0;
 }
 
@@ -61,31 +161,153 @@ double unsupervised::max(double p, double q){
 	else return q;
 }
 
-double unsupervised::gaussian(int k, const ColumnVector& ob){
-	ColumnVector tmp(Dim);
-	tmp = ob-mu[k];
-	double x = (tmp.t() * sigma[k].i() * tmp).AsScalar();
-	if( x<0.0 || std::isnan(x) ) x = 0.0; //for avoiding the failure from calculation error of newmat library.
-    
-	tmp.CleanUp();
-	return (exp(x*(-0.5)) / (pow(2.0*M_PI,ob.Nrows()*0.5)*pow(sigma[k].Determinant(),0.5)));
+/*precision factors and normalisers of the final model, so that they are not recomputed for every observation*/
+void unsupervised::precompute(){
+	best_components.resize(best_k_nz);
+	for(int k=0;k<best_k_nz;k++) best_components[k].set(mu[k], sigma[k]);
 }
 
-double unsupervised::gaussian(const ColumnVector& ob, const ColumnVector& mix_mu, const Matrix& mix_sigma){
-	ColumnVector tmp(Dim);
-	tmp = ob-mix_mu;
-	double x = (tmp.t() * mix_sigma.i() * tmp).AsScalar();
-	if(x<0.0) x = 0.0; //for avoiding the failure from calculation error of newmat library.
-    
-	tmp.CleanUp();
-	return (exp(x*(-0.5)) / (pow(2.0*M_PI,ob.Nrows()*0.5)*pow(mix_sigma.Determinant(),0.5)));
+double unsupervised::gaussian(int k, const ColumnVector& ob){
+	if(!FLAG) nrerror("estimation is not done!\n");
+	std::vector<double> x(Dim);
+	for(int d=0;d<Dim;d++) x[d] = ob.element(d);
+	return exp(best_components[k].log_gaussian(&x[0]));
 }
 
 double unsupervised::likelihood(const ColumnVector& ob){
-	double tmp=0.0;
 	if(!FLAG) nrerror("estimation is not done!\n");
-	for(int i=0;i<best_k_nz;i++) tmp += best_alpha[i]*gaussian(i,ob);
-	return tmp;
+	std::vector<double> x(Dim);
+	for(int d=0;d<Dim;d++) x[d] = ob.element(d);
+	return exp(log_likelihood(&x[0]));
+}
+
+double unsupervised::log_likelihood(const double* ob){
+	if(!FLAG) nrerror("estimation is not done!\n");
+	std::vector<double> log_p(best_k_nz);
+	double log_max = -std::numeric_limits<double>::infinity();
+	for(int k=0;k<best_k_nz;k++){
+		log_p[k] = log(best_alpha[k]) + best_components[k].log_gaussian(ob);
+		log_max = max(log_max, log_p[k]);
+	}
+	if(log_max == -std::numeric_limits<double>::infinity()) return log_max;
+	double sum = 0.0;
+	for(int k=0;k<best_k_nz;k++) sum += exp(log_p[k]-log_max);
+	return log_max + log(sum);
+}
+
+void unsupervised::likelihood(const double* obs, long int n, double* result, bool logarithm){
+	if(!FLAG) nrerror("estimation is not done!\n");
+	std::vector<double> log_alpha(best_k_nz);
+	for(int k=0;k<best_k_nz;k++) log_alpha[k] = log(best_alpha[k]);
+	long int n_blocks = (n+BLOCK-1)/BLOCK;
+#pragma omp parallel
+	{
+		std::vector<double> x(Dim*BLOCK), log_p(best_k_nz*BLOCK);
+#pragma omp for
+		for(long int b=0;b<n_blocks;b++){
+			long int start = b*BLOCK;
+			int size = (int)std::min((long int)BLOCK, n-start);
+			/*component-wise copy of the block*/
+			for(int i=0;i<size;i++)
+				for(int d=0;d<Dim;d++) x[d*size+i] = obs[(start+i)*Dim+d];
+			for(int k=0;k<best_k_nz;k++){
+				double* l = &log_p[k*size];
+				best_components[k].log_gaussian(&x[0], size, l);
+				for(int i=0;i<size;i++) l[i] += log_alpha[k];
+			}
+			/*log-sum-exp over the components*/
+			for(int i=0;i<size;i++){
+				double log_max = -std::numeric_limits<double>::infinity();
+				for(int k=0;k<best_k_nz;k++) log_max = std::max(log_max, log_p[k*size+i]);
+				double sum = 0.0;
+				if(log_max > -std::numeric_limits<double>::infinity())
+					for(int k=0;k<best_k_nz;k++) sum += exp(log_p[k*size+i]-log_max);
+				if(logarithm) result[start+i] = sum>0.0 ? log_max+log(sum) : log_max;
+				else result[start+i] = sum>0.0 ? exp(log_max)*sum : 0.0;
+			}
+		}
+	}
+}
+
+/*sums of the columns of w over all observations; per-thread partial sums are merged in order*/
+static void column_sums(Double2D w, int n, int k_max, std::vector<double>& sums){
+	int n_threads = 1;
+#ifdef _OPENMP
+	n_threads = omp_get_max_threads();
+#endif
+	std::vector<double> partial(n_threads*k_max, 0.0);
+#pragma omp parallel for
+	for(int i=0;i<n;i++){
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		for(int j=0;j<k_max;j++) partial[t*k_max+j] += w[i][j];
+	}
+	sums.assign(k_max, 0.0);
+	for(int t=0;t<n_threads;t++)
+		for(int j=0;j<k_max;j++) sums[j] += partial[t*k_max+j];
+}
+
+/*mean and covariance of the observations weighted by w[.][m]; returns the sum of the weights*/
+static double weighted_moments(const std::vector<double>& obs_data, Double2D w, int m, int n, int Dim, 
+			       ColumnVector& mix_mu, Matrix& mix_sigma){
+	int n_threads = 1;
+#ifdef _OPENMP
+	n_threads = omp_get_max_threads();
+#endif
+	int stride = 1+Dim;
+	std::vector<double> partial(n_threads*stride, 0.0);
+#pragma omp parallel for
+	for(int i=0;i<n;i++){
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		double* p = &partial[t*stride];
+		p[0] += w[i][m];
+		for(int d=0;d<Dim;d++) p[1+d] += w[i][m]*obs_data[i*Dim+d];
+	}
+	double total = 0.0;
+	std::vector<double> mean(Dim, 0.0);
+	for(int t=0;t<n_threads;t++){
+		total += partial[t*stride];
+		for(int d=0;d<Dim;d++) mean[d] += partial[t*stride+1+d];
+	}
+	if(total) for(int d=0;d<Dim;d++) mean[d] /= total;
+
+	stride = Dim*Dim;
+	partial.assign(n_threads*stride, 0.0);
+#pragma omp parallel for
+	for(int i=0;i<n;i++){
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		double* p = &partial[t*stride];
+		const double* ob = &obs_data[i*Dim];
+		for(int d=0;d<Dim;d++)
+			for(int dd=0;dd<Dim;dd++) p[d*Dim+dd] += w[i][m]*(ob[d]-mean[d])*(ob[dd]-mean[dd]);
+	}
+	for(int d=0;d<Dim;d++){
+		mix_mu.element(d) = mean[d];
+		for(int dd=0;dd<Dim;dd++){
+			double c = 0.0;
+			for(int t=0;t<n_threads;t++) c += partial[t*stride+d*Dim+dd];
+			mix_sigma.element(d,dd) = total ? c/total : c;
+		}
+	}
+	return total;
+}
+
+/*u[.][m] = N(obs|component), bounded below by UNDER_PROB*/
+static void component_probabilities(const std::vector<double>& obs_data, const gaussian_component& component, 
+				    Double2D u, int m, int n, int Dim){
+#pragma omp parallel for
+	for(int i=0;i<n;i++){
+		u[i][m] = exp(component.log_gaussian(&obs_data[i*Dim]));
+		if(u[i][m]<UNDER_PROB) u[i][m] = UNDER_PROB;
+	}
 }
 
 int unsupervised::estimate(int k_max, const Matrix& obs){
@@ -189,6 +411,13 @@ int unsupervised::estimate(int k_max, const Matrix& obs){
 	FreeDouble_2D(tmp4,Dim,n);
 	FreeInt_1D(tmp5);
 	FreeDouble_2D(tmp_vectors,n,Dim);
+
+	/*observations as plain array, obs_data[i*Dim+d]*/
+	std::vector<double> obs_data(n*Dim);
+	for(int i=0;i<n;i++)
+		for(int d=0;d<Dim;d++) obs_data[i*Dim+d] = obs.element(d,i);
+	std::vector<gaussian_component> components(k_max);
+	std::vector<double> sums;
     
     
 	ColumnVector *mix_mu = new ColumnVector [k_max];
@@ -205,13 +434,12 @@ int unsupervised::estimate(int k_max, const Matrix& obs){
 	}
     
     
-	for(int i=0;i<n;i++){
-		for(int m=0;m<k_max;m++){
-			u[i][m] = gaussian(m, obs.Column(i+1));
-			if(u[i][m]<UNDER_PROB) u[i][m] = UNDER_PROB;
-            w[i][m]=0.0;
-		}
+	for(int m=0;m<k_max;m++){
+		components[m].set(mu[m], sigma[m]);
+		component_probabilities(obs_data, components[m], u, m, n, Dim);
 	}
+	for(int i=0;i<n;i++)
+		for(int m=0;m<k_max;m++) w[i][m]=0.0;
 #if 1 
 	do{
 		if(!t) criterion = L_MAX;
@@ -229,33 +457,20 @@ int unsupervised::estimate(int k_max, const Matrix& obs){
 			for(int m=0;m<k_max;m++){
                 //std::cout<<"m "<<m<<" "<<alpha[m]<<std::endl;
 				if(!alpha[m]) flag = true;
+#pragma omp parallel for
 				for(int i=0;i<n;i++){
-					tmp = 0.0;
-					for(int j=0;j<k_max;j++) {
-                        tmp += alpha[j]*u[i][j];
-                        //std::cout<<j<<" "<<tmp<<" "<<alpha[j]<<" "<<u[i][j]<<std::endl;
-                    }
-					if(tmp  ) {
-                        //std::cout<<"tmp2 "<<tmp<<" "<< alpha[m] * u[i][m] / tmp<<std::endl;
-                        w[i][m] = alpha[m] * u[i][m] / tmp;
-                    }else{
-                        w[i][m]=0;
-                    }
+					double sum = 0.0;
+					for(int j=0;j<k_max;j++) sum += alpha[j]*u[i][j];
+					if(sum) w[i][m] = alpha[m] * u[i][m] / sum;
+					else w[i][m] = 0;
                 }
 		
                 if(!flag){
-                    alpha[m] = 0.0;
-                    for(int i=0;i<n;i++) {
-                        alpha[m] += w[i][m];
-                        //std::cout<<i<<" "<<alpha[m]<<" "<<w[i][m]<<std::endl;
-                    }
-                    alpha[m] = max(0.0, alpha[m] - (double) N / 2.0);
+                    column_sums(w, n, k_max, sums);
+                    alpha[m] = max(0.0, sums[m] - (double) N / 2.0);
                     tmp = 0.0;
                     for(int j=0;j<k_max;j++){
-                        tmp2 = 0.0;
-                        for(int i=0;i<n;i++) tmp2 += w[i][j];
-                        //std::cout<<j<<" "<<tmp2<<" "<<N<<std::endl;
-                        tmp += max(0.0, tmp2 - (double) N / 2.0);
+                        tmp += max(0.0, sums[j] - (double) N / 2.0);
                     }
                     //std::cout<<"tmp "<<tmp<<" "<<alpha[m]<<std::endl;
                     if(tmp ) alpha[m] = alpha[m] / tmp;
@@ -267,23 +482,9 @@ int unsupervised::estimate(int k_max, const Matrix& obs){
                 for(int l=0;l<k_max;l++) alpha[l] /= tmp;
 		
                 if(alpha[m] ){
-                    mix_mu[m] = 0.0;
-                    mix_sigma[m] = 0.0;
-                    tmp = 0.0;
-		    
-                    for(int i=0;i<n;i++){
-                        tmp += w[i][m];
-                        mix_mu[m] += w[i][m] * obs.Column(i+1);
-                    }
-                    if(tmp  ) mix_mu[m] /= tmp;
-                    for(int i=0;i<n;i++)
-                        mix_sigma[m] += w[i][m] * (obs.Column(i+1)-mix_mu[m])*(obs.Column(i+1)-mix_mu[m]).t();
-                    if(tmp  ) mix_sigma[m] /= tmp;
-		    
-                    for(int i=0;i<n;i++){
-                        u[i][m] = gaussian(obs.Column(i+1), mix_mu[m], mix_sigma[m]);
-                        if(u[i][m]<UNDER_PROB) u[i][m] = UNDER_PROB;
-                    }
+                    tmp = weighted_moments(obs_data, w, m, n, Dim, mix_mu[m], mix_sigma[m]);
+                    components[m].set(mix_mu[m], mix_sigma[m]);
+                    component_probabilities(obs_data, components[m], u, m, n, Dim);
                 }
                 else{
                     if(!flag) k_nz--;
@@ -300,12 +501,15 @@ int unsupervised::estimate(int k_max, const Matrix& obs){
             //std::cout<<tmp<<" "<<criterion<<std::endl;
             criterion += (double) N * tmp / 2.0;
             tmp = 0.0;
+            int n_under = 0;
+#pragma omp parallel for reduction(+:tmp,n_under)
             for(int i=0;i<n;i++){
-                tmp2 = 0.0;
-                for(int m=0;m<k_max;m++) tmp2 += alpha[m]*u[i][m];
-                if(tmp2>UNDER_PROB ) tmp += log(tmp2);
-                else flag = true;
+                double sum = 0.0;
+                for(int m=0;m<k_max;m++) sum += alpha[m]*u[i][m];
+                if(sum>UNDER_PROB ) tmp += log(sum);
+                else n_under++;
             }
+            if(n_under) flag = true;
             if(flag) criterion = previous; 
             else criterion -= tmp;
 	    
@@ -384,5 +588,6 @@ int unsupervised::estimate(int k_max, const Matrix& obs){
     delete [] mix_sigma;
 #endif    
     FLAG = true;  //estimation is done.
+    precompute();
     return best_k_nz;
 }
@@ -14,6 +14,7 @@
 
 #include    <stdlib.h>
 #include    <math.h>
+#include    <vector>
 #include    "newmat.h"
 #include    "newmatap.h"
 #include    "newmatrm.h"
@@ -26,6 +27,24 @@
 #ifdef use_namespace
 using namespace NEWMAT;
 #endif
+/*gaussian with precomputed precision factor: log N(ob) = logNorm - 0.5*|factor*(ob-mean)|^2.
+  factor is the inverse of the cholesky factor of the covariance, or the full inverse 
+  if the covariance is not positive definite.*/
+class gaussian_component{
+ public:
+  int Dim;
+  bool triangular;
+  std::vector<double> mean;
+  std::vector<double> factor;
+  double logNorm;
+
+  void set(const ColumnVector& mix_mu, const Matrix& mix_sigma);
+  double mahalanobis(const double* ob) const;
+  double log_gaussian(const double* ob) const {return logNorm-0.5*mahalanobis(ob);}
+  /*log N for a block of n observations stored component-wise, obs[d*n+i]*/
+  void log_gaussian(const double* obs, int n, double* result) const;
+};
+
 class unsupervised{
  private:
   bool FLAG;
@@ -34,11 +53,11 @@ class unsupervised{
   Double1D best_alpha;
   ColumnVector* mu;
   Matrix* sigma;
+  std::vector<gaussian_component> best_components;
   
   void init();
   double max(double p,double q);
-  double gaussian(const ColumnVector& ob, 
-		  const ColumnVector& mix_mu, const Matrix& mix_sigma);
+  void precompute();
  public:
   unsupervised();
   ~unsupervised();
@@ -53,6 +72,10 @@ class unsupervised{
   int estimate(int k_max, const Matrix& obs);
   /*calculate he likelihood of unseen data from the model*/
   double likelihood(const ColumnVector& ob);
+  /*log-likelihood of one observation ob[0..Dim-1]*/
+  double log_likelihood(const double* ob);
+  /*(log-)likelihoods of n observations stored row-wise, obs[i*Dim+d]. blocks of observations are evaluated in parallel*/
+  void likelihood(const double* obs, long int n, double* result, bool logarithm=false);
   /*memory release*/
   void CleanUp();
 };
@@ -29,6 +29,7 @@
 #endif
 
 #include <itkVectorGradientMagnitudeImageFilter.h>
+#include <map>
 #include "itkGaussianImage.h"
 
 namespace MRegFuse{
@@ -74,6 +75,7 @@ namespace MRegFuse{
   double m_relativeLB;
   SpacingType m_gridSpacings;
   bool m_anisotropicSmoothing;
+  bool m_localRepair;
   GaussianEstimatorScalarImage<FloatImageType> m_smoothingEstimator;
   ImagePointerType m_mask,m_labelImage;
   public:
@@ -86,6 +88,7 @@ namespace MRegFuse{
     m_alpha=1.0;
     m_anisotropicSmoothing=false;
     m_mask=NULL;
+    m_localRepair=false;
   }
   void setPairwiseWeight(double w){m_pairwiseWeight=w;}
   void setAlpha(double a){m_alpha=a;}
@@ -93,6 +96,8 @@ namespace MRegFuse{
   void setHardConstraints(bool b){m_hardConstraints=b;}
   void setAnisoSmoothing(bool a){m_anisotropicSmoothing=a;}
   void setMask(ImagePointerType mask){m_mask=mask;}
+  ///re-solve only the masked control points in solveUntilPosJacDet, see solveLocally()
+  void setLocalRepair(bool b){m_localRepair=b;}
 
     
   //add deformation (with optinal weights)
@@ -381,6 +386,206 @@ namespace MRegFuse{
     return energy;
   }
 
+  /**
+   * Repair mode: only the free nodes of the mask (value 1) are re-optimized. All other nodes are clamped to the
+   * current solution, their pairwise terms with free nodes become unary terms of the free nodes. Each connected
+   * component of free nodes is then an independent sub-problem, and the components are solved in parallel.
+   * The cost is proportional to the masked area instead of the whole control grid.
+   * Returns the energy of the resulting labelling on the whole control grid, so it can be compared with solve().
+   */
+  double solveLocally(){
+    if (m_mask.IsNull()){
+      return solve();
+    }
+    if (m_mask->GetLargestPossibleRegion().GetSize()!=m_gridImage->GetLargestPossibleRegion().GetSize())
+      m_mask=FilterUtils<ImageType>::NNResample(m_mask,1.0/m_gridSpacing,false);
+    FloatImagePointerType anisoSmoothingWeights;
+    if (m_anisotropicSmoothing){
+      m_smoothingEstimator.finalize();
+      anisoSmoothingWeights=m_smoothingEstimator.getMean();
+    }
+
+    //connected components of free nodes, using the neighborhood of the pairwise terms
+    SizeType size=m_gridImage->GetLargestPossibleRegion().GetSize();
+    long int nNodes=m_gridImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    const PixelType * mask=m_mask->GetBufferPointer();
+    long int strides[D];
+    strides[0]=1;
+    for (int d=1;d<D;++d) strides[d]=strides[d-1]*size[d-1];
+    std::vector<int> component(nNodes,-1);
+    std::vector<std::vector<long int> > components;
+    for (long int i=0;i<nNodes;++i){
+      if (mask[i]!=1 || component[i]>=0)
+	continue;
+      int c=components.size();
+      components.push_back(std::vector<long int>(1,i));
+      component[i]=c;
+      for (unsigned int n=0;n<components[c].size();++n){
+	long int node=components[c][n];
+	for (int d=0;d<D;++d){
+	  long int coord=(node/strides[d])%size[d];
+	  for (int dir=-1;dir<=1;dir+=2){
+	    if (coord+dir<0 || coord+dir>=(long int)size[d])
+	      continue;
+	    long int neighbor=node+dir*strides[d];
+	    if (mask[neighbor]==1 && component[neighbor]<0){
+	      component[neighbor]=c;
+	      components[c].push_back(neighbor);
+	    }
+	  }
+	}
+      }
+    }
+    long int nComponents=components.size();
+    long int nFree=0;
+    for (long int c=0;c<nComponents;++c) nFree+=components[c].size();
+    LOGV(2)<<"Re-solving "<<nFree<<" of "<<nNodes<<" control points in "<<nComponents<<" independent components"<<endl;
+
+    std::vector<double> energies(nComponents,0.0),lowerBounds(nComponents,0.0);
+#pragma omp parallel for schedule(dynamic)
+    for (long int c=0;c<nComponents;++c){
+      solveComponent(components[c],component,c,anisoSmoothingWeights,energies[c],lowerBounds[c]);
+    }
+    double componentEnergy=0.0,componentLowerBound=0.0;
+    for (long int c=0;c<nComponents;++c){
+      componentEnergy+=energies[c];
+      componentLowerBound+=lowerBounds[c];
+    }
+    //the terms between clamped nodes are constant, so they shift energy and lower bound of the sub-problems alike
+    double energy=computeEnergy(anisoSmoothingWeights);
+    double lowerBound=componentLowerBound+energy-componentEnergy;
+    LOGV(2)<<"Resulting energy is "<<energy<<" with lower bound "<<lowerBound<<", "<<componentEnergy<<" of it in the re-solved components"<<std::endl;
+    m_relativeLB=energy!=0.0?lowerBound/energy:1.0;
+    return energy;
+  }
+
+  private:
+  ///pairwise cost of label1 at idx and label2 at its grid neighbor neighborIndex, as in solve()
+  inline double pairwisePotential(const IndexType & idx, int label1, const IndexType & neighborIndex, int label2, double normalizer){
+    PointType point,neighborPoint;
+    m_gridImage->TransformIndexToPhysicalPoint(idx,point);
+    m_gridImage->TransformIndexToPhysicalPoint(neighborIndex,neighborPoint);
+    double distanceNormalizer=(point-neighborPoint).GetNorm();
+    DeformationType displacementDifference=m_lowResDeformations[label1]->GetPixel(idx)-m_lowResDeformations[label2]->GetPixel(neighborIndex);
+    double weight=(1.0-m_alpha)*(displacementDifference.GetSquaredNorm()/(distanceNormalizer)) + (m_alpha)*(label1!=label2);
+    if (normalizer>0){
+      weight=(weight*distanceNormalizer- (normalizer*normalizer));
+      weight*=weight;
+    }
+    return m_pairwiseWeight*weight;
+  }
+
+  ///energy of the current labels on the whole control grid, with the unary and pairwise terms of solve() without mask
+  double computeEnergy(FloatImagePointerType anisoSmoothingWeights){
+    double energy=0.0;
+    itk::ImageRegionConstIteratorWithIndex<ImageType> labelIt(m_labelImage,m_labelImage->GetLargestPossibleRegion());
+    for (labelIt.GoToBegin();!labelIt.IsAtEnd();++labelIt){
+      IndexType idx=labelIt.GetIndex();
+      int label=labelIt.Get();
+      energy+=1.0-(m_lowResLocalWeights[label]->GetPixel(idx));
+      double normalizer=anisoSmoothingWeights.IsNotNull()?anisoSmoothingWeights->GetPixel(idx):-1.0;
+      for (int d=0;d<D;++d){
+	OffsetType off;
+	off.Fill(0);
+	off[d]=1;
+	IndexType neighborIndex=idx+off;
+	if (!m_gridImage->GetLargestPossibleRegion().IsInside(neighborIndex))
+	  continue;
+	energy+=pairwisePotential(idx,label,neighborIndex,m_labelImage->GetPixel(neighborIndex),normalizer);
+      }
+    }
+    return energy;
+  }
+
+  IndexType getIndex(long int i){
+    IndexType idx;
+    SizeType size=m_gridImage->GetLargestPossibleRegion().GetSize();
+    for (int d=0;d<D;++d){
+      idx[d]=i%size[d];
+      i/=size[d];
+    }
+    return idx;
+  }
+
+  ///solve the sub-problem of one connected component of free nodes and store its labels in the current solution
+  void solveComponent(const std::vector<long int> & nodes, const std::vector<int> & component, int c, FloatImagePointerType anisoSmoothingWeights,
+		      double & energyResult, double & lowerBoundResult){
+    int nRegLabels=m_count;
+    SizeType size=m_gridImage->GetLargestPossibleRegion().GetSize();
+    MRFType optimizer(TRWType::GlobalSize());
+    std::map<long int,NodeType> nodeIds;
+    TRWType::REAL D1[nRegLabels];
+    for (unsigned int n=0;n<nodes.size();++n){
+      IndexType idx=getIndex(nodes[n]);
+      for (int l1=0;l1<nRegLabels;++l1){
+	D1[l1]=1.0-(m_lowResLocalWeights[l1]->GetPixel(idx));
+      }
+      //clamped neighbors, the edge is oriented from the node with the smaller index as in solve()
+      for (int d=0;d<D;++d){
+	for (int dir=-1;dir<=1;dir+=2){
+	  OffsetType off;
+	  off.Fill(0);
+	  off[d]=dir;
+	  IndexType neighborIndex=idx+off;
+	  if (!m_gridImage->GetLargestPossibleRegion().IsInside(neighborIndex))
+	    continue;
+	  bool buff;
+	  if (component[ImageUtils<ImageType>::ImageIndexToLinearIndex(neighborIndex,size,buff)]==c)
+	    continue;
+	  int fixedLabel=m_labelImage->GetPixel(neighborIndex);
+	  const IndexType & first=dir>0?idx:neighborIndex;
+	  double normalizer=anisoSmoothingWeights.IsNotNull()?anisoSmoothingWeights->GetPixel(first):-1.0;
+	  for (int l1=0;l1<nRegLabels;++l1){
+	    D1[l1]+=dir>0?pairwisePotential(idx,l1,neighborIndex,fixedLabel,normalizer):pairwisePotential(neighborIndex,fixedLabel,idx,l1,normalizer);
+	  }
+	}
+      }
+      nodeIds[nodes[n]]=optimizer.AddNode(TRWType::LocalSize(nRegLabels), TRWType::NodeData(D1));
+    }
+    TRWType::REAL Vreg[nRegLabels*nRegLabels];
+    for (unsigned int n=0;n<nodes.size();++n){
+      IndexType idx=getIndex(nodes[n]);
+      double normalizer=anisoSmoothingWeights.IsNotNull()?anisoSmoothingWeights->GetPixel(idx):-1.0;
+      for (int d=0;d<D;++d){
+	OffsetType off;
+	off.Fill(0);
+	off[d]=1;
+	IndexType neighborIndex=idx+off;
+	if (!m_gridImage->GetLargestPossibleRegion().IsInside(neighborIndex))
+	  continue;
+	bool buff;
+	long int neighbor=ImageUtils<ImageType>::ImageIndexToLinearIndex(neighborIndex,size,buff);
+	if (component[neighbor]!=c)
+	  continue;
+	for (int l1=0;l1<nRegLabels;++l1){
+	  for (int l2=0;l2<nRegLabels;++l2){
+	    Vreg[l1+l2*nRegLabels]=pairwisePotential(idx,l1,neighborIndex,l2,normalizer);
+	  }
+	}
+	optimizer.AddEdge(nodeIds[nodes[n]], nodeIds[neighbor], TRWType::EdgeData(TRWType::GENERAL,Vreg));
+      }
+    }
+
+    MRFEnergy<TRWType>::Options options;
+    options.m_iterMax = 1000;
+    //components are solved concurrently, do not print
+    options.m_printMinIter=options.m_iterMax+1;
+    options.m_eps=1e-7;
+    TRWType::REAL energy=-1, lowerBound=-1;
+    optimizer.Minimize_TRW_S(options, lowerBound, energy);
+    energyResult=energy;
+    lowerBoundResult=lowerBound;
+    //components are disjoint and clamped neighbors are never written, so the results can be stored concurrently
+    for (unsigned int n=0;n<nodes.size();++n){
+      IndexType idx=getIndex(nodes[n]);
+      int label=optimizer.GetSolution(nodeIds[nodes[n]]);
+      m_lowResResult->SetPixel(idx,m_lowResDeformations[label]->GetPixel(idx));
+      m_labelImage->SetPixel(idx,label);
+    }
+  }
+
+  public:
+
   DeformationFieldPointerType getMean(){
     m_result=TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage);
     return m_result;
@@ -411,22 +616,22 @@ namespace MRegFuse{
     LOGI(3,ImageUtils<FloatImageType>::writeImage("resampledDilationRadii.nii",localDilationRadii));
 
     for (;iter<maxIter;++iter){
-          
-      FloatImagePointerType jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(m_lowResResult);
-      minJac=FilterUtils<FloatImageType>::getMin(jacDets);
+      //fold mask, minimum and folded fraction of the jacobian determinants in one pass
+      typename TransfUtils<ImageType,float,double,double>::JacobianStatistics jacStats;
+      ImagePointerType foldMask=TransfUtils<ImageType,float,double,double>::getFoldMask(m_lowResResult,mmJac,true,&jacStats);
+      minJac=jacStats.minJac;
       if (minJac>0.0){
 	LOGV(2)<<"MinJac of coarse test was positive ("<<minJac<<"); now testing high resolution deformation.."<<endl;
-	jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage));
-	LOGI(3,ImageUtils<ImageType>::writeImage("highResNegJac.nii",FilterUtils<FloatImageType,ImageType>::binaryThresholdingHigh(jacDets,0.0)));
-	minJac=FilterUtils<FloatImageType>::getMin(jacDets);
-	if (jacDets->GetSpacing()!=m_gridImage->GetSpacing()){
-	  jacDets=FilterUtils<FloatImageType>::minimumResample(jacDets,m_gridImage,m_gridImage->GetSpacing()[0]/jacDets->GetSpacing()[0]);
+	foldMask=TransfUtils<ImageType,float,double,double>::getFoldMask(TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage),mmJac,true,&jacStats);
+	LOGI(3,ImageUtils<ImageType>::writeImage("highResNegJac.nii",foldMask));
+	minJac=jacStats.minJac;
+	if (foldMask->GetSpacing()!=m_gridImage->GetSpacing()){
+	  //a grid pixel is folded if any high resolution pixel in its neighborhood is
+	  foldMask=FilterUtils<ImageType>::maximumResample(foldMask,FilterUtils<FloatImageType,ImageType>::cast(m_gridImage),m_gridImage->GetSpacing()[0]/foldMask->GetSpacing()[0]);
 	}
       }
            
-      double negJacFrac=FilterUtils<FloatImageType>::sum(FilterUtils<FloatImageType>::binaryThresholdingHigh(jacDets,0.0));
-            
-      negJacFrac/=jacDets->GetLargestPossibleRegion().GetNumberOfPixels();
+      double negJacFrac=jacStats.foldedFraction();
       LOGV(2)<<VAR(iter)<<" "<<VAR(minJac)<<" "<<VAR(negJacFrac)<<endl;
          
 
@@ -436,8 +641,7 @@ namespace MRegFuse{
 	break;
       if (useJacMask){
 	int sumPixels=0;
-	//ImagePointerType mask= FilterUtils<FloatImageType,ImageType>::cast(FilterUtils<FloatImageType>::binaryThresholdingHigh(jacDets,mmJac));
-	ImagePointerType mask= FilterUtils<FloatImageType,ImageType>::myBinaryThresholdingHigh(jacDets,mmJac);
+	ImagePointerType mask=foldMask;
 
 	if (mask->GetLargestPossibleRegion().GetSize()!=m_gridImage->GetLargestPossibleRegion().GetSize()){
 	  LOG<<"SHOULD NOT HAPPEN!"<<endl;
@@ -474,7 +678,7 @@ namespace MRegFuse{
 	setMask(mask);
                                                         
       }
-      energy=solve();
+      energy=m_localRepair?solveLocally():solve();
       m_pairwiseWeight*=increaseSmoothing;
                     
     }
@@ -515,12 +719,15 @@ namespace MRegFuse{
       }
 
     } 
+    //dilation radius per component label, all components are dilated in one pass
+    std::vector<double> radii(nComponents+1,0.0);
     for (int c=0;c<nComponents;++c){
       if (maxSigmaPerComp[c]<1) maxSigmaPerComp[c]=16;
       double dilation=max(1.0,ceil(maxSigmaPerComp[c]/m_gridSpacings[0]));
       LOGV(3)<<VAR(c)<<" "<<VAR(maxSigmaPerComp[c])<<" "<<VAR(dilation)<<endl;
-      components=FilterUtils<ImageType>::dilation(components,dilation,c+1);
+      radii[c+1]=dilation;
     }
+    components=FilterUtils<ImageType>::variableRadiusDilation(components,radii);
     return FilterUtils<ImageType>::binaryThresholdingLow(components,1);
         
 
@@ -537,25 +744,19 @@ namespace MRegFuse{
       setMask(mask);
     }
     for (;iter<maxIter;++iter){
-      //FloatImagePointerType jacDets=TransfUtils<ImageType>::getJacDets(m_lowResResult);
-         
-      FloatImagePointerType jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(m_lowResResult);
-      minJac=FilterUtils<FloatImageType>::getMin(jacDets);
-      //bool lowResNegJacTest=(FilterUtils<FloatImageType>::getMin(TransfUtils<ImageType>::getJacDets(m_lowResResult))<=0);
+      //minimum and folded fraction of the jacobian determinants in one pass, the determinant image is only needed for the mask
+      DeformationFieldPointerType testedDeformation=m_lowResResult;
+      typename TransfUtils<ImageType,float,double,double>::JacobianStatistics jacStats=TransfUtils<ImageType,float,double,double>::getJacDetStatistics(testedDeformation,0,0.0,2.0,NULL,NULL,mmJac);
+      minJac=jacStats.minJac;
       if (minJac>0.0){
-	//            LOGV(3)<<VAR(lowResNegJacTest)<<" "<<(minJac<=0)<<endl;
 	LOGV(2)<<"MinJac of coarse test was positive ("<<minJac<<"); now testing high resolution deformation.."<<endl;
-	jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage));
-	LOGI(3,ImageUtils<ImageType>::writeImage("highResNegJac.nii",FilterUtils<FloatImageType,ImageType>::binaryThresholdingHigh(jacDets,0.0)));
-	minJac=FilterUtils<FloatImageType>::getMin(jacDets);
-	if (jacDets->GetSpacing()!=m_gridImage->GetSpacing()){
-	  jacDets=FilterUtils<FloatImageType>::minimumResample(jacDets,m_gridImage,m_gridImage->GetSpacing()[0]/jacDets->GetSpacing()[0]);
-	}
+	testedDeformation=TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage);
+	LOGI(3,ImageUtils<ImageType>::writeImage("highResNegJac.nii",TransfUtils<ImageType,float,double,double>::getFoldMask(testedDeformation,mmJac)));
+	jacStats=TransfUtils<ImageType,float,double,double>::getJacDetStatistics(testedDeformation,0,0.0,2.0,NULL,NULL,mmJac);
+	minJac=jacStats.minJac;
       }
            
-      double negJacFrac=FilterUtils<FloatImageType>::sum(FilterUtils<FloatImageType>::binaryThresholdingHigh(jacDets,0.0));
-            
-      negJacFrac/=jacDets->GetLargestPossibleRegion().GetNumberOfPixels();
+      double negJacFrac=jacStats.foldedFraction();
       LOGV(2)<<VAR(iter)<<" "<<VAR(minJac)<<" "<<VAR(negJacFrac)<<endl;
          
 
@@ -565,7 +766,10 @@ namespace MRegFuse{
 	break;
       if (useJacMask){
 	int sumPixels=0;
-	//ImagePointerType mask= FilterUtils<FloatImageType,ImageType>::cast(FilterUtils<FloatImageType>::binaryThresholdingHigh(jacDets,mmJac));
+	FloatImagePointerType jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(testedDeformation);
+	if (jacDets->GetSpacing()!=m_gridImage->GetSpacing()){
+	  jacDets=FilterUtils<FloatImageType>::minimumResample(jacDets,m_gridImage,m_gridImage->GetSpacing()[0]/jacDets->GetSpacing()[0]);
+	}
 	ImagePointerType mask= FilterUtils<FloatImageType,ImageType>::myBinaryThresholdingHigh(jacDets,mmJac);
 
 	if (mask->GetLargestPossibleRegion().GetSize()!=m_gridImage->GetLargestPossibleRegion().GetSize()){
@@ -606,7 +810,7 @@ namespace MRegFuse{
 	setMask(mask);
                                                         
       }
-      energy=solve();
+      energy=m_localRepair?solveLocally():solve();
       m_pairwiseWeight*=increaseSmoothing;
                     
     }
@@ -648,12 +852,14 @@ namespace MRegFuse{
 
     }
      
+    std::vector<double> radii(nComponents+1,0.0);
     for (int c=0;c<nComponents;++c){
       double dilation=max(1.0,min(50.0,fabs(dilateFactor*minJacPerComp[c]/mask->GetSpacing()[0])));
       LOGV(3)<<VAR(c)<<" "<<VAR(minJacPerComp[c])<<" "<<VAR(dilation)<<endl;
-      if (dilation>0.0)
-	components=FilterUtils<ImageType>::dilation(components,dilation,c+1);
+      //dilation() takes whole pixels
+      radii[c+1]=floor(dilation);
     }
+    components=FilterUtils<ImageType>::variableRadiusDilation(components,radii);
     return FilterUtils<ImageType>::binaryThresholdingLow(components,1);
         
 
@@ -20,6 +20,7 @@
 #include "itkImageRegionIterator.h"
 #include "TransformationUtils.h"
 #include "ImageUtils.h"
+#include "ImageListLoader.h"
 #include "FilterUtils.hpp"
 #include <sstream>
 #include <string>
@@ -114,6 +115,7 @@ namespace MRegFuse{
       int nKernels=20;
       double smoothIncrease=1.2;
       bool useMaskForSSR=false;
+      bool localRepair=false;
       //as->parameter ("A",atlasSegmentationFileList , "list of atlas segmentations <id> <file>", true);
       as->option ("MRF", estimateMRF, "use MRF fusion");
       as->option ("mean", estimateMean, "use (local) mean fusion. Can be used in addition to MRF or stand-alone.");
@@ -140,6 +142,7 @@ namespace MRegFuse{
       as->parameter ("refineSeamIter", refineSeamIter,"refine MRF solution at seams by smoothing the result and fusing it with the original solution.",false);
       as->parameter ("smoothIncrease", smoothIncrease,"factor to increase smoothing with per iteration for SSR.",false);
       as->option ("useMask", useMaskForSSR,"only update pixels with negative jac dets (or in the vincinity of those) when using SSR.");
+      as->option ("localRepair", localRepair,"with -useMask, re-solve only the masked control points, each connected component separately and in parallel.");
       as->parameter ("O", outputDir,"outputdirectory (will be created + no overwrite checks!)",false);
       as->parameter ("maxHops", maxHops,"maximum number of hops",false);
       as->parameter ("alpha", alpha,"pairwise balancing weight (deformation (alpha=0) vs label smoothness (alpha=1))",false);
@@ -230,8 +233,14 @@ namespace MRegFuse{
       estimator.setAnisoSmoothing(anisoSmoothing);
       GaussianEstimatorVectorImage<ImageType,double> meanEstimator;
       DeformationFieldPointerType result;
+      //decompress the next few deformations in the background while the current one is processed, each is released once it has been added
+      ImageListLoader<DeformationFieldType> deformationLoader;
       for (int i=0;i<nDeformations;++i){
-	DeformationFieldPointerType def=ImageUtils<DeformationFieldType>::readImage(inputDeformationFilenameList[i]);
+	deformationLoader.add(inputDeformationFilenameList[i]);
+      }
+      deformationLoader.start();
+      for (int i=0;i<nDeformations;++i){
+	DeformationFieldPointerType def=deformationLoader.get(i);
 	FloatImagePointerType weightImage=addImage(weightingName,metric,estimator,meanEstimator,targetImage,sourceImage,def,estimateMean,estimateMRF,radius,m_gamma);
 	if (weightImage.IsNotNull() && outputDir!=""){
 	  ostringstream oss;
@@ -290,6 +299,7 @@ namespace MRegFuse{
 	    seamEstimator.setGridSpacing(controlGridSpacingFactor);
 	    seamEstimator.setHardConstraints(useHardConstraints);
 	    seamEstimator.setAnisoSmoothing(false);
+	    seamEstimator.setLocalRepair(localRepair && useMaskForSSR);
 	    //seamEstimator.setAlpha(pow(2.0,1.0*iter)*alpha);
  
 	    //hacky shit to avoid oversmoothing
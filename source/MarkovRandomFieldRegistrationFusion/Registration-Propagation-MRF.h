@@ -39,6 +39,7 @@
 #include "MRFRegistrationFuser.h"
 #include <itkDisplacementFieldJacobianDeterminantFilter.h>
 #include "SegmentationMapper.hxx"
+#include "DerivedImageCache.h"
 
 
 namespace MRegFuse{
@@ -81,6 +82,8 @@ public:
 protected:
     double m_gamma;
     RadiusType m_patchRadius;
+    ///local metric images, reused across runs for identical warped images and targets
+    DerivedImageCache m_cache;
 public:
     int run(int argc, char ** argv){
         feraiseexcept(FE_INVALID|FE_DIVBYZERO|FE_OVERFLOW);
@@ -106,7 +109,10 @@ public:
         int nKernels=20;
         int refineSeamIter=0;
         double smoothIncrease=1.2;
+        string cacheDirectory="";
+        double cacheSizeMB=0;
         bool useMaskForSSR=false;
+        bool localRepair=false;
         //as->parameter ("A",atlasSegmentationFileList , "list of atlas segmentations <id> <file>", true);
         as->option ("MRF", estimateMRF, "use MRF fusion");
         as->option ("mean", estimateMean, "use (local) mean fusion. Can be used in addition to MRF or stand-alone.");
@@ -136,8 +142,11 @@ public:
         as->parameter ("refineSeamIter", refineSeamIter,"refine MRF solution at seams by smoothing the result and fusing it with the original solution.",false);
         as->parameter ("smoothIncrease", smoothIncrease,"factor to increase smoothing with per iteration for SSR.",false);
         as->option ("useMask", useMaskForSSR,"only update pixels with negative jac dets (or in the vincinity of those) when using SSR.");
+        as->option ("localRepair", localRepair,"with -useMask, re-solve only the masked control points, each connected component separately and in parallel.");
         //        as->option ("graphCut", graphCut,"use graph cuts to generate final segmentations instead of locally maximizing");
         //as->parameter ("smoothness", smoothness,"smoothness parameter of graph cut optimizer",false);
+        as->parameter ("cache", cacheDirectory,"directory for caching local metric images across runs, keyed by image content",false);
+        as->parameter ("cacheSize", cacheSizeMB,"maximal size of the cache directory in MB, least recently used entries are removed first (0=unlimited)",false);
         as->parameter ("verbose", verbose,"get verbose output",false);
         as->help();
         as->parse();
@@ -148,6 +157,7 @@ public:
             //estimateMRF=true;
         }
         LOG<<VAR(estimateMRF)<<" "<<VAR(estimateMean)<<endl;
+        m_cache.setDirectory(cacheDirectory,cacheSizeMB);
         for (unsigned int i = 0; i < ImageType::ImageDimension; ++i) m_patchRadius[i] = radius;
 
         if (dontCacheDeformations)
@@ -433,6 +443,7 @@ public:
                                     seamEstimator.setGridSpacing(controlGridSpacingFactor);
                                     seamEstimator.setHardConstraints(useHardConstraints);
                                     seamEstimator.setAnisoSmoothing(false);
+                                    seamEstimator.setLocalRepair(localRepair && useMaskForSSR);
                                     //seamEstimator.setAlpha(pow(2.0,1.0*iter)*alpha);
                                     
                                     //hacky shit to avoid oversmoothing
@@ -699,25 +710,39 @@ protected:
         return result;
     }        
   
+    ///local similarity of the warped source and the target, from the cache if it was computed before
+    FloatImagePointerType localMetric(MetricType metric, ImagePointerType warpedSourceImage, ImagePointerType targetImage, double radius, double m_gamma){
+        FloatImagePointerType metricImage;
+        DerivedImageCache::Key key("localMetric");
+        if (m_cache.enabled()){
+            key.input(warpedSourceImage).input(targetImage).param("metric",metric).param("radius",radius).param("gamma",m_gamma);
+            metricImage=m_cache.get<FloatImageType>(key);
+            if (metricImage.IsNotNull()) return metricImage;
+        }
+        switch(metric){
+        case NCC:
+            metricImage=Metrics<ImageType,FloatImageType>::efficientLNCC(warpedSourceImage,targetImage,radius,m_gamma);
+            break;
+        case MSD:
+            metricImage=Metrics<ImageType,FloatImageType>::LSSDNorm(warpedSourceImage,targetImage,radius,m_gamma);
+            break;
+        case MAD:
+            metricImage=Metrics<ImageType,FloatImageType>::LSADNorm(warpedSourceImage,targetImage,radius,m_gamma);
+            break;
+        default:
+            metricImage=Metrics<ImageType,FloatImageType>::efficientLNCC(warpedSourceImage,targetImage,radius,m_gamma);
+        }
+        m_cache.put<FloatImageType>(key,metricImage);
+        return metricImage;
+    }
+
     FloatImagePointerType addImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  GaussianEstimatorVectorImage<ImageType,double> & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
         FloatImagePointerType metricImage;
 
         if (weighting=="global" || weighting=="local" || weighting=="globallocal"){
             ImagePointerType warpedSourceImage=TransfUtils<ImageType>::warpImage(sourceImage,def);
             if (weighting=="local" || weighting=="globallocal"){
-                switch(metric){
-                case NCC:
-                    metricImage=Metrics<ImageType,FloatImageType>::efficientLNCC(warpedSourceImage,targetImage,radius,m_gamma);
-                    break;
-                case MSD:
-                    metricImage=Metrics<ImageType,FloatImageType>::LSSDNorm(warpedSourceImage,targetImage,radius,m_gamma);
-                    break;
-                case MAD:
-                    metricImage=Metrics<ImageType,FloatImageType>::LSADNorm(warpedSourceImage,targetImage,radius,m_gamma);
-                    break;
-                default:
-                    metricImage=Metrics<ImageType,FloatImageType>::efficientLNCC(warpedSourceImage,targetImage,radius,m_gamma);
-                }
+                metricImage=localMetric(metric,warpedSourceImage,targetImage,radius,m_gamma);
             }else{
                 metricImage=FilterUtils<ImageType,FloatImageType>::createEmpty(targetImage);
                 metricImage->FillBuffer(1.0);
@@ -765,19 +790,7 @@ protected:
             ImagePointerType warpedSourceImage=TransfUtils<ImageType>::warpImage(sourceImage,def);
 
             if (weighting=="local" || weighting=="globallocal"){
-                switch(metric){
-                case NCC:
-                    metricImage=Metrics<ImageType,FloatImageType>::efficientLNCC(warpedSourceImage,targetImage,radius,m_gamma);
-                    break;
-                case MSD:
-                    metricImage=Metrics<ImageType,FloatImageType>::LSSDNorm(warpedSourceImage,targetImage,radius,m_gamma);
-                    break;
-                case MAD:
-                    metricImage=Metrics<ImageType,FloatImageType>::LSADNorm(warpedSourceImage,targetImage,radius,m_gamma);
-                    break;
-                default:
-                    metricImage=Metrics<ImageType,FloatImageType>::efficientLNCC(warpedSourceImage,targetImage,radius,m_gamma);
-                }
+                metricImage=localMetric(metric,warpedSourceImage,targetImage,radius,m_gamma);
             }else{
                 metricImage=FilterUtils<ImageType,FloatImageType>::createEmpty(targetImage);
                 metricImage->FillBuffer(1.0);
@@ -0,0 +1,278 @@
+/**
+ * @file   PartitionedGraphCut.h
+ * @author Tobias Gass <tobiasgass@gmail.com>
+ *
+ * @brief  graph cut back-ends for the segmentation network
+ *
+ * BKGraphCut wraps the global Boykov-Kolmogorov max-flow, PartitionedGraphCut solves the
+ * same binary energy by block coordinate descent over node blocks (one block per image).
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "Log.h"
+
+#ifndef WITH_GCO
+#error "GCO library required"
+#else
+#include "graph.h"
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace SSSP{
+
+  /**
+   * \brief common interface of the binary graph cut solvers used by SegmentationNetwork
+   *
+   * Node i in the sink segment (foreground) costs capSource, in the source segment capSink;
+   * an edge with weight w costs w if its end nodes are in different segments.
+   */
+class GraphCutBackend{
+public:
+    virtual ~GraphCutBackend(){}
+    virtual void add_edge(unsigned long int i, unsigned long int j, float w)=0;
+    virtual void add_tweights(unsigned long int i, float capSource, float capSink)=0;
+    virtual double maxflow()=0;
+    ///true if node i is in the sink (foreground) segment
+    virtual bool isSink(unsigned long int i)=0;
+    ///(approximate) memory allocated for the graph in MB
+    virtual double getMemoryMB()=0;
+};
+
+  /**
+   * \brief exact solution using a single BK max-flow graph spanning all nodes
+   */
+class BKGraphCut: public GraphCutBackend{
+public:
+    typedef Graph<float,float,double> MRFType;
+private:
+    MRFType * m_graph;
+    unsigned long int m_nNodes,m_nEdges;
+public:
+    BKGraphCut(unsigned long int nNodes, unsigned long int nEdges){
+        m_nNodes=nNodes;
+        m_nEdges=nEdges;
+        m_graph=new MRFType(nNodes,nEdges);
+        m_graph->add_node(nNodes);
+    }
+    ~BKGraphCut(){
+        delete m_graph;
+    }
+    void add_edge(unsigned long int i, unsigned long int j, float w){
+        m_graph->add_edge(i,j,w,w);
+    }
+    void add_tweights(unsigned long int i, float capSource, float capSink){
+        m_graph->add_tweights(i,capSource,capSink);
+    }
+    double maxflow(){
+        return m_graph->maxflow();
+    }
+    bool isSink(unsigned long int i){
+        return m_graph->what_segment(i)==MRFType::SINK;
+    }
+    double getMemoryMB(){
+        //BK stores ~40 bytes per node and two arcs of ~32 bytes per edge
+        return (40.0*m_nNodes+64.0*m_nEdges)/(1024*1024);
+    }
+};
+
+  /**
+   * \brief block-partitioned solver for very large networks
+   *
+   * Nodes are grouped into contiguous blocks (the pixels of one image). Edges within a block are kept as
+   * a compact list, edges between blocks are stored with both incident blocks. Each sweep solves all
+   * blocks in parallel with exact BK max-flow, treating the labels of the other blocks as fixed
+   * (which turns cross-block edges into unaries). If such a Jacobi sweep does not decrease the energy,
+   * a sequential Gauss-Seidel sweep is done instead, which never increases it. The result is a
+   * block-wise optimum, not necessarily the global minimum found by BKGraphCut.
+   */
+class PartitionedGraphCut: public GraphCutBackend{
+public:
+    typedef Graph<float,float,double> MRFType;
+private:
+    struct LocalEdge{
+        unsigned int i,j;
+        float w;
+    };
+    struct CrossEdge{
+        unsigned int local;
+        unsigned long int other;
+        float w;
+    };
+
+    std::vector<unsigned long int> m_blockStart;
+    std::vector< std::vector<LocalEdge> > m_localEdges;
+    std::vector< std::vector<CrossEdge> > m_crossEdges;
+    std::vector<float> m_costSink,m_costSource;
+    std::vector<unsigned char> m_labels;
+    int m_maxSweeps;
+
+public:
+    PartitionedGraphCut(){
+        m_blockStart.push_back(0);
+        m_maxSweeps=20;
+    }
+    void setMaxSweeps(int s){m_maxSweeps=s;}
+
+    ///append a block of nNodes nodes, returns the global index of its first node
+    unsigned long int addBlock(unsigned long int nNodes){
+        unsigned long int start=m_blockStart.back();
+        m_blockStart.push_back(start+nNodes);
+        m_localEdges.push_back(std::vector<LocalEdge>());
+        m_crossEdges.push_back(std::vector<CrossEdge>());
+        m_costSink.resize(start+nNodes,0.0);
+        m_costSource.resize(start+nNodes,0.0);
+        m_labels.resize(start+nNodes,0);
+        return start;
+    }
+    int nBlocks(){return m_blockStart.size()-1;}
+    unsigned long int nNodes(){return m_blockStart.back();}
+
+    void add_edge(unsigned long int i, unsigned long int j, float w){
+        int bi=getBlock(i),bj=getBlock(j);
+        if (bi==bj){
+            LocalEdge e;
+            e.i=i-m_blockStart[bi];
+            e.j=j-m_blockStart[bi];
+            e.w=w;
+            m_localEdges[bi].push_back(e);
+        }else{
+            CrossEdge e;
+            e.w=w;
+            e.local=i-m_blockStart[bi];
+            e.other=j;
+            m_crossEdges[bi].push_back(e);
+            e.local=j-m_blockStart[bj];
+            e.other=i;
+            m_crossEdges[bj].push_back(e);
+        }
+    }
+    void add_tweights(unsigned long int i, float capSource, float capSink){
+        m_costSink[i]+=capSource;
+        m_costSource[i]+=capSink;
+    }
+    bool isSink(unsigned long int i){
+        return m_labels[i];
+    }
+    double getMemoryMB(){
+        double bytes=(2.0*sizeof(float)+sizeof(unsigned char))*nNodes();
+        for (int b=0;b<nBlocks();++b){
+            bytes+=1.0*sizeof(LocalEdge)*m_localEdges[b].capacity();
+            bytes+=1.0*sizeof(CrossEdge)*m_crossEdges[b].capacity();
+        }
+        return bytes/(1024*1024);
+    }
+
+    double maxflow(){
+        int nB=nBlocks();
+        unsigned long int n=nNodes();
+#ifdef _OPENMP
+        LOGV(1)<<"Solving "<<nB<<" blocks with "<<omp_get_max_threads()<<" threads"<<std::endl;
+#endif
+        //initialize with the labelling minimizing the unaries
+        for (unsigned long int i=0;i<n;++i){
+            m_labels[i]=m_costSink[i]<m_costSource[i];
+        }
+        double energy=computeEnergy(m_labels);
+        LOG<<"Initial energy "<<energy<<std::endl;
+        std::vector<unsigned char> newLabels(n);
+        for (int sweep=0;sweep<m_maxSweeps;++sweep){
+            //Jacobi sweep: all blocks in parallel, conditioned on the previous labelling
+#pragma omp parallel for schedule(dynamic)
+            for (int b=0;b<nB;++b){
+                solveBlock(b,m_labels,newLabels);
+            }
+            double newEnergy=computeEnergy(newLabels);
+            std::string mode="parallel";
+            if (newEnergy>=energy){
+                //Gauss-Seidel sweep, each block sees the updated labels of its predecessors
+                mode="sequential";
+                newLabels=m_labels;
+                for (int b=0;b<nB;++b){
+                    solveBlock(b,newLabels,newLabels);
+                }
+                newEnergy=computeEnergy(newLabels);
+            }
+            unsigned long int nChanged=0;
+            for (unsigned long int i=0;i<n;++i){
+                nChanged+=(newLabels[i]!=m_labels[i]);
+            }
+            LOG<<"Sweep "<<sweep<<" ("<<mode<<"): "<<VAR(newEnergy)<<" "<<VAR(nChanged)<<std::endl;
+            if (newEnergy>energy){
+                break;
+            }
+            m_labels.swap(newLabels);
+            energy=newEnergy;
+            if (!nChanged){
+                break;
+            }
+        }
+        return energy;
+    }
+
+private:
+    int getBlock(unsigned long int i){
+        return std::upper_bound(m_blockStart.begin(),m_blockStart.end(),i)-m_blockStart.begin()-1;
+    }
+
+    ///exactly minimize the energy of block b with all other nodes fixed to labels.
+    ///the result is written to the block's range in result, which may be the same vector as labels.
+    void solveBlock(int b, const std::vector<unsigned char> & labels, std::vector<unsigned char> & result){
+        unsigned long int start=m_blockStart[b];
+        unsigned int nb=m_blockStart[b+1]-start;
+        std::vector<float> extSink(nb,0.0),extSource(nb,0.0);
+        const std::vector<CrossEdge> & crossEdges=m_crossEdges[b];
+        for (unsigned long int e=0;e<crossEdges.size();++e){
+            if (labels[crossEdges[e].other])
+                extSource[crossEdges[e].local]+=crossEdges[e].w;
+            else
+                extSink[crossEdges[e].local]+=crossEdges[e].w;
+        }
+        const std::vector<LocalEdge> & localEdges=m_localEdges[b];
+        MRFType graph(nb,localEdges.size());
+        graph.add_node(nb);
+        for (unsigned int i=0;i<nb;++i){
+            graph.add_tweights(i,m_costSink[start+i]+extSink[i],m_costSource[start+i]+extSource[i]);
+        }
+        for (unsigned long int e=0;e<localEdges.size();++e){
+            graph.add_edge(localEdges[e].i,localEdges[e].j,localEdges[e].w,localEdges[e].w);
+        }
+        graph.maxflow();
+        for (unsigned int i=0;i<nb;++i){
+            result[start+i]=(graph.what_segment(i)==MRFType::SINK);
+        }
+    }
+
+    double computeEnergy(const std::vector<unsigned char> & labels){
+        double energy=0.0;
+        int nB=nBlocks();
+#pragma omp parallel for schedule(dynamic) reduction(+:energy)
+        for (int b=0;b<nB;++b){
+            unsigned long int start=m_blockStart[b];
+            double blockEnergy=0.0;
+            for (unsigned long int i=start;i<m_blockStart[b+1];++i){
+                blockEnergy+=labels[i]?m_costSink[i]:m_costSource[i];
+            }
+            const std::vector<LocalEdge> & localEdges=m_localEdges[b];
+            for (unsigned long int e=0;e<localEdges.size();++e){
+                if (labels[start+localEdges[e].i]!=labels[start+localEdges[e].j])
+                    blockEnergy+=localEdges[e].w;
+            }
+            //cross edges are stored twice
+            const std::vector<CrossEdge> & crossEdges=m_crossEdges[b];
+            for (unsigned long int e=0;e<crossEdges.size();++e){
+                if (labels[start+crossEdges[e].local]!=labels[crossEdges[e].other])
+                    blockEnergy+=0.5*crossEdges[e].w;
+            }
+            energy+=blockEnergy;
+        }
+        return energy;
+    }
+};
+
+}//namespace
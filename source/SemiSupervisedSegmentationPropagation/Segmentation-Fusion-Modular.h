@@ -39,6 +39,7 @@
 #include "itkLinearInterpolateImageFunction.h"
 #include <itkLabelOverlapMeasuresImageFilter.h>
 #include "Metrics.h"
+#include "ProbabilisticSegmentationFusion.h"
 
 namespace SSSP{
   ///\brief Modular Segmentation Fusion.
@@ -76,12 +77,15 @@ namespace SSSP{
 
 
     typedef std::vector<std::pair<string,ImagePointerType> > ImageListType;
+    typedef ProbabilisticSegmentationFusion<ImageType,ProbabilisticVectorImageType,DeformationFieldType> FusionType;
 
     enum MetricType {NONE,MAD,NCC,MI,NMI,MSD};
     enum WeightingType {UNIFORM,GLOBAL,LOCAL};
   protected:
     double m_sigma;
     RadiusType m_patchRadius;
+    ///local statistics of the last target used for local NCC weighting
+    typename FusionType::TargetStatistics m_targetStatistics;
   public:
     int run(int argc, char ** argv){
       feraiseexcept(FE_INVALID|FE_DIVBYZERO|FE_OVERFLOW);
@@ -254,6 +258,10 @@ namespace SSSP{
 	std::string targetID= targetImageIterator->first;
 	if (atlasSegmentationIDMap->find(targetID)==atlasSegmentationIDMap->end()){ //do not calculate segmentation for atlas images
 	  probabilisticSegmentations[targetID]=createEmptyProbImageFromImage( targetImageIterator->second);
+	  //uniformly weighted atlases are accumulated together in one pass
+	  std::vector<ProbabilisticVectorImagePointerType> uniformAtlases;
+	  std::vector<DeformationFieldPointerType> uniformDeformations;
+	  std::vector<double> uniformWeights;
 	  int atlasN=0;
 	  for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();
 	       atlasIterator!=inputAtlasSegmentations->end() && atlasN<useNAtlases;
@@ -268,7 +276,9 @@ namespace SSSP{
                    
 	      //update
 	      if (weighting==UNIFORM || metric == NONE || (lateFusion && nAtlases==1)){
-		updateProbabilisticSegmentationUniform(probabilisticSegmentations[targetID],probAtlasSegmentation,weight);
+		uniformAtlases.push_back(probAtlasSegmentation);
+		uniformDeformations.push_back(NULL);
+		uniformWeights.push_back(weight);
 	      }else{
 		ImagePointerType targetImage= targetImageIterator->second;
 		ImagePointerType atlasImage=(*atlasImages)[(*atlasIDMap)[atlasID]].second;
@@ -280,6 +290,7 @@ namespace SSSP{
 
 	      }
 	    }
+	  FusionType::accumulateUniform(probabilisticSegmentations[targetID],uniformAtlases,uniformDeformations,uniformWeights);
 	}
            
       }//finished zero-hop segmentation
@@ -619,12 +630,7 @@ namespace SSSP{
 #endif
 
     void updateProbabilisticSegmentationUniform(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight){
-      ProbabilisticVectorImagePointerType deformedIncrement=increment;
-      ProbImageIteratorType accIt(accumulator,accumulator->GetLargestPossibleRegion());
-      ProbImageIteratorType incIt(deformedIncrement,deformedIncrement->GetLargestPossibleRegion());
-      for (accIt.GoToBegin(),incIt.GoToBegin();!incIt.IsAtEnd();++incIt,++accIt){
-	accIt.Set(accIt.Get()+incIt.Get()*globalWeight);
-      }
+      FusionType::accumulateUniform(accumulator,increment,NULL,globalWeight);
     }
 
     void updateProbabilisticSegmentationGlobalMetric(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight, ImagePointerType targetImage, ImagePointerType movingImage,MetricType metric ){
@@ -683,6 +689,14 @@ namespace SSSP{
 
     
     void updateProbabilisticSegmentationLocalMetricNew(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight, ImagePointerType targetImage, ImagePointerType movingImage,MetricType metric ){
+      if (metric==NCC){
+	//weight and accumulate in one pass, target statistics are reused for all atlases
+	if (m_targetStatistics.target!=targetImage){
+	  m_targetStatistics=FusionType::computeTargetStatistics(targetImage,m_patchRadius[0]);
+	}
+	FusionType::accumulateLocalNCC(accumulator,increment,movingImage,NULL,globalWeight,m_targetStatistics,m_sigma);
+	return;
+      }
       ProbabilisticVectorImagePointerType deformedIncrement=increment;
       ProbImageIteratorType accIt(accumulator,accumulator->GetLargestPossibleRegion());
       ProbImageIteratorType incIt(deformedIncrement,deformedIncrement->GetLargestPossibleRegion());
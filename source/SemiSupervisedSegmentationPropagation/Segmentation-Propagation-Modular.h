@@ -47,6 +47,7 @@ public:
 
     typedef typename  TransfUtilsType::DisplacementType DisplacementType; typedef typename  TransfUtilsType::DeformationFieldType DeformationFieldType;
     typedef typename  DeformationFieldType::Pointer DeformationFieldPointerType;
+    typedef ImageListLoader<DeformationFieldType> DeformationLoaderType;
     typedef typename  itk::ImageRegionIterator<ImageType> ImageIteratorType;
     typedef typename  itk::ImageRegionIterator<FloatImageType> FloatImageIteratorType;
     typedef typename  itk::ImageRegionIterator<DeformationFieldType> DeformationIteratorType;
@@ -219,6 +220,9 @@ public:
         map< string, map <string, DeformationFieldPointerType> > deformationCache;
         map< string, map <string, string> > deformationFilenames;
         map<string, map<string, float> > globalWeights;
+        //cached deformations are decompressed in parallel
+        DeformationLoaderType cacheLoader;
+        std::vector<std::pair<std::pair<string,string>,int> > cacheJobs;
         {
             ifstream ifs(deformationFileList.c_str());
 	    LOGV(3)<<"Reading deformation filenames from " << deformationFileList << endl;
@@ -237,7 +241,7 @@ public:
                     }else{
                         if (!dontCacheDeformations){
                             LOGV(3)<<"Reading deformation "<<defFileName<<" for deforming "<<intermediateID<<" to "<<targetID<<endl;
-                            deformationCache[intermediateID][targetID]=ImageUtils<DeformationFieldType>::readImage(defFileName);
+                            cacheJobs.push_back(std::make_pair(std::make_pair(intermediateID,targetID),cacheLoader.add(defFileName)));
                             globalWeights[intermediateID][targetID]=1.0;
                         }else{
                             LOGV(3)<<"Reading filename "<<defFileName<<" for deforming "<<intermediateID<<" to "<<targetID<<endl;
@@ -248,6 +252,9 @@ public:
                 }
             }
         }
+        for (unsigned int j=0;j<cacheJobs.size();++j){
+            deformationCache[cacheJobs[j].first.first][cacheJobs[j].first.second]=cacheLoader.get(cacheJobs[j].second);
+        }
         
         if (weightListFilename!=""){
             ifstream ifs(weightListFilename.c_str());
@@ -294,6 +301,21 @@ public:
                 string bestID;
                 int bestIdx;
                 int j=i;
+                //uncached deformations of this round are read in the background, in the order in which they are used
+                DeformationLoaderType probeLoader;
+                int probeJob=0;
+                if (dontCacheDeformations){
+                    for (ImageListIteratorType targetImageIterator2=targetImageIterator;targetImageIterator2!=targetImages->end();++targetImageIterator2){
+                        string targetID = targetImageIterator2->first;
+                        atlasN=0;
+                        for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();atlasIterator!=inputAtlasSegmentations->end() && (atlasN<useNAtlases);++atlasIterator,++atlasN){
+                            if (atlasIterator->first != targetID){
+                                probeLoader.add(deformationFilenames[atlasIterator->first][targetID]);
+                                probeLoader.add(deformationFilenames[targetID][atlasIterator->first]);
+                            }
+                        }
+                    }
+                }
                 for (ImageListIteratorType targetImageIterator2=targetImageIterator;targetImageIterator2!=targetImages->end();++targetImageIterator2,++j){
                     string targetID = targetImageIterator2->first;
                     LOGV(2)<<"Probing image "<<targetID<<endl;
@@ -311,8 +333,8 @@ public:
                         //todo accumulate atlas segmentations
                         DeformationFieldPointerType firstDeformation,secondDeformation,deformation;
                         if (dontCacheDeformations){
-                            firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
-                            secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[targetID][atlasID]);
+                            firstDeformation = probeLoader.get(probeJob++);
+                            secondDeformation = probeLoader.get(probeJob++);
                         }else{
                             firstDeformation = deformationCache[atlasID][targetID];
                             secondDeformation = deformationCache[targetID][atlasID];
@@ -346,6 +368,15 @@ public:
                 (*targetImages)[bestIdx].first=oldID;
                 (*targetImages)[bestIdx].second=tmp;
                 //update accumulated atlas probabilities
+                DeformationLoaderType updateLoader;
+                int updateJob=0;
+                if (dontCacheDeformations){
+                    int n=0;
+                    for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();atlasIterator!=inputAtlasSegmentations->end() && (n<useNAtlases);++atlasIterator,++n){
+                        updateLoader.add(deformationFilenames[atlasIterator->first][bestID]);
+                        updateLoader.add(deformationFilenames[bestID][atlasIterator->first]);
+                    }
+                }
                 int atlasN=0;
                 for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();atlasIterator!=inputAtlasSegmentations->end() && (atlasN<useNAtlases);++atlasIterator,++atlasN){//iterate over atlases
                     string atlasID = atlasIterator->first;
@@ -354,8 +385,8 @@ public:
                     //todo accumulate atlas segmentations
                     DeformationFieldPointerType firstDeformation,secondDeformation,deformation;
                     if (dontCacheDeformations){
-                        firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
-                        secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[targetID][atlasID]);
+                        firstDeformation = updateLoader.get(updateJob++);
+                        secondDeformation = updateLoader.get(updateJob++);
                     }else{
                         firstDeformation = deformationCache[atlasID][targetID];
                         secondDeformation = deformationCache[targetID][atlasID];
@@ -373,6 +404,19 @@ public:
 
 
         //generate zero-hop target segmentations
+        //uncached deformations are read in the background, in the order in which they are used
+        DeformationLoaderType zeroHopLoader;
+        int zeroHopJob=0;
+        if (dontCacheDeformations){
+            for (ImageListIteratorType targetImageIterator=targetImages->begin();targetImageIterator!=targetImages->end();++targetImageIterator){
+                if (atlasSegmentationIDMap->find(targetImageIterator->first)==atlasSegmentationIDMap->end()){
+                    int atlasN=0;
+                    for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();atlasIterator!=inputAtlasSegmentations->end() && atlasN<useNAtlases;++atlasIterator,++atlasN){
+                        zeroHopLoader.add(deformationFilenames[atlasIterator->first][targetImageIterator->first]);
+                    }
+                }
+            }
+        }
         for (ImageListIteratorType targetImageIterator=targetImages->begin();targetImageIterator!=targetImages->end();++targetImageIterator){                //iterate over targets
             string targetID= targetImageIterator->first;
             if (atlasSegmentationIDMap->find(targetID)==atlasSegmentationIDMap->end()){ //do not calculate segmentation for atlas images
@@ -386,7 +430,7 @@ public:
                         LOGV(4)<<VAR(atlasID)<<" "<<VAR(targetID)<<endl;
                         DeformationFieldPointerType deformation;
                         if (dontCacheDeformations){
-                            deformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
+                            deformation = zeroHopLoader.get(zeroHopJob++);
                         }else{
                             deformation = deformationCache[atlasID][targetID];
                         }
@@ -454,6 +498,31 @@ public:
                 }
             }
             
+            //uncached deformations of this hop are read in the background, in the order in which they are used
+            DeformationLoaderType hopLoader;
+            int hopJob=0;
+            if (dontCacheDeformations){
+                int atlasN=0;
+                for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();atlasIterator!=inputAtlasSegmentations->end() && (atlasN<useNAtlases);++atlasIterator,++atlasN){
+                    string atlasID=atlasIterator->first;
+                    int intermediateN=0;
+                    for (ImageListIteratorType intermediateImageIterator=targetImages->begin();intermediateImageIterator!=targetImages->end() && (intermediateN<useNTargets);++intermediateImageIterator){
+                        string intermediateID= intermediateImageIterator->first;
+                        if ( (intermediateID==atlasID) || (atlasSegmentationIDMap->find(intermediateID) == atlasSegmentationIDMap->end()) ){
+                            ++intermediateN;
+                            if (lateFusion && intermediateID != atlasID){
+                                hopLoader.add(deformationFilenames[atlasID][intermediateID]);
+                            }
+                            for (ImageListIteratorType targetImageIterator=targetImages->begin();targetImageIterator!=targetImages->end();++targetImageIterator){
+                                string targetID= targetImageIterator->first;
+                                if (targetID != atlasID && targetID != intermediateID){
+                                    hopLoader.add(deformationFilenames[intermediateID][targetID]);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
             //update!
             int atlasN=0;
             for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();atlasIterator!=inputAtlasSegmentations->end() && (atlasN<useNAtlases);++atlasIterator,++atlasN){//iterate over atlases
@@ -469,7 +538,7 @@ public:
                             if (intermediateID != atlasID){
                                 if (dontCacheDeformations){
                                     LOGV(3)<<VAR(atlasID)<<" "<<VAR(intermediateID)<<" "<<VAR(deformationFilenames[atlasID][intermediateID])<<endl;
-                                    firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][intermediateID]);
+                                    firstDeformation = hopLoader.get(hopJob++);
                                 }else{
                                     LOGV(3)<<VAR(atlasID)<<" "<<VAR(intermediateID)<<endl;
                                     firstDeformation = deformationCache[atlasID][intermediateID];
@@ -491,7 +560,7 @@ public:
                                     DeformationFieldPointerType secondDeformation,deformation;
                                     if (dontCacheDeformations){
                                         LOGV(3)<<VAR(targetID)<<" "<<VAR(intermediateID)<<" "<<VAR(deformationFilenames[intermediateID][targetID])<<endl<<endl;
-                                        secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[intermediateID][targetID]);
+                                        secondDeformation = hopLoader.get(hopJob++);
                                     }else{
                                         LOGV(3)<<VAR(targetID)<<" "<<VAR(intermediateID)<<endl<<endl;
                                         secondDeformation = deformationCache[intermediateID][targetID];
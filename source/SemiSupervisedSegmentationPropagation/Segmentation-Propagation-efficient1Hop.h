@@ -39,6 +39,8 @@
 #include <itkLabelOverlapMeasuresImageFilter.h>
 #include "Metrics.h"
 #include "SegmentationMapper.hxx"
+#include "ProbabilisticSegmentationFusion.h"
+#include "SparseProbabilisticImage.h"
 
 namespace SSSP{
   /**
@@ -77,12 +79,19 @@ public:
 
 
     typedef std::vector<std::pair<string,ImagePointerType> > ImageListType;
+    typedef ProbabilisticSegmentationFusion<ImageType,ProbabilisticVectorImageType,DeformationFieldType> FusionType;
+    ///long-lived probabilistic segmentations are stored with the 4 most probable labels per voxel
+    typedef SparseProbabilisticImage<ProbabilisticVectorImageType,(nSegmentationLabels<4?nSegmentationLabels:4)> SparseProbType;
+    typedef typename SparseProbType::SparseImageType SparseProbabilisticImageType;
+    typedef typename SparseProbabilisticImageType::Pointer SparseProbabilisticImagePointerType;
 
     enum MetricType {NONE,MAD,NCC,MI,NMI,MSD};
     enum WeightingType {UNIFORM,GLOBAL,LOCAL};
 protected:
     double m_sigma;
     RadiusType m_patchRadius;
+    ///local statistics of the last target used for local NCC weighting
+    typename FusionType::TargetStatistics m_targetStatistics;
 public:
     int run(int argc, char ** argv){
         feraiseexcept(FE_INVALID|FE_DIVBYZERO|FE_OVERFLOW);
@@ -103,6 +112,10 @@ public:
         double globalOneHopWeight=1.0;
         bool AREG= false;
         string singleTarget="";
+        bool reuseIntermediates=false;
+        bool compareExact=false;
+        bool denseIntermediates=false;
+        string intermediateCacheDir="";
         m_sigma=30;
         as->parameter ("A",atlasSegmentationFileList , "list of atlas segmentations <id> <file>", true);
         as->parameter ("T", deformationFileList, " list of deformations", true);
@@ -125,6 +138,10 @@ public:
         as->option ("lateFusion", lateFusion,"fuse segmentations late. maxHops=1");
         as->option ("dontCacheDeformations", dontCacheDeformations,"read deformations only when needed to save memory. higher IO load!");
         as->option ("graphCut", graphCut,"use graph cuts to generate final segmentations instead of locally maximizing");
+        as->option ("reuseIntermediates", reuseIntermediates,"propagate atlases to each intermediate image once and warp the fused intermediate segmentations to the targets, instead of composing atlas->intermediate->target deformations");
+        as->parameter ("intermediateCacheDir", intermediateCacheDir,"store the fused intermediate segmentations of -reuseIntermediates in this directory instead of keeping them in memory",false);
+        as->option ("denseIntermediates", denseIntermediates,"keep all label probabilities of the fused intermediate segmentations of -reuseIntermediates instead of the 4 most probable ones per voxel. needs 4*nLabels bytes per voxel and intermediate image instead of 16");
+        as->option ("compareExact", compareExact,"with -reuseIntermediates, additionally compute the one-hop segmentations by composing deformations and report the differences");
         as->parameter ("smoothness", smoothness,"smoothness parameter of graph cut optimizer",false);
         as->parameter ("verbose", verbose,"get verbose output",false);
         as->help();
@@ -286,14 +303,14 @@ public:
     
         logSetStage("Zero Hop");
         LOG<<"Computing"<<std::endl;
-        map<string,ProbabilisticVectorImagePointerType> probabilisticSegmentations;
+        map<string,SparseProbabilisticImagePointerType> probabilisticSegmentations;
         
         //generate atlas probabilistic segmentations from atlas segmentations
         for (ImageListIteratorType atlasImageIterator=inputAtlasSegmentations->begin();atlasImageIterator!=inputAtlasSegmentations->end();++atlasImageIterator){ 
             //iterate over atlass
             string atlasID = atlasImageIterator->first;
             LOGV(3)<<VAR(atlasID)<<endl;
-            probabilisticSegmentations[atlasID]=segmentationToProbabilisticVector(atlasImageIterator->second);
+            probabilisticSegmentations[atlasID]=SparseProbType::fromSegmentation(atlasImageIterator->second);
         }
 
 
@@ -302,10 +319,14 @@ public:
             LOG<<"Resorting intermediate targets based on ARE-G"<<endl;
             //re-sort target images to yield improving atlas reconstruction error
             int i=0;
+            //the self segmentations are accumulated over the resorting, so they are kept dense to avoid re-encoding them
             map<string,ProbabilisticVectorImagePointerType> probabilisticAtlasSelfSegmentations;
+            //every atlas segmentation is warped once per pair of targets, so it is expanded only once for the resorting
+            map<string,ProbabilisticVectorImagePointerType> expandedAtlasSegmentations;
             int atlasN = 0;
             for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();atlasIterator!=inputAtlasSegmentations->end() && (atlasN<useNAtlases);++atlasIterator,++atlasN){//iterate over atlases
-                probabilisticAtlasSelfSegmentations[atlasIterator->first]=  createEmptyProbImageFromImage(atlasIterator->second);
+                probabilisticAtlasSelfSegmentations[atlasIterator->first]=createEmptyProbImageFromImage(atlasIterator->second);
+                expandedAtlasSegmentations[atlasIterator->first]=SparseProbType::expand(probabilisticSegmentations[atlasIterator->first]);
             }
 
             for (ImageListIteratorType targetImageIterator=targetImages->begin();targetImageIterator!=targetImages->end() && i<useNTargets;++targetImageIterator,++i){
@@ -339,9 +360,8 @@ public:
                             }
                         
                             deformation = TransfUtilsType::composeDeformations(secondDeformation,firstDeformation);
-                            ProbabilisticVectorImagePointerType probSeg=probabilisticSegmentations[atlasID];
                             double weight = 1.0;
-                            updateProbabilisticSegmentationLocalMetricNew(probAtlasSeg,probSeg,weight,targetImageIterator->second,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
+                            updateProbabilisticSegmentationLocalMetricNew(probAtlasSeg,expandedAtlasSegmentations[atlasID],weight,targetImageIterator->second,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
                             ImagePointerType outputImage=probSegmentationToSegmentationLocal(probAtlasSeg);
                             double error=1.0-DICE(outputImage,atlasIterator->second);
                             LOGV(3)<<"Reconstructing "<<atlasID<<" using "<<targetID<<"; dice error: "<<error<<endl;
@@ -381,9 +401,8 @@ public:
                     }
                         
                     deformation = TransfUtilsType::composeDeformations(secondDeformation,firstDeformation);
-                    ProbabilisticVectorImagePointerType probSeg=probabilisticSegmentations[atlasID];
                     double weight = 1.0;
-                    updateProbabilisticSegmentationLocalMetricNew(probabilisticAtlasSelfSegmentations[atlasID],probSeg,weight,tmp,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
+                    updateProbabilisticSegmentationLocalMetricNew(probabilisticAtlasSelfSegmentations[atlasID],expandedAtlasSegmentations[atlasID],weight,tmp,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
                 }
                 
             }
@@ -391,13 +410,159 @@ public:
 #endif
 
 
+        if (reuseIntermediates){
+            //Warping is linear in the probabilities, so the sum over atlases of the atlas segmentations warped via an
+            //intermediate I is the fused segmentation of I warped to the target. The fused segmentation of I is
+            //computed once and cached, which needs A*N + N^2 warps instead of A*N^2 compositions and warps.
+            //Weights factorize: atlas->intermediate deformations are weighted with globalWeights[atlas][intermediate]
+            //and the local metric between atlas and intermediate image, intermediate->target deformations with
+            //globalWeights[intermediate][target] and the local metric between intermediate and target image. Compared
+            //to composing the deformations, the probabilities are interpolated twice (on the grid of I and on the grid
+            //of the target). How much that changes the result has not been measured; -compareExact computes the
+            //composed reference with the same factorized weights and logs the mean probability difference and dice.
+            logSetStage("Intermediate segmentations");
+            if (intermediateCacheDir!="")
+                mkdir(intermediateCacheDir.c_str(),0755);
+            map<string,SparseProbabilisticImagePointerType> intermediateSegmentations;
+            map<string,ProbabilisticVectorImagePointerType> denseIntermediateSegmentations;
+            map<string,string> intermediateSegmentationFilenames;
+            map<string,ImagePointerType> intermediateImages;
+            int intermediateN=0;
+            for (ImageListIteratorType intermediateImageIterator=targetImages->begin();intermediateImageIterator!=targetImages->end() && (intermediateN<useNTargets);++intermediateImageIterator){
+                string intermediateID= intermediateImageIterator->first;
+                if (atlasSegmentationIDMap->find(intermediateID) != atlasSegmentationIDMap->end())
+                    continue;
+                ++intermediateN;
+                ImagePointerType intermediateImage=intermediateImageIterator->second;
+                intermediateImages[intermediateID]=intermediateImage;
+                ProbabilisticVectorImagePointerType intermediateSegmentation=createEmptyProbImageFromImage(intermediateImage);
+                int atlasN=0;
+                for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();
+                     atlasIterator!=inputAtlasSegmentations->end() && atlasN<useNAtlases;
+                     ++atlasIterator,++atlasN){
+                    string atlasID=atlasIterator->first;
+                    if (atlasID==intermediateID) continue;
+                    LOGV(3)<<VAR(atlasID)<<" "<<VAR(intermediateID)<<endl;
+                    DeformationFieldPointerType deformation=getDeformation(deformationCache,deformationFilenames,dontCacheDeformations,atlasID,intermediateID);
+                    deformation=TransfUtils<ImageType,double>::linearInterpolateDeformationField(deformation, intermediateImage);
+                    ImagePointerType atlasImage=(*atlasImages)[(*atlasIDMap)[atlasID]].second;
+                    updateProbabilisticSegmentation(intermediateSegmentation,SparseProbType::expand(probabilisticSegmentations[atlasID]),globalWeights[atlasID][intermediateID],intermediateImage,atlasImage,deformation,weighting,metric);
+                }
+                if (intermediateCacheDir!=""){
+                    ostringstream filename;
+                    if (denseIntermediates){
+                        filename<<intermediateCacheDir<<"/intermediate-"<<intermediateID<<"-ProbImage.mha";
+                        ImageUtils<ProbabilisticVectorImageType>::writeImage(filename.str().c_str(),intermediateSegmentation);
+                    }else{
+                        filename<<intermediateCacheDir<<"/intermediate-"<<intermediateID<<"-SparseProbImage.mha";
+                        SparseProbType::writeImage(filename.str(),SparseProbType::compress(intermediateSegmentation));
+                    }
+                    intermediateSegmentationFilenames[intermediateID]=filename.str();
+                }else if (denseIntermediates){
+                    denseIntermediateSegmentations[intermediateID]=intermediateSegmentation;
+                }else{
+                    intermediateSegmentations[intermediateID]=SparseProbType::compress(intermediateSegmentation);
+                }
+            }
+
+            logSetStage("One Hop");
+            for (ImageListIteratorType targetImageIterator=targetImages->begin();targetImageIterator!=targetImages->end();++targetImageIterator){
+                string targetID= targetImageIterator->first;
+                if ( (singleTarget!="" && targetID!=singleTarget) || atlasSegmentationIDMap->find(targetID)!=atlasSegmentationIDMap->end())
+                    continue;
+                ImagePointerType targetImage= targetImageIterator->second;
+                //one target is processed at a time, so its accumulator is dense and only the atlases and intermediates are stored sparse
+                ProbabilisticVectorImagePointerType probabilisticTargetSegmentation=createEmptyProbImageFromImage(targetImage);
+                //direct atlas->target propagation
+                int atlasN=0;
+                for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();
+                     atlasIterator!=inputAtlasSegmentations->end() && atlasN<useNAtlases;
+                     ++atlasIterator,++atlasN){
+                    string atlasID=atlasIterator->first;
+                    if (atlasID==targetID) continue;
+                    DeformationFieldPointerType deformation=getDeformation(deformationCache,deformationFilenames,dontCacheDeformations,atlasID,targetID);
+                    deformation=TransfUtils<ImageType,double>::linearInterpolateDeformationField(deformation, targetImage);
+                    ImagePointerType atlasImage=(*atlasImages)[(*atlasIDMap)[atlasID]].second;
+                    updateProbabilisticSegmentation(probabilisticTargetSegmentation,SparseProbType::expand(probabilisticSegmentations[atlasID]),globalWeights[atlasID][targetID],targetImage,atlasImage,deformation,weighting,metric);
+                }
+                ProbabilisticVectorImagePointerType exactSegmentation;
+                if (compareExact){
+                    exactSegmentation=ImageUtils<ProbabilisticVectorImageType>::duplicate(probabilisticTargetSegmentation);
+                }
+
+                //propagation of the fused intermediate segmentations
+                for (typename map<string,ImagePointerType>::iterator intermediateIt=intermediateImages.begin();intermediateIt!=intermediateImages.end();++intermediateIt){
+                    string intermediateID=intermediateIt->first;
+                    if (intermediateID==targetID) continue;
+                    LOGV(3)<<VAR(targetID)<<" "<<VAR(intermediateID)<<endl;
+                    DeformationFieldPointerType deformation=getDeformation(deformationCache,deformationFilenames,dontCacheDeformations,intermediateID,targetID);
+                    deformation=TransfUtils<ImageType,double>::linearInterpolateDeformationField(deformation, targetImage);
+                    //sparse intermediates are expanded only while they are warped to this target
+                    ProbabilisticVectorImagePointerType intermediateSegmentation;
+                    if (intermediateCacheDir!="" && denseIntermediates)
+                        intermediateSegmentation=ImageUtils<ProbabilisticVectorImageType>::readImage(intermediateSegmentationFilenames[intermediateID]);
+                    else if (intermediateCacheDir!="")
+                        intermediateSegmentation=SparseProbType::expand(SparseProbType::readImage(intermediateSegmentationFilenames[intermediateID]));
+                    else if (denseIntermediates)
+                        intermediateSegmentation=denseIntermediateSegmentations[intermediateID];
+                    else
+                        intermediateSegmentation=SparseProbType::expand(intermediateSegmentations[intermediateID]);
+                    updateProbabilisticSegmentation(probabilisticTargetSegmentation,intermediateSegmentation,globalWeights[intermediateID][targetID],targetImage,intermediateIt->second,deformation,weighting,metric);
+
+                    if (compareExact){
+                        //same weights as the reuse path, but each atlas segmentation is warped once through the composed deformation
+                        ProbabilisticVectorImagePointerType targetWeights=getWeightImage(globalWeights[intermediateID][targetID],targetImage,intermediateIt->second,deformation,weighting,metric);
+                        atlasN=0;
+                        for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();
+                             atlasIterator!=inputAtlasSegmentations->end() && atlasN<useNAtlases;
+                             ++atlasIterator,++atlasN){
+                            string atlasID=atlasIterator->first;
+                            if (atlasID==intermediateID) continue;
+                            DeformationFieldPointerType firstDeformation=getDeformation(deformationCache,deformationFilenames,dontCacheDeformations,atlasID,intermediateID);
+                            firstDeformation=TransfUtils<ImageType,double>::linearInterpolateDeformationField(firstDeformation, intermediateIt->second);
+                            DeformationFieldPointerType fullDeformation=TransfUtilsType::composeDeformations(deformation,firstDeformation);
+                            ImagePointerType atlasImage=(*atlasImages)[(*atlasIDMap)[atlasID]].second;
+                            ProbabilisticVectorImagePointerType intermediateWeights=getWeightImage(globalWeights[atlasID][intermediateID],intermediateIt->second,atlasImage,firstDeformation,weighting,metric);
+                            ProbabilisticVectorImagePointerType contribution=warpProbImage(SparseProbType::expand(probabilisticSegmentations[atlasID]),fullDeformation);
+                            ProbabilisticVectorImagePointerType warpedWeights=warpProbImage(intermediateWeights,deformation);
+                            ProbabilisticPixelType * exactBuffer=exactSegmentation->GetBufferPointer();
+                            const ProbabilisticPixelType * contributionBuffer=contribution->GetBufferPointer();
+                            const ProbabilisticPixelType * targetWeightBuffer=targetWeights->GetBufferPointer(), * intermediateWeightBuffer=warpedWeights->GetBufferPointer();
+                            long int nPixels=contribution->GetBufferedRegion().GetNumberOfPixels();
+                            for (long int p=0;p<nPixels;++p){
+                                exactBuffer[p]+=contributionBuffer[p]*(targetWeightBuffer[p][0]*intermediateWeightBuffer[p][0]);
+                            }
+                        }
+                    }
+                }
+
+                ImagePointerType outputImage;
+                if (graphCut)
+                    outputImage=probSegmentationToSegmentationGraphcutMultiLabel(probabilisticTargetSegmentation,targetImage,smoothness*inputAtlasSegmentations->size(),m_graphCutSigma);
+                else
+                    outputImage=probSegmentationToSegmentationLocal(probabilisticTargetSegmentation);
+                if (compareExact){
+                    ImagePointerType exactImage=probSegmentationToSegmentationLocal(exactSegmentation);
+                    LOG<<"Intermediate reuse vs. composition for "<<targetID<<": "<<VAR(meanProbabilityDifference(probabilisticTargetSegmentation,exactSegmentation))<<" DICE="<<DICE(probSegmentationToSegmentationLocal(probabilisticTargetSegmentation),exactImage)<<endl;
+                }
+                ostringstream tmpSegmentationFilename;
+                tmpSegmentationFilename<<outputDir<<"/segmentation-weighting"<<weightingName<<"-metric"<<metricName<<"-target"<<targetID<<"-hop1"<<suffix;
+                ImageUtils<ImageType>::writeImage(tmpSegmentationFilename.str().c_str(),segmentationMapper.MapInverse(outputImage));
+                ostringstream tmpSegmentationFilename2;
+                tmpSegmentationFilename2<<outputDir<<"/segmentation-weighting"<<weightingName<<"-metric"<<metricName<<"-target"<<targetID<<"-hop1-ProbImage.mha";
+                LOGI(4,ImageUtils<ProbabilisticVectorImageType>::writeImage(tmpSegmentationFilename2.str().c_str(),probabilisticTargetSegmentation));
+            }
+            LOG<<"done"<<endl;
+            return 1;
+        }
+
         //generate one-hop target segmentations
         for (ImageListIteratorType targetImageIterator=targetImages->begin();targetImageIterator!=targetImages->end();++targetImageIterator){                //iterate over targets
             string targetID= targetImageIterator->first;
             if (singleTarget=="" || targetID==singleTarget){
 
             if (atlasSegmentationIDMap->find(targetID)==atlasSegmentationIDMap->end()){ //do not calculate segmentation for atlas images
-                ProbabilisticVectorImagePointerType probabilisticTargetSegmentation=createEmptyProbImageFromImage( targetImageIterator->second);
+                ProbabilisticVectorImagePointerType probabilisticTargetSegmentation=createEmptyProbImageFromImage(targetImageIterator->second);
                 int atlasN=0;
                 for (ImageListIteratorType atlasIterator=inputAtlasSegmentations->begin();
                      atlasIterator!=inputAtlasSegmentations->end() && atlasN<useNAtlases;
@@ -417,17 +582,9 @@ public:
                             double weight=globalWeights[atlasID][targetID];
                             ImagePointerType targetImage= targetImageIterator->second;
                             atlasTargetDeformation=TransfUtils<ImageType,double>::linearInterpolateDeformationField(atlasTargetDeformation, targetImage);
+                            ImagePointerType atlasImage=(*atlasImages)[(*atlasIDMap)[atlasID]].second;
                             //propagate atlas segmentation directly
-                            if (weighting==UNIFORM || metric == NONE ){
-                                updateProbabilisticSegmentationUniform(probabilisticTargetSegmentation,probAtlasSegmentation,weight,atlasTargetDeformation);
-                            }else{
-                                ImagePointerType atlasImage=(*atlasImages)[(*atlasIDMap)[atlasID]].second;
-                                if (weighting==GLOBAL){
-                                    updateProbabilisticSegmentationGlobalMetric(probabilisticTargetSegmentation,probAtlasSegmentation,weight,targetImage,atlasImage,atlasTargetDeformation,metric);
-                                }else if (weighting==LOCAL){
-                                    updateProbabilisticSegmentationLocalMetricNew(probabilisticTargetSegmentation,probAtlasSegmentation,weight,targetImage,atlasImage,atlasTargetDeformation,metric);
-                                }
-                            }
+                            updateProbabilisticSegmentation(probabilisticTargetSegmentation,probAtlasSegmentation,weight,targetImage,atlasImage,atlasTargetDeformation,weighting,metric);
                             
                             int intermediateN=0;
                             //propagate atlas segmentations via intermediate targets
@@ -458,18 +615,7 @@ public:
 
                                 
                                     DeformationFieldPointerType fullDeformation=TransfUtilsType::composeDeformations(deformation,firstDeformation);
-                                    //update
-                                    if (weighting==UNIFORM || metric == NONE ){
-                                        updateProbabilisticSegmentationUniform(probabilisticTargetSegmentation,probAtlasSegmentation,weight,fullDeformation);
-                                    }else{
-                                        ImagePointerType atlasImage=(*atlasImages)[(*atlasIDMap)[atlasID]].second;
-                                        if (weighting==GLOBAL){
-                                            updateProbabilisticSegmentationGlobalMetric(probabilisticTargetSegmentation,probAtlasSegmentation,weight,targetImage,atlasImage,fullDeformation,metric);
-                                        }else if (weighting==LOCAL){
-                                            updateProbabilisticSegmentationLocalMetricNew(probabilisticTargetSegmentation,probAtlasSegmentation,weight,targetImage,atlasImage,fullDeformation,metric);
-                                        }
-                                    
-                                    }//update
+                                    updateProbabilisticSegmentation(probabilisticTargetSegmentation,probAtlasSegmentation,weight,targetImage,atlasImage,fullDeformation,weighting,metric);
                                 }//intermediate check
                             }//intermediate images
                         }//atlas check
@@ -798,13 +944,58 @@ protected:
         return result;
     }
 
-    void updateProbabilisticSegmentationUniform(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight,DeformationFieldPointerType deformation){
-        ProbabilisticVectorImagePointerType deformedIncrement=warpProbImage(increment,deformation);
-        ProbImageIteratorType accIt(accumulator,accumulator->GetLargestPossibleRegion());
-        ProbImageIteratorType incIt(deformedIncrement,deformedIncrement->GetLargestPossibleRegion());
-        for (accIt.GoToBegin(),incIt.GoToBegin();!incIt.IsAtEnd();++incIt,++accIt){
-            accIt.Set(accIt.Get()+incIt.Get()*globalWeight);
+    DeformationFieldPointerType getDeformation(map< string, map <string, DeformationFieldPointerType> > & deformationCache, map< string, map <string, string> > & deformationFilenames, bool dontCacheDeformations, string sourceID, string targetID){
+        if (dontCacheDeformations)
+            return ImageUtils<DeformationFieldType>::readImage(deformationFilenames[sourceID][targetID]);
+        else
+            return deformationCache[sourceID][targetID];
+    }
+
+    void updateProbabilisticSegmentation(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight, ImagePointerType targetImage, ImagePointerType movingImage,DeformationFieldPointerType deformation, WeightingType weighting, MetricType metric){
+        if (weighting==UNIFORM || metric == NONE ){
+            updateProbabilisticSegmentationUniform(accumulator,increment,globalWeight,deformation);
+        }else if (weighting==GLOBAL){
+            updateProbabilisticSegmentationGlobalMetric(accumulator,increment,globalWeight,targetImage,movingImage,deformation,metric);
+        }else if (weighting==LOCAL){
+            updateProbabilisticSegmentationLocalMetricNew(accumulator,increment,globalWeight,targetImage,movingImage,deformation,metric);
+        }
+    }
+
+    ///weight that updateProbabilisticSegmentation gives to each voxel of targetImage, as the contribution of a constant one probability
+    ProbabilisticVectorImagePointerType getWeightImage(double globalWeight, ImagePointerType targetImage, ImagePointerType movingImage,DeformationFieldPointerType deformation, WeightingType weighting, MetricType metric){
+        ProbabilisticVectorImagePointerType ones=createEmptyProbImageFromImage(movingImage);
+        ProbabilisticPixelType one;
+        one.Fill(1.0);
+        ones->FillBuffer(one);
+        ProbabilisticVectorImagePointerType result=createEmptyProbImageFromImage(targetImage);
+        updateProbabilisticSegmentation(result,ones,globalWeight,targetImage,movingImage,deformation,weighting,metric);
+        return result;
+    }
+
+    ///mean absolute difference of the normalized label probabilities
+    double meanProbabilityDifference(ProbabilisticVectorImagePointerType img1, ProbabilisticVectorImagePointerType img2){
+        ProbImageIteratorType it1(img1,img1->GetLargestPossibleRegion());
+        ProbImageIteratorType it2(img2,img2->GetLargestPossibleRegion());
+        double result=0.0;
+        long int count=0;
+        for (it1.GoToBegin(),it2.GoToBegin();!it1.IsAtEnd();++it1,++it2){
+            ProbabilisticPixelType p1=it1.Get(),p2=it2.Get();
+            double sum1=0.0,sum2=0.0;
+            for (int s=0;s<nSegmentationLabels;++s){
+                sum1+=p1[s];
+                sum2+=p2[s];
+            }
+            if (sum1<=0.0 || sum2<=0.0) continue;
+            for (int s=0;s<nSegmentationLabels;++s){
+                result+=fabs(p1[s]/sum1-p2[s]/sum2);
+            }
+            ++count;
         }
+        return count?result/count:0.0;
+    }
+
+    void updateProbabilisticSegmentationUniform(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight,DeformationFieldPointerType deformation){
+        FusionType::accumulateUniform(accumulator,increment,deformation,globalWeight);
     }
 
     void updateProbabilisticSegmentationGlobalMetric(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight, ImagePointerType targetImage, ImagePointerType movingImage,DeformationFieldPointerType deformation,MetricType metric ){
@@ -891,14 +1082,8 @@ protected:
         }
         }   //switch
 
-        ProbabilisticVectorImagePointerType deformedIncrement=warpProbImage(increment,deformation);
-        ProbImageIteratorType accIt(accumulator,accumulator->GetLargestPossibleRegion());
-        ProbImageIteratorType incIt(deformedIncrement,deformedIncrement->GetLargestPossibleRegion());
-     
         LOGV(10)<<VAR(metricWeight)<<endl;
-        for (accIt.GoToBegin(),incIt.GoToBegin();!incIt.IsAtEnd();++incIt,++accIt){
-            accIt.Set(accIt.Get()+incIt.Get()*globalWeight*metricWeight);
-        }
+        FusionType::accumulateUniform(accumulator,increment,deformation,globalWeight*metricWeight);
     }
     void updateProbabilisticSegmentationLocalMetric(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight, ImagePointerType targetImage, ImagePointerType movingImage,DeformationFieldPointerType deformation,MetricType metric ){
         ProbabilisticVectorImagePointerType deformedIncrement=warpProbImage(increment,deformation);
@@ -934,6 +1119,14 @@ protected:
         delete tIt; delete aIt; delete mIt;
     }
     void updateProbabilisticSegmentationLocalMetricNew(ProbabilisticVectorImagePointerType accumulator, ProbabilisticVectorImagePointerType increment,double globalWeight, ImagePointerType targetImage, ImagePointerType movingImage,DeformationFieldPointerType deformation,MetricType metric ){
+        if (metric==NCC){
+            //warp, weight and accumulate in one pass, target statistics are reused for all atlases
+            if (m_targetStatistics.target!=targetImage){
+                m_targetStatistics=FusionType::computeTargetStatistics(targetImage,m_patchRadius[0]);
+            }
+            FusionType::accumulateLocalNCC(accumulator,increment,movingImage,deformation,globalWeight,m_targetStatistics,m_sigma);
+            return;
+        }
         ProbabilisticVectorImagePointerType deformedIncrement=warpProbImage(increment,deformation);
         ProbImageIteratorType accIt(accumulator,accumulator->GetLargestPossibleRegion());
         ProbImageIteratorType incIt(deformedIncrement,deformedIncrement->GetLargestPossibleRegion());
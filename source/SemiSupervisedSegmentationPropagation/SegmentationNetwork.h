@@ -21,12 +21,8 @@
 #include "TransformationUtils.h"
 #include "ImageUtils.h"
 #include "FilterUtils.hpp"
-
-#ifndef WITH_GCO
-#error "GCO library required"
-#else
-#include "graph.h"
-#endif
+#include "DeformationCache.h"
+#include "PartitionedGraphCut.h"
 
 #include <sstream>
 #include "ArgumentParser.h"
@@ -223,6 +219,8 @@ public:
         bool evalAtlas=false;
         int nRandomSupportSamples=0;
         double confidenceThreshold=2.0;
+        bool partitioned=false;
+        int maxSweeps=20;
         as->parameter ("sa", atlasSegmentationFilename, "atlas segmentation image (file name)", true);
         as->parameter ("T", deformationFileList, " list of deformations", true);
         as->parameter ("i", imageFileList, " list of  images, first image is assumed to be atlas image", true);
@@ -240,6 +238,8 @@ public:
         as->parameter ("thresh", edgeThreshold,"threshold for edge pruning (0=off)",false);
         as->parameter ("edgeCountPenaltyWeight", edgeCountPenaltyWeight,"penalize foreground label of pixels having less outgoing edges (0 to disable)",false);
         as->option ("evalAtlas", evalAtlas,"also segment the atlas within the network");
+        as->option ("partitioned", partitioned,"solve the network by parallel block coordinate descent over images instead of one global max-flow. Needs much less memory, but is not guaranteed to find the global optimum.");
+        as->parameter ("maxSweeps", maxSweeps,"maximal number of sweeps over all images for -partitioned",false);
 
         as->parameter ("supportSamples",supportSamplesListFileName,"filename with a list of support sample IDs. if not set, all images will be used.",false);
         as->parameter ("nRandomSupportSamples",nRandomSupportSamples,"draw random target images as support samples.",false);
@@ -262,9 +262,9 @@ public:
         map<string,ImagePointerType>  m_groundTruthSegmentations;
 
         LOG<<"Reading images."<<endl;
-        unsigned int totalNumberOfPixels=0;
+        unsigned long int totalNumberOfPixels=0;
         std::vector<string> imageIDs;
-        int nTotalEdges=0;
+        unsigned long int nTotalEdges=0;
         map<string,double> maxNormFactor;
         {
             ifstream ifs(imageFileList.c_str());
@@ -354,8 +354,10 @@ public:
                 supportSampleList[tmpList[i]]=true;
             }
         }
-        LOG<<"Reading deformations."<<endl;
-        map< string, map <string, DeformationFieldPointerType> > deformations;
+        LOG<<"Reading deformation list."<<endl;
+        //deformations are only read from disk when the edges of their image pair are constructed
+        DeformationCache<ImageType> deformations;
+        deformations.setCaching(false);
         {
             ifstream ifs(deformationFileList.c_str());
             while (!ifs.eof()){
@@ -369,17 +371,12 @@ public:
                             LOG<<id1<<" or "<<id2<<" not in image database, skipping"<<endl;
                             //exit(0);
                         }else{
-                            LOGV(3)<<"Reading deformation "<<defFileName<<" for deforming "<<id1<<" to "<<id2<<endl;
-                            DeformationFieldPointerType def=ImageUtils<DeformationFieldType>::readImage(defFileName);
-                            deformations[id1][id2]=def;
+                            LOGV(3)<<"Adding deformation "<<defFileName<<" for deforming "<<id1<<" to "<<id2<<endl;
+                            deformations.add(id1,id2,defFileName);
                         
                             if ( evalAtlas || (id1!= atlasID && id2 != atlasID)){
-                                int nDefs=1;
-                                for (unsigned int d=0;d<D;++d){
-                                    nDefs*=def->GetLargestPossibleRegion().GetSize()[d];
-                                }
-                                nTotalEdges+=nDefs;
-                      
+                                //deformations are defined on the grid of the target image id2
+                                nTotalEdges+=inputImages[id2].imageSize;
                             }
                         }
 
@@ -400,22 +397,33 @@ public:
   
       
 
-        unsigned int nNodes=totalNumberOfPixels;
+        unsigned long int nNodes=totalNumberOfPixels;
  
 	//construct MRF
-	typedef Graph<float,float,double> MRFType;
-        typedef MRFType::node_id NodeType;
-        MRFType* optimizer;
-    
-        LOG<<"Allocating MRF with "<<nNodes<<" nodes and "<<nTotalEdges<<" edges."<<endl;
-        optimizer = new MRFType(nNodes,nTotalEdges);
-        optimizer->add_node(nNodes);
+        GraphCutBackend* optimizer;
+        if (partitioned){
+            LOG<<"Allocating partitioned MRF with "<<nNodes<<" nodes."<<endl;
+            PartitionedGraphCut * partitionedOptimizer=new PartitionedGraphCut();
+            partitionedOptimizer->setMaxSweeps(maxSweeps);
+            //one block per image, in the same order as the running indices below
+            for (unsigned int n1=0;n1<nImages;++n1){
+                string id1=imageIDs[n1];
+                if (evalAtlas || id1!=atlasID){
+                    partitionedOptimizer->addBlock(inputImages[id1].imageSize);
+                }
+            }
+            optimizer=partitionedOptimizer;
+        }else{
+            LOG<<"Allocating MRF with "<<nNodes<<" nodes and "<<nTotalEdges<<" edges."<<endl;
+            optimizer = new BKGraphCut(nNodes,nTotalEdges);
+        }
+        LOG<<"MRF memory: "<<optimizer->getMemoryMB()<<" MB"<<endl;
         unsigned long  int i=0;
-        map <string, DeformationFieldPointerType> atlasToTargetDeformations=deformations[atlasID];
         std::vector<int> edgeCount(nNodes,0);
-        int totalEdgeCount=0;
+        unsigned long int totalEdgeCount=0;
         ImagePointerType atlasImage=inputImages[atlasID].img;
         unsigned long int runningIndex=0;
+        int nPairs=0;
         LOG<<"Setting up pairwise potentials"<<endl;
         for (unsigned int n1=0;n1<nImages;++n1){
             string id1=imageIDs[n1];
@@ -430,7 +438,12 @@ public:
                                 //calculate edges from all pixel of image 1 to their corresponding locations in img2
                                 ImagePointerType img1=inputImages[id1].img;
                                 //inverse deformation.
-                                DeformationFieldPointerType deformation=deformations[id2][id1];
+                                DeformationFieldPointerType deformation;
+                                if (!deformations.get(id2,id1,deformation)){
+                                    LOG<<"no deformation from "<<id2<<" to "<<id1<<", skipping"<<endl;
+                                    runningIndex2+=inputImages[id2].imageSize;
+                                    continue;
+                                }
                                 ImagePointerType img2=inputImages[id2].img;
                                 ImagePointerType deformedI2=TransfUtils<ImageType>::warpImage(img2,deformation);
                                 ImageIteratorType img1It(img1,img1->GetLargestPossibleRegion());
@@ -459,7 +472,7 @@ public:
                                     //check if index is within image bounds
                                     bool inside=true;
                                     int withinImageIndex=ImageUtils<ImageType>::ImageIndexToLinearIndex(idx2,size2,inside);
-                                    int linearIndex=runningIndex2+withinImageIndex;
+                                    long int linearIndex=runningIndex2+withinImageIndex;
                                     //LOGV(150)<<inside<<" "<<VAR(id1)<<" "<<VAR(id2)<<" "<<VAR(i)<<" "<<VAR(idx)<<" "<<VAR(linearIndex)<<" "<<VAR(idx2)<<endl;
                                     if (inside){
                                         //compute linear edge index
@@ -477,7 +490,7 @@ public:
                                         //add bidirectional edge
                                         if (weight>edgeThreshold){
                                             weight*=pWeight;
-                                            optimizer -> add_edge(i,linearIndex,weight,weight);
+                                            optimizer -> add_edge(i,linearIndex,weight);
                                             edgeCount[i]++;
                                             //edgeCount[linearIndex]++;
                                             totalEdgeCount++;
@@ -485,7 +498,10 @@ public:
 
                                     }
                                 }
-                                delete tIt,aIt;
+                                delete tIt;
+                                delete aIt;
+                                ++nPairs;
+                                LOGV(1)<<"Added edges for pair "<<nPairs<<" ("<<id1<<","<<id2<<"), "<<VAR(totalEdgeCount)<<", memory: "<<optimizer->getMemoryMB()<<" MB"<<endl;
                             }
                         }
                         runningIndex2+=inputImages[id2].imageSize;
@@ -510,7 +526,8 @@ public:
             if (id!=atlasID){
                 ImagePointerType img=inputImages[id].img;
                 SizeType size=img->GetLargestPossibleRegion().GetSize();
-                DeformationFieldPointerType deformation= atlasToTargetDeformations[id];
+                DeformationFieldPointerType deformation;
+                deformations.get(atlasID,id,deformation);
                 ImagePointerType deformedAtlas=TransfUtils<ImageType>::warpImage(atlasImage,deformation);
                 ImagePointerType deformedAtlasSegmentation=TransfUtils<ImageType>::warpImage(atlasSegmentationImage,deformation,true);
                 ImageIteratorType defSegIt(deformedAtlasSegmentation,deformedAtlasSegmentation->GetLargestPossibleRegion());
@@ -584,8 +601,8 @@ public:
                                             weight2=exp(-0.5*(diff*diff)/(sigma*sigma));
                                         
 
-                                        unsigned int linearIndex2=runningIndex+withinImageIndex2;
-                                        optimizer -> add_edge(i,linearIndex2,segPairwiseWeight*weight2,segPairwiseWeight*weight2);
+                                        long int linearIndex2=runningIndex+withinImageIndex2;
+                                        optimizer -> add_edge(i,linearIndex2,segPairwiseWeight*weight2);
                                         nLocalEdges++;
                                     }
                                 }
@@ -640,8 +657,8 @@ public:
                                 bool inside2;
                                 int withinImageIndex2=ImageUtils<ImageType>::ImageIndexToLinearIndex(neighborIndex,size,inside2);
                                 if (inside2){
-                                    unsigned int linearIndex2=runningIndex+withinImageIndex2;
-                                    optimizer -> add_edge(i,linearIndex2,segPairwiseWeight,segPairwiseWeight);
+                                    long int linearIndex2=runningIndex+withinImageIndex2;
+                                    optimizer -> add_edge(i,linearIndex2,segPairwiseWeight);
                                 }
                             }
                         }
@@ -683,10 +700,9 @@ public:
             }
 
         }
-        optimizer->add_tweights(nNodes,0,nNodes);
-
     
         LOGV(1)<<"done"<<endl;
+        LOG<<"MRF memory: "<<optimizer->getMemoryMB()<<" MB"<<endl;
  
         logSetStage("Optimization");
         LOG<<"starting optimization"<<endl;
@@ -703,7 +719,7 @@ public:
                 for (;!imgIt.IsAtEnd();++imgIt,++i){
                     double mult=D==2?65535:1.0;
                     
-                    imgIt.Set(mult*(optimizer->what_segment(i)== MRFType::SINK ));
+                    imgIt.Set(mult*(optimizer->isSink(i)));
                 }
                 ostringstream tmpSegmentationFilename;
                 tmpSegmentationFilename<<outputDir<<"/segmentation-"<<id1<<"-MRF-nImages"<<nImages<<suffix;
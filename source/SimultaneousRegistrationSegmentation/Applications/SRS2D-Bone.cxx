@@ -151,17 +151,11 @@ int main(int argc, char ** argv)
   logResetStage;
   logSetStage("Preprocessing");
 
+  //derived atlas images are reused across runs if a cache directory is given
+  DerivedImageCache cache(filterConfig.cacheDirectory,filterConfig.cacheSizeMB);
   if (filterConfig.histNorm){
     // Histogram match the images
-    typedef itk::HistogramMatchingImageFilter<ImageType,ImageType> HEFilterType;
-    HEFilterType::Pointer IntensityEqualizeFilter = HEFilterType::New();
-    IntensityEqualizeFilter->SetReferenceImage(targetImage  );
-    IntensityEqualizeFilter->SetInput( atlasImage );
-    IntensityEqualizeFilter->SetNumberOfHistogramLevels( 100);
-    IntensityEqualizeFilter->SetNumberOfMatchPoints( 15);
-    IntensityEqualizeFilter->ThresholdAtMeanIntensityOn();
-    IntensityEqualizeFilter->Update();
-    atlasImage=IntensityEqualizeFilter->GetOutput();
+    atlasImage=Preprocessing<ImageType>::histogramMatching(atlasImage,targetImage,cache);
 
   }
 
@@ -186,7 +180,7 @@ int main(int argc, char ** argv)
       tiler->Update();
       targetImageStack=tiler->GetOutput();
       //compute sheetness
-      ImagePointerType3D sheetness=Preprocessing<ImageType3D>::computeSheetness(targetImageStack);
+      ImagePointerType3D sheetness=Preprocessing<ImageType3D>::computeSheetness(targetImageStack,cache);
 
       //extract slice
       ImageType3D::RegionType inputRegion=sheetness->GetLargestPossibleRegion() ;
@@ -221,7 +215,7 @@ int main(int argc, char ** argv)
       tiler->Update();
       atlasImageStack=tiler->GetOutput();
       //compute sheetness
-      ImagePointerType3D sheetness=Preprocessing<ImageType3D>::computeSheetness(atlasImageStack);
+      ImagePointerType3D sheetness=Preprocessing<ImageType3D>::computeSheetness(atlasImageStack,cache);
 
       //extract slice
       ImageType3D::RegionType inputRegion=sheetness->GetLargestPossibleRegion() ;
@@ -150,17 +150,11 @@ int main(int argc, char ** argv)
     logResetStage;
     logSetStage("Preprocessing");
 
+    //derived atlas images are reused across runs if a cache directory is given
+    DerivedImageCache cache(filterConfig.cacheDirectory,filterConfig.cacheSizeMB);
     if (filterConfig.histNorm){
         // Histogram match the images
-        typedef itk::HistogramMatchingImageFilter<ImageType,ImageType> HEFilterType;
-        HEFilterType::Pointer IntensityEqualizeFilter = HEFilterType::New();
-        IntensityEqualizeFilter->SetReferenceImage(targetImage  );
-        IntensityEqualizeFilter->SetInput( atlasImage );
-        IntensityEqualizeFilter->SetNumberOfHistogramLevels( 100);
-        IntensityEqualizeFilter->SetNumberOfMatchPoints( 15);
-        IntensityEqualizeFilter->ThresholdAtMeanIntensityOn();
-        IntensityEqualizeFilter->Update();
-        atlasImage=IntensityEqualizeFilter->GetOutput();
+        atlasImage=Preprocessing<ImageType>::histogramMatching(atlasImage,targetImage,cache);
 
     }
 
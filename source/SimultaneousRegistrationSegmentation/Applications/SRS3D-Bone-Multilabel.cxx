@@ -148,17 +148,11 @@ int main(int argc, char ** argv)
     logResetStage;
     logSetStage("Preprocessing");
 
+    //derived atlas images are reused across runs if a cache directory is given
+    DerivedImageCache cache(filterConfig.cacheDirectory,filterConfig.cacheSizeMB);
     if (filterConfig.histNorm){
         // Histogram match the images
-        typedef itk::HistogramMatchingImageFilter<ImageType,ImageType> HEFilterType;
-        HEFilterType::Pointer IntensityEqualizeFilter = HEFilterType::New();
-        IntensityEqualizeFilter->SetReferenceImage(targetImage  );
-        IntensityEqualizeFilter->SetInput( atlasImage );
-        IntensityEqualizeFilter->SetNumberOfHistogramLevels( 100);
-        IntensityEqualizeFilter->SetNumberOfMatchPoints( 15);
-        IntensityEqualizeFilter->ThresholdAtMeanIntensityOn();
-        IntensityEqualizeFilter->Update();
-        atlasImage=IntensityEqualizeFilter->GetOutput();
+        atlasImage=Preprocessing<ImageType>::histogramMatching(atlasImage,targetImage,cache);
 
     }
 
@@ -168,7 +162,7 @@ int main(int argc, char ** argv)
         if (filterConfig.targetGradientFilename!=""){
             targetGradient=(ImageUtils<ImageType>::readImage(filterConfig.targetGradientFilename));
         }else{
-            targetGradient=Preprocessing<ImageType>::computeSheetness(targetImage);
+            targetGradient=Preprocessing<ImageType>::computeSheetness(targetImage,cache);
             LOGI(8,ImageUtils<ImageType>::writeImage("targetsheetness.nii",targetGradient));
            
         }
@@ -176,7 +170,7 @@ int main(int argc, char ** argv)
             atlasGradient=(ImageUtils<ImageType>::readImage(filterConfig.atlasGradientFilename));
         }else{
             if (atlasImage.IsNotNull()){
-                atlasGradient=Preprocessing<ImageType>::computeSheetness(atlasImage);
+                atlasGradient=Preprocessing<ImageType>::computeSheetness(atlasImage,cache);
                 LOGI(8,ImageUtils<ImageType>::writeImage("atlassheetness.nii",atlasGradient));
             }
         }
@@ -75,6 +75,12 @@ template<class TImage, class TLabel>
 
   virtual int getTotalNumberOfLabels(){return this->m_nLabels;}
 
+  ///per-node subsets of the displacement labels, only used by AdaptiveRegistrationLabelMapper
+  virtual bool hasNodeLabelSubsets(){return false;}
+  virtual int getNumberOfNodeLabels(int node){return this->m_nDisplacements;}
+  ///return the displacement label index of the i-th label of a node
+  virtual int getNodeLabel(int node, int i){return i;}
+
   ///method for scaling the first elements of the vector by a set of factors, leaving the segmentation label unchanged
   inline const LabelType scaleDisplacement(const LabelType & label,const itk::Vector<float,TImage::ImageDimension> & scaling){
     LabelType result(label);
@@ -347,6 +353,74 @@ template<class TImage, class TLabel>
     }
 };
 
+///\brief Dense labelmapper where each registration node only uses a subset of the dense displacement lattice
+///The subsets are selected by the graph (FastGraphModel::computeRegistrationLabelSubsets) from the unaries on a coarse sub-lattice,
+///refined around the best labels. Label indices stay those of the dense lattice, so potentials and deformations are unchanged.
+template<class TImage, class TLabel>
+  class AdaptiveRegistrationLabelMapper : public DenseRegistrationLabelMapper<TImage,TLabel>{
+ public:
+    typedef TLabel LabelType;
+    static const int Dimension=TImage::ImageDimension;
+ protected:
+    int m_nCandidates,m_coarseStride;
+    std::vector<std::vector<int> > m_nodeLabels;
+ public:
+    AdaptiveRegistrationLabelMapper(int NSegmentations, int NDisplacementSamples, int nCandidates, int coarseStride=2)
+      :DenseRegistrationLabelMapper<TImage,TLabel>(NSegmentations,NDisplacementSamples){
+      m_nCandidates=nCandidates;
+      m_coarseStride=std::max(1,coarseStride);
+      this->descr="ARLM";
+      LOGV(1)<<"Using "<<m_nCandidates<<" adaptive registration labels per node, coarse lattice stride "<<m_coarseStride<<std::endl;
+    }
+    void setNumberOfDisplacementSamplesPerAxis(int nSamples){
+      this->setDisplacementSamples(nSamples);
+      clearNodeLabels();
+    }
+    int getNumberOfCandidates(){return m_nCandidates;}
+    int getCoarseStride(){return m_coarseStride;}
+
+    bool hasNodeLabelSubsets(){return m_nodeLabels.size()>0;}
+    int getNumberOfNodeLabels(int node){return m_nodeLabels[node].size();}
+    int getNodeLabel(int node, int i){return m_nodeLabels[node][i];}
+    void setNodeLabels(int node, const std::vector<int> & labels){
+      if ((int)m_nodeLabels.size()<=node) m_nodeLabels.resize(node+1);
+      m_nodeLabels[node]=labels;
+    }
+    void clearNodeLabels(){m_nodeLabels.clear();}
+
+    ///labels of the sub-lattice with spacing m_coarseStride, including the zero displacement
+    std::vector<int> getCoarseLabels(){
+      std::vector<int> result;
+      for (int i=0;i<this->m_nDisplacements;++i){
+	LabelType l=this->getLabel(i);
+	bool onGrid=true;
+	for (int d=0;d<Dimension;++d){
+	  onGrid=onGrid && (int(round(l[d]))%m_coarseStride==0);
+	}
+	if (onGrid) result.push_back(i);
+      }
+      return result;
+    }
+    ///append the dense lattice labels in the coarse cell around label
+    void addRefinedLabels(int label, std::vector<int> & labels){
+      LabelType center=this->getLabel(label);
+      int n=this->m_nDisplacementSamplesPerAxis;
+      int r=m_coarseStride-1;
+      int nOffsets=pow(2*r+1,Dimension);
+      for (int o=0;o<nOffsets;++o){
+	LabelType l=center;
+	int rest=o;
+	bool inside=true;
+	for (int d=0;d<Dimension;++d){
+	  l[d]+=rest%(2*r+1)-r;
+	  rest/=2*r+1;
+	  inside=inside && fabs(l[d])<=n;
+	}
+	if (inside) labels.push_back(this->getIndex(l));
+      }
+    }
+};
+
 ///\brief Labelmapper that operates on the sumlabel space, eg displacement and segmentation labels are independent. 
 ///Mapping only for displacment vectors
 template<class TImage, class TLabel>
@@ -8,6 +8,12 @@
 #include "Potential-Coherence-Pairwise.h"
 #include "BaseLabel.h"
 #include "Log.h"
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include "itkImageRegionConstIteratorWithIndex.h"
 
 namespace SRS{
 
@@ -37,8 +43,22 @@ namespace SRS{
         typedef typename TImage::Pointer ImagePointerType;
         typedef typename TImage::ConstPointer ConstImagePointerType;
         typedef typename TransfUtils<ImageType>::DisplacementType RegistrationLabelType;
+        typedef AdaptiveRegistrationLabelMapper<ImageType,RegistrationLabelType> AdaptiveLabelMapperType;
+    protected:
+        ///unaries of the registration label subset of each node, computed while selecting the subsets
+        std::vector<std::vector<float> > m_candidateUnaries;
+        ///the unary registration function was initialized by RefineRegistrationNodes, the next Init() can reuse it
+        bool m_cachingPrepared;
     public:
+        FastGraphModel(){
+            m_cachingPrepared=false;
+        }
          void Init(){
+            if (m_cachingPrepared){
+                LOGV(2)<<"Reusing unary registration caching initialized by the adaptive grid"<<std::endl;
+                m_cachingPrepared=false;
+                return;
+            }
             //#define moarcaching
             this->m_unaryRegFunction->setCoarseImage(this->m_coarseGraphImage);
             TIME(this->m_unaryRegFunction->initCaching());
@@ -70,11 +90,253 @@ namespace SRS{
             double result=  this->m_unaryRegFunction->getPotential(index);//this->m_nRegistrationNodes;
 #endif
 
-            if (this->m_normalizePotentials) result/=this->m_nRegistrationNodes;
+            if (this->m_normalizePotentials) result/=this->m_registrationUnaryNormalizer;
+            if (this->m_reducedRegNodes) result+=this->getFrozenNeighbourRegistrationPotential(nodeIndex,labelIndex);
             return result;
 
         }
 
+        /**
+         * freeze the registration nodes which are not expected to need a finer deformation than the coarser levels provide.
+         * a node is optimized if a boundary of the (warped) atlas segmentation lies in its support, or if its unary costs for the largest
+         * displacements along each axis vary by more than costThreshold times the median variation. the optimized nodes are dilated by one node.
+         * to be called once per level, after initGraph and the setup of the registration potentials, before the solver is created.
+         * the solver's following Init() reuses the unary caching initialized here
+         */
+        void RefineRegistrationNodes(ConstImagePointerType atlasSegmentation, double costThreshold){
+            logSetStage("AdaptiveGrid");
+            int nNodes=this->m_nRegistrationNodes;
+            std::vector<bool> active(nNodes,false);
+
+            //unary cost variation
+            std::vector<int> probes=getAxisExtremeLabels();
+            if (probes.size()>1){
+                this->Init();
+                m_cachingPrepared=true;
+                std::vector<float> minCost(nNodes,std::numeric_limits<float>::max()),range(nNodes);
+                std::vector<float> maxCost(nNodes,-std::numeric_limits<float>::max());
+                for (unsigned int p=0;p<probes.size();++p){
+                    cacheRegistrationPotentials(probes[p]);
+                    for (int d=0;d<nNodes;++d){
+                        float pot=getUnaryRegistrationPotential(d,probes[p]);
+                        minCost[d]=std::min(minCost[d],pot);
+                        maxCost[d]=std::max(maxCost[d],pot);
+                    }
+                }
+                for (int d=0;d<nNodes;++d) range[d]=maxCost[d]-minCost[d];
+                std::vector<float> sorted(range);
+                std::nth_element(sorted.begin(),sorted.begin()+nNodes/2,sorted.end());
+                double median=sorted[nNodes/2];
+                LOGV(2)<<"Median unary registration cost range over "<<probes.size()<<" displacements: "<<median<<std::endl;
+                for (int d=0;d<nNodes;++d) active[d]=range[d]>costThreshold*median;
+            }
+
+            //control points whose support contains a boundary of the atlas segmentation, i.e. all corners of the cells of both boundary pixels
+            if (atlasSegmentation.IsNotNull()){
+                const unsigned int D=ImageType::ImageDimension;
+                typename ImageType::RegionType gridRegion=this->m_coarseGraphImage->GetLargestPossibleRegion();
+                typename ImageType::RegionType region=atlasSegmentation->GetLargestPossibleRegion();
+                itk::ImageRegionConstIteratorWithIndex<ImageType> it(atlasSegmentation,region);
+                for (it.GoToBegin();!it.IsAtEnd();++it){
+                    IndexType index=it.GetIndex();
+                    for (unsigned int d=0;d<D;++d){
+                        IndexType next=index;
+                        next[d]+=1;
+                        if (!region.IsInside(next) || atlasSegmentation->GetPixel(next)==it.Get()) continue;
+                        IndexType lower[2]={this->getLowerGraphIndex(index),this->getLowerGraphIndex(next)};
+                        for (int p=0;p<2;++p){
+                            for (int corner=0;corner<(1<<D);++corner){
+                                IndexType node=lower[p];
+                                for (unsigned int d2=0;d2<D;++d2) node[d2]+=(corner>>d2)&1;
+                                if (gridRegion.IsInside(node)) active[this->getGraphIntegerIndex(node)]=true;
+                            }
+                        }
+                    }
+                }
+            }
+
+            //dilate by one node, so that the optimized region can relax towards the frozen nodes
+            std::vector<bool> dilated(active);
+            for (int d=0;d<nNodes;++d){
+                if (!active[d]) continue;
+                IndexType position=this->getGraphIndex(d);
+                for (unsigned int d2=0;d2<ImageType::ImageDimension;++d2){
+                    for (int step=-1;step<=1;step+=2){
+                        IndexType neighbour=position;
+                        neighbour[d2]+=step;
+                        if ((int)neighbour[d2]>=0 && (int)neighbour[d2]<(int)this->m_gridSize[d2]) dilated[this->getGraphIntegerIndex(neighbour)]=true;
+                    }
+                }
+            }
+            this->setActiveRegistrationNodes(dilated);
+            logResetStage;
+        }
+
+        AdaptiveLabelMapperType * getAdaptiveLabelMapper(){
+            return dynamic_cast<AdaptiveLabelMapperType *>(this->m_labelMapper);
+        }
+
+        /**
+         * select the registration labels of each node if an AdaptiveRegistrationLabelMapper is used.
+         * unaries are cached for the coarse sub-lattice of displacements, and each label is scored by its unary plus the
+         * cheapest way the unary-best labels of the neighbouring nodes could agree with it. The best labels are refined on the dense
+         * lattice around them, and the candidates of the refined set with the best scores are kept. The zero displacement is always kept.
+         * returns false if no adaptive label mapper is used
+         */
+        bool computeRegistrationLabelSubsets(double unaryWeight, double pairwiseWeight){
+            AdaptiveLabelMapperType * mapper=getAdaptiveLabelMapper();
+            if (!mapper) return false;
+            logSetStage("AdaptiveLabels");
+            int nNodes=this->m_nRegistrationNodes;
+            int nCandidates=mapper->getNumberOfCandidates();
+            int zeroLabel=mapper->getZeroDisplacementIndex();
+            mapper->clearNodeLabels();
+
+            //symmetric neighbourhood of the registration grid
+            std::vector<std::vector<int> > neighbours(nNodes);
+            for (int d=0;d<nNodes;++d){
+                std::vector<int> forward=this->getForwardRegistrationNeighbours(d);
+                for (unsigned int i=0;i<forward.size();++i){
+                    neighbours[d].push_back(forward[i]);
+                    neighbours[forward[i]].push_back(d);
+                }
+            }
+
+            //unaries on the coarse lattice
+            std::vector<int> coarseLabels=mapper->getCoarseLabels();
+            std::vector<std::vector<std::pair<float,int> > > scores(nNodes);
+            std::vector<std::map<int,float> > unaries(nNodes);
+            for (unsigned int l=0;l<coarseLabels.size();++l){
+                cacheRegistrationPotentials(coarseLabels[l]);
+                for (int d=0;d<nNodes;++d){
+                    float pot=getUnaryRegistrationPotential(d,coarseLabels[l]);
+                    unaries[d][coarseLabels[l]]=pot;
+                    scores[d].push_back(std::make_pair(float(unaryWeight*pot),coarseLabels[l]));
+                }
+            }
+            //the unary-best coarse labels of each node serve as the neighbours' side of the consistency bound
+            std::vector<std::vector<std::pair<float,int> > > best(nNodes);
+            for (int d=0;d<nNodes;++d){
+                best[d]=scores[d];
+                int n=std::min(nCandidates,int(best[d].size()));
+                std::partial_sort(best[d].begin(),best[d].begin()+n,best[d].end());
+                best[d].resize(n);
+            }
+            std::vector<std::vector<int> > survivors(nNodes);
+            for (int d=0;d<nNodes;++d){
+                std::vector<std::pair<float,int> > bounds=addConsistencyBound(d,scores[d],neighbours[d],best,pairwiseWeight);
+                survivors[d]=selectCandidates(bounds,nCandidates,zeroLabel);
+            }
+            LOGV(1)<<"Evaluated "<<coarseLabels.size()<<" coarse labels of "<<this->m_nDisplacementLabels<<std::endl;
+
+            //refine around the survivors, only evaluating the new labels at the nodes which need them
+            std::map<int,std::vector<int> > nodesOfLabel;
+            std::vector<std::vector<int> > refined(nNodes);
+            for (int d=0;d<nNodes;++d){
+                for (unsigned int i=0;i<survivors[d].size();++i){
+                    mapper->addRefinedLabels(survivors[d][i],refined[d]);
+                }
+                std::sort(refined[d].begin(),refined[d].end());
+                refined[d].erase(std::unique(refined[d].begin(),refined[d].end()),refined[d].end());
+                std::vector<std::pair<float,int> > known;
+                for (unsigned int i=0;i<scores[d].size();++i){
+                    if (std::binary_search(refined[d].begin(),refined[d].end(),scores[d][i].second))
+                        known.push_back(scores[d][i]);
+                }
+                scores[d]=known;
+                for (unsigned int i=0;i<refined[d].size();++i){
+                    if (!std::binary_search(coarseLabels.begin(),coarseLabels.end(),refined[d][i]))
+                        nodesOfLabel[refined[d][i]].push_back(d);
+                }
+            }
+            for (typename std::map<int,std::vector<int> >::iterator it=nodesOfLabel.begin();it!=nodesOfLabel.end();++it){
+                cacheRegistrationPotentials(it->first);
+                for (unsigned int i=0;i<it->second.size();++i){
+                    int d=it->second[i];
+                    float pot=getUnaryRegistrationPotential(d,it->first);
+                    unaries[d][it->first]=pot;
+                    scores[d].push_back(std::make_pair(float(unaryWeight*pot),it->first));
+                }
+            }
+            LOGV(1)<<"Evaluated "<<nodesOfLabel.size()<<" refined labels"<<std::endl;
+
+            m_candidateUnaries=std::vector<std::vector<float> >(nNodes);
+            double avgCandidates=0.0;
+            for (int d=0;d<nNodes;++d){
+                std::vector<std::pair<float,int> > bounds=addConsistencyBound(d,scores[d],neighbours[d],best,pairwiseWeight);
+                std::vector<int> labels=selectCandidates(bounds,nCandidates,zeroLabel);
+                //the zero displacement is on the coarse lattice and always survives, so all candidates have been evaluated
+                for (unsigned int i=0;i<labels.size();++i){
+                    m_candidateUnaries[d].push_back(unaries[d][labels[i]]);
+                }
+                unaries[d]=std::map<int,float>();
+                mapper->setNodeLabels(d,labels);
+                avgCandidates+=labels.size();
+            }
+            LOGV(1)<<"Average number of registration labels per node: "<<avgCandidates/nNodes<<" of "<<this->m_nDisplacementLabels<<std::endl;
+            logResetStage;
+            return true;
+        }
+        ///unary of the i-th label of node d, only valid after computeRegistrationLabelSubsets
+        inline double getCandidateUnaryRegistrationPotential(int d, int i){
+            return m_candidateUnaries[d][i];
+        }
+        void freeCandidateUnaries(){
+            m_candidateUnaries=std::vector<std::vector<float> >();
+        }
+
+    protected:
+        ///labels of the largest displacements along each axis, or all non-zero labels if the label mapper has none
+        std::vector<int> getAxisExtremeLabels(){
+            std::vector<int> result,nonZero;
+            for (int l=0;l<this->m_nDisplacementLabels;++l){
+                RegistrationLabelType disp=this->m_labelMapper->getLabel(l);
+                int nAxes=0;
+                bool extreme=false;
+                for (unsigned int d=0;d<ImageType::ImageDimension;++d){
+                    if (disp[d]!=0.0){
+                        ++nAxes;
+                        extreme=fabs(disp[d])>=this->m_nDisplacementSamplesPerAxis;
+                    }
+                }
+                if (nAxes) nonZero.push_back(l);
+                if (nAxes==1 && extreme) result.push_back(l);
+            }
+            return result.size()?result:nonZero;
+        }
+        ///score = unary + sum over neighbours of min over their best labels of (their unary + pairwise)
+        std::vector<std::pair<float,int> > addConsistencyBound(int d, const std::vector<std::pair<float,int> > & unaries, const std::vector<int> & neighbours,
+                                                               const std::vector<std::vector<std::pair<float,int> > > & best, double pairwiseWeight){
+            std::vector<std::pair<float,int> > result(unaries);
+            if (pairwiseWeight<=0.0) return result;
+            for (unsigned int l=0;l<result.size();++l){
+                for (unsigned int n=0;n<neighbours.size();++n){
+                    const std::vector<std::pair<float,int> > & nBest=best[neighbours[n]];
+                    float minCost=std::numeric_limits<float>::max();
+                    for (unsigned int i=0;i<nBest.size();++i){
+                        float cost=nBest[i].first+pairwiseWeight*this->getPairwiseRegistrationPotential(d,neighbours[n],result[l].second,nBest[i].second);
+                        minCost=std::min(minCost,cost);
+                    }
+                    result[l].first+=minCost;
+                }
+            }
+            return result;
+        }
+        ///labels with the nCandidates lowest scores, plus the zero displacement, in increasing label order
+        std::vector<int> selectCandidates(std::vector<std::pair<float,int> > scores, int nCandidates, int zeroLabel){
+            int n=std::min(nCandidates,int(scores.size()));
+            std::partial_sort(scores.begin(),scores.begin()+n,scores.end());
+            std::vector<int> result;
+            bool haveZero=false;
+            for (int i=0;i<n;++i){
+                result.push_back(scores[i].second);
+                haveZero=haveZero || (scores[i].second==zeroLabel);
+            }
+            if (!haveZero) result.push_back(zeroLabel);
+            std::sort(result.begin(),result.end());
+            return result;
+        }
+
 
     };
 }
@@ -122,6 +122,14 @@ namespace SRS{
   bool m_reducedSegNodes;
   double m_coherenceThresh;
 
+  ///map between consecutive and full grid indices of the optimized registration nodes, the other nodes are frozen
+  std::vector<int> m_regMapIdx,m_regMapIdxRev;
+  bool m_reducedRegNodes;
+  double m_registrationUnaryNormalizer;
+
+  ///segmentation potentials do not depend on the deformation and are kept across the iterations of a level
+  std::vector<float> m_segmentationUnaryCache,m_segmentationEdgeWeightCache;
+
   public:
   int getMaxRegSegNeighbors(){return m_maxRegSegNeighbors;}
   GraphModel(){
@@ -133,6 +141,7 @@ namespace SRS{
     m_DisplacementScalingFactor=1.0;
     m_normalizePotentials=false;
     m_reducedSegNodes=false;
+    m_reducedRegNodes=false;
     m_labelMapper=NULL;
   };
   ~GraphModel(){
@@ -150,6 +159,10 @@ namespace SRS{
         
   ImagePointerType getCoarseGraphImage(){ return this->m_coarseGraphImage;}
   void initGraph(int nGraphNodesPerEdge){
+    clearSegmentationCache();
+    m_reducedRegNodes=false;
+    m_regMapIdx.clear();
+    m_regMapIdxRev.clear();
     if (!m_labelMapper){
       LOG<<"ERROR: Labelmapper not set"<<endl;
       exit(0);
@@ -243,6 +256,7 @@ namespace SRS{
                          
         
     m_segmentationUnaryNormalizer=m_nSegmentationNodes;
+    m_registrationUnaryNormalizer=m_nRegistrationNodes;
     LOGV(1)<<" finished graph init" <<std::endl;
     logResetStage;
   }
@@ -304,7 +318,7 @@ namespace SRS{
   }
     
 
-  void SetTargetSegmentation(ConstImagePointerType seg){m_targetSegmentationImage=seg;}
+  void SetTargetSegmentation(ConstImagePointerType seg){m_targetSegmentationImage=seg;clearSegmentationCache();}
   int GetTargetSegmentationAtIdx(int idx){
     return 0;
     if (m_targetSegmentationImage.IsNotNull()){
@@ -317,6 +331,7 @@ namespace SRS{
 
   ///reduces the nodes for which segmentation labels are computed, based on the coherence potential
   void ReduceSegmentationNodesByCoherencePotential(double thresh){
+    clearSegmentationCache();
     m_coherenceThresh=thresh;
     LOGV(1)<<"Removing all segmentation nodes with coherence potential larger "<<thresh<<" for all non-aux labels."<<endl;
 
@@ -363,10 +378,39 @@ namespace SRS{
     m_reducedSegNodes=true;
 
   }
+
+  ///restricts the registration graph to the grid nodes n with active[n]. The other nodes are frozen at the zero displacement, keeping the deformation of the coarser levels
+  void setActiveRegistrationNodes(const std::vector<bool> & active){
+    int nNodes=1;
+    for (unsigned int d=0;d<m_dim;++d) nNodes*=m_gridSize[d];
+    m_reducedRegNodes=false;
+    m_regMapIdx=std::vector<int>(nNodes,-1);
+    m_regMapIdxRev.clear();
+    for (int n=0;n<nNodes;++n){
+      if (active[n]){
+	m_regMapIdx[n]=m_regMapIdxRev.size();
+	m_regMapIdxRev.push_back(n);
+      }
+    }
+    int nActive=m_regMapIdxRev.size();
+    if (nActive==0 || nActive==nNodes){
+      m_regMapIdx.clear();
+      m_regMapIdxRev.clear();
+      nActive=nNodes;
+    }else{
+      m_reducedRegNodes=true;
+    }
+    m_nRegistrationNodes=nActive;
+    m_nNodes=m_nRegistrationNodes+m_nSegmentationNodes;
+    LOG<<"Reduced number of registration nodes to "<<100.0*nActive/nNodes<<"%; "<<nNodes<<"->"<<nActive<<endl;
+  }
      
   ///return position index in coarse graph from coarse graph node index
   inline  IndexType  getGraphIndex(int nodeIndex){
     IndexType position;
+    if (m_reducedRegNodes) {
+      nodeIndex=m_regMapIdxRev[nodeIndex];
+    }
     for ( int d=m_dim-1;d>=0;--d){
       //position[d] is now the index in the coarse graph (image)
       position[d]=nodeIndex/m_graphLevelDivisors[d];
@@ -426,12 +470,15 @@ namespace SRS{
     return position;
   }
 
-  /// get integer index of a graph node
+  /// get integer index of a graph node, -1 if the node is frozen
   inline int  getGraphIntegerIndex(IndexType gridIndex){
     int i=0;
     for (unsigned int d=0;d<m_dim;++d){
       i+=gridIndex[d]*m_graphLevelDivisors[d];
     }
+    if (m_reducedRegNodes) {
+      i=m_regMapIdx[i];
+    }
     return i;
   }
 
@@ -470,10 +517,36 @@ namespace SRS{
     RegistrationLabelType l=this->m_labelMapper->getLabel(labelIndex);
     l=this->m_labelMapper->scaleDisplacement(l,getDisplacementFactor());
     double result=m_unaryRegFunction->getPotential(imageIndex,l);
-    if (m_normalizePotentials) result/=m_nRegistrationNodes;
+    if (m_normalizePotentials) result/=m_registrationUnaryNormalizer;
+    if (m_reducedRegNodes) result+=getFrozenNeighbourRegistrationPotential(nodeIndex,labelIndex);
     return result;//m_nRegistrationNodes;
   }
 
+  /**
+   * Pairwise registration potentials between a node and its frozen neighbours, which keep the zero displacement.
+   * They are added to the unary potential, scaled such that the unary registration weight of the solver yields the pairwise one.
+   */
+  inline double getFrozenNeighbourRegistrationPotential(int nodeIndex,int labelIndex){
+    if (m_config.unaryRegistrationWeight<=0.0) return 0.0;
+    IndexType position=getGraphIndex(nodeIndex);
+    int zeroLabel=this->m_labelMapper->getZeroDisplacementIndex();
+    double result=0.0;
+    for ( int d=0;d<(int)m_dim;++d){
+      for (int step=-1;step<=1;step+=2){
+	IndexType neighbour=position;
+	neighbour[d]+=step;
+	if ((int)neighbour[d]<0 || (int)neighbour[d]>=(int)m_gridSize[d] || getGraphIntegerIndex(neighbour)>=0) continue;
+	//edges point from the lower to the higher node index
+	if (step<0){
+	  result+=getPairwiseRegistrationPotential(neighbour,position,zeroLabel,labelIndex);
+	}else{
+	  result+=getPairwiseRegistrationPotential(position,neighbour,labelIndex,zeroLabel);
+	}
+      }
+    }
+    return result*m_config.pairwiseRegistrationWeight/m_config.unaryRegistrationWeight;
+  }
+
   /**
    * Get Unary segmentation potential for node/label combination
    */
@@ -510,14 +583,25 @@ namespace SRS{
     return result;
   };
 
+  /**
+   * select per-node registration label subsets, only supported by graphs caching the registration unaries
+   */
+  bool computeRegistrationLabelSubsets(double unaryWeight, double pairwiseWeight){return false;}
+  inline double getCandidateUnaryRegistrationPotential(int nodeIndex, int i){
+    return getUnaryRegistrationPotential(nodeIndex,this->m_labelMapper->getNodeLabel(nodeIndex,i));
+  }
+  void freeCandidateUnaries(){}
+
   /**
    * Get pairwise registration potential for node/label,node/label combination
    */
   inline double getPairwiseRegistrationPotential(int nodeIndex1, int nodeIndex2, int labelIndex1, int labelIndex2){
             
     /// get graph coordinates
-    IndexType graphIndex1=getGraphIndex(nodeIndex1);
-    IndexType graphIndex2=getGraphIndex(nodeIndex2);
+    return getPairwiseRegistrationPotential(getGraphIndex(nodeIndex1),getGraphIndex(nodeIndex2),labelIndex1,labelIndex2);
+  }
+  ///pairwise registration potential between two positions in the coarse graph
+  inline double getPairwiseRegistrationPotential(IndexType graphIndex1, IndexType graphIndex2, int labelIndex1, int labelIndex2){
     ///get physical coordinates
     PointType pt1,pt2;
     this->m_coarseGraphImage->TransformIndexToPhysicalPoint(graphIndex1,pt1);
@@ -625,7 +709,32 @@ namespace SRS{
     if (m_normalizePotentials) result/=m_nSegRegEdges;
     return result;
   }
-        
+
+   /**
+   * Precompute coherence potentials of all segmentation nodes for one registration label
+   */
+  void cacheCoherencePotentials(int labelIndex1){
+    RegistrationLabelType registrationLabel=this->m_labelMapper->getLabel(labelIndex1);
+    registrationLabel=this->m_labelMapper->scaleDisplacement(registrationLabel,getDisplacementFactor());
+    m_pairwiseSegRegFunction->cachePotentials(registrationLabel);
+  }
+  void freeCoherencePotentials(){
+    m_pairwiseSegRegFunction->freeMemory();
+  }
+
+   /**
+   * Get pairwise coherence potential for seg node/label and the registration label of the last cacheCoherencePotentials call
+   */
+  inline double getCachedPairwiseRegSegPotential(int nodeIndex2, int segmentationLabel){
+    IndexType imageIndex=getImageIndex(nodeIndex2);
+    if (m_targetSegmentationImage.IsNotNull()){
+      segmentationLabel=m_targetSegmentationImage->GetPixel(imageIndex);
+    }
+    double result = m_pairwiseSegRegFunction->getCachedPotential(imageIndex,segmentationLabel);
+    if (m_normalizePotentials) result/=m_nSegRegEdges;
+    return result;
+  }
+
    /**
    * Get pairwise segmentation potential for seg node/label, seg node/label combination
    */
@@ -644,6 +753,58 @@ namespace SRS{
     return result;
   }
 
+   /**
+   * true if the pairwise registration potential of every edge is the same function of the two labels
+   */
+  bool hasLabelDistanceRegistrationPairwise(){
+    return m_pairwiseRegFunction->isLabelDistance();
+  }
+
+   /**
+   * true if the pairwise segmentation potential of each edge is getPairwiseSegmentationPotential(n1,n2,0,1) for all different labels and zero otherwise
+   */
+  bool hasPottsSegmentationPairwise(){
+    //labels are replaced by the target segmentation if it is known
+    return m_targetSegmentationImage.IsNull() && m_pairwiseSegFunction->isPotts();
+  }
+
+   /**
+   * Potts weights of all forward segmentation edges in one flat array, computed in parallel.
+   * weights[d*m_dim+i] is getPairwiseSegmentationPotential(d,n,0,1) for the i-th entry n of getForwardSegmentationNeighbours(d), unused slots are zero.
+   * Only meaningful if hasPottsSegmentationPairwise(). The array is reused until clearSegmentationCache().
+   */
+  const std::vector<float> & getSegmentationEdgeWeights(){
+    if (m_segmentationEdgeWeightCache.size()) return m_segmentationEdgeWeightCache;
+    long int nNodes=m_nSegmentationNodes;
+    std::vector<float> & weights=m_segmentationEdgeWeightCache;
+    weights.assign(nNodes*m_dim,0.0);
+#pragma omp parallel for schedule(static)
+    for (long int d=0;d<nNodes;++d){
+      std::vector<int> neighbours=getForwardSegmentationNeighbours(d);
+      for (unsigned int i=0;i<neighbours.size();++i){
+        weights[d*m_dim+i]=getPairwiseSegmentationPotential(d,neighbours[i],0,1);
+      }
+    }
+    return weights;
+  }
+
+   /**
+   * Unary segmentation potentials of all nodes, potentials[d*nSegLabels()+l] is getUnarySegmentationPotential(d,l).
+   * They are computed once and reused by all iterations until clearSegmentationCache(), unless the segmentation nodes
+   * are reduced by the coherence potential, which changes with the deformation.
+   */
+  const std::vector<float> & getUnarySegmentationPotentials(){
+    if (m_segmentationUnaryCache.size() && !m_reducedSegNodes) return m_segmentationUnaryCache;
+    long int nNodes=m_nSegmentationNodes;
+    int nLabels=m_nSegmentationLabels;
+    std::vector<float> & potentials=m_segmentationUnaryCache;
+    potentials.resize(nNodes*nLabels);
+    for (long int d=0;d<nNodes;++d){
+      for (int l=0;l<nLabels;++l) potentials[d*nLabels+l]=getUnarySegmentationPotential(d,l);
+    }
+    return potentials;
+  }
+
    /**
    * DEPRECATED
    */
@@ -671,7 +832,8 @@ namespace SRS{
       off.Fill(0);
       if ((int)position[d]<(int)m_gridSize[d]-1){
 	off[d]+=1;
-	neighbours.push_back(getGraphIntegerIndex(position+off));
+	int idx=getGraphIntegerIndex(position+off);
+	if (idx>=0) neighbours.push_back(idx);
       }
     }
     return neighbours;
@@ -722,7 +884,7 @@ namespace SRS{
     ///only valid if a segmentation node can have multiple registration graph neighbors, eg when linear++ interpolation is used
     IndexType position=getLowerGraphIndex(getImageIndex(index));
 
-    neighbours.push_back(getGraphIntegerIndex(position));
+    if (getGraphIntegerIndex(position)>=0) neighbours.push_back(getGraphIntegerIndex(position));
 
         
     OffsetType off;
@@ -747,14 +909,16 @@ namespace SRS{
       }
       if (inBounds){
 	//LOG<<getImageIndex(index)<<" "<<position<<" "<<off<<" "<<position+off<<" "<<getGraphIntegerIndex(position+off)<<std::endl;
-	neighbours.push_back(getGraphIntegerIndex(position+off));
+	int idx=getGraphIntegerIndex(position+off);
+	if (idx>=0) neighbours.push_back(idx);
       }
     }
 #else
     IndexType idx=getImageIndex(index);
     /// standard NN interpolation, only one neighbor
     IndexType position=getClosestGraphIndex(idx);
-    neighbours.push_back(getGraphIntegerIndex(position));
+    int regIdx=getGraphIntegerIndex(position);
+    if (regIdx>=0) neighbours.push_back(regIdx);
  
 #endif
     return neighbours;
@@ -771,14 +935,22 @@ namespace SRS{
     result->SetOrigin(m_origin);
     result->Allocate();
     typename itk::ImageRegionIterator<RegistrationLabelImageType> it(result,region);
-    unsigned int i=0;
+    unsigned int i=0,n=0;
     for (it.GoToBegin();!it.IsAtEnd();++it,++i){
-      assert(i<labels.size());
-      RegistrationLabelType l=this->m_labelMapper->getLabel(labels[i]);
+      if (m_reducedRegNodes && m_regMapIdx[i]<0){
+	//frozen nodes keep the deformation of the coarser levels
+	RegistrationLabelType l;
+	l.Fill(0);
+	it.Set(l);
+	continue;
+      }
+      assert(n<labels.size());
+      RegistrationLabelType l=this->m_labelMapper->getLabel(labels[n]);
       l=this->m_labelMapper->scaleDisplacement(l,getDisplacementFactor());
       it.Set(l);
+      ++n;
     }
-    assert(i==(labels.size()));
+    assert(n==(labels.size()));
     //LOGV(8)<<"git "<<labels.size()<<" registration labels which were transformed into a deformation field with parameters : "<<result<<endl;
     return result;
   }
@@ -866,9 +1038,16 @@ namespace SRS{
   }
   void setUnarySegmentationFunction(UnarySegmentationFunctionPointerType func){
     m_unarySegFunction=func;
+    clearSegmentationCache();
   }
   void setPairwiseSegmentationFunction(PairwiseSegmentationFunctionPointerType func){
     m_pairwiseSegFunction=func;
+    clearSegmentationCache();
+  }
+  ///forget cached segmentation potentials, needed whenever the segmentation nodes or their potentials change
+  void clearSegmentationCache(){
+    m_segmentationUnaryCache=std::vector<float>();
+    m_segmentationEdgeWeightCache=std::vector<float>();
   }
   void setPairwiseCoherenceFunction( PairwiseCoherenceFunctionPointerType func){
     m_pairwiseSegRegFunction=func;
@@ -47,6 +47,8 @@
 #include "itkImageIteratorWithIndex.h"
 #include "itkImageConstIterator.h"
 #include "FilterUtils.hpp"
+#include "ControlPointDeformation.h"
+#include "ImagePyramid.h"
 #include <itkImageAdaptor.h>
 #include <itkAddPixelAccessor.h> 
 #include "itkVectorImage.h"
@@ -112,6 +114,7 @@ namespace SRS{
         typedef typename DeformationFieldType::Pointer DeformationFieldPointerType;
         typedef SparseRegistrationLabelMapper<ImageType,LabelType> SparseLabelMapperType;
         typedef BaseLabelMapper<ImageType,LabelType> BaseLabelMapperType;
+        typedef AdaptiveRegistrationLabelMapper<ImageType,LabelType> AdaptiveLabelMapperType;
 
         typedef itk::ImageRegionIterator< DeformationFieldType>       LabelIteratorType;
         typedef itk::VectorLinearInterpolateImageFunction<DeformationFieldType, double> LabelInterpolatorType;
@@ -153,6 +156,8 @@ namespace SRS{
         PairwiseSegmentationPotentialPointerType m_pairwiseSegmentationPot;
         PairwiseRegistrationPotentialPointerType m_pairwiseRegistrationPot;
         PairwiseCoherencePotentialPointerType m_pairwiseCoherencePot;
+        ///downsampled images of the current run, shared with the potentials
+        ImagePyramid<ImageType> m_pyramid;
         double lastEnergy;
     public:
         HierarchicalSRSImageToImageFilter(){
@@ -245,7 +250,11 @@ namespace SRS{
             m_targetGradientImage = this->GetInput(3);
             m_atlasGradientImage=this->GetInput(4);
 
-          
+            m_pyramid.clear();
+            m_pyramid.setMaxSizeMB(m_config->pyramidSizeMB);
+            m_unaryRegistrationPot->SetImagePyramid(getPyramid());
+            m_unarySegmentationPot->SetImagePyramid(getPyramid());
+            m_pairwiseSegmentationPot->SetImagePyramid(getPyramid());
 
             if (regist || coherence){
                 m_unaryRegistrationPot->setThreshold(m_config->thresh_UnaryReg);
@@ -359,7 +368,13 @@ namespace SRS{
 
             ConstImagePointerType m_inputTargetImage=m_targetImage;
             
-            SparseLabelMapperType * labelmapper=new SparseLabelMapperType(m_config->nSegmentations,m_config->nRegSamples[0]);
+            BaseLabelMapperType * labelmapper;
+            if (m_config->adaptiveLabels>0){
+                //dense displacement lattice, pruned per node to the most promising labels before optimization
+                labelmapper=new AdaptiveLabelMapperType(m_config->nSegmentations,m_config->nRegSamples[0],m_config->adaptiveLabels,m_config->adaptiveLabelStride);
+            }else{
+                labelmapper=new SparseLabelMapperType(m_config->nSegmentations,m_config->nRegSamples[0]);
+            }
             LOGV(5)<<VAR(m_config->nSegmentations)<<" "<<VAR(labelmapper->getNumberOfSegmentationLabels())<<std::endl;
             int iterationCount=0; 
             int level;
@@ -373,6 +388,8 @@ namespace SRS{
                 if (coherence){
                     m_pairwiseCoherencePot->SetNumberOfSegmentationLabels(m_config->nSegmentations);
 		    m_pairwiseCoherencePot->SetAuxLabel(m_config->auxiliaryLabel);
+                    m_pairwiseCoherencePot->SetCacheDirectory(m_config->cacheDirectory,m_config->cacheSizeMB);
+                    m_pairwiseCoherencePot->SetIncremental(m_config->incrementalTolerance>=0.0);
 		}
                 //m_pairwiseCoherencePot->SetAtlasSegmentation((ConstImagePointerType)deformedAtlasSegmentation);
             }
@@ -396,10 +413,24 @@ namespace SRS{
             int l=0;
             //check if any registration labels exist, if not, don't to multi-resolution stuff
             if (labelmapper->getNumberOfDisplacementSamplesPerAxis() == 0 ) l=m_config->nLevels-1;
+            int startLevel=l;
             bool pixelGrid = false;
 
             double tolerance=1000;
 
+            //downsample from fine to coarse before the levels are visited coarse to fine, so each level is computed from the previous one
+            std::vector<double> registrationScales,segmentationScales;
+            for (int i=l;i<m_config->nLevels;++i){
+                registrationScales.push_back(getRegistrationScaling(i));
+                segmentationScales.push_back(getSegmentationScaling(i));
+            }
+            if (getPyramid() && (regist || coherence)){
+                m_pyramid.build(m_inputTargetImage,registrationScales,true);
+                m_pyramid.build(m_atlasImage,registrationScales,true);
+            }
+            if (getPyramid() && m_config->segmentationScalingFactor != 0.0 && m_config->nSegmentationLevels>1){
+                m_pyramid.build(m_inputTargetImage,segmentationScales,true);
+            }
             
             //START OF MULTI-RES Hierarchy
             //------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -417,7 +448,7 @@ namespace SRS{
                 double reductionFactor=pow(mantisse,exponent);
                 double scaling=1.0/reductionFactor;
 
-                scaling=m_config->resamplingFactors[max(0,m_config->imageLevels-l-1)];
+                scaling=getRegistrationScaling(l);
 
                 LOGV(1)<<"Image downsampling factor for registration unary computation : "<<scaling<<" "<<mantisse<<" "<<exponent<<" "<<reductionFactor<<std::endl;
 
@@ -428,10 +459,10 @@ namespace SRS{
 
 		//computing downscaling factor for segmentation estimation if requested
                 if (m_config->segmentationScalingFactor != 0.0 && m_config->nSegmentationLevels>1){
-                    segmentationScalingFactor=pow(m_config->segmentationScalingFactor,m_config->nSegmentationLevels-l-1);
+                    segmentationScalingFactor=getSegmentationScaling(l);
                     //segmentationScalingFactor=max(m_config->segmentationScalingFactor,m_config->resamplingFactors[max(0,m_config->nSegmentationLevels-l-1)]);
                     LOGV(4)<<VAR(segmentationScalingFactor)<<std::endl;
-                    m_targetImage=FilterUtils<ImageType>::LinearResample(m_inputTargetImage,segmentationScalingFactor,true);
+                    m_targetImage=ImagePyramid<ImageType>::LinearResample(getPyramid(),m_inputTargetImage,segmentationScalingFactor,true);
                 }else if (m_config->segmentationScalingFactor == 0.0){
                     LOG<<"Using same grid control point resolution for both registration and segmentation sub-graph!"<<std::endl;
                     logSetStage("segmentation grid size estimation");
@@ -447,7 +478,7 @@ namespace SRS{
                     segmentationScalingFactor = 1.0*graph->getCoarseGraphImage()->GetLargestPossibleRegion().GetSize()[0]/m_inputTargetImage->GetLargestPossibleRegion().GetSize()[0];
                     LOGV(4)<<VAR(segmentationScalingFactor)<<std::endl;
 
-                    m_targetImage=FilterUtils<ImageType>::LinearResample(m_inputTargetImage,(ConstImagePointerType)graph->getCoarseGraphImage(),true);
+                    m_targetImage=ImagePyramid<ImageType>::LinearResample(getPyramid(),m_inputTargetImage,(ConstImagePointerType)graph->getCoarseGraphImage(),true);
                     LOGV(4)<<"downsampled image" << endl;
                     LOGV(4)<<VAR(graph->getCoarseGraphImage()->GetSpacing())<<std::endl;
                     logResetStage;
@@ -554,6 +585,8 @@ namespace SRS{
                 }                
 
                 bool converged=false;
+                //deformation the current deformedAtlasSegmentation was warped with, within this level
+                DeformationFieldPointerType warpedDeformation=NULL;
                 double oldEnergy=1,newEnergy=01,oldWorseEnergy=-1.0;
                 int i=0;
                 std::vector<int> defLabels,segLabels, oldDefLabels,oldSegLabels;
@@ -587,8 +620,18 @@ namespace SRS{
                     }
                     if (coherence || (regist && m_config->verbose>6)){
                         
-                        DeformationFieldPointerType scaledDeformation=TransfUtils<ImageType>::bSplineInterpolateDeformationField(previousFullDeformation,m_targetImage,false);
-                        deformedAtlasSegmentation=TransfUtils<ImageType>::warpImage(m_atlasSegmentationImage,scaledDeformation,true);
+                        //warp directly with the control point deformation instead of materializing it at full resolution
+                        ControlPointDeformation<DeformationFieldType> controlPoints(previousFullDeformation);
+                        if (warpedDeformation.IsNotNull() && m_config->incrementalTolerance>=0.0){
+                            //only re-warp where control points moved since the last iteration
+                            ControlPointDeformation<DeformationFieldType> previousControlPoints(warpedDeformation);
+                            long int nUpdated=0;
+                            deformedAtlasSegmentation=controlPoints.updateWarpedImage(m_atlasSegmentationImage.GetPointer(),deformedAtlasSegmentation.GetPointer(),previousControlPoints,m_config->incrementalTolerance,true,&nUpdated);
+                            LOGV(2)<<"Re-warped "<<nUpdated<<" of "<<deformedAtlasSegmentation->GetLargestPossibleRegion().GetNumberOfPixels()<<" atlas segmentation pixels"<<std::endl;
+                        }else{
+                            deformedAtlasSegmentation=controlPoints.warpImage(m_atlasSegmentationImage.GetPointer(),m_targetImage.GetPointer(),true);
+                        }
+                        warpedDeformation=previousFullDeformation;
                         if (coherence){
                             TIME(m_pairwiseCoherencePot->SetAtlasSegmentation((ConstImagePointerType)deformedAtlasSegmentation));
                         }
@@ -602,6 +645,24 @@ namespace SRS{
                     }
                  
 
+                    //optimize only the control points which need a finer deformation than the previous level provides
+                    if (regist && i==0 && l>startLevel && m_config->adaptiveGrid>0.0){
+                        if (segment && coherence){
+                            LOG<<"WARNING: adaptive control grid not supported with joint segmentation and coherence, optimizing all control points"<<std::endl;
+                        }else if (m_config->unaryRegistrationWeight<=0.0){
+                            LOG<<"WARNING: adaptive control grid requires a positive unary registration weight, optimizing all control points"<<std::endl;
+                        }else{
+                            ConstImagePointerType warpedAtlasSegmentation=NULL;
+                            if (coherence || m_config->verbose>6){
+                                warpedAtlasSegmentation=(ConstImagePointerType)deformedAtlasSegmentation;
+                            }else if (m_atlasSegmentationImage.IsNotNull()){
+                                ControlPointDeformation<DeformationFieldType> controlPoints(previousFullDeformation);
+                                warpedAtlasSegmentation=(ConstImagePointerType)controlPoints.warpImage(m_atlasSegmentationImage.GetPointer(),m_targetImage.GetPointer(),true);
+                            }
+                            TIME(graph->RefineRegistrationNodes(warpedAtlasSegmentation,m_config->adaptiveGrid));
+                        }
+                    }
+
                     if (segment && coherence && m_config->segDistThresh!= -1){
                         graph->ReduceSegmentationNodesByCoherencePotential(m_config->segDistThresh);
                     }
@@ -655,6 +716,7 @@ namespace SRS{
                                                           m_config->pairwiseSegmentationWeight,//*(segmentationScalingFactor),
                                                           m_config->pairwiseCoherenceWeight,//*pow( m_config->coherenceMultiplier,l),
                                                           m_config->verbose);
+                            static_cast<MRFSolverType * >(mrfSolver)->setParallelBlocks(m_config->gcoBlocks);
 #else
                             LOG<<"OPTIMIZER NOT INCLUDED, ABORTING"<<std::endl;
 #endif
@@ -838,7 +900,24 @@ namespace SRS{
 	    m_finalDeformation=previousFullDeformation;
 
             delete labelmapper;
+            m_pyramid.clear();
         }//run
+
+        ///the shared pyramid, or NULL if every level is resampled from the full resolution images
+        ImagePyramid<ImageType> * getPyramid(){
+            return m_config->noSharedPyramid?NULL:&m_pyramid;
+        }
+        ///downsampling factor of the images in the registration unary at level l
+        double getRegistrationScaling(int l){
+            return m_config->resamplingFactors[max(0,m_config->imageLevels-l-1)];
+        }
+        ///downsampling factor of the target image for the segmentation at level l
+        double getSegmentationScaling(int l){
+            if (m_config->segmentationScalingFactor != 0.0 && m_config->nSegmentationLevels>1){
+                return pow(m_config->segmentationScalingFactor,m_config->nSegmentationLevels-l-1);
+            }
+            return 1.0;
+        }
       
        
         
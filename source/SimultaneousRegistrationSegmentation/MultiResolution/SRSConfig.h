@@ -27,6 +27,10 @@ namespace SRS{
     std::string segmentationProbsFilename, pairWiseProbsFilename, targetAnatomyPriorFilename,affineBulkTransform,bulkTransformationField,ROIFilename,groundTruthSegmentationFilename;
     std::string targetRGBImageFilename,atlasRGBImageFilename;
     std::string logFileName,segmentationUnaryProbFilename;
+    std::string cacheDirectory;
+    double cacheSizeMB;
+    double pyramidSizeMB;
+    bool noSharedPyramid;
     int auxiliaryLabel;/// Label to tell SRS that this is not a target anatomy label.
     double pairwiseRegistrationWeight;
     double pairwiseSegmentationWeight;
@@ -64,6 +68,7 @@ namespace SRS{
     double coherenceMultiplier;
     bool dontNormalizeRegUnaries;
     double ARSTolerance;
+    double incrementalTolerance;
     bool centerImages;
     double toleranceBase;
     bool penalizeOutside;
@@ -78,9 +83,12 @@ namespace SRS{
     bool useLowResBSpline;
     std::string atlasLandmarkFilename,targetLandmarkFilename;
     std::vector<int> nRegSamples;
+    int adaptiveLabels,adaptiveLabelStride;
+    double adaptiveGrid;
     std::vector<double> resamplingFactors;
     int nSegmentationLevels;
     std::string solver;
+    int gcoBlocks;
   private:
     ArgumentParser * as;
   public:
@@ -141,6 +149,7 @@ namespace SRS{
       coherenceMultiplier=1.0;
       dontNormalizeRegUnaries=false;
       ARSTolerance=-1.0;
+      incrementalTolerance=0.0;
       centerImages=false;
       segmentationScalingFactor=1.0;
       toleranceBase=2.0;
@@ -152,11 +161,19 @@ namespace SRS{
       targetRGBImageFilename="";
       atlasRGBImageFilename="";
       segmentationUnaryProbFilename="";
+      cacheDirectory="";
+      cacheSizeMB=0;
+      pyramidSizeMB=0;
+      noSharedPyramid=false;
       theta=0;
       linearDeformationInterpolation=false;
       histNorm=false;
       nSegmentationLevels=1;
       solver="GCO";
+      gcoBlocks=0;
+      adaptiveLabels=0;
+      adaptiveLabelStride=2;
+      adaptiveGrid=0.0;
     }
     ~SRSConfig(){
       delete as;
@@ -189,6 +206,11 @@ namespace SRS{
       displacementSampling=c.displacementSampling;
       unaryWeight=c.unaryWeight;
       maxDisplacement=c.maxDisplacement;
+      adaptiveLabels=c.adaptiveLabels;
+      adaptiveLabelStride=c.adaptiveLabelStride;
+      adaptiveGrid=c.adaptiveGrid;
+      gcoBlocks=c.gcoBlocks;
+      noSharedPyramid=c.noSharedPyramid;
       nSegmentations=c.nSegmentations;
       verbose=c.verbose;
       levels=c.levels;
@@ -297,6 +319,9 @@ namespace SRS{
       //other params
       as->parameter ("max", maxDisplacement,"number of displacement samples per axis", false);
       as->parameter ("samp",regSampleString,"displacement sampling hierarchy, eg 6x4x2 for 3 levels", false);
+      as->parameter ("adaptiveLabels",adaptiveLabels,"number of displacement labels kept per registration node after coarse-to-fine pruning (0=use all labels)", false,optionalParameter);
+      as->parameter ("adaptiveLabelStride",adaptiveLabelStride,"stride of the coarse displacement lattice used for adaptive label pruning", false,optionalParameter);
+      as->parameter ("adaptiveGrid",adaptiveGrid,"after the first level, only optimize control points near atlas segmentation boundaries or whose unary cost range exceeds this multiple of the median range; the others keep the interpolated coarser deformation (0=optimize all)", false,optionalParameter);
       as->parameter ("nLevels", nLevels,"number of grid multiresolution pyramid levels", false);
       imageLevels=nLevels;
       as->parameter ("nImageLevels", imageLevels,"number of image multiresolution  levels", false);
@@ -307,11 +332,17 @@ namespace SRS{
       as->parameter ("r",displacementRescalingFactor,"displacementRescalingFactor", false);
       as->parameter ("asymmetry",asymmetry,"asymmetry in segreg potential", false,optionalParameter);
       as->parameter ("displacementScaling",displacementScaling,"Scaling of displacement labels relative to image spacing. WARNING: if set larger than 1, diffeomorphic registrations are no longer guaranteed!", false,optionalParameter);
+      as->parameter ("incrementalTolerance",incrementalTolerance,"control point updates smaller than this (mm) are ignored when re-warping the atlas segmentation between iterations. 0 is exact, <0 recomputes everything.", false,optionalParameter);
       as->parameter ("toleranceBase",toleranceBase,"Base for computing the coherence tolerance at different l evels of the grid pyramid.", false,optionalParameter);
 
       as->parameter ("segmentationProbs", segmentationProbsFilename,"segmentation probabilities  filename (legacy?)", false,optionalParameter);
 
       as->parameter ("segmentationUnaryProbs", segmentationUnaryProbFilename,"segmentation unaries probabilities  filename", false,optionalParameter);
+      as->parameter ("cache", cacheDirectory,"directory for caching derived atlas images (sheetness, histogram matching, distance transforms) across runs, keyed by image content", false,optionalParameter);
+      as->parameter ("coherenceCache", cacheDirectory,"deprecated alias of -cache", false,optionalParameter);
+      as->parameter ("cacheSize", cacheSizeMB,"maximal size of the cache directory in MB, least recently used entries are removed first (0=unlimited)", false,optionalParameter);
+      as->parameter ("pyramidSize", pyramidSizeMB,"maximal memory in MB for the downsampled images kept between resolution levels, least recently used levels are dropped first (0=unlimited)", false,optionalParameter);
+      as->option ("noSharedPyramid", noSharedPyramid,"resample every level from the full resolution images instead of from the shared pyramid, whose cascaded smoothing only approximates direct resampling",optionalParameter);
 
         
       as->parameter ("pairwiseProbs", pairWiseProbsFilename,"pairwise segmentation probabilities filename", false,optionalParameter);
@@ -334,6 +365,7 @@ namespace SRS{
       as->option ("evalContinuously",evalContinuously ,"evaluate optimization at each step. slower, but also returns actual energy and changes in labellings during each iteration.,optionalParamete");
       //as->option ("GCO",GCO ,"Use (alpha expansion) graph cuts instead of TRW-S for optimization.");
       as->parameter ("solver",solver ,"choose solver for optimization (TRWS,GCO,OPENGM).",false);
+      as->parameter ("gcoBlocks",gcoBlocks ,"GCO: run alpha expansion on this many disjoint blocks of nodes in parallel before the global expansion, only with edge weight smoothness (0=off)", false,optionalParameter);
       as->option ("linearDeformationInterpolation",linearDeformationInterpolation ,"Use linear interpolation for deformation field upsampling.");
       as->option ("histNorm",histNorm ,"Use histogram normalization to adapt the atlas intensity distribution to the target.");
          
@@ -4,9 +4,13 @@
 #include "GCoptimization.h"
 #include <vector>
 #include <map>
+#include <algorithm>
 //#include <google/heap-profiler.h>
 #include <limits.h>
 #include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 
@@ -15,6 +19,16 @@ namespace SRS{
 
 /** \brief
    * Wrapper for Olga Vekslers Multilabel graph cut library
+   *
+   * If registration and segmentation are not coupled by coherence edges, and the graph reports that the registration
+   * smoothness is a pure label distance and the segmentation smoothness is Potts, all smoothness terms are passed to GCO
+   * as per-edge weights times a label distance table. GCO then evaluates them inline instead of calling
+   * GLOBALsmoothFunction for every edge and label pair. The edge weights and the table are computed in parallel.
+   *
+   * In that mode, setParallelBlocks(n) splits the nodes into n disjoint blocks of consecutive node indices (slabs of
+   * the grid) and runs alpha expansion on each block with its own GCoptimization instance in parallel. Edges leaving a
+   * block enter its data costs with the current label of the outside node. The block results are merged and refined
+   * by the usual expansion on the full graph; if merging raised the energy, the merged labelling is discarded.
    */
 template<class TGraphModel>
 class GCO_SRSMRFSolver :public BaseMRFSolver<TGraphModel>{
@@ -42,10 +56,26 @@ protected:
     int nRegLabels;
     int nSegLabels;
     bool m_segment, m_register,m_coherence;
+    //only the per-node label subsets of the graph's adaptive label mapper are feasible
+    bool m_adaptive;
     double m_lastLowerBound;
     std::vector<int> m_labelOrder;
     int m_zeroDisplacementLabel;
     bool m_deleteRegNeighb;
+    //smoothness as edge weight * m_smoothCosts[label1*nLabels+label2]
+    bool m_useLabelDistances,m_labelDistancePairwise;
+    std::vector<EnergyType> m_smoothCosts;
+    //number of blocks expanded in parallel before the global expansion, <=1 disables it
+    int m_nBlocks;
+    bool m_blockParallel;
+    //copies of the sparse data costs handed to GCO, only kept for block-parallel expansion
+    std::vector<std::vector<GCoptimization::SparseDataCost> > m_dataCosts;
+    std::vector<int> m_gcoLabelOrder;
+    struct WeightedEdge{
+        int node1,node2,slot1,slot2;
+        ///position in the flat edge weight array of the graph
+        long int weightIndex;
+    };
     
 
     
@@ -182,6 +212,9 @@ public:
         srand ( time(NULL) );
         m_cachePotentials=false;
         m_deleteRegNeighb=false;
+        m_useLabelDistances=true;
+        m_nBlocks=0;
+        m_blockParallel=false;
       
     }
     GCO_SRSMRFSolver()  {
@@ -230,6 +263,10 @@ public:
     }
 
     virtual void setPotentialCaching(bool enableCaching){m_cachePotentials=enableCaching;}
+    ///use edge weights and a label distance table whenever the potentials allow it (default)
+    void setLabelDistancePairwise(bool b){m_useLabelDistances=b;}
+    ///expand this many disjoint blocks of nodes in parallel before the global expansion, needs label distance smoothness
+    void setParallelBlocks(int n){m_nBlocks=n;}
 
     virtual void createGraph(){
         clock_t start = clock();
@@ -238,6 +275,7 @@ public:
             m_register=false;
             m_segment=0;
             m_register=0;
+            m_adaptive=false;
         }
         LOGV(1)<<"starting graph init"<<std::endl;
         this->m_GraphModel->Init();
@@ -259,6 +297,16 @@ public:
         m_register=((m_pairwiseSegmentationRegistrationWeight>0 || m_unaryRegistrationWeight>0 || m_pairwiseRegistrationWeight>0) && nRegLabels>1);
         m_segment=((m_pairwiseSegmentationRegistrationWeight>0 || m_unarySegmentationWeight>0 || m_pairwiseSegmentationWeight)  && nSegLabels>1);
         m_coherence=m_pairwiseSegmentationRegistrationWeight>0;
+        m_adaptive=m_register && this->m_GraphModel->computeRegistrationLabelSubsets(m_unaryRegistrationWeight,m_pairwiseRegistrationWeight);
+        //coherence edges between registration and segmentation nodes depend on both the node and the label pair
+        m_labelDistancePairwise=m_useLabelDistances && !(m_register && m_segment && m_coherence)
+            && (!m_register || this->m_GraphModel->hasLabelDistanceRegistrationPairwise())
+            && (!m_segment || this->m_GraphModel->hasPottsSegmentationPairwise());
+        LOGV(1)<<(m_labelDistancePairwise?"Using edge weights and label distances for GCO smoothness":"Using smoothness callback for GCO")<<std::endl;
+        //the callback path reads the graph model, which is not thread safe
+        m_blockParallel=m_nBlocks>1 && m_labelDistancePairwise;
+        if (m_nBlocks>1 && !m_blockParallel)
+            LOG<<"Block-parallel expansion needs edge weight smoothness, using the global expansion only"<<std::endl;
         GLOBALnRegNodes= m_register*nRegNodes;
         GLOBALnSegNodes= m_segment*nSegNodes;
         GLOBALnRegLabels=m_register*nRegLabels;
@@ -267,6 +315,7 @@ public:
         
         if (m_optimizer) delete m_optimizer;
         m_optimizer= new MRFType(GLOBALnSegNodes+GLOBALnRegNodes,GLOBALnRegLabels+GLOBALnSegLabels);
+        m_dataCosts=std::vector<std::vector<GCoptimization::SparseDataCost> >(m_blockParallel?GLOBALnRegLabels+GLOBALnSegLabels:0);
 		
         //set global size variables :(
         {
@@ -334,7 +383,10 @@ public:
             clock_t startUnary = clock();
             
             //now compute&set all potentials
-            if (m_unaryRegistrationWeight>0){
+            if (m_adaptive){
+                setAdaptiveRegistrationDataCosts();
+            }
+            else if (m_unaryRegistrationWeight>0){
 
                 //#pragma omp parallel for 
                 //theoretically, this computation could be parallelized
@@ -359,7 +411,7 @@ public:
                                 }
                             }
                         }
-                        m_optimizer->setDataCost(regLabel,costs,nRegNodes);
+                        setDataCost(regLabel,costs,nRegNodes);
                     }
             }
 
@@ -369,7 +421,7 @@ public:
             LOGV(1)<<"Registration Unaries took "<<t<<" seconds."<<std::endl;
             tUnary+=t;
             // Pairwise potentials
-            if (m_cachePotentials)
+            if (m_cachePotentials && !m_labelDistancePairwise)
                 regPairwise= new std::vector<std::vector<std::vector<std::map<int,float> > > > (nRegLabels,std::vector<std::vector<std::map<int,float> > >(nRegLabels,std::vector<std::map<int,float> > (nRegNodes) ) );
             
             for (int d=0;d<nRegNodes;++d){
@@ -382,7 +434,7 @@ public:
                         //LOG<<d<<" "<<regNodes[d]<<" "<<i<<" "<<neighbours[i]<<std::endl;
                         //m_optimizer->setNeighbors(d,neighbours[i],1);
                         addNeighbor(d,neighbours[i],m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
-                        if (m_cachePotentials){
+                        if (m_cachePotentials && !m_labelDistancePairwise){
                             for (int l1=0;l1<nRegLabels;++l1){
                                 for (int l2=0;l2<nRegLabels;++l2){                                
                                     if (m_pairwiseRegistrationWeight>0)
@@ -409,6 +461,7 @@ public:
         if (m_segment){
             //SegUnaries
             clock_t startUnary = clock();
+            const std::vector<float> & segUnaries=this->m_GraphModel->getUnarySegmentationPotentials();
             for (int l1=0;l1<nSegLabels;++l1)
                 {
 
@@ -416,10 +469,10 @@ public:
                     std::vector<GCoptimization::SparseDataCost> costas(nSegNodes);
                     int c=0;
                     for (int d=0;d<nSegNodes;++d){
-                        double unarySegCost=this->m_GraphModel->getUnarySegmentationPotential(d,l1);
+                        double unarySegCost=segUnaries[(long int)d*nSegLabels+l1];
                         if ( unarySegCost<10000){
                             costas[c].cost=m_unarySegmentationWeight*unarySegCost;
-                            LOGV(10)<<"node "<<d<<"; seg unary label: "<<l1<<" "<<m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,l1)<<std::endl;
+                            LOGV(10)<<"node "<<d<<"; seg unary label: "<<l1<<" "<<m_unarySegmentationWeight*unarySegCost<<std::endl;
                             costas[c].site=d+GLOBALnRegNodes;
                             if (m_coherence && !m_register){
                                 double coherenceCost=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,0,l1);
@@ -431,7 +484,7 @@ public:
                     }
                     costas.resize(c);
                     LOGV(2)<<"Number of nodes with segmentation label "<<l1<<": :"<<c<<std::endl;
-                    m_optimizer->setDataCost(l1+GLOBALnRegLabels,&costas[0],c);
+                    setDataCost(l1+GLOBALnRegLabels,&costas[0],c);
                 }
           
             clock_t endUnary = clock();
@@ -440,8 +493,9 @@ public:
             LOGV(1)<<"Approximate size of seg unaries: "<<1.0/(1024*1024)*nSegNodes*nSegLabels*sizeof(double)<<" mb."<<std::endl;
 
             int nSegEdges=0,nSegRegEdges=0;
+            std::vector<WeightedEdge> segEdges;
             //Segmentation smoothness cache
-            if (m_cachePotentials){
+            if (m_cachePotentials && !m_labelDistancePairwise){
                 segPairwise= new std::vector<std::vector<std::vector<std::vector<float> > > > (GLOBALnSegLabels,std::vector<std::vector<std::vector<float> > >(GLOBALnSegLabels,std::vector< std::vector<float> > (GLOBALnSegNodes,std::vector<float> (D)) ) );
                 srsPairwise= new std::vector<std::vector<std::vector<float > > > (GLOBALnSegLabels,std::vector<std::vector<float > >(GLOBALnRegLabels,std::vector<float>(GLOBALnSegNodes) ) );
             }
@@ -458,9 +512,18 @@ public:
                     nSegEdges++;
                     //m_optimizer->setNeighbors(d+GLOBALnRegNodes,neighbours[i]+GLOBALnRegNodes,1);
                     addNeighbor(d+GLOBALnRegNodes,neighbours[i]+GLOBALnRegNodes,m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
+                    if (m_labelDistancePairwise){
+                        WeightedEdge edge;
+                        edge.node1=d;
+                        edge.node2=neighbours[i];
+                        edge.slot1=m_numberOfNeighborsofEachNode[d+GLOBALnRegNodes]-1;
+                        edge.slot2=m_numberOfNeighborsofEachNode[neighbours[i]+GLOBALnRegNodes]-1;
+                        edge.weightIndex=(long int)d*D+i;
+                        segEdges.push_back(edge);
+                    }
 
                     edgeCount++;
-                    if (m_cachePotentials){
+                    if (m_cachePotentials && !m_labelDistancePairwise){
                         for (int l1=0;l1<nSegLabels;++l1){
                             for (int l2=0;l2<nSegLabels;++l2){
                                 LOGV(25)<<VAR(d)<<" "<<VAR(l1)<<" "<<VAR(neighbours[i])<<" "<<l2<<std::endl;
@@ -505,6 +568,21 @@ public:
 
                 }
             }
+            if (m_labelDistancePairwise){
+                //Potts: the potential of a label change is the edge weight
+                std::vector<float> noWeights;
+                const std::vector<float> & segEdgeWeights=m_pairwiseSegmentationWeight>0?this->m_GraphModel->getSegmentationEdgeWeights():noWeights;
+                long int nWeightedEdges=segEdges.size();
+#pragma omp parallel for
+                for (long int e=0;e<nWeightedEdges;++e){
+                    const WeightedEdge & edge=segEdges[e];
+                    EnergyType weight=0.0;
+                    if (m_pairwiseSegmentationWeight>0)
+                        weight=m_pairwiseSegmentationWeight*segEdgeWeights[edge.weightIndex];
+                    m_weights[edge.node1+GLOBALnRegNodes][edge.slot1]=weight;
+                    m_weights[edge.node2+GLOBALnRegNodes][edge.slot2]=weight;
+                }
+            }
             clock_t endPairwise = clock();
             t = (float) ((double)(endPairwise-endUnary ) / CLOCKS_PER_SEC);
             LOGV(1)<<"Segmentation + SRS pairwise took "<<t<<" seconds."<<std::endl;
@@ -512,7 +590,12 @@ public:
             LOGV(1)<<"Approximate size of SRS pairwise: "<<1.0/(1024*1024)*nSegRegEdges*nSegLabels*nRegLabels*sizeof(double)*m_cachePotentials<<" mb."<<std::endl;
             
         }
-        m_optimizer->setSmoothCost(&GLOBALsmoothFunction);
+        if (m_labelDistancePairwise){
+            setLabelDistances();
+            m_optimizer->setSmoothCost(&m_smoothCosts[0]);
+        }else{
+            m_optimizer->setSmoothCost(&GLOBALsmoothFunction);
+        }
         m_optimizer->setAllNeighbors(m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
         clock_t finish = clock();
         double t = (float) ((double)(finish - start) / CLOCKS_PER_SEC);
@@ -520,7 +603,8 @@ public:
         LOGV(1)<<"Finished init after "<<t<<" seconds"<<std::endl;
         nEdges=edgeCount;
         logResetStage;
-        int order[GLOBALnRegLabels+GLOBALnSegLabels];
+        m_gcoLabelOrder.resize(GLOBALnRegLabels+GLOBALnSegLabels);
+        int * order=&m_gcoLabelOrder[0];
         for (int l=0;l<GLOBALnSegLabels;++l){
             order[l]=GLOBALnRegLabels+l;
         }
@@ -548,6 +632,8 @@ public:
         clock_t opt_start=clock();
         double energy;//=m_optimizer->compute_energy();
         //LOGV(2)<<VAR(energy)<<std::endl;
+        if (m_blockParallel)
+            expandBlocks(maxIter==0?-1:maxIter);
         try{
             m_optimizer->expansion(maxIter==0?-1:maxIter);
             //m_optimizer->swap(maxIter);
@@ -567,6 +653,8 @@ public:
         clock_t opt_start=clock();
         double energy;//=
         //LOGV(2)<<VAR(energy)<<std::endl;
+        if (m_blockParallel && currentIter==0)
+            expandBlocks(1);
         try{
             m_optimizer->expansion(1);
             //m_optimizer->swap(maxIter);
@@ -612,6 +700,188 @@ public:
         LOG<<"NYI"<<std::endl;
     }
 
+    ///sparse registration data costs, which only list the label subset of each node
+    void setAdaptiveRegistrationDataCosts(){
+        std::vector<std::vector<GCoptimization::SparseDataCost> > costs(nRegLabels);
+        for (int d=0;d<nRegNodes;++d){
+            for (int k=0;k<this->m_GraphModel->getLabelMapper()->getNumberOfNodeLabels(d);++k){
+                GCoptimization::SparseDataCost cost;
+                cost.site=d;
+                cost.cost=m_unaryRegistrationWeight*this->m_GraphModel->getCandidateUnaryRegistrationPotential(d,k);
+                costs[this->m_GraphModel->getLabelMapper()->getNodeLabel(d,k)].push_back(cost);
+            }
+        }
+        this->m_GraphModel->freeCandidateUnaries();
+        double nLabels=0;
+        for (int l=0;l<nRegLabels;++l){
+            if (!costs[l].size()) continue;
+            if (m_coherence && !m_segment){
+                for (unsigned int i=0;i<costs[l].size();++i){
+                    int d=costs[l][i].site;
+                    std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
+                    for (unsigned int n=0;n<regSegNeighbors.size();++n){
+                        costs[l][i].cost+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[n],l,0);
+                    }
+                }
+            }
+            //sites are listed in increasing order as required by GCO
+            setDataCost(l,&costs[l][0],costs[l].size());
+            nLabels+=costs[l].size();
+            costs[l]=std::vector<GCoptimization::SparseDataCost>();
+        }
+        LOGV(1)<<"Average number of registration labels per node: "<<nLabels/nRegNodes<<std::endl;
+    }
+
+    ///label distance table of all labels; registration and segmentation labels are never neighbors
+    void setLabelDistances(){
+        int nLabels=GLOBALnRegLabels+GLOBALnSegLabels;
+        m_smoothCosts=std::vector<EnergyType>(nLabels*nLabels,0.0);
+        if (m_register && m_pairwiseRegistrationWeight>0 && nRegNodes>1){
+            //the potential is the same for all edges, so evaluate it on any of them. frozen registration nodes can leave some nodes without forward neighbours
+            int node1=0;
+            std::vector<int> neighbours=this->m_GraphModel->getForwardRegistrationNeighbours(node1);
+            while (neighbours.empty() && node1<nRegNodes-1) neighbours=this->m_GraphModel->getForwardRegistrationNeighbours(++node1);
+            int node2=neighbours.empty()?node1:neighbours[0];
+#pragma omp parallel for
+            for (long int l1=0;l1<GLOBALnRegLabels;++l1){
+                for (int l2=0;l2<GLOBALnRegLabels;++l2){
+                    m_smoothCosts[l1*nLabels+l2]=m_pairwiseRegistrationWeight*this->m_GraphModel->getPairwiseRegistrationPotential(node1,node2,l1,l2);
+                }
+            }
+        }
+        for (int l1=0;l1<GLOBALnSegLabels;++l1){
+            for (int l2=0;l2<GLOBALnSegLabels;++l2){
+                m_smoothCosts[(GLOBALnRegLabels+l1)*nLabels+GLOBALnRegLabels+l2]=(l1!=l2);
+            }
+        }
+        LOGV(1)<<"Size of label distance table: "<<1.0/(1024*1024)*nLabels*nLabels*sizeof(EnergyType)<<" mb."<<std::endl;
+    }
+
+    ///pass sparse data costs to GCO, and keep a copy for the block subproblems
+    void setDataCost(int label, GCoptimization::SparseDataCost * costs, int count){
+        m_optimizer->setDataCost(label,costs,count);
+        if (m_blockParallel)
+            m_dataCosts[label].assign(costs,costs+count);
+    }
+
+    ///alpha expansion on disjoint blocks of nodes in parallel, the merged labelling is kept if it does not raise the energy
+    void expandBlocks(int maxIter){
+        clock_t start=clock();
+        int nSites=GLOBALnRegNodes+GLOBALnSegNodes;
+        int nLabels=GLOBALnRegLabels+GLOBALnSegLabels;
+        int nBlocks=m_nBlocks;
+        //blocks are ranges of consecutive registration and segmentation nodes, i.e. slabs along the last image axis
+        std::vector<int> blockOf(nSites),localIndex(nSites);
+        std::vector<std::vector<int> > blockSites(nBlocks);
+        for (int b=0;b<nBlocks;++b){
+            for (long int s=(long int)b*GLOBALnRegNodes/nBlocks;s<(long int)(b+1)*GLOBALnRegNodes/nBlocks;++s){
+                blockSites[b].push_back(s);
+            }
+            for (long int s=(long int)b*GLOBALnSegNodes/nBlocks;s<(long int)(b+1)*GLOBALnSegNodes/nBlocks;++s){
+                blockSites[b].push_back(s+GLOBALnRegNodes);
+            }
+            for (unsigned int i=0;i<blockSites[b].size();++i){
+                blockOf[blockSites[b][i]]=b;
+                localIndex[blockSites[b][i]]=i;
+            }
+        }
+        std::vector<int> labels(nSites),newLabels(nSites);
+        for (int s=0;s<nSites;++s){
+            labels[s]=m_optimizer->whatLabel(s);
+        }
+        newLabels=labels;
+        bool sparseCosts=false;
+        for (int l=0;l<nLabels;++l) sparseCosts|=m_dataCosts[l].size()>0;
+        double oldEnergy=m_optimizer->compute_energy();
+
+#pragma omp parallel for schedule(dynamic)
+        for (int b=0;b<nBlocks;++b){
+            const std::vector<int> & sites=blockSites[b];
+            int n=sites.size();
+            if (n==0) continue;
+            //local adjacency, edges to other blocks are folded into the data costs below
+            std::vector<int> nNeighbors(n,0),offsets(n+1,0);
+            for (int i=0;i<n;++i){
+                int s=sites[i];
+                for (int k=0;k<m_numberOfNeighborsofEachNode[s];++k){
+                    if (blockOf[m_neighbourArray[s][k]]==b) ++nNeighbors[i];
+                }
+                offsets[i+1]=offsets[i]+nNeighbors[i];
+            }
+            std::vector<int> neighbors(std::max(1,offsets[n]));
+            std::vector<EnergyType> weights(std::max(1,offsets[n]));
+            std::vector<int *> neighborPointers(n);
+            std::vector<EnergyType *> weightPointers(n);
+            for (int i=0;i<n;++i){
+                int s=sites[i],c=offsets[i];
+                for (int k=0;k<m_numberOfNeighborsofEachNode[s];++k){
+                    int t=m_neighbourArray[s][k];
+                    if (blockOf[t]==b){
+                        neighbors[c]=localIndex[t];
+                        weights[c]=m_weights[s][k];
+                        ++c;
+                    }
+                }
+                neighborPointers[i]=&neighbors[offsets[i]];
+                weightPointers[i]=&weights[offsets[i]];
+            }
+            MRFType * optimizer=new MRFType(n,nLabels);
+            bool haveCosts=false;
+            for (int l=0;l<nLabels;++l){
+                std::vector<GCoptimization::SparseDataCost> costs;
+                for (unsigned int c=0;c<m_dataCosts[l].size();++c){
+                    int s=m_dataCosts[l][c].site;
+                    if (blockOf[s]!=b) continue;
+                    GCoptimization::SparseDataCost cost;
+                    cost.site=localIndex[s];
+                    cost.cost=m_dataCosts[l][c].cost;
+                    for (int k=0;k<m_numberOfNeighborsofEachNode[s];++k){
+                        int t=m_neighbourArray[s][k];
+                        if (blockOf[t]!=b)
+                            cost.cost+=m_weights[s][k]*m_smoothCosts[(long int)l*nLabels+labels[t]];
+                    }
+                    costs.push_back(cost);
+                }
+                if (costs.size()){
+                    optimizer->setDataCost(l,&costs[0],costs.size());
+                    haveCosts=true;
+                }
+            }
+            //without any data cost of its own, GCO would treat the block as unconstrained
+            if (sparseCosts && !haveCosts){
+                delete optimizer;
+                continue;
+            }
+            optimizer->setSmoothCost(&m_smoothCosts[0]);
+            optimizer->setAllNeighbors(&nNeighbors[0],&neighborPointers[0],&weightPointers[0]);
+            optimizer->setLabelOrder(&m_gcoLabelOrder[0],nLabels);
+            for (int i=0;i<n;++i){
+                optimizer->setLabel(i,labels[sites[i]]);
+            }
+            try{
+                optimizer->expansion(maxIter);
+                for (int i=0;i<n;++i){
+                    newLabels[sites[i]]=optimizer->whatLabel(i);
+                }
+            }catch (GCException e){
+                e.Report();
+            }
+            delete optimizer;
+        }
+
+        for (int s=0;s<nSites;++s){
+            m_optimizer->setLabel(s,newLabels[s]);
+        }
+        double newEnergy=m_optimizer->compute_energy();
+        if (newEnergy>oldEnergy){
+            //blocks moved simultaneously against outdated boundary labels
+            for (int s=0;s<nSites;++s){
+                m_optimizer->setLabel(s,labels[s]);
+            }
+        }
+        LOGV(1)<<"Expansion of "<<nBlocks<<" blocks took "<<((double)(clock()-start)/CLOCKS_PER_SEC)<<" seconds, "<<VAR(oldEnergy)<<" "<<VAR(newEnergy)<<std::endl;
+    }
+
     void addNeighbor(int id1, int id2, int * neighbCount, int **neighbors, EnergyType ** weights){
         
         LOGV(15)<<"Adding neighbors "<<id1<<" "<<id2<<" with counts "<<VAR(neighbCount[id1])<< " "<<VAR(neighbCount[id2])<<std::endl;
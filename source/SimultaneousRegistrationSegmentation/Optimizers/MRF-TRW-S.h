@@ -15,6 +15,8 @@
 //#include "minimize.cpp"
 //#include "treeProbabilities.cpp"
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <limits.h>
 
 
@@ -30,6 +32,7 @@ namespace SRS{
 
     typedef TGraphModel GraphModelType;
     typedef typename GraphModelType::Pointer GraphModelPointerType;
+    static const int D = GraphModelType::ImageType::ImageDimension;
 
     typedef TypeGeneral TRWType;
     typedef MRFEnergy<TRWType> MRFType;
@@ -51,8 +54,12 @@ namespace SRS{
     int nRegLabels;
     int nSegLabels;
     bool m_segment, m_register,m_coherence;
+    //registration nodes only carry the label subsets selected by the graph's adaptive label mapper
+    bool m_adaptive;
     double m_lastLowerBound;
     std::vector<int> m_labelOrder;
+    ///upper bound in mb for the precomputed coherence potentials, segmentation nodes are processed in chunks that fit
+    double m_coherenceCacheMB;
     
   public:
   TRWS_SRSMRFSolver(GraphModelPointerType  graphModel,
@@ -70,6 +77,7 @@ namespace SRS{
       m_unaryRegistrationWeight=unaryRegWeight;
       m_pairwiseRegistrationWeight=pairwiseRegWeight;
       m_pairwiseSegmentationRegistrationWeight=pairwiseSegRegWeight;
+      m_coherenceCacheMB=1024.0;
       m_labelOrder=std::vector<int>(this->m_GraphModel->nRegLabels());
       m_labelOrder[0]=(this->m_GraphModel->nRegLabels())/2;
       for (int l=0;l<(this->m_GraphModel->nRegLabels());++l){
@@ -80,11 +88,13 @@ namespace SRS{
       }
     }
     
-  TRWS_SRSMRFSolver()  :m_optimizer(TRWType::GlobalSize()){}
+  TRWS_SRSMRFSolver()  :m_optimizer(TRWType::GlobalSize()),m_coherenceCacheMB(1024.0){}
     ~TRWS_SRSMRFSolver()
       {
       }
 
+    void setCoherenceCacheSize(double mb){m_coherenceCacheMB=mb;}
+
 
     /// create optimizer object, and fill it with the information from the graphModel
     virtual void createGraph(){
@@ -94,6 +104,7 @@ namespace SRS{
 	m_register=false;
 	m_segment=0;
 	m_register=0;
+	m_adaptive=false;
       }
       LOGV(1)<<"starting graph init"<<std::endl;
       m_optimizer=MRFType(TRWType::GlobalSize());
@@ -119,9 +130,13 @@ namespace SRS{
       m_segment=((m_pairwiseSegmentationRegistrationWeight>0 || m_unarySegmentationWeight>0 || m_pairwiseSegmentationWeight)  && nSegLabels>1);
       m_coherence=m_pairwiseSegmentationRegistrationWeight>0;
       LOGV(6)<<VAR(m_register)<<" "<<VAR(m_segment)<<" "<<VAR(m_coherence)<<std::endl;
+      m_adaptive=m_register && this->m_GraphModel->computeRegistrationLabelSubsets(m_unaryRegistrationWeight,m_pairwiseRegistrationWeight);
       logSetStage("Potential functions caching");
       //		traverse grid
-      if (m_register){
+      if (m_adaptive){
+	edgeCount+=addAdaptiveRegistrationPotentials();
+      }
+      else if (m_register){
 	//RegUnaries
 	clock_t startUnary = clock();
 
@@ -138,6 +153,9 @@ namespace SRS{
 	  {
 	    int regLabel=m_labelOrder[l1];
 	    this->m_GraphModel->cacheRegistrationPotentials(regLabel);
+	    if (m_coherence && !m_segment){
+	      this->m_GraphModel->cacheCoherencePotentials(regLabel);
+	    }
 	    for (int d=0;d<nRegNodes;++d){
 	      double pot=this->m_GraphModel->getUnaryRegistrationPotential(d,regLabel);
 	      pot*=m_unaryRegistrationWeight;
@@ -148,7 +166,7 @@ namespace SRS{
 		int nNeighbours=regSegNeighbors.size();
 		if (nNeighbours==0) {LOG<<"ERROR: node "<<d<<" seems to have no neighbors."<<std::endl;}
 		for (int i=0;i<nNeighbours;++i){
-		  double coherencePot=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[i],regLabel,0);
+		  double coherencePot=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getCachedPairwiseRegSegPotential(regSegNeighbors[i],0);
 		  //LOGV(10)<<VAR(d)<<" "<<VAR(regLabel)<<" "<<VAR(pot)<<" "<<VAR(coherencePot)<<std::endl;
 		  pot+=coherencePot;
                                 
@@ -160,6 +178,9 @@ namespace SRS{
 	    }
 	  }
             
+	if (m_coherence && !m_segment){
+	  this->m_GraphModel->freeCoherencePotentials();
+	}
 	TRWType::REAL Vreg[nRegLabels*nRegLabels];
 	for (int l1=0;l1<nRegLabels;++l1){
 	  for (int l2=0;l2<nRegLabels;++l2){
@@ -210,13 +231,14 @@ namespace SRS{
 	//SegUnaries
 	clock_t startUnary = clock();
 	TRWType::REAL D2[nSegLabels];
+	const std::vector<float> & segUnaries=this->m_GraphModel->getUnarySegmentationPotentials();
 
 	for (int d=0;d<nSegNodes;++d){
 	  std::vector<int> segRegNeighbors=this->m_GraphModel->getSegRegNeighbors(d);
 	  for (int l1=0;l1<nSegLabels;++l1)
 	    {
 	      
-	      D2[l1]=m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,l1);
+	      D2[l1]=m_unarySegmentationWeight*segUnaries[(long int)d*nSegLabels+l1];
 	      //in case of coherence weight, but no direct registration optimization, add coherence potential to registration unaries
 	      if (m_coherence && !m_register){
 		for (int i=0;i<segRegNeighbors.size();++i){
@@ -237,35 +259,92 @@ namespace SRS{
 
 	TRWType::REAL VsrsBack[nRegLabels*nSegLabels];
 	int nSegEdges=0,nSegRegEdges=0;
+	//coherence potentials only depend on the segmentation node, so they are computed label by label for a chunk of nodes in advance
+	std::vector<float> srsPotentials;
+	//with adaptive label sets, only the labels used by at least one registration node are cached
+	std::vector<int> activeLabels,activeIndex;
+	getActiveRegistrationLabels(activeLabels,activeIndex);
+	int nActive=activeLabels.size();
+	int chunkSize=nSegNodes,chunkStart=0,chunkEnd=0;
+	if (m_register && m_coherence){
+	  double nodeMB=1.0/(1024*1024)*nActive*nSegLabels*sizeof(float);
+	  chunkSize=std::max(1,std::min(nSegNodes,int(m_coherenceCacheMB/std::max(nodeMB,1e-12))));
+	  LOGV(1)<<"Approximate size of coherence cache: "<<chunkSize*nodeMB<<" mb, "<<(nSegNodes+chunkSize-1)/chunkSize<<" chunk(s) of segmentation nodes."<<std::endl;
+	  srsPotentials.resize((unsigned long int)chunkSize*nActive*nSegLabels);
+	}
+	std::vector<TRWType::REAL> Vsrs;
+	//Potts edges store a single weight and get O(L) message updates instead of a dense L*L table
+	bool pottsSegmentation=this->m_GraphModel->hasPottsSegmentationPairwise();
+	std::vector<float> noWeights;
+	if (pottsSegmentation){
+	  LOGV(1)<<"Using Potts segmentation edges"<<std::endl;
+	}
+	const std::vector<float> & segEdgeWeights=pottsSegmentation?this->m_GraphModel->getSegmentationEdgeWeights():noWeights;
 	for (int d=0;d<nSegNodes;++d){   
+	  if (m_register && m_coherence && d==chunkEnd){
+	    //every registration label warps the whole atlas, so larger chunks mean fewer passes over the image
+	    chunkStart=d;
+	    chunkEnd=std::min(nSegNodes,d+chunkSize);
+	    for (int a=0;a<nActive;++a){
+	      this->m_GraphModel->cacheCoherencePotentials(activeLabels[a]);
+	      for (int d2=chunkStart;d2<chunkEnd;++d2){
+		for (int l2=0;l2<nSegLabels;++l2){
+		  srsPotentials[((unsigned long int)(d2-chunkStart)*nSegLabels+l2)*nActive+a]=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getCachedPairwiseRegSegPotential(d2,l2);
+		}
+	      }
+	    }
+	    this->m_GraphModel->freeCoherencePotentials();
+	  }
 	  TRWType::REAL Vseg[nSegLabels*nSegLabels];
 	  //pure Segmentation
 	  std::vector<int> neighbours= this->m_GraphModel->getForwardSegmentationNeighbours(d);
 	  int nNeighbours=neighbours.size();
 	  for (int i=0;i<nNeighbours;++i){
 	    nSegEdges++;
-	    for (int l1=0;l1<nSegLabels;++l1){
-	      for (int l2=0;l2<nSegLabels;++l2){
-		double lambda =m_pairwiseSegmentationWeight*this->m_GraphModel->getPairwiseSegmentationPotential(d,neighbours[i],l1,l2);
-		Vseg[l1+nSegLabels*l2]=lambda;
+	    if (pottsSegmentation){
+	      TRWType::REAL lambda=m_pairwiseSegmentationWeight*segEdgeWeights[(long int)d*D+i];
+	      m_optimizer.AddEdge(segNodes[d], segNodes[neighbours[i]], TRWType::EdgeData(TRWType::POTTS,lambda));
+	    }else{
+	      for (int l1=0;l1<nSegLabels;++l1){
+		for (int l2=0;l2<nSegLabels;++l2){
+		  double lambda =m_pairwiseSegmentationWeight*this->m_GraphModel->getPairwiseSegmentationPotential(d,neighbours[i],l1,l2);
+		  Vseg[l1+nSegLabels*l2]=lambda;
+		}
 	      }
+	      m_optimizer.AddEdge(segNodes[d], segNodes[neighbours[i]], TRWType::EdgeData(TRWType::GENERAL,Vseg));
 	    }
-	    m_optimizer.AddEdge(segNodes[d], segNodes[neighbours[i]], TRWType::EdgeData(TRWType::GENERAL,Vseg));
 	    edgeCount++;
                     
 	  }
-	  if (m_register && m_coherence){
+	  if (m_register && m_coherence && m_adaptive){
 	    std::vector<int> segRegNeighbors=this->m_GraphModel->getSegRegNeighbors(d);
 	    nNeighbours=segRegNeighbors.size();
 	    if (nNeighbours==0) {LOG<<"ERROR: node "<<d<<" seems to have no neighbors."<<std::endl;}
+	    unsigned long int offset=(unsigned long int)(d-chunkStart)*nSegLabels*nActive;
 	    for (int i=0;i<nNeighbours;++i){
-	      for (int l1=0;l1<nRegLabels;++l1){
-		for (int l2=0;l2<nSegLabels;++l2){
-		  //forward
-		  VsrsBack[l1+l2*nRegLabels]=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(segRegNeighbors[i],d,l1,l2);
-
+	      int r=segRegNeighbors[i];
+	      int K=getNumberOfRegLabels(r);
+	      Vsrs.resize(K*nSegLabels);
+	      for (int l2=0;l2<nSegLabels;++l2){
+		for (int k=0;k<K;++k){
+		  Vsrs[k+K*l2]=srsPotentials[offset+l2*nActive+activeIndex[getRegLabel(r,k)]];
 		}
 	      }
+	      m_optimizer.AddEdge(regNodes[r], segNodes[d], TRWType::EdgeData(TRWType::GENERAL,&Vsrs[0]));
+	      edgeCount++;
+	      nSegRegEdges++;
+	    }
+	  }
+	  else if (m_register && m_coherence){
+	    std::vector<int> segRegNeighbors=this->m_GraphModel->getSegRegNeighbors(d);
+	    nNeighbours=segRegNeighbors.size();
+	    if (nNeighbours==0) {LOG<<"ERROR: node "<<d<<" seems to have no neighbors."<<std::endl;}
+	    unsigned long int offset=(unsigned long int)(d-chunkStart)*nSegLabels*nRegLabels;
+	    for (int l=0;l<nRegLabels*nSegLabels;++l){
+	      //forward
+	      VsrsBack[l]=srsPotentials[offset+l];
+	    }
+	    for (int i=0;i<nNeighbours;++i){
 	      m_optimizer.AddEdge(regNodes[segRegNeighbors[i]], segNodes[d], TRWType::EdgeData(TRWType::GENERAL,VsrsBack));
                   
 	      edgeCount++;
@@ -274,6 +353,7 @@ namespace SRS{
 	  }
                 
 	}
+	srsPotentials=std::vector<float>();
 	clock_t endPairwise = clock();
 	t = (float) ((double)(endPairwise-endUnary ) / CLOCKS_PER_SEC);
 	LOGV(1)<<"Segmentation + SRS pairwise took "<<t<<" seconds."<<std::endl;
@@ -345,7 +425,7 @@ namespace SRS{
       std::vector<int> labels(nRegNodes,0);
       if (m_register){
 	for (int i=0;i<nRegNodes;++i){
-	  labels[i]=m_optimizer.GetSolution(regNodes[i]);
+	  labels[i]=getRegLabel(i,m_optimizer.GetSolution(regNodes[i]));
 	}
       }
       return labels;
@@ -368,7 +448,7 @@ namespace SRS{
       m_start=start;
       if (nRegLabels){
 	for (int d=0;d<nRegNodes;++d){
-	  sumUReg+=m_unaryRegistrationWeight*this->m_GraphModel->getUnaryRegistrationPotential(d,m_optimizer.GetSolution(regNodes[d]));
+	  sumUReg+=m_unaryRegistrationWeight*this->m_GraphModel->getUnaryRegistrationPotential(d,getRegLabel(d,m_optimizer.GetSolution(regNodes[d])));
 	}
       }
       if (nSegLabels){
@@ -382,7 +462,7 @@ namespace SRS{
 	    }
 	    std::vector<int> segRegNeighbors=this->m_GraphModel->getSegRegNeighbor(d);
 	    for (unsigned int n=0;n<segRegNeighbors.size();++n){
-	      sumPSegReg+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(segRegNeighbors[n],d,m_optimizer.GetSolution(regNodes[segRegNeighbors[n]]),m_optimizer.GetSolution(segNodes[d]));
+	      sumPSegReg+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(segRegNeighbors[n],d,getRegLabel(segRegNeighbors[n],m_optimizer.GetSolution(regNodes[segRegNeighbors[n]])),m_optimizer.GetSolution(segNodes[d]));
 	    }
 	  }
 
@@ -398,6 +478,99 @@ namespace SRS{
       LOGV(1)<<"Finished init after "<<t<<" seconds"<<std::endl;
     }
 
+  protected:
+    ///number of labels of registration node d
+    inline int getNumberOfRegLabels(int d){
+      return m_adaptive?this->m_GraphModel->getLabelMapper()->getNumberOfNodeLabels(d):nRegLabels;
+    }
+    ///global registration label of the local label index i of node d
+    inline int getRegLabel(int d, int i){
+      return m_adaptive?this->m_GraphModel->getLabelMapper()->getNodeLabel(d,i):i;
+    }
+    ///labels used by any registration node and their position in activeLabels (-1 if unused)
+    void getActiveRegistrationLabels(std::vector<int> & activeLabels, std::vector<int> & activeIndex){
+      activeIndex=std::vector<int>(nRegLabels,-1);
+      activeLabels.clear();
+      for (int d=0;d<(m_adaptive?nRegNodes:1);++d){
+	for (int i=0;i<getNumberOfRegLabels(d);++i){
+	  activeIndex[getRegLabel(d,i)]=1;
+	}
+      }
+      for (int l=0;l<nRegLabels;++l){
+	if (activeIndex[l]>=0){
+	  activeIndex[l]=activeLabels.size();
+	  activeLabels.push_back(l);
+	}
+      }
+    }
+
+    /// registration nodes and edges for per-node label subsets, returns the number of edges
+    int addAdaptiveRegistrationPotentials(){
+      clock_t startUnary = clock();
+      int edgeCount=0;
+      std::vector<std::vector<TRWType::REAL> > D(nRegNodes);
+      for (int d=0;d<nRegNodes;++d){
+	int K=getNumberOfRegLabels(d);
+	D[d].resize(K);
+	for (int k=0;k<K;++k){
+	  D[d][k]=m_unaryRegistrationWeight*this->m_GraphModel->getCandidateUnaryRegistrationPotential(d,k);
+	}
+      }
+      this->m_GraphModel->freeCandidateUnaries();
+      //in case of coherence weight, but no direct segmentation optimization, add coherence potential to registration unaries
+      if (m_coherence && !m_segment){
+	std::map<int,std::vector<std::pair<int,int> > > nodesOfLabel;
+	for (int d=0;d<nRegNodes;++d){
+	  for (int k=0;k<getNumberOfRegLabels(d);++k){
+	    nodesOfLabel[getRegLabel(d,k)].push_back(std::make_pair(d,k));
+	  }
+	}
+	for (typename std::map<int,std::vector<std::pair<int,int> > >::iterator it=nodesOfLabel.begin();it!=nodesOfLabel.end();++it){
+	  this->m_GraphModel->cacheCoherencePotentials(it->first);
+	  for (unsigned int n=0;n<it->second.size();++n){
+	    int d=it->second[n].first;
+	    std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
+	    for (unsigned int i=0;i<regSegNeighbors.size();++i){
+	      D[d][it->second[n].second]+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getCachedPairwiseRegSegPotential(regSegNeighbors[i],0);
+	    }
+	  }
+	}
+	this->m_GraphModel->freeCoherencePotentials();
+      }
+      double nLabels=0;
+      for (int d=0;d<nRegNodes;++d){
+	regNodes[d] = 
+	  m_optimizer.AddNode(TRWType::LocalSize(D[d].size()), TRWType::NodeData(&D[d][0]));
+	nLabels+=D[d].size();
+      }
+      D=std::vector<std::vector<TRWType::REAL> >();
+      clock_t endUnary = clock();
+      double t = (float) ((double)(endUnary - startUnary) / CLOCKS_PER_SEC);
+      LOGV(1)<<"Registration Unaries took "<<t<<" seconds, average number of labels per node "<<nLabels/nRegNodes<<std::endl;
+      tUnary+=t;
+      std::vector<TRWType::REAL> Vreg;
+      for (int d=0;d<nRegNodes;++d){
+	std::vector<int> neighbours= this->m_GraphModel->getForwardRegistrationNeighbours(d);
+	int K1=getNumberOfRegLabels(d);
+	for (unsigned int i=0;i<neighbours.size();++i){
+	  int K2=getNumberOfRegLabels(neighbours[i]);
+	  Vreg.resize(K1*K2);
+	  for (int k1=0;k1<K1;++k1){
+	    for (int k2=0;k2<K2;++k2){
+	      Vreg[k1+k2*K1]=(m_pairwiseRegistrationWeight>0)?m_pairwiseRegistrationWeight*this->m_GraphModel->getPairwiseRegistrationPotential(d,neighbours[i],getRegLabel(d,k1),getRegLabel(neighbours[i],k2)):0;
+	    }
+	  }
+	  m_optimizer.AddEdge(regNodes[d], regNodes[neighbours[i]], TRWType::EdgeData(TRWType::GENERAL,&Vreg[0]));
+	  edgeCount++;
+	}
+      }
+      clock_t endPairwise = clock();
+      t = (float) ((double)(endPairwise-endUnary ) / CLOCKS_PER_SEC);
+      LOGV(1)<<"Registration pairwise took "<<t<<" seconds."<<std::endl;
+      tPairwise+=t;
+      return edgeCount;
+    }
+
   };
 }
 #endif /* TRW_S_REGISTRATION_H_ */
@@ -42,6 +42,8 @@ namespace SRS{
         int m_nSegmentationLabels;
         std::vector<unsupervised> m_GMMs;
         std::vector<bool> m_trainedGMMs;
+        ///number of voxels whose features are gathered and evaluated at once
+        long int m_chunkSize;
     public:
         typedef ClassifierSegmentationUnaryGMM            Self;
         typedef itk::Object Superclass;
@@ -70,6 +72,7 @@ namespace SRS{
 
         ClassifierSegmentationUnaryGMM(){
             LOGV(5)<<"Initializing intensity based segmentation classifier" << endl;
+            m_chunkSize=1<<20;
         };
      
         virtual void setNSegmentationLabels(int n){
@@ -168,6 +171,25 @@ namespace SRS{
             }
         };
 
+    protected:
+        ///likelihoods of all labels for features[i*nFeatures+f], i<nData, stored at position offset+i of the result images
+        void evalLikelihoods(const std::vector<double> & features, long int nData, long int offset, std::vector<FloatImagePointerType> & result){
+            std::vector<double> p(nData);
+            for ( int s=0;s<m_nSegmentationLabels;++s){
+                typename FloatImageType::PixelType * out=result[s]->GetBufferPointer()+offset;
+                if (!this->m_trainedGMMs[s]){
+                    std::fill(out,out+nData,0.0);
+                    continue;
+                }
+                m_GMMs[s].likelihood(&features[0],nData,&p[0]);
+#pragma omp parallel for
+                for (long int i=0;i<nData;++i){
+                    out[i]=max(std::numeric_limits<double>::epsilon(),min(1.0,p[i]));
+                }
+            }
+        }
+
+    public:
         virtual std::vector<FloatImagePointerType> evalImage(std::vector<ImageConstPointerType> inputImage){
             LOGV(5)<<"Evaluating intensity based segmentation classifier" << endl;
 
@@ -177,35 +199,22 @@ namespace SRS{
             }
            
             unsigned int nFeatures=inputImage.size();
-            std::vector<FloatIteratorType> resultIterators;
-            for ( int s=0;s<m_nSegmentationLabels;++s){
-                resultIterators.push_back(FloatIteratorType(result[s],result[s]->GetLargestPossibleRegion()));
-                resultIterators[s].GoToBegin();
-            }
-            std::vector<ConstImageIteratorType> iterators;
+            std::vector<const PixelType *> inputBuffers(nFeatures);
             for (unsigned int f=0;f<nFeatures;++f){
-                iterators.push_back(ConstImageIteratorType(inputImage[f],inputImage[f]->GetLargestPossibleRegion()));
-                iterators[f].GoToBegin();
+                inputBuffers[f]=inputImage[f]->GetBufferPointer();
             }
-            
-            for (int i=0;!resultIterators[0].IsAtEnd() ; ++i){
-                NEWMAT::ColumnVector c(nFeatures);
-                for (unsigned int f=0;f<nFeatures;++f){
-                    c.element(f)=iterators[f].Get();
-                    ++iterators[f];
-                }
-                for ( int s=0;s<m_nSegmentationLabels;++s){
-                    
-                    double p=0;
-                    if (this->m_trainedGMMs[s]){
-                        p=m_GMMs[s].likelihood(c);
-                        p=min(1.0,p);
-                        p=max(std::numeric_limits<double>::epsilon(),p);
+            long int nData=inputImage[0]->GetBufferedRegion().GetNumberOfPixels();
+            long int chunkSize=min(nData,m_chunkSize);
+            std::vector<double> features(chunkSize*nFeatures);
+            for (long int start=0;start<nData;start+=chunkSize){
+                long int n=min(chunkSize,nData-start);
+#pragma omp parallel for
+                for (long int i=0;i<n;++i){
+                    for (unsigned int f=0;f<nFeatures;++f){
+                        features[i*nFeatures+f]=inputBuffers[f][start+i];
                     }
-                    //resultIterators[s].Set(-log(p));
-                    resultIterators[s].Set((p));
-                    ++resultIterators[s];
                 }
+                evalLikelihoods(features,n,start,result);
             }
             std::string suff;
             if (true){
@@ -272,35 +281,20 @@ namespace SRS{
             }
             typename ImageType::IndexType idx;idx.Fill(0);
             unsigned int nFeatures=3;//inputImage->GetPixel(idx).GetSize();
-            
-            std::vector<FloatIteratorType> resultIterators;
-            for ( int s=0;s<m_nSegmentationLabels;++s){
-                resultIterators.push_back(FloatIteratorType(result[s],result[s]->GetLargestPossibleRegion()));
-                resultIterators[s].GoToBegin();
-            }
            
-            RGBIteratorType iterator(inputImage,inputImage->GetLargestPossibleRegion());
-            iterator.GoToBegin();
-            
-            for (int i=0;!resultIterators[0].IsAtEnd() ; ++i,++iterator){
-                NEWMAT::ColumnVector c(nFeatures);
-                RGBPixelType px=iterator.Get();
-
-                for (unsigned int f=0;f<nFeatures;++f){
-                    c.element(f)=px[f];
-                }
-                for ( int s=0;s<m_nSegmentationLabels;++s){
-                    
-                    double p=0;
-                    if (this->m_trainedGMMs[s]){
-                        p=m_GMMs[s].likelihood(c);
-                        p=min(1.0,p);
-                        p=max(std::numeric_limits<double>::epsilon(),p);
+            const RGBPixelType * inputBuffer=inputImage->GetBufferPointer();
+            long int nData=inputImage->GetBufferedRegion().GetNumberOfPixels();
+            long int chunkSize=min(nData,m_chunkSize);
+            std::vector<double> features(chunkSize*nFeatures);
+            for (long int start=0;start<nData;start+=chunkSize){
+                long int n=min(chunkSize,nData-start);
+#pragma omp parallel for
+                for (long int i=0;i<n;++i){
+                    for (unsigned int f=0;f<nFeatures;++f){
+                        features[i*nFeatures+f]=inputBuffer[start+i][f];
                     }
-                    //resultIterators[s].Set(-log(p));
-                    resultIterators[s].Set((p));
-                    ++resultIterators[s];
                 }
+                evalLikelihoods(features,n,start,result);
             }
             std::string suff;
             if (true){
@@ -16,6 +16,13 @@
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkStatisticsImageFilter.h"
 #include "itkThresholdImageFilter.h"
+#include "itkMath.h"
+#include "DerivedImageCache.h"
+#include <sstream>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace SRS{
 
@@ -70,6 +77,18 @@ namespace SRS{
         double sigma1, sigma2, mean1, mean2, m_tolerance,maxDist,minDist, mDistTarget,mDistSecondary;
         int m_nSegmentationLabels,m_auxiliaryLabel;
 
+        ///on-disk cache for the unscaled distance transforms of the atlas segmentation
+        DerivedImageCache m_cache;
+        ///deformed atlas label and distances to all atlas labels at each target pixel, for the displacement given to cachePotentials
+        std::vector<int> m_cachedDeformedAtlasSegmentation;
+        std::vector<float> m_cachedDistances;
+        unsigned long int m_nCachedPixels;
+        bool m_incremental;
+        ///tolerance with which the current distance transforms were scaled
+        double m_distanceTransformTolerance;
+        ///scale argument of the SetAtlasSegmentation call that computed the current distance transforms
+        double m_distanceTransformScale;
+
     public:
         /** Method for creation through the object factory. */
         itkNewMacro(Self);
@@ -81,9 +100,17 @@ namespace SRS{
             m_asymm=1;
             m_tolerance=9999999999.0;
             m_auxiliaryLabel=1;
+            m_nCachedPixels=0;
+            m_incremental=false;
+            m_distanceTransformTolerance=-1.0;
+            m_distanceTransformScale=-1.0;
         }
         virtual void freeMemory(){
+            m_cachedDeformedAtlasSegmentation=std::vector<int>();
+            m_cachedDistances=std::vector<float>();
+            m_nCachedPixels=0;
         }
+        void SetCacheDirectory(std::string dir, double maxSizeMB=0.0){m_cache.setDirectory(dir,maxSizeMB);}
         void SetAuxLabel(int l){m_auxiliaryLabel=l;}
         void SetNumberOfSegmentationLabels(int n){m_nSegmentationLabels=n;}
         void SetBaseLabelMap(LabelImagePointerType blm){m_baseLabelMap=blm;m_haveLabelMap=true;}
@@ -139,6 +166,10 @@ namespace SRS{
 
         virtual void SetAtlasSegmentation(ConstImagePointerType segImage, double scale=1.0){
             logSetStage("Coherence setup");
+            ConstImagePointerType previousSegImage=m_atlasSegmentationImage;
+            std::vector<FloatImagePointerType> previousDistanceTransforms=m_distanceTransforms;
+            std::vector<FloatImageInterpolatorPointerType> previousInterpolators=m_atlasDistanceTransformInterpolators;
+            std::vector<double> previousMinDists=m_minDists;
             m_atlasSegmentationInterpolator= SegmentationInterpolatorType::New();
             m_atlasSegmentationInterpolator->SetInputImage(segImage);
             m_atlasSegmentationImage=segImage;
@@ -153,15 +184,67 @@ namespace SRS{
                 LOG<<VAR(maxFilter->GetMaximumOutput()->Get()+1)<<endl;
                 LOGI(6,ImageUtils<ImageType>::writeImage("multilabelAtlas.nii",segImage));
             }
+            //when the atlas segmentation is re-warped between iterations, the distance transforms of labels that did not change are kept
+            std::vector<bool> changedLabels(m_nSegmentationLabels,true);
+            bool incremental=m_incremental && previousSegImage.IsNotNull() && previousDistanceTransforms.size()==(unsigned int)m_nSegmentationLabels
+                && m_distanceTransformTolerance==m_tolerance && m_distanceTransformScale==scale
+                && previousSegImage->GetLargestPossibleRegion()==segImage->GetLargestPossibleRegion()
+                && previousSegImage->GetSpacing()==segImage->GetSpacing() && previousSegImage->GetOrigin()==segImage->GetOrigin();
+            if (incremental){
+                changedLabels=getChangedLabels(previousSegImage,segImage,m_nSegmentationLabels);
+            }
+            m_distanceTransformTolerance=m_tolerance;
+            m_distanceTransformScale=scale;
             m_distanceTransforms= std::vector<FloatImagePointerType>( m_nSegmentationLabels ,NULL);
             m_atlasDistanceTransformInterpolators = std::vector<FloatImageInterpolatorPointerType>( m_nSegmentationLabels ,NULL);
             m_minDists=std::vector<double> ( m_nSegmentationLabels ,-1);;
 
             typename StatisticsFilterType::Pointer filter=StatisticsFilterType::New();
+            std::string hash="";
+            if (m_cache.enabled()){
+                hash=DerivedImageCache::hashImage(segImage.GetPointer());
+                LOGV(3)<<"Distance transform cache key: "<<hash<<endl;
+            }
+
+            //distance transforms of all changed labels that are not cached are computed in one pass
+            std::vector<FloatImagePointerType> distanceTransforms(m_nSegmentationLabels);
+            std::vector<bool> missing(m_nSegmentationLabels,false);
+            int nMissing=0;
+            for (int l=0;l< m_nSegmentationLabels;++l){
+                if (!changedLabels[l]) continue;
+                if (m_cache.enabled()){
+                    DerivedImageCache::Key key("coherenceDT");
+                    key.input(hash).param("label",l);
+                    distanceTransforms[l]=m_cache.get<FloatImageType>(key);
+                }
+                missing[l]=distanceTransforms[l].IsNull();
+                nMissing+=missing[l];
+            }
+            if (nMissing){
+                LOGV(3)<<"Computing distance transforms of "<<nMissing<<" labels"<<endl;
+                std::vector<FloatImagePointerType> computed=computeDistanceTransforms(segImage,missing);
+                for (int l=0;l< m_nSegmentationLabels;++l){
+                    if (!missing[l]) continue;
+                    distanceTransforms[l]=computed[l];
+                    if (m_cache.enabled()){
+                        DerivedImageCache::Key key("coherenceDT");
+                        key.input(hash).param("label",l);
+                        m_cache.put<FloatImageType>(key,distanceTransforms[l]);
+                    }
+                }
+            }
 
             for (int l=0;l< m_nSegmentationLabels;++l){
-                //get distance transform to foreground label
-                FloatImagePointerType dt1=getDistanceTransform(segImage,l);
+                if (!changedLabels[l]){
+                    LOGV(3)<<"Label "<<l<<" unchanged, reusing its distance transform"<<endl;
+                    m_distanceTransforms[l]=previousDistanceTransforms[l];
+                    m_atlasDistanceTransformInterpolators[l]=previousInterpolators[l];
+                    m_minDists[l]=previousMinDists[l];
+                    continue;
+                }
+                //distance transform to foreground label
+                FloatImagePointerType dt1=distanceTransforms[l];
+                ImageUtils<FloatImageType>::multiplyImage(dt1,1.0/this->m_tolerance);
                 //save image for debugging
              
                    
@@ -181,53 +264,59 @@ namespace SRS{
                 m_minDists[l]=fabs(filter->GetMinimumOutput()->Get());
                 LOGV(3)<<"Maximal radius of target object: "<< m_minDists[l]<<endl;
             }
+            freeMemory();
             logResetStage;
         }
 
         ConstImagePointerType getAtlasSegmentation(){return  m_atlasSegmentationImage;}
+        ///distance transform to label value, scaled by the tolerance
         FloatImagePointerType getDistanceTransform(ConstImagePointerType segmentationImage, int value){
-            assert(segmentationImage.IsNotNull());
-            typedef typename itk::SignedMaurerDistanceMapImageFilter< ImageType, FloatImageType > DistanceTransformType;
-            typename DistanceTransformType::Pointer distanceTransform=DistanceTransformType::New();
-            typedef typename  itk::ImageRegionConstIterator<ImageType> ImageConstIterator;
-            typedef typename  itk::ImageRegionIterator<ImageType> ImageIterator;
-            ImagePointerType newImage=ImageUtils<ImageType>::createEmpty(segmentationImage);
-            ImageConstIterator imageIt(segmentationImage,segmentationImage->GetLargestPossibleRegion());        
-            ImageIterator imageIt2(newImage,newImage->GetLargestPossibleRegion());        
-            int count=0,countAll=0;
-            
-            for (imageIt.GoToBegin(),imageIt2.GoToBegin();!imageIt.IsAtEnd();++imageIt, ++imageIt2,++countAll){
-                float val=imageIt.Get();
-                imageIt2.Set(val==value);
-                count+=(val==value);
-            }
-            LOGV(8)<<VAR(countAll)<<" "<<VAR(count)<<" "<<VAR(value)<<endl;
-            FloatImagePointerType positiveDM;
-            if (count!=0){
-                //distanceTransform->InsideIsPositiveOn();
-                distanceTransform->SetInput(newImage);
-                distanceTransform->SquaredDistanceOff ();
-                distanceTransform->UseImageSpacingOn();
-                distanceTransform->Update();
-            typedef typename  itk::ImageRegionIterator<FloatImageType> FloatImageIterator;
-
-            positiveDM=FilterUtils<FloatImageType>::lowerThresholding(distanceTransform->GetOutput(),0.0);
-
-            }else{
-                positiveDM=FilterUtils<ImageType,FloatImageType>::createEmptyFrom(newImage);
-                positiveDM->FillBuffer(0.0);
-            }
-
+            FloatImagePointerType positiveDM=computeDistanceTransform(segmentationImage,value);
             ImageUtils<FloatImageType>::multiplyImage(positiveDM,1.0/this->m_tolerance);
             return  positiveDM;
         }
+        ///positive part of the signed distance transform to label value, zero if the label does not occur
+        FloatImagePointerType computeDistanceTransform(ConstImagePointerType segmentationImage, int value){
+            std::vector<bool> selected(value+1,false);
+            selected[value]=true;
+            return computeDistanceTransforms(segmentationImage,selected)[value];
+        }
+        ///positive parts of the distance transforms of all labels l with selected[l], in a single pass
+        std::vector<FloatImagePointerType> computeDistanceTransforms(ConstImagePointerType segmentationImage, const std::vector<bool> & selected){
+            assert(segmentationImage.IsNotNull());
+            return FilterUtils<ImageType,FloatImageType>::multiLabelDistanceMaps(segmentationImage,selected.size(),false,-1.0,selected);
+        }
 
         void SetTolerance(double t){m_tolerance=t;}
+        ///reuse distance transforms of labels that are unchanged since the previous atlas segmentation
+        void SetIncremental(bool incremental){m_incremental=incremental;}
+
+        ///labels whose region differs between two segmentations of the same size
+        static std::vector<bool> getChangedLabels(ConstImagePointerType segmentation1, ConstImagePointerType segmentation2, int nLabels){
+            const typename ImageType::PixelType * buffer1=segmentation1->GetBufferPointer();
+            const typename ImageType::PixelType * buffer2=segmentation2->GetBufferPointer();
+            long int nPixels=segmentation1->GetLargestPossibleRegion().GetNumberOfPixels();
+            std::vector<char> changed(nLabels,0);
+#pragma omp parallel
+            {
+                std::vector<char> localChanged(nLabels,0);
+#pragma omp for
+                for (long int i=0;i<nPixels;++i){
+                    int l1=buffer1[i],l2=buffer2[i];
+                    if (l1!=l2){
+                        if (l1>=0 && l1<nLabels) localChanged[l1]=1;
+                        if (l2>=0 && l2<nLabels) localChanged[l2]=1;
+                    }
+                }
+#pragma omp critical
+                for (int l=0;l<nLabels;++l) changed[l]|=localChanged[l];
+            }
+            return std::vector<bool>(changed.begin(),changed.end());
+        }
 
 
         //edge from registration to segmentation
         inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
-            double result=0;
             ContinuousIndexType idx2;//(targetIndex2);
             itk::Vector<float,ImageType::ImageDimension> disp=displacement;
 
@@ -235,7 +324,6 @@ namespace SRS{
             this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
             p +=disp;//+this->m_baseLabelMap->GetPixel(targetIndex1);
             this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p,idx2);
-            int deformedAtlasSegmentation=-1;
             if (!m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
                 for (int d=0;d<ImageType::ImageDimension;++d){
                     if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
@@ -246,20 +334,23 @@ namespace SRS{
                     }
                 }
             }
-            deformedAtlasSegmentation=int(m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
-            if (segmentationLabel!=deformedAtlasSegmentation){ 
-                double dist=m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);       
-                //double dist2=m_atlasDistanceTransformInterpolators[deformedAtlasSegmentation]->EvaluateAtContinuousIndex(idx2);
-                result=std::max(0.0,dist);
+            int deformedAtlasSegmentation=int(m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
+            double dist=0.0;
+            if (segmentationLabel!=deformedAtlasSegmentation && m_atlasDistanceTransformInterpolators.size()){ 
+                dist=m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);       
             }
+            return potentialFromDistance(segmentationLabel,deformedAtlasSegmentation,dist);
+        }
 
+        ///potential given the (tolerance scaled) distance of the deformed atlas point to segmentationLabel, dist is zero if the labels agree
+        inline virtual double potentialFromDistance(int segmentationLabel, int deformedAtlasSegmentation, double dist){
+            double result=std::max(0.0,dist);
             //bool targetSegmentation=(segmentationLabel==this->m_nSegmentationLabels-1 ||  deformedAtlasSegmentation == this->m_nSegmentationLabels-1 );
             //bool auxiliarySegmentation=!targetSegmentation && (segmentationLabel || deformedAtlasSegmentation);
 	    bool auxiliarySegmentation=this->m_nSegmentationLabels>2 && ((segmentationLabel == this->m_auxiliaryLabel ) || (deformedAtlasSegmentation == this->m_auxiliaryLabel));
 	    
             if (auxiliarySegmentation){
 	      result=min(result,1.0);
-                LOGV(16)<<VAR(result)<<endl;
             }
             result=0.5*result*result;//exp(result)-1;
            
@@ -268,6 +359,123 @@ namespace SRS{
             return result;
         }
 
+        ///warp the atlas segmentation and all distance transforms by a constant displacement in a single pass over the target image
+        virtual void cachePotentials(LabelType displacement){
+            const int D=ImageType::ImageDimension;
+            typename ImageType::RegionType targetRegion=m_targetImage->GetLargestPossibleRegion();
+            typename ImageType::RegionType atlasRegion=m_atlasSegmentationImage->GetLargestPossibleRegion();
+            IndexType targetStart=targetRegion.GetIndex(),atlasStart=atlasRegion.GetIndex();
+            m_nCachedPixels=targetRegion.GetNumberOfPixels();
+            int nLabels=m_distanceTransforms.size();
+            m_cachedDeformedAtlasSegmentation.resize(m_nCachedPixels);
+            m_cachedDistances.resize(nLabels*m_nCachedPixels);
+
+            //the atlas continuous index is an affine function of the target index, get it from the first pixel and one step along each axis
+            itk::Vector<float,ImageType::ImageDimension> disp=displacement;
+            double origin[D],steps[D][D];
+            PointType p;
+            ContinuousIndexType idx;
+            m_targetImage->TransformIndexToPhysicalPoint(targetStart,p);
+            m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p+disp,idx);
+            for (int d=0;d<D;++d) origin[d]=idx[d];
+            for (int d=0;d<D;++d){
+                IndexType stepIndex=targetStart;
+                stepIndex[d]+=1;
+                m_targetImage->TransformIndexToPhysicalPoint(stepIndex,p);
+                m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p+disp,idx);
+                for (int d2=0;d2<D;++d2) steps[d][d2]=idx[d2]-origin[d2];
+            }
+            long int atlasEnd[D];
+            unsigned long int atlasStrides[D],targetStrides[D];
+            atlasStrides[0]=1;targetStrides[0]=1;
+            for (int d=0;d<D;++d){
+                atlasEnd[d]=atlasStart[d]+atlasRegion.GetSize()[d]-1;
+                if (d>0){
+                    atlasStrides[d]=atlasStrides[d-1]*atlasRegion.GetSize()[d-1];
+                    targetStrides[d]=targetStrides[d-1]*targetRegion.GetSize()[d-1];
+                }
+            }
+            const typename ImageType::PixelType * segBuffer=m_atlasSegmentationImage->GetBufferPointer();
+            std::vector<const float *> dtBuffers(nLabels);
+            for (int l=0;l<nLabels;++l) dtBuffers[l]=m_distanceTransforms[l]->GetBufferPointer();
+            const int nCorners=1<<D;
+            long int nPixels=m_nCachedPixels;
+
+#pragma omp parallel for schedule(static)
+            for (long int i=0;i<nPixels;++i){
+                //target index -> clamped atlas continuous index, same clamping as getPotential
+                double cidx[D];
+                long int rest=i;
+                for (int d=0;d<D;++d) cidx[d]=origin[d];
+                for (int d=D-1;d>=0;--d){
+                    long int pos=rest/targetStrides[d];
+                    rest-=pos*targetStrides[d];
+                    for (int d2=0;d2<D;++d2) cidx[d2]+=pos*steps[d][d2];
+                }
+                for (int d=0;d<D;++d){
+                    if (cidx[d]>=atlasEnd[d]+0.5) cidx[d]=atlasEnd[d];
+                    else if (cidx[d]<atlasStart[d]-0.5) cidx[d]=atlasStart[d];
+                }
+                //nearest neighbour atlas label
+                unsigned long int nnOffset=0;
+                for (int d=0;d<D;++d){
+                    long int nn=itk::Math::RoundHalfIntegerUp<long int>(cidx[d]);
+                    nn=std::max(long(atlasStart[d]),std::min(atlasEnd[d],nn));
+                    nnOffset+=(nn-atlasStart[d])*atlasStrides[d];
+                }
+                m_cachedDeformedAtlasSegmentation[i]=int(segBuffer[nnOffset]);
+                if (!nLabels) continue;
+                //linear interpolation weights, shared by all labels
+                long int base[D];
+                double frac[D];
+                for (int d=0;d<D;++d){
+                    base[d]=(long int)floor(cidx[d]);
+                    frac[d]=cidx[d]-base[d];
+                }
+                unsigned long int cornerOffsets[1<<D];
+                double cornerWeights[1<<D];
+                for (int c=0;c<nCorners;++c){
+                    cornerOffsets[c]=0;
+                    cornerWeights[c]=1.0;
+                    for (int d=0;d<D;++d){
+                        long int pos=base[d];
+                        if (c & (1<<d)){
+                            pos+=1;
+                            cornerWeights[c]*=frac[d];
+                        }else{
+                            cornerWeights[c]*=1.0-frac[d];
+                        }
+                        pos=std::max(long(atlasStart[d]),std::min(atlasEnd[d],pos));
+                        cornerOffsets[c]+=(pos-atlasStart[d])*atlasStrides[d];
+                    }
+                }
+                for (int l=0;l<nLabels;++l){
+                    double dist=0.0;
+                    for (int c=0;c<nCorners;++c){
+                        dist+=cornerWeights[c]*dtBuffers[l][cornerOffsets[c]];
+                    }
+                    m_cachedDistances[l*m_nCachedPixels+i]=dist;
+                }
+            }
+        }
+
+        ///potential for the displacement given to the last cachePotentials call
+        inline virtual double getCachedPotential(IndexType targetIndex, int segmentationLabel){
+            assert(m_nCachedPixels);
+            unsigned long int i=0,stride=1;
+            IndexType targetStart=m_targetImage->GetLargestPossibleRegion().GetIndex();
+            for (int d=0;d<ImageType::ImageDimension;++d){
+                i+=(targetIndex[d]-targetStart[d])*stride;
+                stride*=m_targetSize[d];
+            }
+            int deformedAtlasSegmentation=m_cachedDeformedAtlasSegmentation[i];
+            double dist=0.0;
+            if (segmentationLabel!=deformedAtlasSegmentation && m_cachedDistances.size()){
+                dist=m_cachedDistances[segmentationLabel*m_nCachedPixels+i];
+            }
+            return potentialFromDistance(segmentationLabel,deformedAtlasSegmentation,dist);
+        }
+
         //Return minimum potential for segmentation node index given a zero displacement
         inline virtual double getMinZeroPotential(PointType pt){
             double minPot=std::numeric_limits<double>::max();
@@ -323,48 +531,16 @@ namespace SRS{
     public:
         itkNewMacro(Self);
 
-          inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
-            double result=0;
-            ContinuousIndexType idx2(targetIndex2);
-            itk::Vector<float,ImageType::ImageDimension> disp=displacement;
-
-            typename ImageType::PointType p;
-            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
-          
-            this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p+disp,idx2);
-            int deformedAtlasSegmentation=-1;
-            if (!this->m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
-                for (int d=0;d<ImageType::ImageDimension;++d){
-                    if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]-0.5;
-                    }
-                    else if (idx2[d]<this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]+0.5;
-                    }
-                }
-            }
-            deformedAtlasSegmentation=int(this->m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
-            if (segmentationLabel!=deformedAtlasSegmentation){
-#if 1
-                double dist=this->m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);       
-                result=std::max(0.0,dist);
-#else
-		double dist=this->m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);       
-		double dist2=this->m_atlasDistanceTransformInterpolators[deformedAtlasSegmentation]->Evaluate(p);
-                result=std::max(dist2,dist);
-#endif
-            }
+        inline virtual double potentialFromDistance(int segmentationLabel, int deformedAtlasSegmentation, double dist){
+            double result=std::max(0.0,dist);
 	    ///do not penalize confusion of background and auxiliary label that strongly?
 	    bool auxiliarySegmentation=(this->m_nSegmentationLabels>2) && ((segmentationLabel == this->m_auxiliaryLabel && deformedAtlasSegmentation == 0 ) || (deformedAtlasSegmentation == this->m_auxiliaryLabel && segmentationLabel == 0));
 	    if (auxiliarySegmentation){
 	      result=std::min(result,1.0);
-	      LOGV(16)<<VAR(result)<<endl;
-
             }
             result=0.5*result*result;//exp(result)-1;
            
             result=min(999999.0,result);
-            LOGV(8)<<VAR(segmentationLabel)<<" "<<VAR(deformedAtlasSegmentation)<<" "<<VAR(result)<<std::endl;
             return result;
         }
 
@@ -404,34 +580,9 @@ namespace SRS{
         itkNewMacro(Self);
 
         //edge from registration to segmentation
-        inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
-            double result=0;
-            ContinuousIndexType idx2(targetIndex2);
-            itk::Vector<float,ImageType::ImageDimension> disp=displacement;
-
-            typename ImageType::PointType p;
-            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
-            p +=disp;//+this->m_baseLabelMap->GetPixel(targetIndex1);
-            this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p,idx2);
-            int deformedAtlasSegmentation=-1;
-            if (!this->m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
-                for (int d=0;d<ImageType::ImageDimension;++d){
-                    if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]-0.5;
-                    }
-                    else if (idx2[d]<this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]+0.5;
-                    }
-                }
-            }
-            deformedAtlasSegmentation=int(this->m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
-            if (segmentationLabel!=deformedAtlasSegmentation){ 
-                double dist=this->m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);
-                result=dist;//-this->m_minDists[segmentationLabel];
-            }
-            
+        inline virtual double potentialFromDistance(int segmentationLabel, int deformedAtlasSegmentation, double dist){
             //return 1.0/(1.0+exp(-(result-this->m_tolerance)));
-            return 0.5*result*result;
+            return 0.5*dist*dist;
         }
     };//class
 
@@ -502,6 +653,26 @@ namespace SRS{
            
         }
 
+        ///the bone potential depends on atlas intensities as well, so the final potentials of all labels are cached per target pixel
+        virtual void cachePotentials(LabelType displacement){
+            typename ImageType::RegionType targetRegion=this->m_targetImage->GetLargestPossibleRegion();
+            this->m_nCachedPixels=targetRegion.GetNumberOfPixels();
+            int nLabels=this->m_nSegmentationLabels;
+            this->m_cachedDistances.resize(nLabels*this->m_nCachedPixels);
+            long int nPixels=this->m_nCachedPixels;
+#pragma omp parallel for schedule(static)
+            for (long int i=0;i<nPixels;++i){
+                IndexType idx=this->m_targetImage->ComputeIndex(i);
+                for (int l=0;l<nLabels;++l){
+                    this->m_cachedDistances[l*this->m_nCachedPixels+i]=getPotential(idx,idx,displacement,l);
+                }
+            }
+        }
+        inline virtual double getCachedPotential(IndexType targetIndex, int segmentationLabel){
+            assert(this->m_nCachedPixels);
+            return this->m_cachedDistances[segmentationLabel*this->m_nCachedPixels+this->m_targetImage->ComputeOffset(targetIndex)];
+        }
+
         inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
             double result=0;
             ContinuousIndexType idx2(targetIndex2);
@@ -648,31 +819,8 @@ namespace SRS{
           
             logResetStage;
         }
-        inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
-            double result=0;
-            ContinuousIndexType idx2(targetIndex2);
-            itk::Vector<float,ImageType::ImageDimension> disp=displacement;
-
-            typename ImageType::PointType p;
-            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
-            p +=disp;//+this->m_baseLabelMap->GetPixel(targetIndex1);
-            this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p,idx2);
-            int deformedAtlasSegmentation=-1;
-            if (!this->m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
-                for (int d=0;d<ImageType::ImageDimension;++d){
-                    if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]-0.5;
-                    }
-                    else if (idx2[d]<this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]+0.5;
-                    }
-                }
-            }
-            deformedAtlasSegmentation=int(this->m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
-            if (segmentationLabel!=deformedAtlasSegmentation){ 
-                result=1;
-            }
-
+        inline virtual double potentialFromDistance(int segmentationLabel, int deformedAtlasSegmentation, double dist){
+            double result=(segmentationLabel!=deformedAtlasSegmentation);
             bool auxiliarySegmentation=(this->m_nSegmentationLabels>2) && ((segmentationLabel == this->m_auxiliaryLabel ) || (deformedAtlasSegmentation == this->m_auxiliaryLabel));
 	    bool targetSegmentation = ! auxiliarySegmentation;
             if (targetSegmentation){
@@ -76,6 +76,8 @@ namespace SRS{
             //m_maxDist=sqrt(m_maxDist);
         }
         virtual void setFullRegularization(bool b){ m_fullRegPairwise = b; }
+        ///true if the potential only depends on the two displacement labels, and not on the edge
+        virtual bool isLabelDistance(){ return !m_fullRegPairwise; }
         inline double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
             assert(m_haveDisplacementMap);
             double result=0;
@@ -197,7 +199,7 @@ namespace SRS{
         /** Standard part of every itk Object. */
         itkTypeMacro(RegistrationPairwisePotentialSigmoid, Object);
 
-   
+        virtual bool isLabelDistance(){ return false; }
         
         virtual double getPotential(IndexType targetIndex1, IndexType targetIndex2,DisplacementType displacement1, DisplacementType displacement2){
             assert(this->m_haveDisplacementMap);
@@ -320,7 +322,7 @@ namespace SRS{
         /** Standard part of every itk Object. */
         itkTypeMacro(RegistrationPairwisePotentialSigmoid, Object);
 
-   
+        virtual bool isLabelDistance(){ return false; }
         
         inline double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
             assert(this->m_haveDisplacementMap);
@@ -21,10 +21,8 @@
 #include "TransformationUtils.h"
 #include "Log.h"
 #include <limits>
-#include "itkNormalizedMutualInformationHistogramImageToImageMetric.h"
+#include "LocalMutualInformation.h"
 #include "itkMattesMutualInformationImageToImageMetric.h"
-#include "itkHistogram.h"
-#include "itkScalarImageToHistogramGenerator.h"
 #include "itkIdentityTransform.h"
 #include "Metrics.h"
 #include "itkPointSet.h"
@@ -33,6 +31,7 @@
 #include "itkPointsLocator.h"
 #include "itkSignedMaurerDistanceMapImageFilter.h"
 #include "SegmentationMapper.hxx"
+#include "ImagePyramid.h"
 
 namespace SRS{
 
@@ -85,6 +84,7 @@ namespace SRS{
         bool m_useGradient;
         double m_alpha;
         bool m_normalizeImages;
+        ImagePyramid<ImageType> * m_pyramid;
     public:
         /** Method for creation through the object factory. */
         itkNewMacro(Self);
@@ -106,6 +106,7 @@ namespace SRS{
             m_useGradient=false;
             m_alpha=0.0;
             m_normalizeImages=0.0;
+            m_pyramid=NULL;
         }
         ~UnaryPotentialRegistrationNCC(){
             //delete nIt;
@@ -119,15 +120,17 @@ namespace SRS{
         virtual void setLogPotential(bool b){LOGPOTENTIAL=b;}
         virtual void setNoOutsidePolicy(bool b){ m_noOutSidePolicy = b;}
         virtual void setNormalizeImages(bool b){m_normalizeImages=b;}
+        ///scaled images are taken from the pyramid instead of being resampled in every Init()
+        void SetImagePyramid(ImagePyramid<ImageType> * pyramid){m_pyramid=pyramid;}
         virtual void Init(){
 
             assert(m_targetImage);
             assert(m_atlasImage);
             if ( m_scale!=1.0){
-                m_scaledTargetImage=FilterUtils<ImageType>::LinearResample(m_targetImage,m_scale,true);
-                m_scaledAtlasImage=FilterUtils<ImageType>::LinearResample(m_atlasImage,m_scale,true);
+                m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_targetImage,m_scale,true);
+                m_scaledAtlasImage=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_atlasImage,m_scale,true);
                 if (m_atlasMaskImage.IsNotNull()){
-                    m_scaledAtlasMaskImage=FilterUtils<ImageType>::NNResample(m_atlasMaskImage,m_scale,false);                }
+                    m_scaledAtlasMaskImage=ImagePyramid<ImageType>::NNResample(m_pyramid,m_atlasMaskImage,m_scale,false);                }
             }else{
                 m_scaledTargetImage=m_targetImage;
                 m_scaledAtlasImage=m_atlasImage;
@@ -966,470 +969,125 @@ namespace SRS{
     };//FastUnaryPotentialRegistrationSSD
 
 
-#define NMI
+    /** \brief
+     * Local normalized mutual information registration potential (1-ECC, entropy correlation coefficient).
+     * The potentials of all control points for one displacement are computed at once with sliding window joint histograms
+     * (LocalMutualInformation) and cached, like in FastUnaryPotentialRegistrationNCC.
+     */
     template<class TImage>
-    class FastUnaryPotentialRegistrationNMI: public UnaryPotentialRegistrationNCC<TImage> {
+    class FastUnaryPotentialRegistrationNMI: public FastUnaryPotentialRegistrationNCC<TImage> {
     public:
         //itk declarations
         typedef FastUnaryPotentialRegistrationNMI            Self;
         typedef itk::SmartPointer<Self>        Pointer;
         typedef itk::SmartPointer<const Self>  ConstPointer;
-        typedef UnaryPotentialRegistrationNCC<TImage> Superclass;
+        typedef FastUnaryPotentialRegistrationNCC<TImage> Superclass;
         typedef	TImage ImageType;
         typedef typename ImageType::Pointer ImagePointerType;
         typedef typename ImageType::ConstPointer ConstImagePointerType;
 
-
         typedef typename TransfUtils<ImageType>::DisplacementType DisplacementType;
         typedef typename ImageType::IndexType IndexType;
         typedef typename ImageType::PointType PointType;
-        typedef typename ImageType::PixelType PixelType;
-
-        typedef typename ImageType::SizeType SizeType;
-        typedef typename ImageType::SpacingType SpacingType;
-        typedef itk::LinearInterpolateImageFunction<ImageType> InterpolatorType;
-        typedef typename InterpolatorType::Pointer InterpolatorPointerType;
-        typedef typename InterpolatorType::ContinuousIndexType ContinuousIndexType;
-        typedef itk::NearestNeighborInterpolateImageFunction<ImageType> NNInterpolatorType;
-
-        
-
         typedef typename TransfUtils<ImageType>::DeformationFieldPointerType DisplacementImagePointerType;
-        typedef typename itk::ConstNeighborhoodIterator<ImageType> ImageNeighborhoodIteratorType;
-        typedef typename ImageNeighborhoodIteratorType::RadiusType RadiusType;
-        
-        typedef itk::TranslationTransform<double,ImageType::ImageDimension> TranslationTransformType;
-        typedef typename TranslationTransformType::Pointer TranslationTransformPointerType;
-        typedef itk::ResampleImageFilter<ImageType, ImageType> ResampleImageFilterType;
-        
+
         typedef typename ImageUtils<ImageType>::FloatImageType FloatImageType;
         typedef typename FloatImageType::Pointer FloatImagePointerType;
         typedef typename itk::ImageRegionIteratorWithIndex<FloatImageType> FloatImageIteratorType;
-#ifdef NMI        
-        typedef typename itk::NormalizedMutualInformationHistogramImageToImageMetric<ImageType,ImageType> NMIMetricType;
-        typedef typename NMIMetricType::MeasureType             MeasureType;
-        typedef typename NMIMetricType::HistogramType            HistogramType;
-        typedef typename HistogramType::SizeType              HistogramSizeType;
-        typedef typename HistogramType::MeasurementVectorType MeasurementVectorType;
-        typedef typename HistogramType::AbsoluteFrequencyType HistogramFrequencyType;
-        typedef typename HistogramType::Iterator              HistogramIteratorType;
-        
-        typedef itk::Statistics::ScalarImageToHistogramGenerator<ImageType> HistGenType ;
-#else
-#ifdef MMI
-        typedef typename itk::MattesMutualInformationImageToImageMetric<ImageType,ImageType> NMIMetricType;
-#else
-#ifdef MI
-#endif
-#endif
-#endif
+        typedef LocalMutualInformation<ImageType> LocalMutualInformationType;
     protected:
-        ImageNeighborhoodIteratorType m_atlasNeighborhoodIterator,m_maskNeighborhoodIterator;
-        std::vector<DisplacementType> m_displacements;
-        std::vector<FloatImagePointerType> m_potentials;
-        ImagePointerType m_coarseImage;
-        typename NMIMetricType::Pointer m_metric;
+        LocalMutualInformationType m_localMI;
         int m_numberOfBins;
     public:
         /** Method for creation through the object factory. */
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(FastRegistrationUnaryPotentialNMI, Object);
-       
 
-        virtual void compute(){
+        FastUnaryPotentialRegistrationNMI():Superclass(){
             m_numberOfBins=32;
-            m_metric=NMIMetricType::New();
-            typename NNInterpolatorType::Pointer nnInt=NNInterpolatorType::New();
-            m_metric->SetInterpolator(nnInt);
-            m_potentials=std::vector<FloatImagePointerType>(m_displacements.size(),NULL);
-#ifdef NMI
-#else
-            //m_metric->SetNumberOfSpatialSamples();
-            m_metric->SetNumberOfHistogramBins(64);
-#endif          
-            for (unsigned int n=0;n<m_displacements.size();++n){
-                LOGV(9)<<"cachhing unary registrationpotentials for label " <<n<<endl;
-                FloatImagePointerType pot=FilterUtils<ImageType,FloatImageType>::createEmpty(m_coarseImage);
-                DisplacementImagePointerType translation=TransfUtils<ImageType>::createEmpty(this->m_baseDisplacementMap);
-                translation->FillBuffer( m_displacements[n]);
-                DisplacementImagePointerType composedDeformation=TransfUtils<ImageType>::composeDeformations(translation,this->m_baseDisplacementMap);
-                ImagePointerType deformedAtlas,deformedMask;
-                pair<ImagePointerType,ImagePointerType> result=TransfUtils<ImageType>::warpImageWithMask(this->m_scaledAtlasImage,composedDeformation);
-                deformedAtlas=result.first;
-                deformedMask=result.second;
-                m_atlasNeighborhoodIterator=ImageNeighborhoodIteratorType(this->m_scaledRadius,deformedAtlas,deformedAtlas->GetLargestPossibleRegion());
-                m_maskNeighborhoodIterator=ImageNeighborhoodIteratorType(this->m_scaledRadius,deformedMask,deformedMask->GetLargestPossibleRegion());
-                m_metric->SetFixedImage(this->m_scaledTargetImage);
-                m_metric->SetMovingImage(deformedAtlas);
-                nnInt->SetInputImage(deformedAtlas);
-#ifdef NMI
-                typename HistogramType::SizeType histSize(2);
-                histSize.Fill(100); 
-                m_metric->SetHistogramSize(histSize);
-#endif
-                FloatImageIteratorType coarseIterator(pot,pot->GetLargestPossibleRegion());
-                for (coarseIterator.GoToBegin();!coarseIterator.IsAtEnd();++coarseIterator){
-                    IndexType coarseIndex=coarseIterator.GetIndex();
-                    PointType point;
-                    m_coarseImage->TransformIndexToPhysicalPoint(coarseIndex,point);
-                    IndexType targetIndex;
-                    this->m_scaledTargetImage->TransformPhysicalPointToIndex(point,targetIndex);
-                    //coarseIterator.Set(getLocalPotential(targetIndex));
-                    //double potentialNMI=getLocalPotential(targetIndex,fixedEntropy,movingEntropy);
-                    double potentialNMI=getLocalPotential(targetIndex);
-                    //double potentialNCC=getLocalPotentialNCC(targetIndex);
-                    //LOGGV(5)<<VAR(potentialNMI)<<" "<<VAR(potentialNCC)<<endl;
-                    coarseIterator.Set(potentialNMI);
-
-                }
-                m_potentials[n]=pot;
-                            
-            }
-        }
-#ifdef NMI        
-        double computeEntropy(ConstImagePointerType img){
-            typename HistGenType::Pointer histGen=HistGenType::New();
-            histGen->SetInput(img);
-            histGen->SetNumberOfBins(50);
-            histGen->Compute();
-            typename HistogramType::ConstPointer  hist=histGen->GetOutput();
-            LOGV(40)<<hist<<endl;
-            MeasureType entropyX = itk::NumericTraits< MeasureType >::Zero;
-            typedef typename itk::NumericTraits< HistogramFrequencyType >::RealType HistogramFrequencyRealType;
-            HistogramFrequencyRealType totalFreq =
-                static_cast< HistogramFrequencyRealType >( hist->GetTotalFrequency() );
-
-            for ( unsigned int i = 0; i < hist->GetSize(0); i++ )
-                {
-                    HistogramFrequencyRealType freq =
-                        static_cast< HistogramFrequencyRealType >( hist->GetFrequency(i, 0) );
-                    LOGV(70)<<VAR(i)<<" "<<VAR(freq)<<endl;
-                    if ( freq > 0 )
-                        {
-                            entropyX += freq * vcl_log(freq);
-                        }
-                }
-
-            entropyX = -entropyX / static_cast< MeasureType >( totalFreq ) + vcl_log(totalFreq);
-            LOGV(40)<<VAR(entropyX)<<endl;
-            return entropyX;
-        }
-#endif
-        void setDisplacements(std::vector<DisplacementType> displacements){
-            m_displacements=displacements;
         }
-        void setCoarseImage(ImagePointerType img){m_coarseImage=img;}
+        void setNumberOfBins(int n){m_numberOfBins=n;}
 
-        virtual double getPotential(IndexType coarseIndex, unsigned int displacementDisplacement){
-            return m_potentials[displacementDisplacement]->GetPixel(coarseIndex);
-        }
-        virtual double getPotential(IndexType coarseIndex, DisplacementType l){
-            LOG<<"ERROR NEVER CALL THIS"<<endl;
-            exit(0);
+        virtual void Init(){
+            Superclass::Init();
+            m_localMI.setMeasure(LocalMutualInformationType::ECC);
+            m_localMI.setNumberOfBins(m_numberOfBins);
+            m_localMI.setRadius(this->m_scaledRadius);
+            //all displacements use the bins of the undeformed atlas
+            m_localMI.setMovingRange(FilterUtils<ImageType>::getMin(this->m_scaledAtlasImage),FilterUtils<ImageType>::getMax(this->m_scaledAtlasImage));
+            m_localMI.setFixedImage(this->m_scaledTargetImage);
         }
-        inline double getLocalPotential(IndexType targetIndex){
-#if 1
-            //use ITK (SLOW!!!)
-            typedef itk::IdentityTransform<double,ImageType::ImageDimension> TransType;
-            typename TransType::Pointer t=TransType::New();
-            IndexType cornerIndex=targetIndex-this->m_scaledRadius;
-            IndexType secondCornerIndex=targetIndex+this->m_scaledRadius;
-            SizeType regionSize;
-            for (unsigned int d=0;d< ImageType::ImageDimension;++d){
-                if (cornerIndex[d]<0)
-                    cornerIndex[d]=0;
-                if ( secondCornerIndex[d] >= this->m_scaledTargetImage->GetLargestPossibleRegion().GetSize()[d])
-                    secondCornerIndex[d]=this->m_scaledTargetImage->GetLargestPossibleRegion().GetSize()[d]-1;
-                regionSize[d]=secondCornerIndex[d]-cornerIndex[d];
-            }
-            typename ImageType::RegionType region(cornerIndex,regionSize);
-            m_metric->SetTransform(t);
-            m_metric->SetFixedImageRegion(region);
-            m_metric->Initialize();
-            double result=m_metric->GetValue(t->GetParameters());
-            return result;
-                
-#else            
-            //use iterators
-            double result;
-            this->nIt.SetLocation(targetIndex);
-            m_atlasNeighborhoodIterator.SetLocation(targetIndex);
-            m_maskNeighborhoodIterator.SetLocation(targetIndex);
-            
-            double count=0;
-            //compute joint histogram
-            typename HistogramType::Pointer jointHist=HistogramType::New();
-            jointHist->SetMeasurementVectorSize(2);
-            typename HistogramType::SizeType histSize(2);
-            histSize.Fill(m_numberOfBins);
-
-            //find bounds
-            MeasurementVectorType m_LowerBound;
-            MeasurementVectorType m_UpperBound;
-            m_LowerBound.SetSize(2);
-            m_UpperBound.SetSize(2);
-            m_LowerBound[0]=numeric_limits<PixelType>::max();
-            m_LowerBound[1]=numeric_limits<PixelType>::max();
-            m_UpperBound[0]=numeric_limits<PixelType>::min();
-            m_UpperBound[1]=numeric_limits<PixelType>::min();
-            for (unsigned int i=0;i<this->nIt.Size();++i){
-                bool inBounds;
-                double m=m_atlasNeighborhoodIterator.GetPixel(i,inBounds);
-                bool inside=m_maskNeighborhoodIterator.GetPixel(i);
-                if (inside && inBounds){
-                    double f=this->nIt.GetPixel(i);
-                    m_LowerBound[0]=f<m_LowerBound[0]?f:m_LowerBound[0];
-                    m_LowerBound[1]=m<m_LowerBound[1]?m:m_LowerBound[1];
-                    m_UpperBound[0]=f>m_UpperBound[0]?f:m_UpperBound[0];
-                    m_UpperBound[1]=m>m_UpperBound[1]?f:m_UpperBound[1];
 
-                }
-            }                                                           
-            LOGV(40)<<VAR(histSize)<<" "<<VAR(m_LowerBound)<<" "<<VAR(m_UpperBound)<<endl;
-            jointHist->Initialize(histSize,m_LowerBound,m_UpperBound);                    
-            typename HistogramType::MeasurementVectorType sample;
-            sample.SetSize(2);
-
-            for (unsigned int i=0;i<this->nIt.Size();++i){
-                bool inBounds;
-                double m=m_atlasNeighborhoodIterator.GetPixel(i,inBounds);
-                bool inside=m_maskNeighborhoodIterator.GetPixel(i);
-                if (inside && inBounds){
-                    double f=this->nIt.GetPixel(i);
-                    sample[0] = f;
-                    sample[1] = m;
-                    LOGV(70)<<VAR(sample)<<endl;
-                    jointHist->IncreaseFrequencyOfMeasurement(sample, 1);
-                    count++;
-                }
+        ///potentials for all displacements at once (memory intensive)
+        virtual void compute(){
+            this->m_potentials=std::vector<FloatImagePointerType>(this->m_displacements.size(),NULL);
+            for (unsigned int n=0;n<this->m_displacements.size();++n){
+                LOGV(9)<<"cachhing unary registrationpotentials for label " <<n<<endl;
+                this->m_potentials[n]=computePotentials(this->m_displacements[n]);
             }
-          
-            if (count){
-                double NMI=-2;
-                MeasureType entropyX = NumericTraits< MeasureType >::Zero;
-                MeasureType entropyY = NumericTraits< MeasureType >::Zero;
-                MeasureType jointEntropy = NumericTraits< MeasureType >::Zero;
-
-                typedef typename NumericTraits< HistogramFrequencyType >::RealType HistogramFrequencyRealType;
-
-                HistogramFrequencyRealType totalFreq =
-                    static_cast< HistogramFrequencyRealType >( jointHist->GetTotalFrequency() );
-
-                for ( unsigned int i = 0; i < jointHist->GetSize(0); i++ )
-                    {
-                        HistogramFrequencyRealType freq =
-                            static_cast< HistogramFrequencyRealType >( jointHist->GetFrequency(i, 0) );
-                        LOGV(50)<<VAR(i)<<" "<<VAR(freq)<<endl;
-                        if ( freq > 0 )
-                            {
-                                entropyX += freq * vcl_log(freq);
-                            }
-                    }
-
-                entropyX = -entropyX / static_cast< MeasureType >( totalFreq ) + vcl_log(totalFreq);
-
-                for ( unsigned int i = 0; i < jointHist->GetSize(1); i++ )
-                    {
-                        HistogramFrequencyRealType freq =
-                            static_cast< HistogramFrequencyRealType >( jointHist->GetFrequency(i, 1) );
-                        LOGV(50)<<VAR(i)<<" "<<VAR(freq)<<endl;
-                        if ( freq > 0 )
-                            {
-                                entropyY += freq * vcl_log(freq);
-                            }
-                    }
-
-                entropyY = -entropyY / static_cast< MeasureType >( totalFreq ) + vcl_log(totalFreq);
-
-                HistogramIteratorType it = jointHist->Begin();
-                HistogramIteratorType end = jointHist->End();
-                while ( it != end )
-                    {
-                        HistogramFrequencyRealType freq =
-                            static_cast< HistogramFrequencyRealType >( it.GetFrequency() );
-                        LOGV(50)<<VAR(freq)<<endl;
-                        if ( freq > 0 )
-                            {
-                                jointEntropy += freq * vcl_log(freq);
-                            }
-                        ++it;
-                    }
-
-                jointEntropy = -jointEntropy / static_cast< MeasureType >( totalFreq )
-                    + vcl_log(totalFreq);
-                LOGV(40)<<VAR(jointEntropy)<<" "<<VAR(entropyX)<<" "<<entropyY<<endl;
-#if 1
-                double ECC;
-                if (( entropyX + entropyY)==0.0)
-                    ECC=0;
-                else 
-                    ECC=2.0 - 2.0*jointEntropy/( entropyX + entropyY );
-                result=-ECC;
-#else
-                if (jointEntropy==0)
-                    NMI=0.00000001;
-                else
-                    NMI= ( entropyX + entropyY ) / jointEntropy;
-                result=-(2.0-2.0/NMI);
-#endif
-            }else return 0;
-
-
-
-            return result;
-#endif
         }
-#ifdef NMI
-        inline double getLocalPotential(IndexType targetIndex, double entropyX, double entropyY){
-            if (!this->nIt.Size()) {
-                cout<<VAR(this->nIt.Size())<<endl;
-            }
-            //use iterators
-            double result;
-            this->nIt.SetLocation(targetIndex);
-            m_atlasNeighborhoodIterator.SetLocation(targetIndex);
-            m_maskNeighborhoodIterator.SetLocation(targetIndex);
-            
-            double count=0;
-            //compute joint histogram
-            typename HistogramType::Pointer jointHist=HistogramType::New();
-            jointHist->SetMeasurementVectorSize(2);
-            typename HistogramType::SizeType histSize(2);
-            histSize.Fill(m_numberOfBins);
-
-            //find bounds
-            MeasurementVectorType m_LowerBound;
-            MeasurementVectorType m_UpperBound;
-            m_LowerBound.SetSize(2);
-            m_UpperBound.SetSize(2);
-            m_LowerBound[0]=numeric_limits<PixelType>::max();
-            m_LowerBound[1]=numeric_limits<PixelType>::max();
-            m_UpperBound[0]=numeric_limits<PixelType>::min();
-            m_UpperBound[1]=numeric_limits<PixelType>::min();
-            for (unsigned int i=0;i<this->nIt.Size();++i){
-                bool inBounds;
-                double m=m_atlasNeighborhoodIterator.GetPixel(i,inBounds);
-                bool inside=m_maskNeighborhoodIterator.GetPixel(i);
-                if (inside && inBounds){
-                    double f=this->nIt.GetPixel(i);
-                    m_LowerBound[0]=f<m_LowerBound[0]?f:m_LowerBound[0];
-                    m_LowerBound[1]=m<m_LowerBound[1]?m:m_LowerBound[1];
-                    m_UpperBound[0]=f>m_UpperBound[0]?f:m_UpperBound[0];
-                    m_UpperBound[1]=m>m_UpperBound[1]?f:m_UpperBound[1];
 
+        void cachePotentials(DisplacementType displacement){
+            LOGV(15)<<"Caching registration unary potential for displacement "<<displacement<<endl;
+            DisplacementType zeroDisp;
+            zeroDisp.Fill(0.0);
+            FloatImagePointerType pot=computePotentials(displacement);
+            //compute average potential for zero displacement.
+            if (displacement == zeroDisp){
+                long int nPixels=pot->GetBufferedRegion().GetNumberOfPixels();
+                double sum=0.0;
+                const float * buffer=pot->GetBufferPointer();
+                for (long int i=0;i<nPixels;++i) sum+=buffer[i];
+                this->m_averageFixedPotential=nPixels?sum/nPixels:0.0;
+                this->m_normalizationFactor=1.0;
+                if (this->m_normalize && (this->m_averageFixedPotential<std::numeric_limits<float>::epsilon())){
+                    this->m_normalizationFactor=this->m_oldAveragePotential/this->m_averageFixedPotential;
                 }
-            }                                                           
-            LOGV(40)<<VAR(histSize)<<" "<<VAR(m_LowerBound)<<" "<<VAR(m_UpperBound)<<endl;
-            jointHist->Initialize(histSize,m_LowerBound,m_UpperBound);                    
-            typename HistogramType::MeasurementVectorType sample;
-            sample.SetSize(2);
-            double insideCount=0.0;
-            //compute joint histogram
-            for (unsigned int i=0;i<this->nIt.Size();++i){
-                bool inBounds;
-                double m=m_atlasNeighborhoodIterator.GetPixel(i,inBounds);
-                insideCount+=inBounds;
-                bool inside=m_maskNeighborhoodIterator.GetPixel(i);
-                if (inside && inBounds){
-                    double f=this->nIt.GetPixel(i);
-                    sample[0] = f;
-                    sample[1] = m;
-                    LOGV(80)<<VAR(sample)<<endl;
-                    jointHist->IncreaseFrequencyOfMeasurement(sample, 1);
-                    count++;
-                }
+                LOGV(3)<<VAR(this->m_normalizationFactor)<<endl;
+                this->m_oldAveragePotential=this->m_averageFixedPotential;
             }
-            
-            if (count){
-                MeasureType jointEntropy = itk::NumericTraits< MeasureType >::Zero;
-                typedef typename itk::NumericTraits< HistogramFrequencyType >::RealType HistogramFrequencyRealType;
-                
-                HistogramFrequencyRealType totalFreq =
-                    static_cast< HistogramFrequencyRealType >( jointHist->GetTotalFrequency() );
-                
-                
-                HistogramIteratorType it = jointHist->Begin();
-                HistogramIteratorType end = jointHist->End();
-                while ( it != end )
-                    {
-                        HistogramFrequencyRealType freq =
-                            static_cast< HistogramFrequencyRealType >( it.GetFrequency() );
-                        LOGV(70)<<VAR(freq)<<endl;
-                        if ( freq > 0 )
-                            {
-                                jointEntropy += freq * vcl_log(freq);
-                            }
-                        ++it;
-                    }
-                
-                jointEntropy = -jointEntropy / static_cast< MeasureType >( totalFreq )
-                    + vcl_log(totalFreq);
-                LOGV(40)<<VAR(jointEntropy)<<" "<<VAR(entropyX)<<" "<<entropyY<<endl;
-                
-                if ((entropyX + entropyY)==0.0){
-                    cout<<"strange"<<endl;
-                    result=0;
-                }
-                else{
-                    result =2  - 2.0* jointEntropy/ ( entropyX + entropyY ) ;
-                }
-            }else{ result=0;}
-            //                    NMI= ( entropyX + entropyY )/jointEntropy ;
-            
-            result=-result;
-            
-            //            result=min(this->m_threshold,result);
-            LOGV(15)<<VAR(result)<<endl;
-            return result*insideCount/this->nIt.Size();
+            this->m_currentCachedPotentials=pot;
+            this->m_currentActiveDisplacement=displacement;
         }
-        inline double getLocalPotentialNCC(IndexType targetIndex){
 
-            double result;
-            this->nIt.SetLocation(targetIndex);
-            m_atlasNeighborhoodIterator.SetLocation(targetIndex);
-            m_maskNeighborhoodIterator.SetLocation(targetIndex);
-            
-            double count=0;
-            double sff=0.0,smm=0.0,sfm=0.0,sf=0.0,sm=0.0;
-            for (unsigned int i=0;i<this->nIt.Size();++i){
-                bool inBounds;
-                double m=m_atlasNeighborhoodIterator.GetPixel(i,inBounds);
-                bool inside=m_maskNeighborhoodIterator.GetPixel(i);
-                if (inside && inBounds){
-                    double f=this->nIt.GetPixel(i);
-                    sff+=f*f;
-                    smm+=m*m;
-                    sfm+=f*m;
-                    sf+=f;
-                    sm+=m;
-                    count+=1;
+    protected:
+        ///1-ECC between the target and the atlas deformed by the base deformation plus displacement, at all control points
+        FloatImagePointerType computePotentials(DisplacementType displacement){
+            DisplacementImagePointerType translation=TransfUtils<ImageType>::createEmpty(this->m_baseDisplacementMap);
+            translation->FillBuffer(displacement);
+            DisplacementImagePointerType composedDeformation=TransfUtils<ImageType>::composeDeformations(translation,this->m_baseDisplacementMap);
+            pair<ImagePointerType,ImagePointerType> result=TransfUtils<ImageType>::warpImageWithMask(this->m_scaledAtlasImage,composedDeformation);
+            //atlas pixels mapped from outside the atlas are only counted with the no outside policy
+            ConstImagePointerType mask=this->m_noOutSidePolicy?NULL:(ConstImagePointerType)result.second;
+            FloatImagePointerType ecc=m_localMI.compute((ConstImagePointerType)result.first,mask,(ConstImagePointerType)this->m_coarseImage);
 
+            FloatImagePointerType pot=FilterUtils<ImageType,FloatImageType>::createEmpty(this->m_coarseImage);
+            float * potBuffer=pot->GetBufferPointer();
+            const float * eccBuffer=ecc->GetBufferPointer();
+            long int nPixels=pot->GetBufferedRegion().GetNumberOfPixels();
+#pragma omp parallel for
+            for (long int i=0;i<nPixels;++i){
+                double localPot;
+                if (this->LOGPOTENTIAL){
+                    localPot=-log(max(double(eccBuffer[i]),0.00000001));
+                }else{
+                    localPot=1.0-eccBuffer[i];
                 }
+                potBuffer[i]=min(this->m_threshold,localPot);
             }
-            double NCC=0;
-            if (count){
-                sff -= ( sf * sf / count );
-                smm -= ( sm * sm / count );
-                sfm -= ( sf * sm / count );
-                if (smm*sff>0){
-                    NCC=1.0*sfm/sqrt(smm*sff);
-                
+            if (this->m_unaryPotentialWeights.IsNotNull()){
+                FloatImageIteratorType it(pot,pot->GetLargestPossibleRegion());
+                for (it.GoToBegin();!it.IsAtEnd();++it){
+                    PointType point;
+                    pot->TransformIndexToPhysicalPoint(it.GetIndex(),point);
+                    IndexType weightIndex;
+                    this->m_unaryPotentialWeights->TransformPhysicalPointToIndex(point,weightIndex);
+                    it.Set(it.Get()*this->m_unaryPotentialWeights->GetPixel(weightIndex));
                 }
             }
-            //result=result>0.5?0.5:result; 
-            if (this->LOGPOTENTIAL){
-                result=((1+NCC)/2);
-                result=result>0?result:0.00000001;
-                result=-log(result);
-            }else{
-                result=(1-(NCC))/2;
-            }
-            result=min(this->m_threshold,result);
-            
-            return result;
+            return pot;
         }
-#endif
     };//FastUnaryPotentialRegistrationNMI
 
 
@@ -1663,11 +1321,11 @@ namespace SRS{
             assert(this->m_targetImage);
             assert(this->m_atlasImage);
             if ( this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::NNResample(this->m_targetImage,this->m_scale,false);
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::NNResample(this->m_atlasImage,this->m_scale,false);
+                this->m_scaledTargetImage=ImagePyramid<ImageType>::NNResample(this->m_pyramid,this->m_targetImage,this->m_scale,false);
+                this->m_scaledAtlasImage=ImagePyramid<ImageType>::NNResample(this->m_pyramid,this->m_atlasImage,this->m_scale,false);
               
                 if (this->m_atlasMaskImage.IsNotNull()){
-                    this->m_scaledAtlasMaskImage=FilterUtils<ImageType>::NNResample(this->m_atlasMaskImage,this->m_scale,false);                }
+                    this->m_scaledAtlasMaskImage=ImagePyramid<ImageType>::NNResample(this->m_pyramid,this->m_atlasMaskImage,this->m_scale,false);                }
             }else{
                 this->m_scaledTargetImage=this->m_targetImage;
                 this->m_scaledAtlasImage=this->m_atlasImage;
@@ -1798,11 +1456,11 @@ namespace SRS{
             assert(this->m_targetImage);
             assert(this->m_atlasImage);
             if ( this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::NNResample(this->m_targetImage,this->m_scale,false);
+                this->m_scaledTargetImage=ImagePyramid<ImageType>::NNResample(this->m_pyramid,this->m_targetImage,this->m_scale,false);
                 
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::NNResample(this->m_atlasImage,this->m_scale,false);
+                this->m_scaledAtlasImage=ImagePyramid<ImageType>::NNResample(this->m_pyramid,this->m_atlasImage,this->m_scale,false);
                 if (this->m_atlasMaskImage.IsNotNull()){
-                    this->m_scaledAtlasMaskImage=FilterUtils<ImageType>::NNResample(this->m_atlasMaskImage,this->m_scale,false);                
+                    this->m_scaledAtlasMaskImage=ImagePyramid<ImageType>::NNResample(this->m_pyramid,this->m_atlasMaskImage,this->m_scale,false);                
                 }
                
                           
@@ -1852,14 +1510,8 @@ namespace SRS{
             int nSegs=FilterUtils<ImageType>::getMax(this->m_targetImage)+1;
             m_distanceTransforms=new std::vector<FloatImagePointerType>(nSegs);
             LOGV(3)<<"Computing distance transforms for "<<nSegs<<" labels"<<endl;
-            for (unsigned int s=0;s<nSegs;++s){
-                LOGV(3)<<"Computing distance transforms for label:"<<s<<endl;
-                //(*m_distanceTransforms)[s]=FilterUtils<ImageType,FloatImageType>::distanceMapByFastMarcher(this->m_targetImage,s);
-                (*m_distanceTransforms)[s]=FilterUtils<ImageType,FloatImageType>::distanceMapBySignedMaurer(this->m_targetImage,s);
-                if (s==0){
-                    ImageUtils<FloatImageType>::writeImage("DT-zero.nii", (*m_distanceTransforms)[s]);
-                }
-            }
+            *m_distanceTransforms=FilterUtils<ImageType,FloatImageType>::multiLabelDistanceMaps(this->m_targetImage,nSegs);
+            ImageUtils<FloatImageType>::writeImage("DT-zero.nii", (*m_distanceTransforms)[0]);
             this->m_targetSize=this->m_targetImage->GetLargestPossibleRegion().GetSize();
             if (this->m_atlasImage.IsNotNull()){
                 this->m_atlasImage=m_segmentationMapper->ApplyMap(this->m_atlasImage);
@@ -2191,10 +1843,10 @@ namespace SRS{
             assert(this->m_targetSheetness);
             assert(this->m_atlasSegmentation);
             if (this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::LinearResample((this->m_targetImage),this->m_scale,true);
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::LinearResample((this->m_atlasImage),this->m_scale,true);
-                this->m_scaledAtlasSegmentation=FilterUtils<ImageType>::NNResample((m_atlasSegmentation),this->m_scale,false);
-                this->m_scaledTargetSheetness=FilterUtils<ImageType>::LinearResample((m_targetSheetness),this->m_scale,true);
+                this->m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,this->m_targetImage,this->m_scale,true);
+                this->m_scaledAtlasImage=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,this->m_atlasImage,this->m_scale,true);
+                this->m_scaledAtlasSegmentation=ImagePyramid<ImageType>::NNResample(this->m_pyramid,m_atlasSegmentation,this->m_scale,false);
+                this->m_scaledTargetSheetness=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,m_targetSheetness,this->m_scale,true);
             }
             assert(this->radiusSet);
             for (int d=0;d<ImageType::ImageDimension;++d){
@@ -2452,10 +2104,10 @@ namespace SRS{
             assert(this->m_targetSheetness);
             assert(this->m_atlasSegmentation);
             if (this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::LinearResample((this->m_targetImage),this->m_scale,true);
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::LinearResample((this->m_atlasImage),this->m_scale,true);
-                this->m_scaledAtlasSegmentation=FilterUtils<ImageType>::NNResample((m_atlasSegmentation),this->m_scale);
-                this->m_scaledTargetSheetness=FilterUtils<ImageType>::LinearResample((m_targetSheetness),this->m_scale,true);
+                this->m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,this->m_targetImage,this->m_scale,true);
+                this->m_scaledAtlasImage=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,this->m_atlasImage,this->m_scale,true);
+                this->m_scaledAtlasSegmentation=ImagePyramid<ImageType>::NNResample(this->m_pyramid,m_atlasSegmentation,this->m_scale,false);
+                this->m_scaledTargetSheetness=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,m_targetSheetness,this->m_scale,true);
             }
             assert(this->radiusSet);
             for (int d=0;d<ImageType::ImageDimension;++d){
@@ -12,6 +12,7 @@
 #include "itkObjectFactory.h"
 #include <utility>
 #include <itkStatisticsImageFilter.h>
+#include "ImagePyramid.h"
 
 namespace SRS{
 
@@ -46,6 +47,7 @@ namespace SRS{
         int m_nSegmentationLabels;
         double m_alpha;
         double m_theta;
+        ImagePyramid<ImageType> * m_pyramid;
     public:
         /** Method for creation through the object factory. */
         itkNewMacro(Self);
@@ -54,9 +56,14 @@ namespace SRS{
 
         PairwisePotentialSegmentation(){
             this->m_haveLabelMap=false;
+            this->m_pyramid=NULL;
         }
+        ///scaled images are taken from the pyramid instead of being resampled at every level
+        void SetImagePyramid(ImagePyramid<ImageType> * pyramid){m_pyramid=pyramid;}
         virtual void freeMemory(){
         }
+        ///true if the potential is w(idx1,idx2)*[label1!=label2] for some edge weight w
+        virtual bool isPotts(){return true;}
         virtual void SetTargetImage(string filename){
             if (filename!=""){
                 LOG<<"warning, trying to load RGB iamge in unsuitable pairwise segmentation function!"<<endl;
@@ -118,11 +125,11 @@ namespace SRS{
             }
             if (segmentationScalingFactor<1.0){
                 //only use gaussian smoothing if down scaling
-                m_scaledTargetImage=FilterUtils<ImageType>::LinearResample(m_targetImage,segmentationScalingFactor,false,true);
-                m_scaledTargetGradient=FilterUtils<ImageType>::LinearResample(m_gradientImage,segmentationScalingFactor,false,true);
+                m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_targetImage,segmentationScalingFactor,false,true);
+                m_scaledTargetGradient=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_gradientImage,segmentationScalingFactor,false,true);
             }else{
-                m_scaledTargetImage=FilterUtils<ImageType>::LinearResample(m_targetImage,segmentationScalingFactor,false,false);
-                m_scaledTargetGradient=FilterUtils<ImageType>::LinearResample(m_gradientImage,segmentationScalingFactor,false,false);
+                m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_targetImage,segmentationScalingFactor,false,false);
+                m_scaledTargetGradient=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_gradientImage,segmentationScalingFactor,false,false);
         
             }
             if (m_scaledTargetImage.IsNull()){
@@ -250,6 +257,7 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(PairwisePotentialSegmentationClassifier, Object);
+        virtual bool isPotts(){return false;} //the classifier probabilities depend on the label pair
         virtual void Init(string filename, bool train){
             assert(this->m_targetImage);
             assert(this->m_gradientImage);
@@ -388,6 +396,7 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(PairwisePotentialSegmentationMarcel, Object);
+        virtual bool isPotts(){return false;} //transitions to label 2 are weighted differently
 
         virtual double getPotential(IndexType idx1, IndexType idx2, int label1, int label2){
             //equal labels don't have costs
@@ -798,6 +807,7 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(CachingPairwisePotentialSegmentationClassifier, Object);
+        virtual bool isPotts(){return true;}
         virtual void Init(string filename, bool train){
             assert(this->m_targetImage);
             assert(this->m_gradientImage);
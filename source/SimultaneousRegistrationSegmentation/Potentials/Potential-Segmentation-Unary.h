@@ -16,6 +16,7 @@
 #include "itkObjectFactory.h"
 #include <utility>
 #include <itkStatisticsImageFilter.h>
+#include "ImagePyramid.h"
 
 namespace SRS{
 
@@ -63,6 +64,7 @@ namespace SRS{
     ImageConstPointerType m_targetAnatomyPrior;
     bool m_useTargetAnatomyPrior;
     int m_nSegmentationLabels;
+    ImagePyramid<ImageType> * m_pyramid;
   public:
         
     /** Method for creation through the object factory. */
@@ -75,7 +77,10 @@ namespace SRS{
     }
     UnaryPotentialSegmentation(){
       this->m_haveLabelMap=false;
+      this->m_pyramid=NULL;
     }
+    ///scaled images are taken from the pyramid instead of being resampled at every level
+    void SetImagePyramid(ImagePyramid<ImageType> * pyramid){m_pyramid=pyramid;}
     void SetNSegmentationLabels(int n){m_nSegmentationLabels=n;}
     virtual void Init(){}
     virtual void freeMemory(){
@@ -115,11 +120,11 @@ namespace SRS{
       if (m_targetImage.IsNotNull()){
 	if (segmentationScalingFactor<1.0){
 	  //only use gaussian smoothing if downsampling
-	  m_scaledTargetImage=FilterUtils<ImageType>::LinearResample(m_targetImage,segmentationScalingFactor,false,false);
-	  m_scaledTargetGradient=FilterUtils<ImageType>::LinearResample(m_targetGradient,segmentationScalingFactor,false,false);
+	  m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_targetImage,segmentationScalingFactor,false,false);
+	  m_scaledTargetGradient=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_targetGradient,segmentationScalingFactor,false,false);
 	}else{
-	  m_scaledTargetImage=FilterUtils<ImageType>::LinearResample(m_targetImage,segmentationScalingFactor,true,false);
-	  m_scaledTargetGradient=FilterUtils<ImageType>::LinearResample(m_targetGradient,segmentationScalingFactor,true,false);
+	  m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_targetImage,segmentationScalingFactor,true,false);
+	  m_scaledTargetGradient=ImagePyramid<ImageType>::LinearResample(m_pyramid,m_targetGradient,segmentationScalingFactor,true,false);
 	}
       }else{
 	if (m_targetRGBImage.IsNotNull()){
@@ -133,7 +138,7 @@ namespace SRS{
 	}
 
       }
-      if (m_targetAnatomyPrior.IsNotNull()) m_scaledTargetAnatomyPrior=FilterUtils<ImageType>::NNResample(m_targetAnatomyPrior,segmentationScalingFactor,false);
+      if (m_targetAnatomyPrior.IsNotNull()) m_scaledTargetAnatomyPrior=ImagePyramid<ImageType>::NNResample(m_pyramid,m_targetAnatomyPrior,segmentationScalingFactor,false);
     }
     virtual void SetAtlasSegmentation(ImageConstPointerType im){
       m_atlasSegmentation=im;
@@ -747,8 +752,8 @@ namespace SRS{
     }
     virtual void ResamplePotentials(double scale){
 
-      this->m_scaledTargetImage=FilterUtils<ImageType>::LinearResample(this->m_targetImage,scale,true);
-      this->m_scaledTargetGradient=FilterUtils<ImageType>::LinearResample(this->m_targetGradient,scale,true);
+      this->m_scaledTargetImage=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,this->m_targetImage,scale,true);
+      this->m_scaledTargetGradient=ImagePyramid<ImageType>::LinearResample(this->m_pyramid,this->m_targetGradient,scale,true);
             
     }
     virtual double getPotential(IndexType targetIndex, int segmentationLabel){
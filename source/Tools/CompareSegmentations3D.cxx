@@ -17,6 +17,9 @@
 #include <itkLabelOverlapMeasuresImageFilter.h>
 #include "mmalloc.h"
 #include "SegmentationMapper.hxx"
+#include "SurfaceDistance.h"
+#include "ImageListLoader.h"
+#include <set>
 using namespace std;
 
 const unsigned int D=3;
@@ -24,6 +27,7 @@ typedef int Label;
 typedef itk::Image< Label, D >  LabelImage;
 typedef itk::Image< float, D > TRealImage;
 typedef  LabelImage::Pointer LabelImagePointerType;
+typedef SurfaceDistance<LabelImage> SurfaceDistanceType;
 
 LabelImagePointerType selectLabel(LabelImagePointerType img, Label l, bool &present){
     LabelImagePointerType result=ImageUtils<LabelImage>::createEmpty(img);
@@ -49,12 +53,105 @@ LabelImagePointerType differenceLabels(LabelImagePointerType img, LabelImagePoin
     return result;
 }
 
+///non-zero labels present in img
+void addLabels(LabelImagePointerType img, set<int> & labels){
+    const Label * buf=img->GetBufferPointer();
+    long int nPixels=img->GetBufferedRegion().GetNumberOfPixels();
+    for (long int i=0;i<nPixels;++i){
+        if (buf[i]) labels.insert(buf[i]);
+    }
+}
+
+///print the measures of one label in the column order of the single pair mode
+void printScores(const SurfaceDistanceType::Scores & s, int label, double percentile, bool distances){
+    std::cout<<" Label "<< label;
+    std::cout<<" Dice " << s.dice ;
+    if (distances){
+        std::cout<<" Mean "<< s.meanDistance;
+        std::cout<<" MaxAbs "<< s.maxAbsDistance;
+        std::cout<<" ASSD "<< s.ASSD;
+        std::cout<<" HD "<< s.HD;
+        std::cout<<" HD"<<percentile<<" "<< s.HDPercentile<<" ";
+    }
+}
+
+///loader for the pairs [start,end) of the list
+ImageListLoader<LabelImage> * startBatch(const vector<string> & gtNames, const vector<string> & segNames, int start, int end){
+    ImageListLoader<LabelImage> * loader=new ImageListLoader<LabelImage>;
+    for (int p=start;p<end;++p){
+        loader->add(gtNames[p]);
+        loader->add(segNames[p]);
+    }
+    loader->start();
+    return loader;
+}
+
+/**
+ * compare all pairs '<groundtruth> <segmentation>' listed in pairList. Pairs are processed in chunks of batchSize,
+ * the surface distances of all labels of a chunk are computed in parallel while the files of the next chunk are read.
+ */
+void compareList(string pairList, string maskFilename, vector<int> listOfLabels, int batchSize, double percentile){
+    vector<string> gtNames,segNames;
+    ifstream ifs(pairList.c_str());
+    string gt,seg;
+    while (ifs>>gt>>seg){
+        gtNames.push_back(gt);
+        segNames.push_back(seg);
+    }
+    LabelImage::Pointer mask = NULL;
+    if (maskFilename !=""){
+        mask = ImageUtils<LabelImage>::readImage(maskFilename);
+    }
+    SurfaceDistanceType surfaceDistance(percentile);
+    int nPairs=gtNames.size();
+    ImageListLoader<LabelImage> * loader=startBatch(gtNames,segNames,0,min(nPairs,batchSize));
+    for (int start=0;start<nPairs;start+=batchSize){
+        int end=min(nPairs,start+batchSize);
+        vector<LabelImagePointerType> gts,segs;
+        set<int> labels(listOfLabels.begin(),listOfLabels.end());
+        for (int p=start;p<end;++p){
+            LabelImagePointerType gtImg=loader->get(2*(p-start));
+            LabelImagePointerType segImg=loader->get(2*(p-start)+1);
+            if (gtImg.IsNull() || segImg.IsNull()){
+                exit(0);
+            }
+            if (gtImg->GetSpacing()!=segImg->GetSpacing() 
+                || gtImg->GetOrigin()!=segImg->GetOrigin() 
+                ||gtImg->GetLargestPossibleRegion().GetSize()!=segImg->GetLargestPossibleRegion().GetSize() ){
+                segImg=FilterUtils<LabelImage>::NNResample(segImg,gtImg,false);
+            }
+            if (mask.IsNotNull()){
+                gtImg=ImageUtils<LabelImage>::multiplyImageOutOfPlace(gtImg,mask);
+                segImg=ImageUtils<LabelImage>::multiplyImageOutOfPlace(segImg,mask);
+            }
+            if (!listOfLabels.size()){
+                addLabels(gtImg,labels);
+            }
+            gts.push_back(gtImg);
+            segs.push_back(segImg);
+        }
+        labels.erase(0);
+        delete loader;
+        loader=NULL;
+        if (end<nPairs)
+            loader=startBatch(gtNames,segNames,end,min(nPairs,end+batchSize));
+        vector<vector<SurfaceDistanceType::Scores> > scores=surfaceDistance.compute(gts,segs,vector<int>(labels.begin(),labels.end()));
+        for (int p=start;p<end;++p){
+            for (unsigned int l=0;l<scores[p-start].size();++l){
+                std::cout<<gtNames[p]<<" "<<segNames[p];
+                printScores(scores[p-start][l],scores[p-start][l].label,percentile,true);
+                std::cout<<endl;
+            }
+        }
+    }
+}
+
 int main(int argc, char * argv [])
 {
 
     
     ArgumentParser as(argc, argv);
-	string groundTruth,segmentationFilename,outputFilename="",maskFilename="";
+	string groundTruth="",segmentationFilename="",outputFilename="",maskFilename="",pairList="";
     bool hausdorff=false;
     double threshold=1;
     int evalLabel=-1;
@@ -65,8 +162,13 @@ int main(int argc, char * argv [])
     bool evalAll=false;
     bool resampleIfNeeded=false;
     bool excludeMissing=false;
-	as.parameter ("g", groundTruth, "groundtruth image (file name)", true);
-	as.parameter ("s", segmentationFilename, "segmentation image (file name)", true);
+    double percentile=95;
+    int batchSize=8;
+	as.parameter ("g", groundTruth, "groundtruth image (file name)", false);
+	as.parameter ("s", segmentationFilename, "segmentation image (file name)", false);
+	as.parameter ("list", pairList, "file with one line '<groundtruth> <segmentation>' per comparison; computes dice and surface distances of all labels (file name)", false);
+	as.parameter ("batchSize", batchSize, "number of image pairs compared in parallel when using -list", false);
+	as.parameter ("percentile", percentile, "percentile of the surface distances reported in addition to the hausdorff distance", false);
 	as.parameter ("m", maskFilename, "Binary mask in which measures are to be computed (file name)", false);
 	as.parameter ("o", outputFilename, "output image (file name)", false);
     as.parameter ("t", threshold, "threshold segmentedImage (threshold)", false);
@@ -85,12 +187,30 @@ int main(int argc, char * argv [])
 	as.parse();
 	
     logSetVerbosity(verbose);
+
+    std::vector<int> listOfLabels;
+    if (labelList!=""){
+        ifstream ifs(labelList.c_str());
+        int tmp;
+        while (ifs>>tmp){
+            listOfLabels.push_back(tmp);
+        }
+    }
+    if (pairList!=""){
+        compareList(pairList,maskFilename,listOfLabels,max(1,batchSize),percentile);
+        return EXIT_SUCCESS;
+    }
+    if (groundTruth=="" || segmentationFilename==""){
+        LOG<<"-g and -s, or -list are required"<<endl;
+        exit(0);
+    }
  
     LabelImage::Pointer groundTruthImg =
         ImageUtils<LabelImage>::readImage(groundTruth);
     LabelImage::Pointer segmentedImg =
         ImageUtils<LabelImage>::readImage(segmentationFilename);
-    if (resampleIfNeeded){
+    //per-label measures are computed on the voxel grid of the ground truth
+    if (resampleIfNeeded || !evalAll){
         if (groundTruthImg->GetSpacing()!=segmentedImg->GetSpacing() 
             || groundTruthImg->GetOrigin()!=segmentedImg->GetOrigin() 
             ||groundTruthImg->GetLargestPossibleRegion().GetSize()!=segmentedImg->GetLargestPossibleRegion().GetSize() ){
@@ -126,7 +246,6 @@ int main(int argc, char * argv [])
         return 1;
     }
 
-    std::vector<int> listOfLabels;
     SegmentationMapper<LabelImage> segmentationMapper;
         
     if (labelList==""){
@@ -138,49 +257,36 @@ int main(int argc, char * argv [])
             evalLabel=1;
         }
     }else{
-        ifstream ifs(labelList.c_str());
-        labelsToEvaluate=0;
-        do{
-            int tmp;
-            ifs>>tmp;
-            listOfLabels.push_back(tmp);
-            LOGV(1)<<VAR(labelsToEvaluate)<<" "<<VAR(tmp)<<endl;
-            ++labelsToEvaluate;
-        } while (!ifs.eof());
-        ifs.close();
-        --labelsToEvaluate;
+        labelsToEvaluate=listOfLabels.size();
     }
  
     
   
-    TRealImage::Pointer distancesOutsideTruthBone;
-    TRealImage::Pointer distancesInsideTruthBone;
-    TRealImage::Pointer distanceMap;
-    float maxAbsDistance = 0;
-    float mean=0;
     if (labelsToEvaluate<0 && (labelList == "")){
         labelsToEvaluate=segmentationMapper.getNumberOfLabels()-1;
     }
+
+    //dice and surface distances of all evaluated labels in one pass over both images
+    SurfaceDistanceType surfaceDistance(percentile,hausdorff && !connectedComponent);
+    vector<int> labels;
     for (int l=0;l<labelsToEvaluate;++l){
-        if (listOfLabels.size()){
-            evalLabel=listOfLabels[l];
-            LOGV(2)<<"Evaluating label "<<VAR(evalLabel)<<" "<<VAR(l)<<endl;
-            //skip label 0
-            if (evalLabel==0){
-                continue;
-            }
+        int label=listOfLabels.size()?listOfLabels[l]:evalLabel+l;
+        LOGV(2)<<"Evaluating label "<<VAR(label)<<" "<<VAR(l)<<endl;
+        //skip label 0
+        if (label!=0) labels.push_back(label);
+    }
+    vector<SurfaceDistanceType::Scores> scores=surfaceDistance.compute(groundTruthImg,segmentedImg,labels);
+    for (unsigned int l=0;l<scores.size();++l){
+        SurfaceDistanceType::Scores score=scores[l];
+        evalLabel=score.label;
+        if (score.volumeB==0 && excludeMissing){
+            continue;
         }
-        bool present;
-        LabelImage::Pointer evalGroundTruthImage=            selectLabel(groundTruthImg,evalLabel,present);   
-        present=false;
-        LabelImage::Pointer evalSegmentedImage=            selectLabel(segmentedImg,evalLabel,present);   
-        
-        if (present || !excludeMissing ){
-       
-        typedef LabelImage::ConstPointer ConstType;
         if (connectedComponent){  
-            typedef itk::MinimumMaximumImageCalculator <LabelImage>
-                ImageCalculatorFilterType;
+            //only the largest component of the segmented label is compared, which needs the label as a binary image
+            bool present=false;
+            LabelImage::Pointer evalGroundTruthImage=            selectLabel(groundTruthImg,evalLabel,present);   
+            LabelImage::Pointer evalSegmentedImage=            selectLabel(segmentedImg,evalLabel,present);   
             typedef itk::ConnectedComponentImageFilter<LabelImage,LabelImage>  ConnectedComponentImageFilterType;
             ConnectedComponentImageFilterType::Pointer filter =
                 ConnectedComponentImageFilterType::New();
@@ -198,45 +304,14 @@ int main(int argc, char * argv [])
             if (outputFilename!=""){
                 ImageUtils<LabelImage>::writeImage(outputFilename,evalSegmentedImage);
             }
+            score=SurfaceDistanceType(percentile,hausdorff).compute(evalGroundTruthImage,evalSegmentedImage,vector<int>(1,1))[0];
         }
-   
-   
-        if (hausdorff){
-            typedef itk::HausdorffDistanceImageFilter<LabelImage, LabelImage> HausdorffDistanceFilterType;
-            typedef HausdorffDistanceFilterType::Pointer HDPointerType;
-            HDPointerType hdFilter=HausdorffDistanceFilterType::New();
-            evalSegmentedImage=FilterUtils<LabelImage>::NNResample(evalSegmentedImage,evalGroundTruthImage,false);
-            hdFilter->SetInput1(evalGroundTruthImage);
-            hdFilter->SetInput2(evalSegmentedImage);
-            hdFilter->SetUseImageSpacing(true);
-            hdFilter->SetCoordinateTolerance(1e-3);
-            hdFilter->SetDirectionTolerance(1e-3);
-            hdFilter->Update();
-            mean=hdFilter->GetAverageHausdorffDistance();
-            maxAbsDistance=hdFilter->GetHausdorffDistance();
-        }
-
-        typedef itk::LabelOverlapMeasuresImageFilter<LabelImage> OverlapMeasureFilterType;
-        OverlapMeasureFilterType::Pointer filter = OverlapMeasureFilterType::New();
-        filter->SetSourceImage(evalGroundTruthImage);
-        filter->SetTargetImage(evalSegmentedImage);
-        filter->SetCoordinateTolerance(1e-3);
-        filter->Update();
-        double dice=filter->GetDiceCoefficient();
         int label=evalLabel;
         if (labelList==""){
             label=segmentationMapper.GetInverseMappedLabel(evalLabel) ;
         }
-        std::cout<<" Label "<< label;
-        std::cout<<" Dice " << dice ;
-        if (hausdorff){
-            std::cout<<" Mean "<< mean;
-            std::cout<<" MaxAbs "<< maxAbsDistance<<" ";
-        }
+        printScores(score,label,percentile,hausdorff);
         std::cout<<endl;
-        }
-        //std::cout<<endl;
-        ++evalLabel;
     }
     std::cout<< std::endl;
     // std::cout<<"EvalG - % of bone segmented "<< float(glob.truePos) / ((glob.truePos + glob.falseNeg) / 100)<< std::endl;
@@ -81,6 +81,7 @@ int main(int argc, char ** argv){
     ArgumentParser * as=new ArgumentParser(argc,argv);
     string maskFileList="",groundTruthSegmentationFileList="",landmarkFileList="",deformationFileList,imageFileList,atlasSegmentationFileList,supportSamplesListFileName="",outputDir="",outputSuffix="",weightListFilename="",trueDefListFilename="",ROIFilename="";
     int verbose=0;
+    double memoryBudget=0.0;
     double pWeight=1.0;
     int radius=3;
     int maxHops=1;
@@ -98,6 +99,7 @@ int main(int argc, char ** argv){
     as->parameter ("ROI", ROIFilename, "file containing a ROI on which to perform erstimation", false);
     as->parameter ("i", imageFileList, " list of  images", true);
 
+    as->parameter ("memory", memoryBudget,"if >0, deformations are not kept in memory but streamed from disk using at most this budget (MB)",false);
     as->parameter ("verbose", verbose,"get verbose output",false);
     as->parse();
     
@@ -133,6 +135,7 @@ int main(int argc, char ** argv){
  
     //read  target deformations filenames
     DeformationCacheType defCache,trueDefCache;
+    FileListCacheType defFiles,trueDefFiles;
     ifstream ifs(deformationFileList.c_str());
     while (!ifs.eof()){
         string sourceID,targetID,defFileName;
@@ -144,8 +147,12 @@ int main(int argc, char ** argv){
                 LOGV(3)<<sourceID<<" or "<<targetID<<" not in image database, skipping"<<endl;
                 //exit(0);
             }else{
-                LOGV(3)<<"Reading deformation "<<defFileName<<" for deforming "<<sourceID<<" to "<<targetID<<endl;
-                defCache[sourceID][targetID]=ImageUtils<DeformationFieldType>::readImage(defFileName);
+                if (memoryBudget>0){
+                    defFiles[sourceID][targetID]=defFileName;
+                }else{
+                    LOGV(3)<<"Reading deformation "<<defFileName<<" for deforming "<<sourceID<<" to "<<targetID<<endl;
+                    defCache[sourceID][targetID]=ImageUtils<DeformationFieldType>::readImage(defFileName);
+                }
             }
         }
     }
@@ -162,6 +169,8 @@ int main(int argc, char ** argv){
                 if (inputImages.find(sourceID)==inputImages.end() || inputImages.find(targetID)==inputImages.end() ){
                     LOGV(3)<<sourceID<<" or "<<targetID<<" not in image database, skipping"<<endl;
                     //exit(0);
+                }else if (memoryBudget>0){
+                    trueDefFiles[sourceID][targetID]=defFileName;
                 }else{
                     trueDefCache[sourceID][targetID]=ImageUtils<DeformationFieldType>::readImage(defFileName);
                 }  
@@ -169,8 +178,14 @@ int main(int argc, char ** argv){
         }
     }
 
-    double ADE=TransfUtils<ImageType>::computeError(&defCache,&trueDefCache,&imageIDs);
-    double C=TransfUtils<ImageType>::computeInconsistency(&defCache,&imageIDs,NULL);
+    double ADE,C;
+    if (memoryBudget>0){
+        ADE=TransfUtils<ImageType>::computeError(&defFiles,&trueDefFiles,&imageIDs,memoryBudget);
+        C=TransfUtils<ImageType>::computeInconsistency(&defFiles,&imageIDs,memoryBudget);
+    }else{
+        ADE=TransfUtils<ImageType>::computeError(&defCache,&trueDefCache,&imageIDs);
+        C=TransfUtils<ImageType>::computeInconsistency(&defCache,&imageIDs,NULL);
+    }
     LOG<<VAR(ADE)<<" "<<VAR(C)<<endl;
 
     return 1;
@@ -40,18 +40,19 @@ int main(int argc, char ** argv)
     double norm;
     FloatImagePointerType diff2=TransfUtils<ImageType>::computeLocalDeformationNorm(deformation1,1,&norm);
 
-    typedef  itk::DisplacementFieldJacobianDeterminantFilter<LabelImageType,float> DisplacementFieldJacobianDeterminantFilterType;
-     DisplacementFieldJacobianDeterminantFilterType::Pointer jacobianFilter = DisplacementFieldJacobianDeterminantFilterType::New();
-    jacobianFilter->SetInput(deformation1);
-    jacobianFilter->SetUseImageSpacingOff();
-    jacobianFilter->Update();
-    FloatImagePointerType jac=jacobianFilter->GetOutput();
     if (argc>2){
-        ImageUtils<FloatImageType>::writeImage(argv[2],jac);
+        typedef  itk::DisplacementFieldJacobianDeterminantFilter<LabelImageType,float> DisplacementFieldJacobianDeterminantFilterType;
+        DisplacementFieldJacobianDeterminantFilterType::Pointer jacobianFilter = DisplacementFieldJacobianDeterminantFilterType::New();
+        jacobianFilter->SetInput(deformation1);
+        jacobianFilter->SetUseImageSpacingOff();
+        jacobianFilter->Update();
+        ImageUtils<FloatImageType>::writeImage(argv[2],jacobianFilter->GetOutput());
     }
-    double minJac = FilterUtils<FloatImageType>::getMin(jac);
+    TransfUtils<ImageType>::JacobianStatistics jacStats=TransfUtils<ImageType>::getJacDetStatistics(deformation1,0,0.0,2.0,NULL,NULL,0.0,false);
+    double minJac = jacStats.minJac;
+    double foldedFraction = jacStats.foldedFraction();
 
-    LOG<<VAR(norm)<<" "<<VAR(FilterUtils<FloatImageType>::getMax(diff2))<<" "<<VAR(minJac)<<endl;
+    LOG<<VAR(norm)<<" "<<VAR(FilterUtils<FloatImageType>::getMax(diff2))<<" "<<VAR(minJac)<<" "<<VAR(foldedFraction)<<endl;
 
     
     
@@ -40,17 +40,13 @@ int main(int argc, char ** argv)
     double norm;
     FloatImagePointerType diff2=TransfUtils<ImageType>::computeLocalDeformationNorm(deformation1,1,&norm);
 
-    typedef  itk::DisplacementFieldJacobianDeterminantFilter<LabelImageType,float> DisplacementFieldJacobianDeterminantFilterType;
-     DisplacementFieldJacobianDeterminantFilterType::Pointer jacobianFilter = DisplacementFieldJacobianDeterminantFilterType::New();
-    jacobianFilter->SetInput(deformation1);
-    jacobianFilter->SetUseImageSpacingOff();
-    jacobianFilter->Update();
-    FloatImagePointerType jac=jacobianFilter->GetOutput();
-    double minJac = FilterUtils<FloatImageType>::getMin(jac);
-    double maxJac = FilterUtils<FloatImageType>::getMax(jac);
-    double meanJac = FilterUtils<FloatImageType>::getMean(jac);
-
-    LOG<<VAR(norm)<<" "<<VAR(FilterUtils<FloatImageType>::getMax(diff2))<<" "<<VAR(minJac)<<" "<<VAR(maxJac)<<" "<<VAR(meanJac)<<endl;
+    TransfUtils<ImageType>::JacobianStatistics jacStats=TransfUtils<ImageType>::getJacDetStatistics(deformation1,0,0.0,2.0,NULL,NULL,0.0,false);
+    double minJac = jacStats.minJac;
+    double maxJac = jacStats.maxJac;
+    double meanJac = jacStats.meanJac;
+    double foldedFraction = jacStats.foldedFraction();
+
+    LOG<<VAR(norm)<<" "<<VAR(FilterUtils<FloatImageType>::getMax(diff2))<<" "<<VAR(minJac)<<" "<<VAR(maxJac)<<" "<<VAR(meanJac)<<" "<<VAR(foldedFraction)<<endl;
 
     
     
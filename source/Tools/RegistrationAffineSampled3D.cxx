@@ -0,0 +1,126 @@
+#include "Log.h"
+
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "ArgumentParser.h"
+#include "ImageUtils.h"
+#include "TransformationUtils.h"
+#include "SampledAffineRegistration.h"
+
+
+using namespace std;
+using namespace itk;
+
+
+int main(int argc, char ** argv)
+{
+    feraiseexcept(FE_INVALID|FE_DIVBYZERO|FE_OVERFLOW);
+    typedef short PixelType;
+    const unsigned int D=3;
+    typedef Image<PixelType,D> ImageType;
+    typedef ImageType::Pointer ImagePointerType;
+    typedef SampledAffineRegistration<ImageType> RegistrationType;
+    typedef RegistrationType::PyramidType PyramidType;
+    typedef RegistrationType::Pose PoseType;
+    typedef TransfUtils<ImageType>::AffineTransformPointerType AffineTransformPointerType;
+
+    ArgumentParser * as=new ArgumentParser(argc,argv);
+    string fixed,moving="",dofin="",dofout="",movingList="",fixedMask="",outputImage="",cacheDir="",metric="NCC";
+    int verbose=0,nLevels=4,iterations=50,nSamples=20000;
+    double startAngle=0.0;
+    bool rigid=false,moments=false;
+    as->parameter ("fixed", fixed, " filename of fixed image", true);
+    as->parameter ("moving", moving, " filename of moving image", false);
+    as->parameter ("dofout", dofout, " output filename of the affine transformation", false);
+    as->parameter ("movingList", movingList, " file with one line '<moving image> <dofout>' per moving image, all registered to the same fixed image", false);
+    as->parameter ("dofin", dofin, " initial affine transformation (single moving image only)", false);
+    as->parameter ("fixedMask", fixedMask, " only sample the fixed image where this mask is >0", false);
+    as->parameter ("out", outputImage, " filename of the deformed moving image (single moving image only)", false);
+    as->parameter ("cacheDir", cacheDir, " directory in which image pyramids are cached", false);
+    as->parameter ("metric", metric, " NCC or SSD", false);
+    as->parameter ("levels", nLevels, " number of pyramid levels", false);
+    as->parameter ("iterations", iterations, " maximum number of iterations per level", false);
+    as->parameter ("samples", nSamples, " approximate number of stratified fixed image samples per level", false);
+    as->parameter ("startAngle", startAngle, " also start from poses rotated by +-startAngle degrees around each axis (0=off)", false);
+    as->option ("rigid", rigid, " restrict to rigid transformations");
+    as->option ("moments", moments, " initialize by aligning the intensity centroids instead of the image centers");
+    as->parameter ("v", verbose, " verbosity", false);
+    as->parse();
+
+    logSetVerbosity(verbose);
+
+    vector<string> movingNames,dofoutNames;
+    if (movingList!=""){
+        ifstream ifs(movingList.c_str());
+        if (!ifs){
+            LOG<<"could not open moving list "<<movingList<<endl;
+            exit(0);
+        }
+        string line;
+        while (getline(ifs,line)){
+            istringstream iss(line);
+            string m,d;
+            if (iss>>m>>d){
+                movingNames.push_back(m);
+                dofoutNames.push_back(d);
+            }
+        }
+        if (dofin!="" || outputImage!=""){
+            LOG<<"-dofin and -out are ignored when registering a list of moving images"<<endl;
+            dofin="";
+            outputImage="";
+        }
+    }else if (moving!="" && dofout!=""){
+        movingNames.push_back(moving);
+        dofoutNames.push_back(dofout);
+    }else{
+        LOG<<"either -moving and -dofout or -movingList are required"<<endl;
+        exit(0);
+    }
+    if (metric!="NCC" && metric!="SSD"){
+        LOG<<"unknown metric "<<metric<<", use NCC or SSD"<<endl;
+        exit(0);
+    }
+
+    RegistrationType registration;
+    registration.setMetric(metric=="NCC"?RegistrationType::NCC:RegistrationType::SSD);
+    registration.setNumberOfSamples(nSamples);
+    registration.setIterations(iterations);
+    registration.setStartAngle(startAngle);
+    registration.setRigid(rigid);
+
+    //fixed pyramid, samples and gradients are shared by all moving images
+    logSetStage("Fixed image");
+    PyramidType fixedPyramid=RegistrationType::getPyramid(fixed,nLevels,cacheDir);
+    if (fixedMask!=""){
+        registration.setFixed(fixedPyramid,ImageUtils<ImageType>::readImage(fixedMask));
+    }else{
+        registration.setFixed(fixedPyramid);
+    }
+
+    for (unsigned int m=0;m<movingNames.size();++m){
+        logSetStage("Registration");
+        LOGV(1)<<"Registering "<<movingNames[m]<<" to "<<fixed<<endl;
+        PyramidType movingPyramid=RegistrationType::getPyramid(movingNames[m],nLevels,cacheDir);
+        PoseType initial;
+        if (dofin!=""){
+            initial=RegistrationType::getPose(TransfUtils<ImageType>::readAffine(dofin));
+        }else{
+            initial=registration.getCenteredPose(movingPyramid,moments);
+        }
+        PoseType result=registration.registerMoving(movingPyramid,initial);
+        LOG<<"Final cost for "<<movingNames[m]<<": "<<result.cost<<endl;
+        AffineTransformPointerType affine=RegistrationType::getAffine(result);
+        LOGV(2)<<VAR(affine)<<endl;
+        TransfUtils<ImageType>::writeAffine(dofoutNames[m],affine);
+        if (outputImage!=""){
+            ImagePointerType movingImage=ImageUtils<ImageType>::readImage(movingNames[m]);
+            ImagePointerType fixedImage=ImageUtils<ImageType>::readImage(fixed);
+            ImageUtils<ImageType>::writeImage(outputImage,TransfUtils<ImageType>::affineDeformImage(movingImage,affine,fixedImage));
+        }
+    }
+    return 1;
+}